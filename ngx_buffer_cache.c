@@ -4,6 +4,7 @@
 	shared memory layout:
 		shared memory start
 		fixed size headers
+		index
 		entries_start
 		...
 		entries_end
@@ -13,113 +14,261 @@
 		buffers_end
 		shared memory end
 
-	the shared memory is composed of 3 sections:
+	the shared memory is composed of 4 sections:
 	1. fixed size headers - contains the ngx_slab_pool_t struct allocated by nginx,
 		the log context string and ngx_buffer_cache_sh_t
-	2. entries - an array of ngx_buffer_cache_entry_t, each entry has a key and 
-		points to a buffer in the buffers section. the entries are connected with a 
-		red/black tree for fast lookup by key. the entries section grows as needed until 
-		it bumps into the buffers section. each entry is a member of one of 2 doubly 
-		linked lists - the free queue and the used queue. the entries move between these 
-		queues as they are allocated / deallocated
-	3. buffers - a cyclic queue of variable size buffers. the buffers section starts
+	2. index - an open addressed hash table (linear probing) of ngx_buffer_cache_index_slot_t,
+		each slot holds the hash of the key and the index of the entry. the size of the index
+		is fixed, and determines the maximum number of entries that can be stored in the cache.
+	3. entries - an array of ngx_buffer_cache_entry_t, each entry has a key and
+		points to a buffer in the buffers section. the entries section grows as needed until
+		it bumps into the buffers section, it never shrinks. each entry is a member of one
+		of 2 doubly linked lists - the free queue and the used queue. the entries move between
+		these queues as they are allocated / deallocated
+	4. buffers - a cyclic queue of variable size buffers. the buffers section starts
 		at the end of the shared memory and grows towards its beginning until it bumps
 		into the entries section. the buffers section has 2 pointers:
 		a. when a buffer is allocated, it is allocated before the write head
 		b. when an entry is freed, the read head of the buffers section moves
 
+	when the cache is partitioned, the fixed size headers contain an array of 
+	ngx_buffer_cache_sh_t structs, and the remaining space is split evenly between 
+	the partitions. each partition has its own index, entries and buffers sections, as
+	well as its own queues and mutex. the partition of a key is selected according
+	to its hash, so that operations on different keys can usually run in parallel.
+
+	when size classes are configured, each size class gets its own set of partitions,
+	and the space of each class is determined by the percent configured for it. a buffer
+	is stored in the first class that can hold its size, so that small buffers and large 
+	buffers do not evict each other. since the size is not known when fetching, the key 
+	is looked up in all the classes.
+
+	synchronization:
+	all updates are performed while holding the partition mutex. in addition, updates to
+	the index and the entries are performed while the sequence number of the partition is odd.
+	fetch operations do not take the mutex - they look up the index, increment the reference
+	count of the entry, and then verify that the sequence number did not change. if it did change,
+	the reference is released and the fetch is retried while holding the mutex.
+	entries that have a non-zero reference count are not evicted, the reference is released
+	by the caller when it no longer uses the buffer. since the buffers are allocated cyclically,
+	a referenced entry at the head of the used queue blocks the reclaiming of buffer space. when the
+	oldest entry is referenced, it is retired - removed from the index, so that no new references can 
+	be taken, and freed once the existing references are released. a retired entry that remains 
+	referenced for a long period is assumed to be leaked by a killed process, and gets freed.
+	similarly, the reset of a partition is performed only when no entry is referenced, or when the
+	partition was not accessed for a long period (fetches fail while the partition is being reset).
+
+	key locks:
+	in order to avoid having multiple requests build the same buffer concurrently, a caller that
+	misses the cache can lock the key before building it. the locks are kept in a small table in the 
+	size class 0 partition of the key, and expire after the timeout given by the locking caller, 
+	in case the lock owner is killed. when the table is full, lock requests succeed without locking.
+
+	replace:
+	a replace operation stores a new entry for a key that may already exist. the existing entry is
+	retired, and freed immediately when it is not referenced. removing an entry from the middle of
+	the used queue is safe, its buffer space is reclaimed when the entry that follows it is evicted.
+	a referenced entry remains in the used queue (holding its buffer) until it becomes the oldest 
+	entry and its references are released, so references to the old entry remain valid until released.
+	since retired entries are no longer in the index, evicting them does not free an index slot.
+
 */
 
-// Note: code taken from ngx_str_rbtree_insert_value, updated the node comparison
 static void
-ngx_buffer_cache_rbtree_insert_value(
-	ngx_rbtree_node_t *temp, 
-	ngx_rbtree_node_t *node, 
-	ngx_rbtree_node_t *sentinel)
+ngx_buffer_cache_write_start(ngx_buffer_cache_sh_t *cache)
+{
+	// Note: the sequence may already be odd if a process was killed while updating the cache
+	if ((cache->sequence & 1) == 0)
+	{
+		(void)ngx_atomic_fetch_add(&cache->sequence, 1);
+	}
+	ngx_memory_barrier();
+}
+
+static void
+ngx_buffer_cache_write_end(ngx_buffer_cache_sh_t *cache)
 {
-	ngx_buffer_cache_entry_t *n, *t;
-	ngx_rbtree_node_t **p;
+	ngx_memory_barrier();
+	(void)ngx_atomic_fetch_add(&cache->sequence, 1);
+}
+
+/* Note: may be called without the mutex, in this case, the result must be validated using the sequence */
+static ngx_buffer_cache_entry_t *
+ngx_buffer_cache_index_lookup(
+	ngx_buffer_cache_sh_t *cache,
+	const u_char* key,
+	uint32_t hash)
+{
+	ngx_buffer_cache_index_slot_t* slot;
+	ngx_buffer_cache_entry_t* entry;
+	uint32_t entry_count;
+	uint32_t entry_index;
+	uint32_t mask = cache->index_mask;
+	uint32_t pos;
+	uint32_t i;
+
+	entry_count = cache->entries_end - cache->entries_start;
 
-	for (;;) 
+	pos = hash & mask;
+	for (i = 0; i <= mask; i++, pos = (pos + 1) & mask)
 	{
-		n = (ngx_buffer_cache_entry_t *)node;
-		t = (ngx_buffer_cache_entry_t *)temp;
+		slot = &cache->index[pos];
 
-		if (node->key != temp->key) 
+		entry_index = slot->entry;
+		if (entry_index == 0)
 		{
-			p = (node->key < temp->key) ? &temp->left : &temp->right;
+			break;
 		}
-		else 
+
+		if (slot->hash != hash)
 		{
-			p = (ngx_memcmp(n->key, t->key, BUFFER_CACHE_KEY_SIZE) < 0)
-				? &temp->left : &temp->right;
+			continue;
 		}
 
-		if (*p == sentinel) 
+		// Note: when running without the mutex, the slot may be stale, validating the entry
+		//		index to make sure the entry pointer is valid
+		entry_index--;
+		if (entry_index >= entry_count)
 		{
-			break;
+			continue;
+		}
+
+		entry = cache->entries_start + entry_index;
+		if (ngx_memcmp(entry->key, key, BUFFER_CACHE_KEY_SIZE) != 0)
+		{
+			continue;
 		}
 
-		temp = *p;
+		return entry;
 	}
 
-	*p = node;
-	node->parent = temp;
-	node->left = sentinel;
-	node->right = sentinel;
-	ngx_rbt_red(node);
+	return NULL;
 }
 
-// Note: code taken from ngx_str_rbtree_lookup, updated the node comparison
-static ngx_buffer_cache_entry_t *
-ngx_buffer_cache_rbtree_lookup(ngx_rbtree_t *rbtree, const u_char* key, uint32_t hash)
+/* Note: must be called with the mutex locked and the sequence odd */
+static void
+ngx_buffer_cache_index_insert(ngx_buffer_cache_sh_t *cache, ngx_buffer_cache_entry_t* entry)
 {
-	ngx_buffer_cache_entry_t *n;
-	ngx_rbtree_node_t *node, *sentinel;
-	ngx_int_t rc;
+	ngx_buffer_cache_index_slot_t* slot;
+	uint32_t mask = cache->index_mask;
+	uint32_t pos;
 
-	node = rbtree->root;
-	sentinel = rbtree->sentinel;
+	// Note: the index never gets full since the number of entries is limited to index_max_count
+	for (pos = entry->hash & mask; cache->index[pos].entry != 0; pos = (pos + 1) & mask);
 
-	while (node != sentinel) 
-	{
-		n = (ngx_buffer_cache_entry_t *)node;
+	slot = &cache->index[pos];
+	slot->hash = entry->hash;
+	slot->entry = entry - cache->entries_start + 1;
+
+	cache->index_count++;
+}
 
-		if (hash != node->key) 
+/* Note: must be called with the mutex locked and the sequence odd */
+static void
+ngx_buffer_cache_index_delete(ngx_buffer_cache_sh_t *cache, ngx_buffer_cache_entry_t* entry)
+{
+	uint32_t mask = cache->index_mask;
+	uint32_t entry_index = entry - cache->entries_start + 1;
+	uint32_t home;
+	uint32_t pos;
+	uint32_t next;
+
+	// find the slot of the entry
+	for (pos = entry->hash & mask; cache->index[pos].entry != entry_index; pos = (pos + 1) & mask)
+	{
+		if (cache->index[pos].entry == 0)
 		{
-			node = (hash < node->key) ? node->left : node->right;
-			continue;
+			return;		// not found, should not happen
 		}
+	}
+
+	// remove the slot, and shift back following slots that can not be found without it
+	for (;;)
+	{
+		cache->index[pos].entry = 0;
 
-		rc = ngx_memcmp(key, n->key, BUFFER_CACHE_KEY_SIZE);
-		if (rc < 0) 
+		for (next = (pos + 1) & mask; ; next = (next + 1) & mask)
 		{
-			node = node->left;
-			continue;
+			if (cache->index[next].entry == 0)
+			{
+				cache->index_count--;
+				return;
+			}
+
+			// leave the slot in place if its home position is cyclically in (pos, next]
+			home = cache->index[next].hash & mask;
+			if (pos <= next ? (pos < home && home <= next) : (pos < home || home <= next))
+			{
+				continue;
+			}
+
+			break;
 		}
 
-		if (rc > 0) 
+		cache->index[pos] = cache->index[next];
+		pos = next;
+	}
+}
+
+/* Note: must be called with the mutex locked */
+static ngx_flag_t
+ngx_buffer_cache_has_references(ngx_buffer_cache_sh_t *cache)
+{
+	ngx_buffer_cache_entry_t* entry;
+
+	// Note: fetches fail while the partition is being reset, so no reference was taken after the
+	//		last access to the partition. references that remain after a long period are leaked
+	if (ngx_time() >= cache->access_time + ENTRY_LEAKED_REF_EXPIRATION)
+	{
+		return 0;
+	}
+
+	for (entry = cache->entries_start; entry < cache->entries_end; entry++)
+	{
+		if (entry->state != CES_FREE && entry->ref_count > 0)
 		{
-			node = node->right;
-			continue;
+			return 1;
 		}
-
-		return n;
 	}
 
-	return NULL;
+	return 0;
+}
+
+/* Note: used for references that were leaked by a killed process. the count is decremented 
+	atomically since a lock-free fetch may be incrementing it concurrently */
+static void
+ngx_buffer_cache_clear_references(ngx_buffer_cache_entry_t* entry)
+{
+	ngx_atomic_uint_t ref_count = entry->ref_count;
+
+	if (ref_count > 0)
+	{
+		(void)ngx_atomic_fetch_add(&entry->ref_count, -(ngx_atomic_int_t)ref_count);
+	}
 }
 
+/* Note: must be called with the mutex locked and the sequence odd */
 static void
 ngx_buffer_cache_reset(ngx_buffer_cache_sh_t *cache)
 {
-	cache->entries_end = cache->entries_start;
+	ngx_buffer_cache_entry_t* entry;
+
+	// Note: the entries section is not reduced, since lock-free fetches may still access it
+	ngx_queue_init(&cache->used_queue);
+	ngx_queue_init(&cache->free_queue);
+	for (entry = cache->entries_start; entry < cache->entries_end; entry++)
+	{
+		entry->state = CES_FREE;
+		ngx_buffer_cache_clear_references(entry);
+		ngx_queue_insert_tail(&cache->free_queue, &entry->queue_node);
+	}
+
+	ngx_memzero(cache->index, sizeof(cache->index[0]) * (cache->index_mask + 1));
+	cache->index_count = 0;
+
 	cache->buffers_start = cache->buffers_end;
 	cache->buffers_read = cache->buffers_end;
 	cache->buffers_write = cache->buffers_end;
-	ngx_rbtree_init(&cache->rbtree, &cache->sentinel, ngx_buffer_cache_rbtree_insert_value);
-	ngx_queue_init(&cache->used_queue);
-	ngx_queue_init(&cache->free_queue);
 
 	// update stats (everything is evicted)
 	cache->stats.evicted = cache->stats.store_ok;
@@ -132,12 +281,37 @@ ngx_buffer_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 	ngx_buffer_cache_sh_t *sh;
 	ngx_buffer_cache_t *ocache = data;
 	ngx_buffer_cache_t *cache;
+	ngx_uint_t sh_count;
+	ngx_uint_t i;
+	ngx_uint_t c;
+	uint32_t index_size = 0;
+	size_t partition_size = 0;
+	size_t total_size;
+	u_char* partition_end;
 	u_char* p;
 
 	cache = shm_zone->data;
 
 	if (ocache)
 	{
+		if (ocache->partitions != cache->partitions)
+		{
+			ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+				"buffer cache \"%V\" had previously %ui partitions, now %ui", 
+				&shm_zone->shm.name, ocache->partitions, cache->partitions);
+			return NGX_ERROR;
+		}
+
+		if (ocache->size_class_count != cache->size_class_count ||
+			ngx_memcmp(ocache->size_classes, cache->size_classes, 
+				sizeof(cache->size_classes[0]) * cache->size_class_count) != 0)
+		{
+			ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+				"buffer cache \"%V\" had previously different size classes",
+				&shm_zone->shm.name);
+			return NGX_ERROR;
+		}
+
 		cache->sh = ocache->sh;
 		cache->shpool = ocache->shpool;
 		return NGX_OK;
@@ -158,58 +332,105 @@ ngx_buffer_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 	cache->shpool->log_ctx = p;
 	p = ngx_sprintf(cache->shpool->log_ctx, " in buffer cache \"%V\"%Z", &shm_zone->shm.name);
 
-	// allocate the shared cache state
+	// allocate the shared cache state of the partitions
+	sh_count = cache->partitions * cache->size_class_count;
+
+	p = ngx_align_ptr(p, NGX_ALIGNMENT);
 	sh = (ngx_buffer_cache_sh_t*)p;
-	p += sizeof(*sh);
+	p += sizeof(*sh) * sh_count;
 	cache->sh = sh;
 
 	cache->shpool->data = sh;
 
-	// initialize fixed cache fields
-	sh->entries_start = (ngx_buffer_cache_entry_t*)p;
-	sh->buffers_end = shm_zone->shm.addr + shm_zone->shm.size;
-	sh->access_time = 0;
+	total_size = shm_zone->shm.addr + shm_zone->shm.size - p;
 
-	// reset the stats
-	ngx_memzero(&sh->stats, sizeof(sh->stats));
+	for (i = 0; i < sh_count; i++, sh++)
+	{
+		c = i / cache->partitions;
+		if (i % cache->partitions == 0)
+		{
+			// first partition of the size class, calculate the partition size
+			partition_size = ((total_size * cache->size_classes[c].percent / 100) / cache->partitions) & (~(BUFFER_ALIGNMENT - 1));
 
-	// reset the cache status
-	ngx_buffer_cache_reset(sh);
-	sh->reset = 0;
+			// get the index size - a power of 2
+			for (index_size = INDEX_MIN_SLOTS; index_size < partition_size / INDEX_BYTES_PER_SLOT; index_size <<= 1);
+		}
+
+		partition_end = p + partition_size;
+
+		// initialize the mutex
+		if (sh_count > 1)
+		{
+			if (ngx_shmtx_create(&sh->own_mutex, &sh->lock, NULL) != NGX_OK)
+			{
+				return NGX_ERROR;
+			}
+
+			sh->mutex = &sh->own_mutex;
+		}
+		else
+		{
+			sh->mutex = &cache->shpool->mutex;
+		}
+
+		// initialize the index
+		p = ngx_align_ptr(p, BUFFER_ALIGNMENT);
+		sh->index = (ngx_buffer_cache_index_slot_t*)p;
+		sh->index_mask = index_size - 1;
+		sh->index_max_count = index_size / 4 * 3;		// keep the load factor at most 75%
+		p += sizeof(sh->index[0]) * index_size;
+
+		// initialize fixed partition fields
+		sh->entries_start = (ngx_buffer_cache_entry_t*)p;
+		sh->entries_end = sh->entries_start;
+		sh->buffers_end = partition_end;
+		sh->access_time = 0;
+		sh->sequence = 0;
+
+		// reset the stats and key locks
+		ngx_memzero(&sh->stats, sizeof(sh->stats));
+		ngx_memzero(sh->key_locks, sizeof(sh->key_locks));
+
+		// reset the partition status
+		ngx_buffer_cache_reset(sh);
+		sh->reset = 0;
+
+		p = partition_end;
+	}
 
 	return NGX_OK;
 }
 
-/* Note: must be called with the mutex locked */
-static ngx_buffer_cache_entry_t*
-ngx_buffer_cache_free_oldest_entry(ngx_buffer_cache_sh_t *cache, uint32_t expiration)
+static ngx_buffer_cache_sh_t*
+ngx_buffer_cache_get_partition(ngx_buffer_cache_t* cache, ngx_uint_t size_class, uint32_t hash)
 {
-	ngx_buffer_cache_entry_t* entry;
+	ngx_buffer_cache_sh_t* sh = cache->sh + size_class * cache->partitions;
 
-	// verify we have an entry to free
-	if (ngx_queue_empty(&cache->used_queue))
+	if (cache->partitions <= 1)
 	{
-		return NULL;
+		return sh;
 	}
 
-	// verify the entry is not locked
-	entry = container_of(ngx_queue_head(&cache->used_queue), ngx_buffer_cache_entry_t, queue_node);
-	if (ngx_time() < entry->access_time + ENTRY_LOCK_EXPIRATION)
-	{
-		return NULL;
-	}
+	// Note: using the high bits of the hash to select the partition, the low bits are used by the index
+	return sh + ((hash >> 16) % cache->partitions);
+}
+
+/* Note: must be called with the mutex locked and the sequence odd */
+static void
+ngx_buffer_cache_free_entry(ngx_buffer_cache_sh_t *cache, ngx_buffer_cache_entry_t* entry)
+{
+	ngx_flag_t is_oldest;
+
+	is_oldest = ngx_queue_head(&cache->used_queue) == &entry->queue_node;
 
-	// make sure the entry is expired, if that is the requirement
-	if (expiration && ngx_time() < (time_t)(entry->write_time + expiration))
-	{
-		return NULL;
-	}
-	
 	// update the state
 	entry->state = CES_FREE;
 
-	// remove from rb tree
-	ngx_rbtree_delete(&cache->rbtree, &entry->node);
+	// remove from the index
+	if (entry->retire_time == 0)
+	{
+		ngx_buffer_cache_index_delete(cache, entry);
+	}
 
 	// move from used_queue to free_queue
 	ngx_queue_remove(&entry->queue_node);
@@ -221,7 +442,7 @@ ngx_buffer_cache_free_oldest_entry(ngx_buffer_cache_sh_t *cache, uint32_t expira
 		cache->buffers_read = cache->buffers_end;
 		cache->buffers_write = cache->buffers_end;
 	}
-	else
+	else if (is_oldest)
 	{
 		// update the read buffer pointer
 		cache->buffers_read = entry->start_offset;
@@ -230,16 +451,92 @@ ngx_buffer_cache_free_oldest_entry(ngx_buffer_cache_sh_t *cache, uint32_t expira
 	// update stats
 	cache->stats.evicted++;
 	cache->stats.evicted_bytes += entry->buffer_size;
+}
+
+/* Note: must be called with the mutex locked and the sequence odd */
+static void
+ngx_buffer_cache_retire_entry(ngx_buffer_cache_sh_t *cache, ngx_buffer_cache_entry_t* entry)
+{
+	ngx_buffer_cache_index_delete(cache, entry);
+
+	entry->retire_time = ngx_time();
+}
+
+/* Note: must be called with the mutex locked and the sequence odd */
+static void
+ngx_buffer_cache_remove_replaced_entry(ngx_buffer_cache_sh_t *cache, ngx_buffer_cache_entry_t* entry)
+{
+	ngx_buffer_cache_retire_entry(cache, entry);
+
+	// Note: a referenced entry must keep its buffer, it is freed when it becomes the oldest entry
+	if (entry->ref_count == 0)
+	{
+		ngx_buffer_cache_free_entry(cache, entry);
+	}
+}
+
+/* Note: must be called with the mutex locked and the sequence odd */
+static ngx_buffer_cache_entry_t*
+ngx_buffer_cache_free_oldest_entry(ngx_buffer_cache_sh_t *cache, uint32_t expiration)
+{
+	ngx_buffer_cache_entry_t* entry;
+
+	// verify we have an entry to free
+	if (ngx_queue_empty(&cache->used_queue))
+	{
+		return NULL;
+	}
+
+	entry = container_of(ngx_queue_head(&cache->used_queue), ngx_buffer_cache_entry_t, queue_node);
+
+	// make sure the entry is expired, if that is the requirement
+	if (expiration && ngx_time() < (time_t)(entry->write_time + expiration))
+	{
+		return NULL;
+	}
+
+	// verify the entry is not referenced
+	if (entry->ref_count > 0)
+	{
+		if (entry->retire_time == 0)
+		{
+			// prevent new references, the entry is freed once the existing references are released
+			ngx_buffer_cache_retire_entry(cache, entry);
+			return NULL;
+		}
+
+		if (ngx_time() < entry->retire_time + ENTRY_LEAKED_REF_EXPIRATION)
+		{
+			return NULL;
+		}
+
+		// the references were leaked
+		ngx_buffer_cache_clear_references(entry);
+	}
+
+	ngx_buffer_cache_free_entry(cache, entry);
 
 	return entry;
 }
 
-/* Note: must be called with the mutex locked */
+/* Note: must be called with the mutex locked and the sequence odd */
 static ngx_buffer_cache_entry_t*
 ngx_buffer_cache_get_free_entry(ngx_buffer_cache_sh_t *cache)
 {
 	ngx_buffer_cache_entry_t* entry;
 
+	// the index is full, must free entries until a slot becomes available
+	// Note: the oldest entries may be retired entries that are no longer in the index. on the other hand,
+	//		retiring the oldest entry frees a slot even though no entry is freed
+	while (cache->index_count >= cache->index_max_count)
+	{
+		if (ngx_buffer_cache_free_oldest_entry(cache, 0) == NULL &&
+			cache->index_count >= cache->index_max_count)
+		{
+			return NULL;
+		}
+	}
+
 	if (!ngx_queue_empty(&cache->free_queue))
 	{
 		// return the free queue head
@@ -248,20 +545,25 @@ ngx_buffer_cache_get_free_entry(ngx_buffer_cache_sh_t *cache)
 	
 	if ((u_char*)(cache->entries_end + 1) < cache->buffers_start)
 	{
-		// enlarge the entries buffer
-		entry = cache->entries_end;
-		cache->entries_end++;
-
 		// initialize the state and add to free queue
+		entry = cache->entries_end;
 		entry->state = CES_FREE;
+		entry->ref_count = 0;
 		ngx_queue_insert_tail(&cache->free_queue, &entry->queue_node);
+
+		// Note: the entry must be initialized before it becomes visible to lock-free fetches,
+		//		from this point on, the reference count is updated only with atomic operations
+		ngx_memory_barrier();
+
+		// enlarge the entries buffer
+		cache->entries_end++;
 		return entry;
 	}
 	
 	return ngx_buffer_cache_free_oldest_entry(cache, 0);
 }
 
-/* Note: must be called with the mutex locked */
+/* Note: must be called with the mutex locked and the sequence odd */
 static u_char*
 ngx_buffer_cache_get_free_buffer(
 	ngx_buffer_cache_sh_t *cache,
@@ -319,87 +621,257 @@ ngx_buffer_cache_get_free_buffer(
 	return NULL;
 }
 
+/* Note: used when replacing an entry, to remove the key from the partitions of other size classes, and when deleting a key */
+static void
+ngx_buffer_cache_delete_key(ngx_buffer_cache_sh_t *sh, u_char* key, uint32_t hash)
+{
+	ngx_buffer_cache_entry_t* entry;
+
+	ngx_shmtx_lock(sh->mutex);
+
+	if (!sh->reset)
+	{
+		entry = ngx_buffer_cache_index_lookup(sh, key, hash);
+		if (entry != NULL)
+		{
+			ngx_buffer_cache_write_start(sh);
+			sh->reset = 1;
+
+			ngx_buffer_cache_remove_replaced_entry(sh, entry);
+
+			sh->reset = 0;
+			ngx_buffer_cache_write_end(sh);
+		}
+	}
+
+	ngx_shmtx_unlock(sh->mutex);
+}
+
+static ngx_flag_t
+ngx_buffer_cache_entry_valid(ngx_buffer_cache_t* cache, ngx_buffer_cache_entry_t* entry)
+{
+	return entry->state == CES_READY &&
+		(cache->expiration == 0 || ngx_time() < (time_t)(entry->write_time + cache->expiration));
+}
+
+static ngx_int_t
+ngx_buffer_cache_fetch_lock_free(
+	ngx_buffer_cache_t* cache,
+	ngx_buffer_cache_sh_t *sh,
+	u_char* key,
+	uint32_t hash,
+	ngx_buffer_cache_entry_t** result)
+{
+	ngx_buffer_cache_entry_t* entry;
+	ngx_atomic_uint_t sequence;
+
+	sequence = sh->sequence;
+	if (sequence & 1)
+	{
+		return NGX_AGAIN;		// update in progress
+	}
+
+	ngx_memory_barrier();
+
+	if (sh->reset)
+	{
+		return NGX_DECLINED;
+	}
+
+	entry = ngx_buffer_cache_index_lookup(sh, key, hash);
+	if (entry == NULL)
+	{
+		ngx_memory_barrier();
+		return sh->sequence == sequence ? NGX_DECLINED : NGX_AGAIN;
+	}
+
+	// add a reference to the entry, and verify it did not change during the lookup
+	// Note: the atomic increment also acts as a memory barrier
+	(void)ngx_atomic_fetch_add(&entry->ref_count, 1);
+
+	if (sh->sequence != sequence)
+	{
+		(void)ngx_atomic_fetch_add(&entry->ref_count, (ngx_atomic_int_t)-1);
+		return NGX_AGAIN;
+	}
+
+	if (!ngx_buffer_cache_entry_valid(cache, entry))
+	{
+		(void)ngx_atomic_fetch_add(&entry->ref_count, (ngx_atomic_int_t)-1);
+		return NGX_DECLINED;
+	}
+
+	*result = entry;
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_buffer_cache_fetch_partition(
+	ngx_buffer_cache_t* cache,
+	ngx_buffer_cache_sh_t *sh,
+	u_char* key,
+	uint32_t hash,
+	ngx_buffer_cache_entry_t** result)
+{
+	ngx_buffer_cache_entry_t* entry;
+	ngx_int_t rc;
+
+	rc = ngx_buffer_cache_fetch_lock_free(cache, sh, key, hash, result);
+	if (rc != NGX_AGAIN)
+	{
+		return rc;
+	}
+
+	// the partition is being updated, fall back to fetching under the mutex
+	ngx_shmtx_lock(sh->mutex);
+
+	rc = NGX_DECLINED;
+	if (!sh->reset)
+	{
+		entry = ngx_buffer_cache_index_lookup(sh, key, hash);
+		if (entry != NULL && ngx_buffer_cache_entry_valid(cache, entry))
+		{
+			(void)ngx_atomic_fetch_add(&entry->ref_count, 1);
+			*result = entry;
+			rc = NGX_OK;
+		}
+	}
+
+	ngx_shmtx_unlock(sh->mutex);
+
+	return rc;
+}
+
 ngx_flag_t
 ngx_buffer_cache_fetch(
 	ngx_buffer_cache_t* cache,
 	u_char* key,
 	u_char** buffer,
-	size_t* buffer_size)
+	size_t* buffer_size,
+	ngx_buffer_cache_entry_t** result)
 {
-	ngx_buffer_cache_entry_t* entry;
-	ngx_buffer_cache_sh_t *sh = cache->sh;
-	ngx_flag_t result = 0;
+	ngx_buffer_cache_entry_t* entry = NULL;
+	ngx_buffer_cache_sh_t *sh;
+	ngx_uint_t size_class;
 	uint32_t hash;
+	time_t now;
 
 	hash = ngx_crc32_short(key, BUFFER_CACHE_KEY_SIZE);
 
-	ngx_shmtx_lock(&cache->shpool->mutex);
-
-	if (!sh->reset)
+	for (size_class = 0; ; size_class++)
 	{
-		entry = ngx_buffer_cache_rbtree_lookup(&sh->rbtree, key, hash);
-		if (entry != NULL && entry->state == CES_READY && 
-			(cache->expiration == 0 || ngx_time() < (time_t)(entry->write_time + cache->expiration)))
+		if (size_class >= cache->size_class_count)
 		{
-			result = 1;
-
 			// update stats
-			sh->stats.fetch_hit++;
-			sh->stats.fetch_bytes += entry->buffer_size;
+			sh = ngx_buffer_cache_get_partition(cache, 0, hash);
+			(void)ngx_atomic_fetch_add(&sh->stats.fetch_miss, 1);
+			return 0;
+		}
 
-			// copy buffer pointer and size
-			*buffer = entry->start_offset;
-			*buffer_size = entry->buffer_size;
+		sh = ngx_buffer_cache_get_partition(cache, size_class, hash);
 
-			// Note: setting the access time of the entry and cache to prevent it 
-			//		from being freed while the caller uses the buffer
-			sh->access_time = entry->access_time = ngx_time();
-		}
-		else
+		if (ngx_buffer_cache_fetch_partition(cache, sh, key, hash, &entry) == NGX_OK)
 		{
-			// update stats
-			sh->stats.fetch_miss++;
+			break;
 		}
 	}
 
-	ngx_shmtx_unlock(&cache->shpool->mutex);
+	// update stats
+	(void)ngx_atomic_fetch_add(&sh->stats.fetch_hit, 1);
+	(void)ngx_atomic_fetch_add(&sh->stats.fetch_bytes, entry->buffer_size);
+
+	// copy buffer pointer and size
+	*buffer = entry->start_offset;
+	*buffer_size = entry->buffer_size;
+	*result = entry;
+
+	// Note: the access time of the cache is used to delay the reset of the cache while it is being accessed.
+	//		the value is updated only when changed, to avoid writing to a shared cache line
+	now = ngx_time();
+	if (sh->access_time != now)
+	{
+		sh->access_time = now;
+	}
 
-	return result;
+	return 1;
 }
 
-ngx_flag_t
-ngx_buffer_cache_store_gather(
+void
+ngx_buffer_cache_release(ngx_buffer_cache_entry_t* entry)
+{
+	(void)ngx_atomic_fetch_add(&entry->ref_count, (ngx_atomic_int_t)-1);
+}
+
+time_t
+ngx_buffer_cache_get_write_time(ngx_buffer_cache_entry_t* entry)
+{
+	return entry->write_time;
+}
+
+static ngx_flag_t
+ngx_buffer_cache_store_internal(
 	ngx_buffer_cache_t* cache, 
 	u_char* key, 
 	ngx_str_t* buffers,
-	size_t buffer_count)
+	size_t buffer_count,
+	ngx_flag_t replace)
 {
 	ngx_buffer_cache_entry_t* entry;
-	ngx_buffer_cache_sh_t *sh = cache->sh;
+	ngx_buffer_cache_sh_t *sh;
 	ngx_str_t* cur_buffer;
 	ngx_str_t* last_buffer;
+	ngx_uint_t size_class;
+	ngx_uint_t cur_class;
 	size_t buffer_size;
 	uint32_t hash;
 	uint32_t evictions;
 	u_char* target_buffer;
 
+	// calculate the buffer size
+	last_buffer = buffers + buffer_count;
+	buffer_size = 0;
+	for (cur_buffer = buffers; cur_buffer < last_buffer; cur_buffer++)
+	{
+		buffer_size += cur_buffer->len;
+	}
+
+	// get the size class - the last class has no size limit
+	for (size_class = 0; buffer_size > cache->size_classes[size_class].max_size; size_class++);
+
 	hash = ngx_crc32_short(key, BUFFER_CACHE_KEY_SIZE);
 
-	ngx_shmtx_lock(&cache->shpool->mutex);
+	if (replace)
+	{
+		// the existing entry may be in a different size class
+		for (cur_class = 0; cur_class < cache->size_class_count; cur_class++)
+		{
+			if (cur_class != size_class)
+			{
+				ngx_buffer_cache_delete_key(ngx_buffer_cache_get_partition(cache, cur_class, hash), key, hash);
+			}
+		}
+	}
+
+	sh = ngx_buffer_cache_get_partition(cache, size_class, hash);
+
+	ngx_shmtx_lock(sh->mutex);
 
 	if (sh->reset)
 	{
 		// a previous store operation was killed in progress, need to reset the cache
 		// since the data structures may be corrupt. we can only reset the cache after
 		// the access time expires since other processes may still be reading from / 
-		// writing to the cache
-		if (ngx_time() < sh->access_time + CACHE_LOCK_EXPIRATION)
+		// writing to the cache, and no entry is referenced
+		if (ngx_time() < sh->access_time + CACHE_LOCK_EXPIRATION ||
+			ngx_buffer_cache_has_references(sh))
 		{
-			ngx_shmtx_unlock(&cache->shpool->mutex);
+			ngx_shmtx_unlock(sh->mutex);
 			return 0;
 		}
 
 		// reset the cache, leave the reset flag enabled
+		ngx_buffer_cache_write_start(sh);
+
 		ngx_buffer_cache_reset(sh);
 
 		// update stats
@@ -407,6 +879,8 @@ ngx_buffer_cache_store_gather(
 	}
 	else
 	{
+		ngx_buffer_cache_write_start(sh);
+
 		// remove expired entries
 		if (cache->expiration)
 		{
@@ -420,16 +894,22 @@ ngx_buffer_cache_store_gather(
 		}
 
 		// make sure the entry does not already exist
-		entry = ngx_buffer_cache_rbtree_lookup(&sh->rbtree, key, hash);
-		if (entry != NULL)
+		entry = ngx_buffer_cache_index_lookup(sh, key, hash);
+		if (entry != NULL && !replace)
 		{
 			sh->stats.store_exists++;
-			ngx_shmtx_unlock(&cache->shpool->mutex);
+			ngx_buffer_cache_write_end(sh);
+			ngx_shmtx_unlock(sh->mutex);
 			return 0;
 		}
 
 		// enable the reset flag before we start making any changes
 		sh->reset = 1;
+
+		if (entry != NULL)
+		{
+			ngx_buffer_cache_remove_replaced_entry(sh, entry);
+		}
 	}
 
 	// allocate a new entry
@@ -439,14 +919,6 @@ ngx_buffer_cache_store_gather(
 		goto error;
 	}
 
-	// calculate the buffer size
-	last_buffer = buffers + buffer_count;
-	buffer_size = 0;
-	for (cur_buffer = buffers; cur_buffer < last_buffer; cur_buffer++)
-	{
-		buffer_size += cur_buffer->len;
-	}
-
 	// allocate a buffer to hold the data
 	target_buffer = ngx_buffer_cache_get_free_buffer(sh, buffer_size);
 	if (target_buffer == NULL)
@@ -456,10 +928,11 @@ ngx_buffer_cache_store_gather(
 
 	// initialize the entry
 	entry->state = CES_ALLOCATED;
-	entry->node.key = hash;
+	entry->hash = hash;
 	memcpy(entry->key, key, BUFFER_CACHE_KEY_SIZE);
 	entry->start_offset = target_buffer;
 	entry->buffer_size = buffer_size;
+	entry->retire_time = 0;
 
 	// update the write position
 	sh->buffers_write = target_buffer;
@@ -468,38 +941,55 @@ ngx_buffer_cache_store_gather(
 	ngx_queue_remove(&entry->queue_node);
 	ngx_queue_insert_tail(&sh->used_queue, &entry->queue_node);
 
-	// insert to rbtree
-	ngx_rbtree_insert(&sh->rbtree, &entry->node);
+	// insert to the index
+	ngx_buffer_cache_index_insert(sh, entry);
 
 	// update stats
 	sh->stats.store_ok++;
 	sh->stats.store_bytes += buffer_size;
 
 	// Note: the memcpy is performed after releasing the lock to avoid holding the lock for a long time
-	//		setting the access time of the entry and cache prevents it from being freed
-	sh->access_time = entry->access_time = ngx_time();
+	//		adding a reference to the entry prevents it from being freed
+	(void)ngx_atomic_fetch_add(&entry->ref_count, 1);
+	sh->access_time = ngx_time();
 	entry->write_time = ngx_time();
 
 	sh->reset = 0;
-	ngx_shmtx_unlock(&cache->shpool->mutex);
+	ngx_buffer_cache_write_end(sh);
+	ngx_shmtx_unlock(sh->mutex);
 
 	for (cur_buffer = buffers; cur_buffer < last_buffer; cur_buffer++)
 	{
 		target_buffer = ngx_copy(target_buffer, cur_buffer->data, cur_buffer->len);
 	}
 
-	// Note: no need to obtain the lock since state is ngx_atomic_t
+	// Note: no need to obtain the lock since state is ngx_atomic_t, the barrier makes sure
+	//		the data is visible before the state changes
+	ngx_memory_barrier();
 	entry->state = CES_READY;
 
+	ngx_buffer_cache_release(entry);
+
 	return 1;
 
 error:
 	sh->stats.store_err++;
 	sh->reset = 0;
-	ngx_shmtx_unlock(&cache->shpool->mutex);
+	ngx_buffer_cache_write_end(sh);
+	ngx_shmtx_unlock(sh->mutex);
 	return 0;
 }
 
+ngx_flag_t
+ngx_buffer_cache_store_gather(
+	ngx_buffer_cache_t* cache, 
+	u_char* key, 
+	ngx_str_t* buffers,
+	size_t buffer_count)
+{
+	return ngx_buffer_cache_store_internal(cache, key, buffers, buffer_count, 0);
+}
+
 ngx_flag_t
 ngx_buffer_cache_store(
 	ngx_buffer_cache_t* cache,
@@ -512,7 +1002,115 @@ ngx_buffer_cache_store(
 	buffer.data = source_buffer;
 	buffer.len = buffer_size;
 
-	return ngx_buffer_cache_store_gather(cache, key, &buffer, 1);
+	return ngx_buffer_cache_store_internal(cache, key, &buffer, 1, 0);
+}
+
+ngx_flag_t
+ngx_buffer_cache_replace(
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	u_char* source_buffer,
+	size_t buffer_size)
+{
+	ngx_str_t buffer;
+
+	buffer.data = source_buffer;
+	buffer.len = buffer_size;
+
+	return ngx_buffer_cache_store_internal(cache, key, &buffer, 1, 1);
+}
+
+void
+ngx_buffer_cache_delete(
+	ngx_buffer_cache_t* cache,
+	u_char* key)
+{
+	ngx_uint_t cur_class;
+	uint32_t hash;
+
+	hash = ngx_crc32_short(key, BUFFER_CACHE_KEY_SIZE);
+
+	for (cur_class = 0; cur_class < cache->size_class_count; cur_class++)
+	{
+		ngx_buffer_cache_delete_key(ngx_buffer_cache_get_partition(cache, cur_class, hash), key, hash);
+	}
+}
+
+ngx_flag_t
+ngx_buffer_cache_lock(
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	ngx_msec_t timeout)
+{
+	ngx_buffer_cache_key_lock_t* free_lock = NULL;
+	ngx_buffer_cache_key_lock_t* cur_lock;
+	ngx_buffer_cache_key_lock_t* last_lock;
+	ngx_buffer_cache_sh_t *sh;
+	ngx_msec_t now;
+
+	sh = ngx_buffer_cache_get_partition(cache, 0, ngx_crc32_short(key, BUFFER_CACHE_KEY_SIZE));
+	last_lock = sh->key_locks + MAX_KEY_LOCKS;
+	now = ngx_current_msec;
+
+	ngx_shmtx_lock(sh->mutex);
+
+	for (cur_lock = sh->key_locks; cur_lock < last_lock; cur_lock++)
+	{
+		if (cur_lock->expiration == 0 || 
+			(ngx_msec_int_t)(cur_lock->expiration - now) <= 0)
+		{
+			if (free_lock == NULL)
+			{
+				free_lock = cur_lock;
+			}
+			continue;
+		}
+
+		if (ngx_memcmp(cur_lock->key, key, BUFFER_CACHE_KEY_SIZE) == 0)
+		{
+			sh->stats.lock_busy++;
+			ngx_shmtx_unlock(sh->mutex);
+			return 0;
+		}
+	}
+
+	if (free_lock != NULL)
+	{
+		ngx_memcpy(free_lock->key, key, BUFFER_CACHE_KEY_SIZE);
+		free_lock->expiration = (now + timeout) | 1;		// Note: making sure it is not 0
+	}
+
+	sh->stats.lock_ok++;
+	ngx_shmtx_unlock(sh->mutex);
+
+	return 1;
+}
+
+void
+ngx_buffer_cache_unlock(
+	ngx_buffer_cache_t* cache,
+	u_char* key)
+{
+	ngx_buffer_cache_key_lock_t* cur_lock;
+	ngx_buffer_cache_key_lock_t* last_lock;
+	ngx_buffer_cache_sh_t *sh;
+
+	sh = ngx_buffer_cache_get_partition(cache, 0, ngx_crc32_short(key, BUFFER_CACHE_KEY_SIZE));
+	last_lock = sh->key_locks + MAX_KEY_LOCKS;
+
+	ngx_shmtx_lock(sh->mutex);
+
+	for (cur_lock = sh->key_locks; cur_lock < last_lock; cur_lock++)
+	{
+		if (cur_lock->expiration != 0 &&
+			ngx_memcmp(cur_lock->key, key, BUFFER_CACHE_KEY_SIZE) == 0)
+		{
+			cur_lock->expiration = 0;
+			break;
+		}
+	}
+
+	ngx_shmtx_unlock(sh->mutex);
 }
 
 void
@@ -520,40 +1118,147 @@ ngx_buffer_cache_get_stats(
 	ngx_buffer_cache_t* cache,
 	ngx_buffer_cache_stats_t* stats)
 {
-	ngx_buffer_cache_sh_t *sh = cache->sh;
+	ngx_buffer_cache_sh_t *sh;
+	ngx_buffer_cache_sh_t *sh_end = cache->sh + cache->partitions * cache->size_class_count;
+	ngx_atomic_t* src;
+	ngx_atomic_t* dest;
+	ngx_atomic_t* dest_end = &stats->entries;
+
+	ngx_memzero(stats, sizeof(*stats));
 
-	ngx_shmtx_lock(&cache->shpool->mutex);
+	for (sh = cache->sh; sh < sh_end; sh++)
+	{
+		ngx_shmtx_lock(sh->mutex);
 
-	memcpy(stats, &sh->stats, sizeof(sh->stats));
+		// Note: all the stats up to 'entries' are counters of type ngx_atomic_t
+		for (src = (ngx_atomic_t*)&sh->stats, dest = (ngx_atomic_t*)stats; dest < dest_end; src++, dest++)
+		{
+			*dest += *src;
+		}
 
-	stats->entries = sh->entries_end - sh->entries_start;
-	stats->data_size = sh->buffers_end - sh->buffers_start;
+		stats->entries += sh->entries_end - sh->entries_start;
+		stats->data_size += sh->buffers_end - sh->buffers_start;
 
-	ngx_shmtx_unlock(&cache->shpool->mutex);
+		ngx_shmtx_unlock(sh->mutex);
+	}
 }
 
 void
 ngx_buffer_cache_reset_stats(ngx_buffer_cache_t* cache)
 {
-	ngx_shmtx_lock(&cache->shpool->mutex);
+	ngx_buffer_cache_sh_t *sh;
+	ngx_buffer_cache_sh_t *sh_end = cache->sh + cache->partitions * cache->size_class_count;
 
-	ngx_memzero(&cache->sh->stats, sizeof(cache->sh->stats));
+	for (sh = cache->sh; sh < sh_end; sh++)
+	{
+		ngx_shmtx_lock(sh->mutex);
+
+		ngx_memzero(&sh->stats, sizeof(sh->stats));
 
-	ngx_shmtx_unlock(&cache->shpool->mutex);
+		ngx_shmtx_unlock(sh->mutex);
+	}
 }
 
 ngx_buffer_cache_t*
-ngx_buffer_cache_create(ngx_conf_t *cf, ngx_str_t *name, size_t size, time_t expiration, void *tag)
+ngx_buffer_cache_create(
+	ngx_conf_t *cf, 
+	ngx_str_t *name, 
+	size_t size, 
+	time_t expiration, 
+	ngx_uint_t partitions, 
+	ngx_array_t *size_classes,
+	void *tag)
 {
+	ngx_buffer_cache_size_class_t* cur_class;
+	ngx_buffer_cache_size_class_t* last_class;
 	ngx_buffer_cache_t* cache;
+	ngx_uint_t size_class_count;
+	ngx_uint_t percent_left;
+	size_t prev_max_size;
+
+	if (partitions < 1 || partitions > MAX_PARTITIONS)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"partition count must be between 1 and %d", MAX_PARTITIONS);
+		return NULL;
+	}
+
+	size_class_count = (size_classes != NULL ? size_classes->nelts : 0) + 1;
+	if (size_class_count > MAX_SIZE_CLASSES)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"size class count must not exceed %d", MAX_SIZE_CLASSES - 1);
+		return NULL;
+	}
+
+#if !(NGX_HAVE_ATOMIC_OPS)
+	if (partitions * size_class_count > 1)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"cache partitioning requires atomic operations support");
+		return NULL;
+	}
+#endif
 
 	cache = ngx_pcalloc(cf->pool, sizeof(ngx_buffer_cache_t));
 	if (cache == NULL) 
 	{
-		return NGX_CONF_ERROR;
+		return NULL;
 	}
 
 	cache->expiration = expiration;
+	cache->partitions = partitions;
+
+	// initialize the size classes, the last class holds all sizes and gets the percent left
+	cache->size_classes = ngx_palloc(cf->pool, sizeof(cache->size_classes[0]) * size_class_count);
+	if (cache->size_classes == NULL)
+	{
+		return NULL;
+	}
+
+	if (size_classes != NULL)
+	{
+		ngx_memcpy(cache->size_classes, size_classes->elts, sizeof(cache->size_classes[0]) * size_classes->nelts);
+	}
+
+	cache->size_class_count = size_class_count;
+
+	last_class = cache->size_classes + size_class_count - 1;
+	last_class->max_size = NGX_MAX_SIZE_T_VALUE;
+
+	percent_left = 100;
+	prev_max_size = 0;
+	for (cur_class = cache->size_classes; cur_class < last_class; cur_class++)
+	{
+		if (cur_class->max_size <= prev_max_size)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"size classes must be sorted by size");
+			return NULL;
+		}
+
+		if (cur_class->percent <= 0 || cur_class->percent >= percent_left)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"the total percent of the size classes must be less than 100");
+			return NULL;
+		}
+
+		prev_max_size = cur_class->max_size;
+		percent_left -= cur_class->percent;
+	}
+
+	last_class->percent = percent_left;
+
+	for (cur_class = cache->size_classes; cur_class <= last_class; cur_class++)
+	{
+		if (size / 100 * cur_class->percent / partitions < MIN_PARTITION_SIZE)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"cache size %uz too small for %ui partitions and the configured size classes", size, partitions);
+			return NULL;
+		}
+	}
 
 	cache->shm_zone = ngx_shared_memory_add(cf, name, size, tag);
 	if (cache->shm_zone == NULL)
@@ -565,7 +1270,7 @@ ngx_buffer_cache_create(ngx_conf_t *cf, ngx_str_t *name, size_t size, time_t exp
 	{
 		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
 			"duplicate zone \"%V\"", name);
-		return NGX_CONF_ERROR;
+		return NULL;
 	}
 
 	cache->shm_zone->init = ngx_buffer_cache_init;
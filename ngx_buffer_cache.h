@@ -11,6 +11,14 @@
 struct ngx_buffer_cache_s;
 typedef struct ngx_buffer_cache_s ngx_buffer_cache_t;
 
+struct ngx_buffer_cache_entry_s;
+typedef struct ngx_buffer_cache_entry_s ngx_buffer_cache_entry_t;
+
+typedef struct {
+	size_t max_size;
+	ngx_uint_t percent;
+} ngx_buffer_cache_size_class_t;
+
 typedef struct {
 	ngx_atomic_t store_ok;
 	ngx_atomic_t store_bytes;
@@ -22,6 +30,8 @@ typedef struct {
 	ngx_atomic_t evicted;
 	ngx_atomic_t evicted_bytes;
 	ngx_atomic_t reset;
+	ngx_atomic_t lock_ok;
+	ngx_atomic_t lock_busy;
 
 	// updated only when the stats are fetched
 	ngx_atomic_t entries;
@@ -33,7 +43,14 @@ ngx_flag_t ngx_buffer_cache_fetch(
 	ngx_buffer_cache_t* cache,
 	u_char* key,
 	u_char** buffer,
-	size_t* buffer_size);
+	size_t* buffer_size,
+	ngx_buffer_cache_entry_t** entry);
+
+// Note: the buffer remains valid until the entry is released, an oldest entry that is still referenced is removed
+//		from the index, and its buffer is reclaimed only after all its references are released
+void ngx_buffer_cache_release(ngx_buffer_cache_entry_t* entry);
+
+time_t ngx_buffer_cache_get_write_time(ngx_buffer_cache_entry_t* entry);
 
 ngx_flag_t ngx_buffer_cache_store(
 	ngx_buffer_cache_t* cache,
@@ -47,6 +64,26 @@ ngx_flag_t ngx_buffer_cache_store_gather(
 	ngx_str_t* buffers,
 	size_t buffer_count);
 
+// Note: unlike store, replace succeeds when the key already exists, the previous entry is discarded
+ngx_flag_t ngx_buffer_cache_replace(
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	u_char* source_buffer,
+	size_t buffer_size);
+
+void ngx_buffer_cache_delete(
+	ngx_buffer_cache_t* cache,
+	u_char* key);
+
+ngx_flag_t ngx_buffer_cache_lock(
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	ngx_msec_t timeout);
+
+void ngx_buffer_cache_unlock(
+	ngx_buffer_cache_t* cache,
+	u_char* key);
+
 void ngx_buffer_cache_get_stats(
 	ngx_buffer_cache_t* cache,
 	ngx_buffer_cache_stats_t* stats);
@@ -58,6 +95,8 @@ ngx_buffer_cache_t* ngx_buffer_cache_create(
 	ngx_str_t *name, 
 	size_t size, 
 	time_t expiration, 
+	ngx_uint_t partitions, 
+	ngx_array_t *size_classes,
 	void *tag);
 
 #endif // _NGX_BUFFER_CACHE_H_INCLUDED_
\ No newline at end of file
@@ -9,10 +9,16 @@
 
 // constants
 #define CACHE_LOCK_EXPIRATION (5)
-#define ENTRY_LOCK_EXPIRATION (5)
+#define ENTRY_LEAKED_REF_EXPIRATION (60)	// a referenced entry that was removed from the index for this period is assumed to be leaked by a killed process
 #define ENTRIES_ALLOC_MARGIN (1024)		// 1K entries ~= 100KB, we reserve this space to make sure allocating entries does not become the bottleneck
 #define BUFFER_ALIGNMENT (16)
 #define MAX_EVICTIONS_PER_STORE (128)
+#define MAX_PARTITIONS (64)
+#define MAX_SIZE_CLASSES (8)
+#define INDEX_BYTES_PER_SLOT (256)
+#define INDEX_MIN_SLOTS (1024)
+#define MIN_PARTITION_SIZE (ENTRIES_ALLOC_MARGIN * sizeof(ngx_buffer_cache_entry_t) * 2)
+#define MAX_KEY_LOCKS (64)				// per partition, when exhausted lock requests succeed without locking
 
 // enums
 enum {
@@ -22,22 +28,39 @@ enum {
 };
 
 // typedefs
-typedef struct {
-	ngx_rbtree_node_t node;
+struct ngx_buffer_cache_entry_s {
 	ngx_queue_t queue_node;
 	u_char* start_offset;
 	size_t buffer_size;
 	ngx_atomic_t state;
-	time_t access_time;
+	ngx_atomic_t ref_count;
+	time_t retire_time;			// the time the entry was removed from the index, 0 while it is in the index
 	time_t write_time;
+	uint32_t hash;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+};
+
+typedef struct {
+	uint32_t hash;
+	uint32_t entry;				// entry index + 1, 0 = empty slot
+} ngx_buffer_cache_index_slot_t;
+
+typedef struct {
 	u_char key[BUFFER_CACHE_KEY_SIZE];
-} ngx_buffer_cache_entry_t;
+	ngx_msec_t expiration;		// 0 = free slot
+} ngx_buffer_cache_key_lock_t;
 
 typedef struct {
+	ngx_shmtx_sh_t lock;
+	ngx_shmtx_t own_mutex;
+	ngx_shmtx_t* mutex;			// points to own_mutex or to the slab pool mutex when there is a single partition
 	ngx_atomic_t reset;
+	ngx_atomic_t sequence;		// odd while the index / entries are being updated
 	time_t access_time;
-	ngx_rbtree_t rbtree;
-	ngx_rbtree_node_t sentinel;
+	ngx_buffer_cache_index_slot_t* index;
+	uint32_t index_mask;
+	uint32_t index_count;
+	uint32_t index_max_count;
 	ngx_queue_t used_queue;
 	ngx_queue_t free_queue;
 	ngx_buffer_cache_entry_t* entries_start;
@@ -46,14 +69,18 @@ typedef struct {
 	u_char* buffers_end;
 	u_char* buffers_read;
 	u_char* buffers_write;
+	ngx_buffer_cache_key_lock_t key_locks[MAX_KEY_LOCKS];
 	ngx_buffer_cache_stats_t stats;
 } ngx_buffer_cache_sh_t;
 
 struct ngx_buffer_cache_s {
-	ngx_buffer_cache_sh_t *sh;
+	ngx_buffer_cache_sh_t *sh;		// array of partitions, ordered by size class
 	ngx_slab_pool_t *shpool;
 
 	uint32_t expiration;
+	ngx_uint_t partitions;			// partitions per size class
+	ngx_buffer_cache_size_class_t* size_classes;
+	ngx_uint_t size_class_count;
 
 	ngx_shm_zone_t *shm_zone;
 };
@@ -85,6 +85,66 @@ static ngx_child_request_hide_header_t hide_headers[] = {
 static ngx_http_output_header_filter_pt ngx_http_next_header_filter;
 static ngx_hash_t hide_headers_hash;
 
+static ngx_int_t
+ngx_child_request_get_result(
+	ngx_http_request_t *r,
+	ngx_child_request_context_t* ctx,
+	ngx_http_upstream_t *u,
+	ngx_int_t rc,
+	off_t* content_length)
+{
+	if (rc == NGX_OK && is_in_memory(ctx))
+	{
+		if (u->headers_in.status_n != NGX_HTTP_OK && u->headers_in.status_n != NGX_HTTP_PARTIAL_CONTENT)
+		{
+			if (u->headers_in.status_n != 0)
+			{
+				ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+					"ngx_child_request_get_result: upstream returned a bad status %ui", u->headers_in.status_n);
+			}
+			else
+			{
+				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+					"ngx_child_request_get_result: failed to get upstream status");
+			}
+			rc = NGX_HTTP_BAD_GATEWAY;
+		}
+		else if (u->length != 0 && u->length != -1 && !u->headers_in.chunked)
+		{
+			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+				"ngx_child_request_get_result: upstream connection was closed with %O bytes left to read", u->length);
+			rc = NGX_HTTP_BAD_GATEWAY;
+		}
+	}
+	else if (rc == NGX_ERROR)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_child_request_get_result: got error -1, changing to 502");
+		rc = NGX_HTTP_BAD_GATEWAY;
+	}
+
+	if (ctx->send_header_result != NGX_OK)
+	{
+		rc = ctx->send_header_result;
+	}
+
+	// get the content length
+	if (is_in_memory(ctx))
+	{
+		*content_length = u->buffer.last - u->buffer.pos;
+	}
+	else if (u->state != NULL)
+	{
+		*content_length = u->state->response_length;
+	}
+	else
+	{
+		*content_length = 0;
+	}
+
+	return rc;
+}
+
 static void
 ngx_child_request_wev_handler(ngx_http_request_t *r)
 {
@@ -132,55 +192,7 @@ ngx_child_request_wev_handler(ngx_http_request_t *r)
 	}
 
 	// get the final error code
-	rc = ctx->error_code;
-	if (rc == NGX_OK && is_in_memory(ctx))
-	{
-		if (u->headers_in.status_n != NGX_HTTP_OK && u->headers_in.status_n != NGX_HTTP_PARTIAL_CONTENT)
-		{
-			if (u->headers_in.status_n != 0)
-			{
-				ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-					"ngx_child_request_wev_handler: upstream returned a bad status %ui", u->headers_in.status_n);
-			}
-			else
-			{
-				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-					"ngx_child_request_wev_handler: failed to get upstream status");
-			}
-			rc = NGX_HTTP_BAD_GATEWAY;
-		}
-		else if (u->length != 0 && u->length != -1 && !u->headers_in.chunked)
-		{
-			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-				"ngx_child_request_wev_handler: upstream connection was closed with %O bytes left to read", u->length);
-			rc = NGX_HTTP_BAD_GATEWAY;
-		}
-	}
-	else if (rc == NGX_ERROR)
-	{
-		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_child_request_wev_handler: got error -1, changing to 502");
-		rc = NGX_HTTP_BAD_GATEWAY;
-	}
-
-	if (ctx->send_header_result != NGX_OK)
-	{
-		rc = ctx->send_header_result;
-	}
-
-	// get the content length
-	if (is_in_memory(ctx))
-	{
-		content_length = u->buffer.last - u->buffer.pos;
-	}
-	else if (u->state != NULL)
-	{
-		content_length = u->state->response_length;
-	}
-	else
-	{
-		content_length = 0;
-	}
+	rc = ngx_child_request_get_result(r, ctx, u, ctx->error_code, &content_length);
 
 	if (ctx->callback != NULL)
 	{
@@ -258,6 +270,46 @@ ngx_child_request_finished_handler(
 	return NGX_OK;
 }
 
+#if defined(nginx_version) && nginx_version >= 1013001
+/*
+	background requests are not waited by the parent, the parent may complete before they do.
+	the callback is called directly when the request completes, the parent request is not touched
+*/
+static ngx_int_t
+ngx_child_request_background_finished_handler(
+	ngx_http_request_t *r,
+	void *data,
+	ngx_int_t rc)
+{
+	ngx_child_request_context_t* ctx;
+	ngx_http_upstream_t *u;
+	off_t content_length;
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"ngx_child_request_background_finished_handler: error code %ui", rc);
+
+	// make sure we are not called twice for the same request
+	r->post_subrequest = NULL;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+
+	u = r->upstream;
+	if (u == NULL)
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_child_request_background_finished_handler: upstream is null");
+		ctx->callback(ctx->callback_context, NGX_HTTP_BAD_GATEWAY, NULL, 0);
+		return NGX_OK;
+	}
+
+	rc = ngx_child_request_get_result(r, ctx, u, rc, &content_length);
+
+	ctx->callback(ctx->callback_context, rc, &u->buffer, content_length);
+
+	return NGX_OK;
+}
+#endif
+
 static void
 ngx_child_request_initial_wev_handler(ngx_http_request_t *r)
 {
@@ -471,6 +523,15 @@ ngx_child_request_start(
 		return NGX_ERROR;
 	}
 
+#if !defined(nginx_version) || nginx_version < 1013001
+	if (params->background)
+	{
+		ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+			"ngx_child_request_start: background requests require nginx 1.13.1 or newer");
+		return NGX_DECLINED;
+	}
+#endif
+
 	child_ctx->callback = callback;
 	child_ctx->callback_context = callback_context;
 	child_ctx->response_buffer = response_buffer;
@@ -497,7 +558,16 @@ ngx_child_request_start(
 		return NGX_ERROR;
 	}
 
-	psr->handler = ngx_child_request_finished_handler;
+#if defined(nginx_version) && nginx_version >= 1013001
+	if (params->background)
+	{
+		psr->handler = ngx_child_request_background_finished_handler;
+	}
+	else
+#endif
+	{
+		psr->handler = ngx_child_request_finished_handler;
+	}
 	psr->data = r;
 
 	if (is_in_memory(child_ctx))
@@ -517,6 +587,13 @@ ngx_child_request_start(
 		flags = NGX_HTTP_SUBREQUEST_WAITED;
 	}
 
+#if defined(nginx_version) && nginx_version >= 1013001
+	if (params->background)
+	{
+		flags = (flags & ~NGX_HTTP_SUBREQUEST_WAITED) | NGX_HTTP_SUBREQUEST_BACKGROUND;
+	}
+#endif
+
 	rc = ngx_http_subrequest(r, &uri, &params->extra_args, &sr, psr, flags);
 	if (rc == NGX_ERROR)
 	{
@@ -16,6 +16,7 @@ typedef struct {
 	ngx_table_elt_t extra_header;
 	ngx_flag_t proxy_range;
 	ngx_flag_t proxy_all_headers;
+	ngx_flag_t background;
 } ngx_child_request_params_t;
 
 // functions
@@ -26,6 +27,9 @@ typedef struct {
 //	2. response_buffer is optional, if it is not supplied, the upstream response gets written
 //		to the parent request. when a response buffer is supplied, the response is written to it, 
 //		the buffer should be large enough to contain both the response body and the response headers.
+//	3. background requests (nginx 1.13.1+) are not waited by the parent request, the callback is mandatory
+//		and is called when the child request completes, possibly after the parent request was finalized.
+//		NGX_DECLINED is returned when background requests are not supported.
 ngx_int_t ngx_child_request_start(
 	ngx_http_request_t *r,
 	ngx_child_request_callback_t callback,
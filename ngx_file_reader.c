@@ -91,6 +91,7 @@ ngx_file_reader_update_state_file_info(ngx_file_reader_state_t* state, ngx_open_
 
 	state->file.fd = of->fd;
 	state->file_size = of->size;
+	state->file_mtime = of->mtime;
 
 	return NGX_OK;
 }
@@ -115,6 +116,8 @@ ngx_file_reader_init(
 	state->log = r->connection->log;
 #if (NGX_HAVE_FILE_AIO)
 	state->use_aio = clcf->aio;
+#endif
+#if (NGX_HAVE_FILE_AIO || NGX_HAVE_IO_URING)
 	state->read_callback = read_callback;
 	state->callback_context = callback_context;
 #endif
@@ -181,6 +184,8 @@ ngx_file_reader_init_async(
 	state->log = r->connection->log;
 #if (NGX_HAVE_FILE_AIO)
 	state->use_aio = clcf->aio;
+#endif
+#if (NGX_HAVE_FILE_AIO || NGX_HAVE_IO_URING)
 	state->read_callback = read_callback;
 	state->callback_context = callback_context;
 #endif
@@ -297,6 +302,37 @@ ngx_file_reader_dump_file_part(ngx_file_reader_state_t* state, off_t start, off_
 	return NGX_OK;
 }
 
+ngx_int_t
+ngx_file_reader_get_file_buf(ngx_file_reader_state_t* state, off_t start, off_t end, ngx_buf_t** result)
+{
+	ngx_buf_t* b;
+
+	if (end > state->file_size)
+	{
+		ngx_log_error(NGX_LOG_ERR, state->log, 0,
+			"ngx_file_reader_get_file_buf: end offset %O exceeds file size %O, probably a truncated file", end, state->file_size);
+		return NGX_HTTP_NOT_FOUND;
+	}
+
+	b = ngx_calloc_buf(state->r->pool);
+	if (b == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, state->log, 0,
+			"ngx_file_reader_get_file_buf: ngx_calloc_buf failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	// Note: the file is owned by the reader state, and remains open until the request pool is destroyed
+	b->file = &state->file;
+	b->file_pos = start;
+	b->file_last = end;
+	b->in_file = 1;
+
+	*result = b;
+
+	return NGX_OK;
+}
+
 ngx_int_t
 ngx_file_reader_enable_directio(ngx_file_reader_state_t* state)
 {
@@ -315,6 +351,73 @@ ngx_file_reader_enable_directio(ngx_file_reader_state_t* state)
 	return NGX_OK;
 }
 
+ngx_int_t
+ngx_file_reader_get_file_info(ngx_file_reader_state_t* state, off_t* size, time_t* mtime)
+{
+	*size = state->file_size;
+	*mtime = state->file_mtime;
+
+	return NGX_OK;
+}
+
+#if (NGX_HAVE_IO_URING)
+
+static void
+ngx_async_read_io_uring_callback(void* data, ssize_t result)
+{
+	ngx_file_reader_state_t* state = data;
+	ngx_http_request_t *r = state->r;
+	ngx_connection_t *c = r->connection;
+	ssize_t bytes_read;
+	ngx_int_t rc;
+
+	r->main->blocked--;
+	r->aio = 0;
+
+	if (result < 0)
+	{
+		ngx_log_error(NGX_LOG_ERR, state->log, -result,
+			"ngx_async_read_io_uring_callback: read \"%s\" failed", state->file.name.data);
+		bytes_read = 0;
+		rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+	else
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, state->log, 0, "ngx_async_read_io_uring_callback: read returned %z", result);
+		state->buf->last += result;
+		bytes_read = result;
+		rc = NGX_OK;
+	}
+
+	state->cur_read_callback(state->cur_callback_context, rc, NULL, bytes_read);
+
+	ngx_http_run_posted_requests(c);
+}
+
+static ngx_int_t
+ngx_async_file_read_io_uring(ngx_file_reader_state_t* state, ngx_buf_t *buf, size_t size, off_t offset)
+{
+	ngx_int_t rc;
+
+	state->io_uring_request.handler = ngx_async_read_io_uring_callback;
+	state->io_uring_request.data = state;
+
+	rc = ngx_io_uring_read(&state->io_uring_request, state->log, state->file.fd, buf->last, size, offset);
+	if (rc != NGX_AGAIN)
+	{
+		// io_uring is not available, fall back to the other read methods
+		return NGX_DECLINED;
+	}
+
+	state->r->main->blocked++;
+	state->r->aio = 1;
+
+	state->buf = buf;
+	return NGX_AGAIN;
+}
+
+#endif // NGX_HAVE_IO_URING
+
 #if (NGX_HAVE_FILE_AIO)
 
 static void
@@ -352,17 +455,28 @@ ngx_async_read_completed_callback(ngx_event_t *ev)
 		rc = NGX_OK;
 	}
 
-	state->read_callback(state->callback_context, rc, NULL, bytes_read);
+	state->cur_read_callback(state->cur_callback_context, rc, NULL, bytes_read);
 
 	ngx_http_run_posted_requests(c);
 }
 
-ngx_int_t 
-ngx_async_file_read(ngx_file_reader_state_t* state, ngx_buf_t *buf, size_t size, off_t offset)
+static ngx_int_t 
+ngx_async_file_read_internal(ngx_file_reader_state_t* state, ngx_buf_t *buf, size_t size, off_t offset)
 {
 	ssize_t rc;
 
-	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, state->log, 0, "ngx_async_file_read: reading offset %O size %uz", offset, size);
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, state->log, 0, "ngx_async_file_read_internal: reading offset %O size %uz", offset, size);
+
+#if (NGX_HAVE_IO_URING)
+	if (state->use_io_uring)
+	{
+		rc = ngx_async_file_read_io_uring(state, buf, size, offset);
+		if (rc != NGX_DECLINED)
+		{
+			return rc;
+		}
+	}
+#endif
 
 	if (state->use_aio)
 	{
@@ -387,11 +501,11 @@ ngx_async_file_read(ngx_file_reader_state_t* state, ngx_buf_t *buf, size_t size,
 
 	if (rc < 0)
 	{
-		ngx_log_error(NGX_LOG_ERR, state->log, 0, "ngx_async_file_read: ngx_file_aio_read failed rc=%z", rc);
+		ngx_log_error(NGX_LOG_ERR, state->log, 0, "ngx_async_file_read_internal: ngx_file_aio_read failed rc=%z", rc);
 		return rc;
 	}
 
-	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, state->log, 0, "ngx_async_file_read: ngx_file_aio_read returned %z", rc);
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, state->log, 0, "ngx_async_file_read_internal: ngx_file_aio_read returned %z", rc);
 	buf->last += rc;
 	
 	return NGX_OK;
@@ -399,24 +513,93 @@ ngx_async_file_read(ngx_file_reader_state_t* state, ngx_buf_t *buf, size_t size,
 
 #else
 
-ngx_int_t 
-ngx_async_file_read(ngx_file_reader_state_t* state, ngx_buf_t *buf, size_t size, off_t offset)
+static ngx_int_t 
+ngx_async_file_read_internal(ngx_file_reader_state_t* state, ngx_buf_t *buf, size_t size, off_t offset)
 {
 	ssize_t rc;
 
-	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, state->log, 0, "ngx_async_file_read: reading offset %O size %uz", offset, size);
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, state->log, 0, "ngx_async_file_read_internal: reading offset %O size %uz", offset, size);
+
+#if (NGX_HAVE_IO_URING)
+	if (state->use_io_uring)
+	{
+		rc = ngx_async_file_read_io_uring(state, buf, size, offset);
+		if (rc != NGX_DECLINED)
+		{
+			return rc;
+		}
+	}
+#endif
 
 	rc = ngx_read_file(&state->file, buf->last, size, offset);
 	if (rc < 0)
 	{
-		ngx_log_error(NGX_LOG_ERR, state->log, 0, "ngx_async_file_read: ngx_read_file failed rc=%z", rc);
+		ngx_log_error(NGX_LOG_ERR, state->log, 0, "ngx_async_file_read_internal: ngx_read_file failed rc=%z", rc);
 		return rc;
 	}
 
-	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, state->log, 0, "ngx_async_file_read: ngx_read_file returned %z", rc);
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, state->log, 0, "ngx_async_file_read_internal: ngx_read_file returned %z", rc);
 	buf->last += rc;
 
 	return NGX_OK;
 }
 
 #endif
+
+ngx_int_t
+ngx_async_file_read(ngx_file_reader_state_t* state, ngx_buf_t *buf, size_t size, off_t offset)
+{
+#if (NGX_HAVE_FILE_AIO || NGX_HAVE_IO_URING)
+	state->cur_read_callback = state->read_callback;
+	state->cur_callback_context = state->callback_context;
+#endif
+
+	return ngx_async_file_read_internal(state, buf, size, offset);
+}
+
+ngx_int_t
+ngx_async_file_read_callback(
+	ngx_file_reader_state_t* state,
+	ngx_buf_t *buf,
+	size_t size,
+	off_t offset,
+	ngx_async_read_callback_t read_callback,
+	void* callback_context)
+{
+#if (NGX_HAVE_FILE_AIO || NGX_HAVE_IO_URING)
+	state->cur_read_callback = read_callback;
+	state->cur_callback_context = callback_context;
+#endif
+
+	return ngx_async_file_read_internal(state, buf, size, offset);
+}
+
+void
+ngx_file_reader_prefetch(ngx_file_reader_state_t* state, off_t offset, off_t size)
+{
+#if (NGX_HAVE_POSIX_FADVISE)
+	ngx_err_t err;
+
+	// Note: direct io reads bypass the page cache
+	if (state->file.directio || offset >= state->file_size)
+	{
+		return;
+	}
+
+	if (size > state->file_size - offset)
+	{
+		size = state->file_size - offset;
+	}
+
+	ngx_log_debug3(NGX_LOG_DEBUG_HTTP, state->log, 0,
+		"ngx_file_reader_prefetch: prefetching \"%s\" offset %O size %O", state->file.name.data, offset, size);
+
+	// Note: posix_fadvise returns the error code instead of setting errno
+	err = posix_fadvise(state->file.fd, offset, size, POSIX_FADV_WILLNEED);
+	if (err != 0)
+	{
+		ngx_log_error(NGX_LOG_WARN, state->log, err,
+			"ngx_file_reader_prefetch: posix_fadvise \"%s\" failed", state->file.name.data);
+	}
+#endif
+}
@@ -11,6 +11,10 @@
 #include "ngx_async_open_file_cache.h"
 #endif
 
+#if (NGX_HAVE_IO_URING)
+#include "ngx_io_uring.h"
+#endif
+
 // typedefs
 typedef void (*ngx_async_read_callback_t)(void* context, ngx_int_t rc, ngx_buf_t* buf, ssize_t bytes_read);
 
@@ -21,10 +25,19 @@ typedef struct {
 	ngx_flag_t log_not_found;
 	ngx_log_t* log;
 	off_t file_size;
+	time_t file_mtime;
 #if (NGX_HAVE_FILE_AIO)
 	ngx_flag_t use_aio;
+#endif
+#if (NGX_HAVE_IO_URING)
+	ngx_flag_t use_io_uring;
+	ngx_io_uring_request_t io_uring_request;
+#endif
+#if (NGX_HAVE_FILE_AIO || NGX_HAVE_IO_URING)
 	ngx_async_read_callback_t read_callback;
 	void* callback_context;
+	ngx_async_read_callback_t cur_read_callback;		// the callback of the read in progress
+	void* cur_callback_context;
 	ngx_buf_t* buf;
 #endif
 } ngx_file_reader_state_t;
@@ -53,8 +66,24 @@ ngx_int_t ngx_file_reader_init_async(
 
 ngx_int_t ngx_file_reader_dump_file_part(ngx_file_reader_state_t* state, off_t start, off_t end);
 
+ngx_int_t ngx_file_reader_get_file_buf(ngx_file_reader_state_t* state, off_t start, off_t end, ngx_buf_t** result);
+
 ngx_int_t ngx_async_file_read(ngx_file_reader_state_t* state, ngx_buf_t *buf, size_t size, off_t offset);
 
+// Note: same as ngx_async_file_read, except that the completion of this read is reported to the
+//		supplied callback, instead of the callback that was passed on init
+ngx_int_t ngx_async_file_read_callback(
+	ngx_file_reader_state_t* state,
+	ngx_buf_t *buf,
+	size_t size,
+	off_t offset,
+	ngx_async_read_callback_t read_callback,
+	void* callback_context);
+
 ngx_int_t ngx_file_reader_enable_directio(ngx_file_reader_state_t* state);
 
+ngx_int_t ngx_file_reader_get_file_info(ngx_file_reader_state_t* state, off_t* size, time_t* mtime);
+
+void ngx_file_reader_prefetch(ngx_file_reader_state_t* state, off_t offset, off_t size);
+
 #endif // _NGX_FILE_READER_H_INCLUDED_
@@ -1,3 +1,4 @@
+#include <nginx.h>
 #include "ngx_http_vod_conf.h"
 #include "ngx_http_vod_request_parse.h"
 #include "ngx_child_http_request.h"
@@ -143,9 +144,19 @@ ngx_http_vod_create_loc_conf(ngx_conf_t *cf)
 	conf->max_metadata_size = NGX_CONF_UNSET_SIZE;
 	conf->max_frames_size = NGX_CONF_UNSET_SIZE;
 	conf->cache_buffer_size = NGX_CONF_UNSET_SIZE;
+	conf->max_coalesced_read_size = NGX_CONF_UNSET_SIZE;
+	conf->coalesced_read_max_gap = NGX_CONF_UNSET_SIZE;
+	conf->max_parallel_reads = NGX_CONF_UNSET_UINT;
+	conf->block_cache_block_size = NGX_CONF_UNSET_SIZE;
+	conf->block_cache_read_ahead = NGX_CONF_UNSET_UINT;
+	conf->sendfile_frames = NGX_CONF_UNSET;
+	conf->max_buffered_segment_size = NGX_CONF_UNSET_SIZE;
+	conf->cache_lock = NGX_CONF_UNSET;
+	conf->cache_lock_timeout = NGX_CONF_UNSET_MSEC;
 	conf->max_upstream_headers_size = NGX_CONF_UNSET_SIZE;
 	conf->ignore_edit_list = NGX_CONF_UNSET;
 	conf->max_mapping_response_size = NGX_CONF_UNSET_SIZE;
+	conf->mapping_refresh_time = NGX_CONF_UNSET;
 
 	conf->expires[CACHE_TYPE_VOD] = NGX_CONF_UNSET;
 	conf->expires[CACHE_TYPE_LIVE] = NGX_CONF_UNSET;
@@ -154,12 +165,18 @@ ngx_http_vod_create_loc_conf(ngx_conf_t *cf)
 	conf->drm_enabled = NGX_CONF_UNSET;
 	conf->drm_clear_lead_segment_count = NGX_CONF_UNSET_UINT;
 	conf->drm_max_info_length = NGX_CONF_UNSET_SIZE;
+	conf->drm_refresh_time = NGX_CONF_UNSET;
 	conf->min_single_nalu_per_frame_segment = NGX_CONF_UNSET_UINT;
 
 #if (NGX_THREADS)
 	conf->open_file_thread_pool = NGX_CONF_UNSET_PTR;
 #endif
 
+#if (NGX_HAVE_IO_URING)
+	conf->io_uring = NGX_CONF_UNSET;
+#endif
+	conf->segment_prefetch = NGX_CONF_UNSET;
+
 	// submodules
 	for (cur_module = submodules; *cur_module != NULL; cur_module++)
 	{
@@ -223,6 +240,29 @@ ngx_http_vod_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 		conf->metadata_cache = prev->metadata_cache;
 	}
 
+	if (conf->frames_cache == NULL)
+	{
+		conf->frames_cache = prev->frames_cache;
+	}
+
+	if (conf->index_cache == NULL)
+	{
+		conf->index_cache = prev->index_cache;
+	}
+
+	if (conf->manifest_cache == NULL)
+	{
+		conf->manifest_cache = prev->manifest_cache;
+	}
+
+	if (conf->live_playlist_cache == NULL)
+	{
+		conf->live_playlist_cache = prev->live_playlist_cache;
+	}
+
+	ngx_conf_merge_value(conf->cache_lock, prev->cache_lock, 0);
+	ngx_conf_merge_msec_value(conf->cache_lock_timeout, prev->cache_lock_timeout, 5000);
+
 	if (conf->dynamic_mapping_cache == NULL)
 	{
 		conf->dynamic_mapping_cache = prev->dynamic_mapping_cache;
@@ -247,6 +287,26 @@ ngx_http_vod_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 	ngx_conf_merge_size_value(conf->max_metadata_size, prev->max_metadata_size, 128 * 1024 * 1024);
 	ngx_conf_merge_size_value(conf->max_frames_size, prev->max_frames_size, 16 * 1024 * 1024);
 	ngx_conf_merge_size_value(conf->cache_buffer_size, prev->cache_buffer_size, 256 * 1024);
+	ngx_conf_merge_size_value(conf->max_coalesced_read_size, prev->max_coalesced_read_size, 0);
+	ngx_conf_merge_size_value(conf->coalesced_read_max_gap, prev->coalesced_read_max_gap, 64 * 1024);
+	ngx_conf_merge_uint_value(conf->max_parallel_reads, prev->max_parallel_reads, 0);
+
+	if (conf->block_cache == NULL)
+	{
+		conf->block_cache = prev->block_cache;
+	}
+
+	ngx_conf_merge_size_value(conf->block_cache_block_size, prev->block_cache_block_size, 1024 * 1024);
+	ngx_conf_merge_uint_value(conf->block_cache_read_ahead, prev->block_cache_read_ahead, 0);
+
+	if (conf->block_cache_block_size <= 0)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"\"vod_block_cache_block_size\" must be positive");
+		return NGX_CONF_ERROR;
+	}
+	ngx_conf_merge_value(conf->sendfile_frames, prev->sendfile_frames, 0);
+	ngx_conf_merge_size_value(conf->max_buffered_segment_size, prev->max_buffered_segment_size, 0);
 	ngx_conf_merge_size_value(conf->max_upstream_headers_size, prev->max_upstream_headers_size, 4 * 1024);
 	
 	if (conf->output_buffer_pool == NULL)
@@ -264,6 +324,7 @@ ngx_http_vod_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 	ngx_conf_merge_str_value(conf->path_response_prefix, prev->path_response_prefix, "{\"sequences\":[{\"clips\":[{\"type\":\"source\",\"path\":\"");
 	ngx_conf_merge_str_value(conf->path_response_postfix, prev->path_response_postfix, "\"}]}]}");
 	ngx_conf_merge_size_value(conf->max_mapping_response_size, prev->max_mapping_response_size, 1024);
+	ngx_conf_merge_value(conf->mapping_refresh_time, prev->mapping_refresh_time, 0);
 	if (conf->dynamic_clip_map_uri == NULL)
 	{
 		conf->dynamic_clip_map_uri = prev->dynamic_clip_map_uri;
@@ -313,6 +374,7 @@ ngx_http_vod_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 	{
 		conf->drm_request_uri = prev->drm_request_uri;
 	}
+	ngx_conf_merge_value(conf->drm_refresh_time, prev->drm_refresh_time, 0);
 	ngx_conf_merge_uint_value(conf->min_single_nalu_per_frame_segment, prev->min_single_nalu_per_frame_segment, 0);
 	
 	ngx_conf_merge_str_value(conf->clip_to_param_name, prev->clip_to_param_name, "clipTo");
@@ -329,6 +391,11 @@ ngx_http_vod_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 	ngx_conf_merge_ptr_value(conf->open_file_thread_pool, prev->open_file_thread_pool, NULL);
 #endif
 
+#if (NGX_HAVE_IO_URING)
+	ngx_conf_merge_value(conf->io_uring, prev->io_uring, 0);
+#endif
+	ngx_conf_merge_value(conf->segment_prefetch, prev->segment_prefetch, 0);
+
 	// validate vod_upstream / vod_upstream_host_header used when needed
 	if (conf->request_handler == ngx_http_vod_remote_request_handler)
 	{
@@ -365,6 +432,22 @@ ngx_http_vod_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 		}
 	}
 
+#if !defined(nginx_version) || nginx_version < 1013001
+	if (conf->drm_refresh_time > 0)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"\"vod_drm_refresh_time\" requires nginx 1.13.1 or newer");
+		return NGX_CONF_ERROR;
+	}
+
+	if (conf->mapping_refresh_time > 0)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"\"vod_mapping_refresh_time\" requires nginx 1.13.1 or newer");
+		return NGX_CONF_ERROR;
+	}
+#endif
+
 	// validate the lengths of uri parameters
 	if (conf->clip_to_param_name.len > MAX_URI_PARAM_NAME_LEN)
 	{
@@ -626,13 +709,87 @@ ngx_http_vod_manifest_segment_durations_mode_command(ngx_conf_t *cf, ngx_command
 	return NGX_CONF_OK;
 }
 
+static char *
+ngx_http_vod_parse_size_classes(ngx_conf_t *cf, ngx_str_t* value, ngx_array_t** result)
+{
+	ngx_buffer_cache_size_class_t* cur_class;
+	ngx_array_t* size_classes;
+	ngx_str_t size;
+	ngx_str_t percent;
+	ssize_t max_size;
+	ngx_int_t percent_value;
+	u_char* end = value->data + value->len;
+	u_char* next;
+	u_char* colon;
+	u_char* p;
+
+	// format: max_size:percent[,max_size:percent...]
+	size_classes = ngx_array_create(cf->pool, 4, sizeof(*cur_class));
+	if (size_classes == NULL)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	for (p = value->data; p < end; p = next + 1)
+	{
+		next = ngx_strlchr(p, end, ',');
+		if (next == NULL)
+		{
+			next = end;
+		}
+
+		colon = ngx_strlchr(p, next, ':');
+		if (colon == NULL)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"invalid size class \"%*s\", expected max_size:percent", (size_t)(next - p), p);
+			return NGX_CONF_ERROR;
+		}
+
+		size.data = p;
+		size.len = colon - p;
+		max_size = ngx_parse_size(&size);
+		if (max_size == NGX_ERROR)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"invalid size class size %V", &size);
+			return NGX_CONF_ERROR;
+		}
+
+		percent.data = colon + 1;
+		percent.len = next - percent.data;
+		percent_value = ngx_atoi(percent.data, percent.len);
+		if (percent_value == NGX_ERROR)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"invalid size class percent %V", &percent);
+			return NGX_CONF_ERROR;
+		}
+
+		cur_class = ngx_array_push(size_classes);
+		if (cur_class == NULL)
+		{
+			return NGX_CONF_ERROR;
+		}
+
+		cur_class->max_size = max_size;
+		cur_class->percent = percent_value;
+	}
+
+	*result = size_classes;
+	return NGX_CONF_OK;
+}
+
 static char *
 ngx_http_vod_cache_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
 	ngx_buffer_cache_t **cache = (ngx_buffer_cache_t **)((u_char*)conf + cmd->offset);
+	ngx_array_t* size_classes;
 	ngx_str_t  *value;
+	ngx_int_t partitions;
 	ssize_t size;
 	time_t expiration;
+	char* rc;
 
 	value = cf->args->elts;
 
@@ -641,6 +798,13 @@ ngx_http_vod_cache_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 		return "is duplicate";
 	}
 
+	if (cf->args->nelts > 6)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"invalid number of arguments in \"%V\"", &cmd->name);
+		return NGX_CONF_ERROR;
+	}
+
 	if (ngx_strcmp(value[1].data, "off") == 0) 
 	{
 		*cache = NULL;
@@ -677,7 +841,35 @@ ngx_http_vod_cache_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 		expiration = 0;
 	}
 
-	*cache = ngx_buffer_cache_create(cf, &value[1], size, expiration, &ngx_http_vod_module);
+	if (cf->args->nelts > 4)
+	{
+		partitions = ngx_atoi(value[4].data, value[4].len);
+		if (partitions == NGX_ERROR || partitions <= 0)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"invalid partition count %V", &value[4]);
+			return NGX_CONF_ERROR;
+		}
+	}
+	else
+	{
+		partitions = 1;
+	}
+
+	if (cf->args->nelts > 5)
+	{
+		rc = ngx_http_vod_parse_size_classes(cf, &value[5], &size_classes);
+		if (rc != NGX_CONF_OK)
+		{
+			return rc;
+		}
+	}
+	else
+	{
+		size_classes = NULL;
+	}
+
+	*cache = ngx_buffer_cache_create(cf, &value[1], size, expiration, partitions, size_classes, &ngx_http_vod_module);
 	if (*cache == NULL)
 	{
 		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
@@ -688,6 +880,105 @@ ngx_http_vod_cache_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 	return NGX_CONF_OK;
 }
 
+static char *
+ngx_http_vod_index_cache_path_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_index_cache_t **cache = (ngx_index_cache_t **)((u_char*)conf + cmd->offset);
+	ngx_path_t* path;
+	ngx_str_t  *value;
+	ngx_str_t s;
+	ngx_uint_t i;
+	ngx_uint_t level_count;
+	ngx_int_t level;
+	time_t inactive;
+	off_t max_size;
+
+	value = cf->args->elts;
+
+	if (*cache != NULL)
+	{
+		return "is duplicate";
+	}
+
+	path = ngx_pcalloc(cf->pool, sizeof(*path));
+	if (path == NULL)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	path->name = value[1];
+
+	if (path->name.data[path->name.len - 1] == '/')
+	{
+		path->name.len--;
+	}
+
+	if (ngx_conf_full_name(cf->cycle, &path->name, 0) != NGX_OK)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	path->conf_file = cf->conf_file->file.name.data;
+	path->line = cf->conf_file->line;
+
+	max_size = 0;
+	inactive = INDEX_CACHE_DEFAULT_INACTIVE;
+	level_count = 0;
+
+	for (i = 2; i < cf->args->nelts; i++)
+	{
+		if (ngx_strncmp(value[i].data, "max_size=", sizeof("max_size=") - 1) == 0)
+		{
+			s.len = value[i].len - (sizeof("max_size=") - 1);
+			s.data = value[i].data + sizeof("max_size=") - 1;
+
+			max_size = ngx_parse_offset(&s);
+			if (max_size < 0)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"invalid max_size value \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "inactive=", sizeof("inactive=") - 1) == 0)
+		{
+			s.len = value[i].len - (sizeof("inactive=") - 1);
+			s.data = value[i].data + sizeof("inactive=") - 1;
+
+			inactive = ngx_parse_time(&s, 1);
+			if (inactive == (time_t)NGX_ERROR)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+					"invalid inactive value \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+			continue;
+		}
+
+		// the levels, same as in ngx_conf_set_path_slot
+		level = ngx_atoi(value[i].data, value[i].len);
+		if (level == NGX_ERROR || level == 0 || level > 2 || level_count >= NGX_MAX_PATH_LEVEL)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"invalid parameter \"%V\"", &value[i]);
+			return NGX_CONF_ERROR;
+		}
+
+		path->level[level_count++] = level;
+		path->len += level + 1;
+	}
+
+	*cache = ngx_index_cache_create(cf, path, max_size, inactive, ngx_http_vod_get_index_cache_format());
+	if (*cache == NULL)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	return NGX_CONF_OK;
+}
+
 static char *
 ngx_http_vod_perf_counters_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -721,8 +1012,11 @@ ngx_http_vod_perf_counters_command(ngx_conf_t *cf, ngx_command_t *cmd, void *con
 static char*
 ngx_http_vod_buffer_pool_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
+	buffer_pool_size_class_t size_classes[BUFFER_POOL_MAX_SIZE_CLASSES];
+	buffer_pool_size_class_t* cur_size_class;
 	buffer_pool_t** buffer_pool = (buffer_pool_t **)((u_char*)conf + cmd->offset);
 	ngx_str_t  *value;
+	ngx_uint_t i;
 	ngx_int_t count;
 	ssize_t buffer_size;
 
@@ -731,21 +1025,35 @@ ngx_http_vod_buffer_pool_command(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 		return "is duplicate";
 	}
 
-	value = cf->args->elts;
-
-	buffer_size = ngx_parse_size(&value[1]);
-	if (buffer_size == NGX_ERROR)
+	if ((cf->args->nelts - 1) % 2 != 0 ||
+		(cf->args->nelts - 1) / 2 > BUFFER_POOL_MAX_SIZE_CLASSES)
 	{
-		return "invalid size";
+		return "invalid number of arguments";
 	}
 
-	count = ngx_atoi(value[2].data, value[2].len);
-	if (count == NGX_ERROR)
+	value = cf->args->elts;
+
+	// the arguments are pairs of buffer size and count
+	cur_size_class = size_classes;
+	for (i = 1; i < cf->args->nelts; i += 2, cur_size_class++)
 	{
-		return "invalid count";
+		buffer_size = ngx_parse_size(&value[i]);
+		if (buffer_size == NGX_ERROR)
+		{
+			return "invalid size";
+		}
+
+		count = ngx_atoi(value[i + 1].data, value[i + 1].len);
+		if (count == NGX_ERROR)
+		{
+			return "invalid count";
+		}
+
+		cur_size_class->size = buffer_size;
+		cur_size_class->count = count;
 	}
 	
-	*buffer_pool = buffer_pool_create(cf->pool, cf->log, buffer_size, count);
+	*buffer_pool = buffer_pool_create(cf->pool, cf->log, size_classes, cur_size_class - size_classes);
 	if (*buffer_pool == NULL)
 	{
 		return NGX_CONF_ERROR;
@@ -930,26 +1238,68 @@ ngx_command_t ngx_http_vod_commands[] = {
 	
 	// mp4 reading parameters
 	{ ngx_string("vod_metadata_cache"),
-	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
 	ngx_http_vod_cache_command,
 	NGX_HTTP_LOC_CONF_OFFSET,
 	offsetof(ngx_http_vod_loc_conf_t, metadata_cache),
 	NULL },
 
+	{ ngx_string("vod_frames_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, frames_cache),
+	NULL },
+
+	{ ngx_string("vod_index_cache_path"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_index_cache_path_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, index_cache),
+	NULL },
+
 	{ ngx_string("vod_response_cache"),
-	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
 	ngx_http_vod_cache_command,
 	NGX_HTTP_LOC_CONF_OFFSET,
 	offsetof(ngx_http_vod_loc_conf_t, response_cache[CACHE_TYPE_VOD]),
 	NULL },
 
 	{ ngx_string("vod_live_response_cache"),
-	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
 	ngx_http_vod_cache_command,
 	NGX_HTTP_LOC_CONF_OFFSET,
 	offsetof(ngx_http_vod_loc_conf_t, response_cache[CACHE_TYPE_LIVE]),
 	NULL },
 
+	{ ngx_string("vod_manifest_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, manifest_cache),
+	NULL },
+
+	{ ngx_string("vod_live_playlist_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, live_playlist_cache),
+	NULL },
+
+	{ ngx_string("vod_cache_lock"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, cache_lock),
+	NULL },
+
+	{ ngx_string("vod_cache_lock_timeout"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_msec_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, cache_lock_timeout),
+	NULL },
+
 	{ ngx_string("vod_initial_read_size"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
 	ngx_conf_set_size_slot,
@@ -978,6 +1328,62 @@ ngx_command_t ngx_http_vod_commands[] = {
 	offsetof(ngx_http_vod_loc_conf_t, cache_buffer_size),
 	NULL },
 
+	{ ngx_string("vod_max_coalesced_read_size"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_size_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, max_coalesced_read_size),
+	NULL },
+
+	{ ngx_string("vod_coalesced_read_max_gap"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_size_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, coalesced_read_max_gap),
+	NULL },
+
+	{ ngx_string("vod_max_parallel_reads"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_num_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, max_parallel_reads),
+	NULL },
+
+	{ ngx_string("vod_block_cache"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+	ngx_http_vod_cache_command,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, block_cache),
+	NULL },
+
+	{ ngx_string("vod_block_cache_block_size"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_size_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, block_cache_block_size),
+	NULL },
+
+	{ ngx_string("vod_block_cache_read_ahead"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_num_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, block_cache_read_ahead),
+	NULL },
+
+	{ ngx_string("vod_sendfile_frames"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, sendfile_frames),
+	NULL },
+
+	{ ngx_string("vod_max_buffered_segment_size"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_size_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, max_buffered_segment_size),
+	NULL },
+
 	{ ngx_string("vod_ignore_edit_list"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
 	ngx_conf_set_flag_slot,
@@ -986,7 +1392,7 @@ ngx_command_t ngx_http_vod_commands[] = {
 	NULL },
 
 	{ ngx_string("vod_output_buffer_pool"),
-	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE2,
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_2MORE,
 	ngx_http_vod_buffer_pool_command,
 	NGX_HTTP_LOC_CONF_OFFSET,
 	offsetof(ngx_http_vod_loc_conf_t, output_buffer_pool),
@@ -1016,21 +1422,21 @@ ngx_command_t ngx_http_vod_commands[] = {
 
 	// path request parameters - mapped mode only
 	{ ngx_string("vod_mapping_cache"),
-	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
 	ngx_http_vod_cache_command,
 	NGX_HTTP_LOC_CONF_OFFSET,
 	offsetof(ngx_http_vod_loc_conf_t, mapping_cache[CACHE_TYPE_VOD]),
 	NULL },
 
 	{ ngx_string("vod_live_mapping_cache"),
-	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
 	ngx_http_vod_cache_command,
 	NGX_HTTP_LOC_CONF_OFFSET,
 	offsetof(ngx_http_vod_loc_conf_t, mapping_cache[CACHE_TYPE_LIVE]),
 	NULL },
 
 	{ ngx_string("vod_dynamic_mapping_cache"),
-	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
 	ngx_http_vod_cache_command,
 	NGX_HTTP_LOC_CONF_OFFSET,
 	offsetof(ngx_http_vod_loc_conf_t, dynamic_mapping_cache),
@@ -1057,6 +1463,13 @@ ngx_command_t ngx_http_vod_commands[] = {
 	offsetof(ngx_http_vod_loc_conf_t, max_mapping_response_size),
 	NULL },
 
+	{ ngx_string("vod_mapping_refresh_time"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_sec_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, mapping_refresh_time),
+	NULL },
+
 	{ ngx_string("vod_dynamic_clip_map_uri"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
 	ngx_http_set_complex_value_slot,
@@ -1175,7 +1588,7 @@ ngx_command_t ngx_http_vod_commands[] = {
 	NULL },
 
 	{ ngx_string("vod_drm_info_cache"),
-	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
 	ngx_http_vod_cache_command,
 	NGX_HTTP_LOC_CONF_OFFSET,
 	offsetof(ngx_http_vod_loc_conf_t, drm_info_cache),
@@ -1188,6 +1601,13 @@ ngx_command_t ngx_http_vod_commands[] = {
 	offsetof(ngx_http_vod_loc_conf_t, drm_request_uri),
 	NULL },
 
+	{ ngx_string("vod_drm_refresh_time"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_sec_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, drm_refresh_time),
+	NULL },
+
 	{ ngx_string("vod_min_single_nalu_per_frame_segment"),
 	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
 	ngx_conf_set_num_slot,
@@ -1241,6 +1661,22 @@ ngx_command_t ngx_http_vod_commands[] = {
 	NULL },
 #endif
 
+#if (NGX_HAVE_IO_URING)
+	{ ngx_string("vod_io_uring"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, io_uring),
+	NULL },
+#endif
+
+	{ ngx_string("vod_segment_prefetch"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(ngx_http_vod_loc_conf_t, segment_prefetch),
+	NULL },
+
 #include "ngx_http_vod_dash_commands.h"
 #include "ngx_http_vod_hds_commands.h"
 #include "ngx_http_vod_hls_commands.h"
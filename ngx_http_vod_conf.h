@@ -8,6 +8,7 @@
 #include "ngx_http_vod_hds_conf.h"
 #include "ngx_http_vod_hls_conf.h"
 #include "ngx_http_vod_mss_conf.h"
+#include "ngx_index_cache.h"
 #include "vod/segmenter.h"
 
 // enum
@@ -32,11 +33,25 @@ struct ngx_http_vod_loc_conf_s {
 	ngx_http_complex_value_t *base_url;
 	ngx_http_complex_value_t *segments_base_url;
 	ngx_buffer_cache_t* metadata_cache;
+	ngx_buffer_cache_t* frames_cache;
+	ngx_index_cache_t* index_cache;
 	ngx_buffer_cache_t* response_cache[CACHE_TYPE_COUNT];
+	ngx_buffer_cache_t* manifest_cache;
+	ngx_buffer_cache_t* live_playlist_cache;
+	ngx_flag_t cache_lock;
+	ngx_msec_t cache_lock_timeout;
 	size_t initial_read_size;
 	size_t max_metadata_size;
 	size_t max_frames_size;
 	size_t cache_buffer_size;
+	size_t max_coalesced_read_size;
+	size_t coalesced_read_max_gap;
+	ngx_uint_t max_parallel_reads;
+	ngx_buffer_cache_t* block_cache;
+	size_t block_cache_block_size;
+	ngx_uint_t block_cache_read_ahead;
+	ngx_flag_t sendfile_frames;
+	size_t max_buffered_segment_size;
 	buffer_pool_t* output_buffer_pool;
 	size_t max_upstream_headers_size;
 	ngx_flag_t ignore_edit_list;
@@ -46,6 +61,7 @@ struct ngx_http_vod_loc_conf_s {
 	ngx_str_t path_response_prefix;
 	ngx_str_t path_response_postfix;
 	size_t max_mapping_response_size;
+	time_t mapping_refresh_time;
 	ngx_http_complex_value_t* dynamic_clip_map_uri;
 	ngx_http_complex_value_t* source_clip_map_uri;
 	ngx_http_complex_value_t* redirect_segments_url;
@@ -65,6 +81,7 @@ struct ngx_http_vod_loc_conf_s {
 	size_t drm_max_info_length;
 	ngx_buffer_cache_t* drm_info_cache;
 	ngx_http_complex_value_t *drm_request_uri;
+	time_t drm_refresh_time;
 	ngx_uint_t min_single_nalu_per_frame_segment;
 
 	ngx_str_t clip_to_param_name;
@@ -78,6 +95,11 @@ struct ngx_http_vod_loc_conf_s {
 	ngx_thread_pool_t *open_file_thread_pool;
 #endif
 
+#if (NGX_HAVE_IO_URING)
+	ngx_flag_t io_uring;
+#endif
+	ngx_flag_t segment_prefetch;
+
 	// derived fields
 	ngx_hash_t uri_params_hash;
 	ngx_hash_t pd_uri_params_hash;
@@ -5,6 +5,7 @@
 #include "vod/dash/dash_packager.h"
 #include "vod/dash/edash_packager.h"
 #include "vod/mkv/mkv_builder.h"
+#include "vod/mp4/mp4_encrypt.h"
 #include "vod/udrm.h"
 
 // constants
@@ -19,6 +20,12 @@ ngx_conf_enum_t  dash_manifest_formats[] = {
 	{ ngx_null_string, 0 }
 };
 
+ngx_conf_enum_t  dash_encryption_schemes[] = {
+	{ ngx_string("cenc"), MP4_ENCRYPT_SCHEME_CENC },
+	{ ngx_string("cbcs"), MP4_ENCRYPT_SCHEME_CBCS },
+	{ ngx_null_string, 0 }
+};
+
 // content types
 static u_char mpd_content_type[] = "application/dash+xml";
 static u_char mp4_audio_content_type[] = "audio/mp4";
@@ -32,6 +39,27 @@ static const u_char init_segment_file_ext[] = ".mp4";
 static const u_char fragment_file_ext[] = ".m4s";
 static const u_char webm_file_ext[] = ".webm";
 
+static const u_char*
+ngx_http_vod_dash_get_encryption_iv(ngx_http_vod_submodule_context_t* submodule_context)
+{
+	media_sequence_t* sequence = &submodule_context->media_set.sequences[0];
+	drm_info_t* drm_info;
+
+	if (submodule_context->conf->dash.encryption_scheme != MP4_ENCRYPT_SCHEME_CBCS)
+	{
+		return sequence->encryption_key;
+	}
+
+	// cbcs uses a constant iv, that is signaled in the init segment
+	drm_info = sequence->drm_info;
+	if (drm_info->iv_set)
+	{
+		return drm_info->iv;
+	}
+
+	return sequence->encryption_key;
+}
+
 static ngx_int_t 
 ngx_http_vod_dash_handle_manifest(
 	ngx_http_vod_submodule_context_t* submodule_context,
@@ -69,6 +97,7 @@ ngx_http_vod_dash_handle_manifest(
 			&conf->dash.mpd_config,
 			&base_url,
 			&submodule_context->media_set,
+			conf->dash.encryption_scheme,
 			response);
 	}
 	else
@@ -112,6 +141,8 @@ ngx_http_vod_dash_mp4_handle_init_segment(
 			&submodule_context->request_context,
 			&submodule_context->media_set,
 			conf->drm_clear_lead_segment_count > 0,
+			conf->dash.encryption_scheme,
+			ngx_http_vod_dash_get_encryption_iv(submodule_context),
 			ngx_http_vod_submodule_size_only(submodule_context),
 			response);
 	}
@@ -174,9 +205,10 @@ ngx_http_vod_dash_mp4_init_frame_processor(
 			&submodule_context->request_context,
 			&submodule_context->media_set,
 			submodule_context->request_params.segment_index,
+			conf->dash.encryption_scheme,
 			conf->min_single_nalu_per_frame_segment > 0 && submodule_context->request_params.segment_index >= conf->min_single_nalu_per_frame_segment - 1,
 			segment_writer,
-			submodule_context->media_set.sequences[0].encryption_key,		// iv
+			ngx_http_vod_dash_get_encryption_iv(submodule_context),
 			size_only,
 			output_buffer,
 			response_size);
@@ -222,6 +254,7 @@ ngx_http_vod_dash_mp4_init_frame_processor(
 			&submodule_context->request_context,
 			submodule_context->media_set.sequences,
 			segment_writer->write_tail,
+			segment_writer->write_file,
 			segment_writer->context,
 			reuse_buffers,
 			&state);
@@ -409,6 +442,7 @@ ngx_http_vod_dash_create_loc_conf(
 	conf->absolute_manifest_urls = NGX_CONF_UNSET;
 	conf->mpd_config.manifest_format = NGX_CONF_UNSET_UINT;
 	conf->mpd_config.duplicate_bitrate_threshold = NGX_CONF_UNSET_UINT;
+	conf->encryption_scheme = NGX_CONF_UNSET_UINT;
 }
 
 static char *
@@ -426,6 +460,7 @@ ngx_http_vod_dash_merge_loc_conf(
 	ngx_conf_merge_str_value(conf->mpd_config.fragment_file_name_prefix, prev->mpd_config.fragment_file_name_prefix, "fragment");
 	ngx_conf_merge_uint_value(conf->mpd_config.manifest_format, prev->mpd_config.manifest_format, FORMAT_SEGMENT_TIMELINE);
 	ngx_conf_merge_uint_value(conf->mpd_config.duplicate_bitrate_threshold, prev->mpd_config.duplicate_bitrate_threshold, 4096);
+	ngx_conf_merge_uint_value(conf->encryption_scheme, prev->encryption_scheme, MP4_ENCRYPT_SCHEME_CENC);
 
 	return NGX_CONF_OK;
 }
@@ -11,9 +11,11 @@ typedef struct
 	ngx_str_t manifest_file_name_prefix;
 	ngx_flag_t absolute_manifest_urls;
 	dash_manifest_config_t mpd_config;
+	ngx_uint_t encryption_scheme;
 } ngx_http_vod_dash_loc_conf_t;
 
 // globals
 extern ngx_conf_enum_t dash_manifest_formats[];
+extern ngx_conf_enum_t dash_encryption_schemes[];
 
 #endif // _NGX_HTTP_VOD_DASH_CONF_H_INCLUDED_
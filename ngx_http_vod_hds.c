@@ -138,7 +138,7 @@ static const ngx_http_vod_request_t hds_manifest_request = {
 };
 
 static const ngx_http_vod_request_t hds_bootstrap_request = {
-	REQUEST_FLAG_SINGLE_TRACK_PER_MEDIA_TYPE | REQUEST_FLAG_TIME_DEPENDENT_ON_LIVE,
+	REQUEST_FLAG_SINGLE_TRACK_PER_MEDIA_TYPE | REQUEST_FLAG_TIME_DEPENDENT_ON_LIVE | REQUEST_FLAG_BINARY_RESPONSE,
 	0,
 	REQUEST_CLASS_MANIFEST,
 	SUPPORTED_CODECS,
@@ -1,18 +1,27 @@
 #include <ngx_http.h>
 #include "ngx_http_vod_submodule.h"
+#include "ngx_http_vod_module.h"
 #include "ngx_http_vod_utils.h"
 #include "vod/hls/hls_muxer.h"
+#include "vod/dash/dash_packager.h"
+#include "vod/dash/edash_packager.h"
+#include "vod/mp4/mp4_encrypt.h"
 #include "vod/udrm.h"
 
 // constants
 #define SUPPORTED_CODECS (VOD_CODEC_FLAG(AVC) | VOD_CODEC_FLAG(HEVC) | VOD_CODEC_FLAG(AAC) | VOD_CODEC_FLAG(MP3))
+#define SUPPORTED_CODECS_FMP4 (VOD_CODEC_FLAG(AVC) | VOD_CODEC_FLAG(HEVC) | VOD_CODEC_FLAG(AAC))
 
 // content types
 static u_char mpeg_ts_content_type[] = "video/MP2T";
 static u_char m3u8_content_type[] = "application/vnd.apple.mpegurl";
 static u_char encryption_key_content_type[] = "application/octet-stream";
+static u_char mp4_audio_content_type[] = "audio/mp4";
+static u_char mp4_video_content_type[] = "video/mp4";
 
 static const u_char ts_file_ext[] = ".ts";
+static const u_char m4s_file_ext[] = ".m4s";
+static const u_char mp4_file_ext[] = ".mp4";
 static const u_char m3u8_file_ext[] = ".m3u8";
 static const u_char key_file_ext[] = ".key";
 
@@ -26,6 +35,12 @@ ngx_conf_enum_t  hls_encryption_methods[] = {
 	{ ngx_null_string, 0 }
 };
 
+ngx_conf_enum_t  hls_container_formats[] = {
+	{ ngx_string("mpegts"), HLS_CONTAINER_FORMAT_MPEGTS },
+	{ ngx_string("fmp4"), HLS_CONTAINER_FORMAT_FMP4 },
+	{ ngx_null_string, 0 }
+};
+
 static void
 ngx_http_vod_hls_init_encryption_iv(u_char* iv, uint32_t segment_index)
 {
@@ -115,6 +130,17 @@ ngx_http_vod_hls_handle_master_playlist(
 	return NGX_OK;
 }
 
+static vod_status_t
+ngx_http_vod_hls_get_live_state(void* context, uint32_t segment_index, vod_str_t* result)
+{
+	if (ngx_http_vod_fetch_live_playlist_state(context, segment_index, result) != NGX_OK)
+	{
+		return VOD_NOT_FOUND;
+	}
+
+	return VOD_OK;
+}
+
 static ngx_int_t 
 ngx_http_vod_hls_handle_index_playlist(
 	ngx_http_vod_submodule_context_t* submodule_context,
@@ -123,6 +149,8 @@ ngx_http_vod_hls_handle_index_playlist(
 {
 	ngx_http_vod_loc_conf_t* conf = submodule_context->conf;
 	hls_encryption_params_t encryption_params;
+	m3u8_live_state_t live_state;
+	m3u8_live_state_t* live_state_ptr = NULL;
 	ngx_str_t segments_base_url = ngx_null_string;
 	ngx_str_t base_url = ngx_null_string;
 	vod_status_t rc;
@@ -154,6 +182,15 @@ ngx_http_vod_hls_handle_index_playlist(
 		}
 	}
 
+	if (conf->hls.m3u8_config.container_format == HLS_CONTAINER_FORMAT_FMP4 &&
+		submodule_context->media_set.track_count[MEDIA_TYPE_VIDEO] != 0 &&
+		submodule_context->media_set.track_count[MEDIA_TYPE_AUDIO] != 0)
+	{
+		ngx_log_error(NGX_LOG_ERR, submodule_context->request_context.log, 0,
+			"ngx_http_vod_hls_handle_index_playlist: muxed audio and video not supported with fmp4 container");
+		return NGX_HTTP_BAD_REQUEST;
+	}
+
 	ngx_http_vod_hls_init_encryption_params(&encryption_params, submodule_context, iv);
 
 	if (encryption_params.type != HLS_ENC_NONE)
@@ -169,6 +206,11 @@ ngx_http_vod_hls_handle_index_playlist(
 					"ngx_http_vod_hls_handle_index_playlist: ngx_http_complex_value failed");
 				return NGX_ERROR;
 			}
+
+			(void)ngx_http_vod_get_manifest_placeholder(
+				submodule_context->r, 
+				MANIFEST_VALUE_ENCRYPTION_KEY_URI, 
+				&encryption_params.key_uri);
 		}
 		else
 		{
@@ -176,6 +218,14 @@ ngx_http_vod_hls_handle_index_playlist(
 		}
 	}
 
+	if (submodule_context->media_set.type == MEDIA_SET_LIVE && conf->live_playlist_cache != NULL)
+	{
+		ngx_memzero(&live_state, sizeof(live_state));
+		live_state.get_state = ngx_http_vod_hls_get_live_state;
+		live_state.context = submodule_context->r;
+		live_state_ptr = &live_state;
+	}
+
 	rc = m3u8_builder_build_index_playlist(
 		&submodule_context->request_context,
 		&conf->hls.m3u8_config,
@@ -184,6 +234,7 @@ ngx_http_vod_hls_handle_index_playlist(
 		&submodule_context->request_params,
 		&encryption_params,
 		&submodule_context->media_set,
+		live_state_ptr,
 		response);
 	if (rc != VOD_OK)
 	{
@@ -192,6 +243,11 @@ ngx_http_vod_hls_handle_index_playlist(
 		return ngx_http_vod_status_to_ngx_error(rc);
 	}
 
+	if (live_state_ptr != NULL && live_state.state.len != 0)
+	{
+		ngx_http_vod_store_live_playlist_state(submodule_context->r, live_state.segment_index, &live_state.state);
+	}
+
 	content_type->data = m3u8_content_type;
 	content_type->len = sizeof(m3u8_content_type) - 1;
 	
@@ -215,6 +271,13 @@ ngx_http_vod_hls_handle_iframe_playlist(
 		return NGX_HTTP_BAD_REQUEST;
 	}
 
+	if (conf->hls.m3u8_config.container_format == HLS_CONTAINER_FORMAT_FMP4)
+	{
+		ngx_log_error(NGX_LOG_ERR, submodule_context->request_context.log, 0,
+			"ngx_http_vod_hls_handle_iframe_playlist: iframes playlist not supported with fmp4 container");
+		return NGX_HTTP_BAD_REQUEST;
+	}
+
 	if (submodule_context->media_set.audio_filtering_needed)
 	{
 		ngx_log_error(NGX_LOG_ERR, submodule_context->request_context.log, 0,
@@ -323,6 +386,221 @@ ngx_http_vod_hls_init_frame_processor(
 	return NGX_OK;
 }
 
+// Note: fmp4 sample-aes segments use cbcs, with a constant iv that is signaled in the init segment
+static ngx_int_t
+ngx_http_vod_hls_init_mp4_encryption(
+	ngx_http_vod_submodule_context_t* submodule_context,
+	u_char* iv)
+{
+	media_sequence_t* sequence = &submodule_context->media_set.sequences[0];
+	drm_info_t* drm_info;
+
+	if (submodule_context->conf->drm_enabled)
+	{
+		drm_info = sequence->drm_info;
+	}
+	else
+	{
+		// the clients get the key from the key uri, the key id in the init segment is not used
+		drm_info = ngx_pcalloc(submodule_context->request_context.pool, sizeof(*drm_info));
+		if (drm_info == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, submodule_context->request_context.log, 0,
+				"ngx_http_vod_hls_init_mp4_encryption: ngx_pcalloc failed");
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+
+		ngx_memcpy(drm_info->key, sequence->encryption_key, sizeof(drm_info->key));
+		sequence->drm_info = drm_info;
+	}
+
+	if (drm_info->iv_set)
+	{
+		ngx_memcpy(iv, drm_info->iv, AES_BLOCK_SIZE);
+	}
+	else
+	{
+		// the iv must be the same in all segments
+		ngx_http_vod_hls_init_encryption_iv(iv, 0);
+	}
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_hls_handle_mp4_init_segment(
+	ngx_http_vod_submodule_context_t* submodule_context,
+	ngx_str_t* response,
+	ngx_str_t* content_type)
+{
+	vod_status_t rc;
+	u_char iv[AES_BLOCK_SIZE];
+
+	if (submodule_context->conf->hls.encryption_method == HLS_ENC_SAMPLE_AES)
+	{
+		rc = ngx_http_vod_hls_init_mp4_encryption(submodule_context, iv);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+
+		rc = edash_packager_build_init_mp4(
+			&submodule_context->request_context,
+			&submodule_context->media_set,
+			FALSE,
+			MP4_ENCRYPT_SCHEME_CBCS,
+			iv,
+			ngx_http_vod_submodule_size_only(submodule_context),
+			response);
+		if (rc != VOD_OK)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, submodule_context->request_context.log, 0,
+				"ngx_http_vod_hls_handle_mp4_init_segment: edash_packager_build_init_mp4 failed %i", rc);
+			return ngx_http_vod_status_to_ngx_error(rc);
+		}
+	}
+	else
+	{
+		rc = dash_packager_build_init_mp4(
+			&submodule_context->request_context,
+			&submodule_context->media_set,
+			ngx_http_vod_submodule_size_only(submodule_context),
+			NULL,
+			NULL,
+			response);
+		if (rc != VOD_OK)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, submodule_context->request_context.log, 0,
+				"ngx_http_vod_hls_handle_mp4_init_segment: dash_packager_build_init_mp4 failed %i", rc);
+			return ngx_http_vod_status_to_ngx_error(rc);
+		}
+	}
+
+	if (submodule_context->media_set.track_count[MEDIA_TYPE_VIDEO] != 0)
+	{
+		content_type->data = mp4_video_content_type;
+		content_type->len = sizeof(mp4_video_content_type) - 1;
+	}
+	else
+	{
+		content_type->data = mp4_audio_content_type;
+		content_type->len = sizeof(mp4_audio_content_type) - 1;
+	}
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_hls_init_mp4_frame_processor(
+	ngx_http_vod_submodule_context_t* submodule_context,
+	segment_writer_t* segment_writer,
+	ngx_http_vod_frame_processor_t* frame_processor,
+	void** frame_processor_state,
+	ngx_str_t* output_buffer,
+	size_t* response_size,
+	ngx_str_t* content_type)
+{
+	dash_fragment_header_extensions_t header_extensions;
+	fragment_writer_state_t* state;
+	segment_writer_t edash_writer;
+	vod_status_t rc;
+	bool_t reuse_buffers = FALSE;
+	bool_t size_only = ngx_http_vod_submodule_size_only(submodule_context);
+	u_char iv[AES_BLOCK_SIZE];
+
+	if (submodule_context->conf->hls.encryption_method == HLS_ENC_SAMPLE_AES)
+	{
+		// Note: the segments are identical to the dash cbcs fragments
+		rc = ngx_http_vod_hls_init_mp4_encryption(submodule_context, iv);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+
+		rc = edash_packager_get_fragment_writer(
+			&edash_writer,
+			&submodule_context->request_context,
+			&submodule_context->media_set,
+			submodule_context->request_params.segment_index,
+			MP4_ENCRYPT_SCHEME_CBCS,
+			FALSE,
+			segment_writer,
+			iv,
+			size_only,
+			output_buffer,
+			response_size);
+		if (rc != VOD_OK)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, submodule_context->request_context.log, 0,
+				"ngx_http_vod_hls_init_mp4_frame_processor: edash_packager_get_fragment_writer failed %i", rc);
+			return ngx_http_vod_status_to_ngx_error(rc);
+		}
+
+		if (edash_writer.write_tail != NULL)
+		{
+			segment_writer = &edash_writer;
+			reuse_buffers = TRUE;		// mp4_encrypt allocates new buffers
+		}
+	}
+	else
+	{
+		// Note: the segments are identical to the unencrypted dash fragments
+		ngx_memzero(&header_extensions, sizeof(header_extensions));
+
+		rc = dash_packager_build_fragment_header(
+			&submodule_context->request_context,
+			&submodule_context->media_set,
+			submodule_context->request_params.segment_index,
+			0,	// sample description index
+			&header_extensions,
+			size_only,
+			output_buffer,
+			response_size);
+		if (rc != VOD_OK)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, submodule_context->request_context.log, 0,
+				"ngx_http_vod_hls_init_mp4_frame_processor: dash_packager_build_fragment_header failed %i", rc);
+			return ngx_http_vod_status_to_ngx_error(rc);
+		}
+	}
+
+	// initialize the frame processor
+	if (!size_only || *response_size == 0)
+	{
+		rc = mp4_builder_frame_writer_init(
+			&submodule_context->request_context,
+			submodule_context->media_set.sequences,
+			segment_writer->write_tail,
+			segment_writer->write_file,
+			segment_writer->context,
+			reuse_buffers,
+			&state);
+		if (rc != VOD_OK)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, submodule_context->request_context.log, 0,
+				"ngx_http_vod_hls_init_mp4_frame_processor: mp4_builder_frame_writer_init failed %i", rc);
+			return ngx_http_vod_status_to_ngx_error(rc);
+		}
+
+		*frame_processor = (ngx_http_vod_frame_processor_t)mp4_builder_frame_writer_process;
+		*frame_processor_state = state;
+	}
+
+	// set the 'Content-type' header
+	if (submodule_context->media_set.track_count[MEDIA_TYPE_VIDEO] != 0)
+	{
+		content_type->len = sizeof(mp4_video_content_type) - 1;
+		content_type->data = (u_char *)mp4_video_content_type;
+	}
+	else
+	{
+		content_type->len = sizeof(mp4_audio_content_type) - 1;
+		content_type->data = (u_char *)mp4_audio_content_type;
+	}
+
+	return NGX_OK;
+}
+
 static const ngx_http_vod_request_t hls_master_request = {
 	0,
 	PARSE_FLAG_TOTAL_SIZE_ESTIMATE | PARSE_FLAG_CODEC_NAME,
@@ -364,7 +642,7 @@ static const ngx_http_vod_request_t hls_enc_key_request = {
 };
 
 static const ngx_http_vod_request_t hls_segment_request = {
-	REQUEST_FLAG_SINGLE_TRACK_PER_MEDIA_TYPE,
+	REQUEST_FLAG_SINGLE_TRACK_PER_MEDIA_TYPE | REQUEST_FLAG_STREAM_UNKNOWN_SIZE,
 	PARSE_FLAG_FRAMES_ALL | PARSE_FLAG_PARSED_EXTRA_DATA,
 	REQUEST_CLASS_SEGMENT,
 	SUPPORTED_CODECS,
@@ -373,6 +651,26 @@ static const ngx_http_vod_request_t hls_segment_request = {
 	ngx_http_vod_hls_init_frame_processor,
 };
 
+static const ngx_http_vod_request_t hls_mp4_init_request = {
+	REQUEST_FLAG_SINGLE_TRACK,
+	PARSE_BASIC_METADATA_ONLY | PARSE_FLAG_SAVE_RAW_ATOMS,
+	REQUEST_CLASS_OTHER,
+	SUPPORTED_CODECS_FMP4,
+	HLS_TIMESCALE,
+	ngx_http_vod_hls_handle_mp4_init_segment,
+	NULL,
+};
+
+static const ngx_http_vod_request_t hls_mp4_segment_request = {
+	REQUEST_FLAG_SINGLE_TRACK,
+	PARSE_FLAG_FRAMES_ALL,
+	REQUEST_CLASS_SEGMENT,
+	SUPPORTED_CODECS_FMP4,
+	HLS_TIMESCALE,
+	NULL,
+	ngx_http_vod_hls_init_mp4_frame_processor,
+};
+
 void
 ngx_http_vod_hls_create_loc_conf(
 	ngx_conf_t *cf,
@@ -385,6 +683,7 @@ ngx_http_vod_hls_create_loc_conf(
 	conf->muxer_config.align_frames = NGX_CONF_UNSET;
 	conf->muxer_config.output_id3_timestamps = NGX_CONF_UNSET;
 	conf->encryption_method = NGX_CONF_UNSET_UINT;
+	conf->m3u8_config.container_format = NGX_CONF_UNSET_UINT;
 }
 
 static char *
@@ -402,6 +701,8 @@ ngx_http_vod_hls_merge_loc_conf(
 	ngx_conf_merge_str_value(conf->m3u8_config.index_file_name_prefix, prev->m3u8_config.index_file_name_prefix, "index");	
 	ngx_conf_merge_str_value(conf->iframes_file_name_prefix, prev->iframes_file_name_prefix, "iframes");
 	ngx_conf_merge_str_value(conf->m3u8_config.segment_file_name_prefix, prev->m3u8_config.segment_file_name_prefix, "seg");
+	ngx_conf_merge_str_value(conf->m3u8_config.init_file_name_prefix, prev->m3u8_config.init_file_name_prefix, "init");
+	ngx_conf_merge_uint_value(conf->m3u8_config.container_format, prev->m3u8_config.container_format, HLS_CONTAINER_FORMAT_MPEGTS);
 
 	ngx_conf_merge_str_value(conf->m3u8_config.encryption_key_file_name, prev->m3u8_config.encryption_key_file_name, "encryption");
 	ngx_conf_merge_str_value(conf->m3u8_config.encryption_key_format, prev->m3u8_config.encryption_key_format, "");
@@ -431,6 +732,14 @@ ngx_http_vod_hls_merge_loc_conf(
 		return NGX_CONF_ERROR;
 	}
 
+	if (conf->encryption_method == HLS_ENC_AES_128 &&
+		conf->m3u8_config.container_format == HLS_CONTAINER_FORMAT_FMP4)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			"\"vod_hls_encryption_method\" must be none or sample-aes when \"vod_hls_container_format\" is fmp4");
+		return NGX_CONF_ERROR;
+	}
+
 	return NGX_CONF_OK;
 }
 
@@ -460,6 +769,24 @@ ngx_http_vod_hls_parse_uri_file_name(
 		*request = &hls_segment_request;
 		flags = PARSE_FILE_NAME_EXPECT_SEGMENT_INDEX;
 	}
+	// fmp4 segment
+	else if (conf->hls.m3u8_config.container_format == HLS_CONTAINER_FORMAT_FMP4 &&
+		ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->hls.m3u8_config.segment_file_name_prefix, m4s_file_ext))
+	{
+		start_pos += conf->hls.m3u8_config.segment_file_name_prefix.len;
+		end_pos -= (sizeof(m4s_file_ext) - 1);
+		*request = &hls_mp4_segment_request;
+		flags = PARSE_FILE_NAME_EXPECT_SEGMENT_INDEX;
+	}
+	// fmp4 init segment
+	else if (conf->hls.m3u8_config.container_format == HLS_CONTAINER_FORMAT_FMP4 &&
+		ngx_http_vod_match_prefix_postfix(start_pos, end_pos, &conf->hls.m3u8_config.init_file_name_prefix, mp4_file_ext))
+	{
+		start_pos += conf->hls.m3u8_config.init_file_name_prefix.len;
+		end_pos -= (sizeof(mp4_file_ext) - 1);
+		*request = &hls_mp4_init_request;
+		flags = 0;
+	}
 	// manifest
 	else if (ngx_http_vod_ends_with_static(start_pos, end_pos, m3u8_file_ext))
 	{
@@ -14,9 +14,14 @@
 #include "ngx_http_vod_conf.h"
 #include "ngx_file_reader.h"
 #include "ngx_buffer_cache.h"
+#include "ngx_index_cache.h"
+#include "ngx_manifest_template.h"
 #include "vod/mp4/mp4_format.h"
+#include "vod/mp4/mp4_sample_index.h"
 #include "vod/mkv/mkv_format.h"
 #include "vod/input/read_cache.h"
+#include "vod/input/frames_source_cache.h"
+#include "vod/buffer_pool.h"
 #include "vod/filters/audio_filter.h"
 #include "vod/filters/dynamic_clip.h"
 #include "vod/filters/concat_clip.h"
@@ -25,6 +30,10 @@
 #include "vod/media_set_parser.h"
 #include "vod/manifest_utils.h"
 
+// constants
+#define CACHE_LOCK_WAIT_INTERVAL (50)		// msec
+#define MAX_PREFETCH_SEGMENT_SIZE_RATIO (4)		// max prefetch range of a track, relative to the segment size
+
 enum {
 	// mapping state machine
 	STATE_MAP_INITIAL,
@@ -33,9 +42,13 @@ enum {
 
 	// main state machine
 	STATE_READ_DRM_INFO,
+	STATE_FETCH_MANIFEST,
+	STATE_OPEN_SOURCES,
 	STATE_READ_METADATA_INITIAL,
 	STATE_READ_METADATA_OPEN_FILE,
+	STATE_READ_METADATA_INDEX_CACHE,
 	STATE_READ_METADATA_READ,
+	STATE_READ_METADATA_PARSE,
 	STATE_READ_FRAMES_OPEN_FILE,
 	STATE_READ_FRAMES_READ,
 	STATE_OPEN_FILE,
@@ -59,20 +72,37 @@ typedef ngx_int_t(*ngx_http_vod_state_machine_t)(ngx_http_vod_ctx_t* ctx);
 typedef ngx_int_t(*ngx_http_vod_open_file_t)(ngx_http_request_t* r, ngx_str_t* path, void** context);
 typedef ngx_int_t(*ngx_http_vod_async_read_func_t)(void* context, ngx_buf_t *buf, size_t size, off_t offset);
 typedef ngx_int_t(*ngx_http_vod_dump_part_t)(void* context, off_t start, off_t end);
+typedef ngx_int_t(*ngx_http_vod_get_file_info_t)(void* context, off_t* size, time_t* mtime);
 typedef ngx_int_t(*ngx_http_vod_dump_request_t)(ngx_http_vod_ctx_t* context);
+typedef ngx_int_t(*ngx_http_vod_open_sources_t)(ngx_http_vod_ctx_t* context);
+typedef void(*ngx_http_vod_prefetch_t)(void* context, off_t offset, off_t size);
+typedef ngx_int_t(*ngx_http_vod_parallel_read_func_t)(void* context, ngx_buf_t *buf, size_t size, off_t offset,
+	ngx_child_request_callback_t callback, void* callback_context);
 typedef ngx_int_t(*ngx_http_vod_mapping_apply_t)(ngx_http_vod_ctx_t *ctx, ngx_str_t* mapping, int* cache_index);
 typedef ngx_int_t(*ngx_http_vod_mapping_get_uri_t)(ngx_http_vod_ctx_t *ctx, ngx_str_t* uri);
+typedef void(*ngx_http_vod_index_cache_callback_t)(void* context, ngx_int_t rc);
 
 typedef struct {
 	uint32_t type;
 	uint32_t part_count;
 } multipart_cache_header_t;
 
+#if (NGX_THREADS)
+typedef struct {
+	ngx_http_vod_ctx_t* ctx;
+	multipart_cache_header_t* header;
+	ngx_str_t** out_parts;
+	ngx_http_vod_index_cache_callback_t callback;
+	void* callback_context;
+} ngx_http_vod_index_cache_fetch_t;
+#endif
+
 typedef struct {
 	ngx_http_request_t* r;
 	ngx_chain_t* chain_head;
 	ngx_chain_t* chain_end;
 	size_t total_size;
+	size_t max_buffered_size;		// when non-zero, the headers are sent once more than this size is buffered
 } ngx_http_vod_write_segment_context_t;
 
 typedef struct {
@@ -80,11 +110,56 @@ typedef struct {
 	ngx_str_t cur_remote_suburi;
 } ngx_http_vod_http_reader_state_t;
 
+typedef struct {
+	ngx_http_vod_ctx_t* ctx;
+	ngx_http_vod_http_reader_state_t* state;
+	ngx_child_request_callback_t callback;
+	void* callback_context;
+	ngx_buf_t* buf;				// the buffer of the caller
+	off_t offset;				// the first offset that was not found in the cache
+	off_t end_offset;
+	off_t block_offset;			// the offset of the first block requested from the upstream
+	ngx_buf_t response;
+} ngx_http_vod_block_read_t;
+
 typedef struct {
 	off_t alignment;
 	size_t extra_size;
 } ngx_http_vod_alloc_params_t;
 
+typedef struct {
+	ngx_http_vod_ctx_t* ctx;
+	ngx_buf_t buf;
+	size_t index;
+} ngx_http_vod_parallel_read_t;
+
+typedef struct {
+	ngx_http_vod_ctx_t* ctx;
+	media_clip_source_t* source;
+	ngx_int_t rc;					// NGX_AGAIN while the read is in progress, NGX_OK once the metadata is available
+	ngx_flag_t metadata_cache_hit;	// the parts were fetched from the metadata cache, and are parsed by the state machine
+	ngx_flag_t index_cache_hit;
+	multipart_cache_header_t multipart_header;
+	ngx_str_t* parts;
+	media_format_t* format;
+	void* metadata_reader_context;
+	ngx_buf_t read_buffer;
+	off_t read_offset;
+	off_t requested_offset;
+} ngx_http_vod_metadata_read_t;
+
+typedef struct {
+	ngx_http_vod_ctx_t* ctx;
+	media_sequence_t* sequence;
+	ngx_buf_t buf;
+} ngx_http_vod_drm_info_request_t;
+
+typedef struct {
+	ngx_http_vod_ctx_t* ctx;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+	ngx_buf_t buf;
+} ngx_http_vod_drm_info_refresh_t;
+
 typedef struct {
 	u_char cache_key[MEDIA_CLIP_KEY_SIZE];
 	ngx_str_t* cache_key_prefix;
@@ -92,10 +167,38 @@ typedef struct {
 	uint32_t cache_count;
 	void* reader_context;
 	size_t max_response_size;
+	time_t refresh_time;			// 0 = disabled, requires reading the mapping over http
 	ngx_http_vod_mapping_get_uri_t get_uri;
 	ngx_http_vod_mapping_apply_t apply;
 } ngx_http_vod_mapping_context_t;
 
+typedef struct {
+	ngx_http_vod_ctx_t* ctx;
+	ngx_buffer_cache_t* cache;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+	ngx_buf_t buf;
+	media_clip_source_t* source;
+	ngx_flag_t single_source;
+} ngx_http_vod_mapping_refresh_t;
+
+enum {
+	MAPPING_TYPE_PATH,				// simple file path response
+	MAPPING_TYPE_SOURCE,			// media set with a single source, without clipping / track selection
+	MAPPING_TYPE_MEDIA_SET,			// media set that replaces the media set of the request
+};
+
+typedef struct {
+	ngx_uint_t type;
+	ngx_str_t path;
+	media_set_t media_set;
+	int cache_index;
+} ngx_http_vod_media_set_mapping_t;
+
+typedef struct {
+	ngx_buffer_cache_t* cache;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+} ngx_http_vod_cache_lock_t;
+
 struct ngx_http_vod_ctx_s {
 	// base params
 	ngx_http_vod_submodule_context_t submodule_context;
@@ -107,6 +210,17 @@ struct ngx_http_vod_ctx_s {
 	u_char request_key[BUFFER_CACHE_KEY_SIZE];
 	ngx_http_vod_state_machine_t state_machine;
 
+	// manifest cache
+	ngx_flag_t manifest_cache_enabled;
+	ngx_md5_t dependencies_md5;					// mapping & drm info responses the manifest was built from
+	u_char manifest_key[BUFFER_CACHE_KEY_SIZE];
+	ngx_str_t manifest_values[MANIFEST_VALUE_COUNT];
+
+	// cache lock
+	ngx_event_t cache_lock_event;
+	ngx_msec_t cache_lock_wait_start;
+	u_char cache_lock_key[BUFFER_CACHE_KEY_SIZE];
+
 	// iterators
 	media_sequence_t* cur_sequence;
 	media_clip_source_t* cur_source;
@@ -121,6 +235,11 @@ struct ngx_http_vod_ctx_s {
 	// mapping
 	ngx_http_vod_mapping_context_t mapping;
 
+	// drm
+	ngx_str_t* drm_infos;						// [sequence_count]
+	ngx_uint_t pending_drm_requests;
+	ngx_int_t drm_info_rc;
+
 	// read metadata state
 	ngx_buf_t read_buffer;
 	media_format_t* format;
@@ -131,6 +250,8 @@ struct ngx_http_vod_ctx_s {
 	void* metadata_reader_context;
 	ngx_str_t* metadata_parts;
 	size_t metadata_part_count;
+	ngx_flag_t index_cache_hit;
+	multipart_cache_header_t index_cache_header;
 
 	// read frames state
 	media_base_metadata_t* base_metadata;
@@ -144,15 +265,25 @@ struct ngx_http_vod_ctx_s {
 	ngx_http_vod_async_read_func_t async_read;
 	ngx_http_vod_dump_part_t dump_part;
 	ngx_http_vod_dump_request_t dump_request;
+	ngx_http_vod_get_file_info_t get_file_info;		// optional, required for the index cache
+	ngx_http_vod_open_sources_t open_sources;		// optional, opens the sources of segment requests and reads their metadata concurrently
+	ngx_http_vod_prefetch_t prefetch;				// optional, hints the reader to load a range in the background
+	ngx_http_vod_parallel_read_func_t parallel_read;	// optional, supports several concurrent reads
 
 	// read state - file
 #if (NGX_THREADS)
 	void* async_open_context;
+	ngx_uint_t pending_opens;
 #endif
+	ngx_http_vod_metadata_read_t* metadata_reads;
+	ngx_uint_t metadata_read_count;
+	ngx_uint_t pending_metadata_reads;
 
 	// read state - http
 	ngx_str_t* file_key_prefix;
 	ngx_str_t upstream_extra_args;
+	ngx_uint_t pending_reads;
+	ngx_int_t parallel_read_rc;
 
 	// segment requests only
 	size_t content_length;
@@ -165,6 +296,12 @@ struct ngx_http_vod_ctx_s {
 
 // forward declarations
 static ngx_int_t ngx_http_vod_run_state_machine(ngx_http_vod_ctx_t *ctx);
+static ngx_int_t ngx_http_vod_map_media_set_parse(
+	ngx_http_vod_ctx_t *ctx,
+	media_clip_source_t* cur_source,
+	ngx_str_t* mapping,
+	ngx_flag_t single_source,
+	ngx_http_vod_media_set_mapping_t* result);
 static ngx_int_t ngx_http_vod_process_init(ngx_cycle_t *cycle);
 
 // globals
@@ -424,23 +561,48 @@ ngx_http_vod_set_request_params_var(ngx_http_request_t *r, ngx_http_variable_val
 
 ////// Perf counter wrappers
 
+static void
+ngx_buffer_cache_release_cleanup(void* data)
+{
+	ngx_buffer_cache_release(data);
+}
+
 static ngx_flag_t
 ngx_buffer_cache_fetch_perf(
 	ngx_perf_counters_t* perf_counters,
+	ngx_pool_t* pool,
 	ngx_buffer_cache_t* cache,
 	u_char* key,
 	u_char** buffer,
 	size_t* buffer_size)
 {
 	ngx_perf_counter_context(pcctx);
+	ngx_buffer_cache_entry_t* entry;
+	ngx_pool_cleanup_t* cln;
 	ngx_flag_t result;
-	
+
+	// Note: the cleanup is allocated in advance, so that the entry will not remain referenced on failure
+	cln = ngx_pool_cleanup_add(pool, 0);
+	if (cln == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pool->log, 0,
+			"ngx_buffer_cache_fetch_perf: ngx_pool_cleanup_add failed");
+		return 0;
+	}
+
 	ngx_perf_counter_start(pcctx);
 
-	result = ngx_buffer_cache_fetch(cache, key, buffer, buffer_size);
+	result = ngx_buffer_cache_fetch(cache, key, buffer, buffer_size, &entry);
 
 	ngx_perf_counter_end(perf_counters, pcctx, PC_FETCH_CACHE);
 
+	if (result)
+	{
+		// release the entry when the request completes
+		cln->handler = ngx_buffer_cache_release_cleanup;
+		cln->data = entry;
+	}
+
 	return result;
 }
 
@@ -452,9 +614,11 @@ ngx_buffer_cache_fetch_copy_perf(
 	uint32_t cache_count,
 	u_char* key,
 	u_char** buffer,
-	size_t* buffer_size)
+	size_t* buffer_size,
+	time_t* write_time)
 {
 	ngx_perf_counter_context(pcctx);
+	ngx_buffer_cache_entry_t* entry;
 	ngx_buffer_cache_t* cache;
 	ngx_flag_t result;
 	u_char* original_buffer;
@@ -472,7 +636,7 @@ ngx_buffer_cache_fetch_copy_perf(
 			continue;
 		}
 
-		result = ngx_buffer_cache_fetch(cache, key, &original_buffer, &original_size);
+		result = ngx_buffer_cache_fetch(cache, key, &original_buffer, &original_size, &entry);
 		if (!result)
 		{
 			continue;
@@ -483,6 +647,7 @@ ngx_buffer_cache_fetch_copy_perf(
 		buffer_copy = ngx_palloc(r->pool, original_size + 1);
 		if (buffer_copy == NULL)
 		{
+			ngx_buffer_cache_release(entry);
 			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
 				"ngx_buffer_cache_fetch_copy_perf: ngx_palloc failed");
 			return -1;
@@ -491,6 +656,13 @@ ngx_buffer_cache_fetch_copy_perf(
 		ngx_memcpy(buffer_copy, original_buffer, original_size);
 		buffer_copy[original_size] = '\0';
 
+		if (write_time != NULL)
+		{
+			*write_time = ngx_buffer_cache_get_write_time(entry);
+		}
+
+		ngx_buffer_cache_release(entry);
+
 		*buffer = buffer_copy;
 		*buffer_size = original_size;
 
@@ -544,11 +716,9 @@ ngx_buffer_cache_store_gather_perf(
 
 ////// Multipart cache functions
 
-static ngx_flag_t 
-ngx_buffer_cache_store_multipart_perf(
+static ngx_str_t*
+ngx_http_vod_init_multipart_buffers(
 	ngx_http_vod_ctx_t *ctx,
-	ngx_buffer_cache_t* cache,
-	u_char* key,
 	multipart_cache_header_t* header,
 	ngx_str_t* parts)
 {
@@ -565,8 +735,8 @@ ngx_buffer_cache_store_multipart_perf(
 	if (p == NULL)
 	{
 		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-			"ngx_buffer_cache_store_multipart_perf: ngx_palloc failed");
-		return 0;
+			"ngx_http_vod_init_multipart_buffers: ngx_palloc failed");
+		return NULL;
 	}
 
 	buffers = (void*)p;
@@ -585,19 +755,14 @@ ngx_buffer_cache_store_multipart_perf(
 		*cur_size++ = cur_part->len;
 	}
 
-	return ngx_buffer_cache_store_gather_perf(
-		ctx->perf_counters,
-		cache,
-		key,
-		buffers,
-		part_count + 1);
+	return buffers;
 }
 
 static ngx_flag_t
-ngx_buffer_cache_fetch_multipart_perf(
+ngx_http_vod_parse_multipart(
 	ngx_http_vod_ctx_t *ctx,
-	ngx_buffer_cache_t* cache,
-	u_char* key,
+	u_char* p,
+	size_t size,
 	multipart_cache_header_t* header,
 	ngx_str_t** out_parts)
 {
@@ -607,23 +772,11 @@ ngx_buffer_cache_fetch_multipart_perf(
 	size_t* part_sizes;
 	size_t cur_size;
 	u_char* end;
-	u_char* p;
-	size_t size;
-
-	if (!ngx_buffer_cache_fetch_perf(
-		ctx->perf_counters,
-		cache,
-		key,
-		&p,
-		&size))
-	{
-		return 0;
-	}
 
 	if (size < sizeof(*header))
 	{
 		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-			"ngx_buffer_cache_fetch_multipart_perf: size %uz smaller than header size", size);
+			"ngx_http_vod_parse_multipart: size %uz smaller than header size", size);
 		return 0;
 	}
 
@@ -636,7 +789,7 @@ ngx_buffer_cache_fetch_multipart_perf(
 	if ((size_t)(end - p) < part_count * sizeof(part_sizes[0]))
 	{
 		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-			"ngx_buffer_cache_fetch_multipart_perf: size %uz too small to hold %uD parts", size, part_count);
+			"ngx_http_vod_parse_multipart: size %uz too small to hold %uD parts", size, part_count);
 		return 0;
 	}
 	part_sizes = (void*)p;
@@ -646,7 +799,7 @@ ngx_buffer_cache_fetch_multipart_perf(
 	if (parts == NULL)
 	{
 		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-			"ngx_buffer_cache_fetch_multipart_perf: ngx_palloc failed");
+			"ngx_http_vod_parse_multipart: ngx_palloc failed");
 		return 0;
 	}
 
@@ -658,7 +811,7 @@ ngx_buffer_cache_fetch_multipart_perf(
 		if ((size_t)(end - p) < cur_size)
 		{
 			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_buffer_cache_fetch_multipart_perf: size left %uz smaller than part size %uz", 
+				"ngx_http_vod_parse_multipart: size left %uz smaller than part size %uz", 
 				(size_t)(end - p), cur_size);
 			return 0;
 		}
@@ -674,6 +827,168 @@ ngx_buffer_cache_fetch_multipart_perf(
 	return 1;
 }
 
+static ngx_flag_t 
+ngx_buffer_cache_store_multipart_perf(
+	ngx_http_vod_ctx_t *ctx,
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	multipart_cache_header_t* header,
+	ngx_str_t* parts)
+{
+	ngx_str_t* buffers;
+
+	buffers = ngx_http_vod_init_multipart_buffers(ctx, header, parts);
+	if (buffers == NULL)
+	{
+		return 0;
+	}
+
+	return ngx_buffer_cache_store_gather_perf(
+		ctx->perf_counters,
+		cache,
+		key,
+		buffers,
+		header->part_count + 1);
+}
+
+static ngx_flag_t
+ngx_buffer_cache_fetch_multipart_perf(
+	ngx_http_vod_ctx_t *ctx,
+	ngx_buffer_cache_t* cache,
+	u_char* key,
+	multipart_cache_header_t* header,
+	ngx_str_t** out_parts)
+{
+	u_char* p;
+	size_t size;
+
+	if (!ngx_buffer_cache_fetch_perf(
+		ctx->perf_counters,
+		ctx->submodule_context.r->pool,
+		cache,
+		key,
+		&p,
+		&size))
+	{
+		return 0;
+	}
+
+	return ngx_http_vod_parse_multipart(ctx, p, size, header, out_parts);
+}
+
+uint32_t
+ngx_http_vod_get_index_cache_format()
+{
+	// everything that determines the layout of the multipart buffers saved to the index cache
+	uint32_t values[] = {
+		0x01020304,				// byte order
+		sizeof(size_t),			// the part sizes
+		sizeof(multipart_cache_header_t),
+		FORMAT_ID_MP4,
+		MP4_METADATA_VERSION,
+		MP4_METADATA_PART_COUNT,
+		MP4_SAMPLE_INDEX_VERSION,
+		MP4_SAMPLE_INDEX_INTERVAL,
+		sizeof(mp4_sample_index_header_t),
+		sizeof(mp4_sample_index_track_t),
+		sizeof(mp4_sample_index_checkpoint_t),
+		FORMAT_ID_MKV,
+		MKV_METADATA_VERSION,
+	};
+
+	return ngx_crc32_short((u_char*)values, sizeof(values));
+}
+
+static ngx_flag_t
+ngx_index_cache_fetch_multipart_perf(
+	ngx_http_vod_ctx_t *ctx,
+	ngx_index_cache_t* cache,
+	u_char* key,
+	off_t source_size,
+	time_t source_mtime,
+	multipart_cache_header_t* header,
+	ngx_str_t** out_parts)
+{
+	ngx_perf_counter_context(pcctx);
+	ngx_flag_t result;
+	u_char* p;
+	size_t size;
+
+	ngx_perf_counter_start(pcctx);
+
+	result = ngx_index_cache_fetch(
+		cache,
+		ctx->submodule_context.r->pool,
+		ctx->submodule_context.request_context.log,
+		key,
+		source_size,
+		source_mtime,
+		&p,
+		&size);
+
+	ngx_perf_counter_end(ctx->perf_counters, pcctx, PC_FETCH_INDEX_CACHE);
+
+	if (!result)
+	{
+		return 0;
+	}
+
+	return ngx_http_vod_parse_multipart(ctx, p, size, header, out_parts);
+}
+
+static ngx_flag_t
+ngx_index_cache_store_multipart_perf(
+	ngx_http_vod_ctx_t *ctx,
+	ngx_index_cache_t* cache,
+	u_char* key,
+	off_t source_size,
+	time_t source_mtime,
+	multipart_cache_header_t* header,
+	ngx_str_t* parts)
+{
+	ngx_perf_counter_context(pcctx);
+	ngx_flag_t result;
+	ngx_str_t* buffers;
+
+	buffers = ngx_http_vod_init_multipart_buffers(ctx, header, parts);
+	if (buffers == NULL)
+	{
+		return 0;
+	}
+
+	ngx_perf_counter_start(pcctx);
+
+#if (NGX_THREADS)
+	if (ctx->submodule_context.conf->open_file_thread_pool != NULL)
+	{
+		result = ngx_index_cache_store_gather_async(
+			cache,
+			ctx->submodule_context.conf->open_file_thread_pool,
+			key,
+			source_size,
+			source_mtime,
+			buffers,
+			header->part_count + 1);
+	}
+	else
+#endif
+	{
+		result = ngx_index_cache_store_gather(
+			cache,
+			ctx->submodule_context.r->pool,
+			ctx->submodule_context.request_context.log,
+			key,
+			source_size,
+			source_mtime,
+			buffers,
+			header->part_count + 1);
+	}
+
+	ngx_perf_counter_end(ctx->perf_counters, pcctx, PC_STORE_INDEX_CACHE);
+
+	return result;
+}
+
 ////// Utility functions
 
 static ngx_int_t
@@ -727,13 +1042,16 @@ ngx_http_vod_send_header(
 		}
 	}
 
-	// set the etag
-	rc = ngx_http_set_etag(r);
-	if (rc != NGX_OK)
+	// set the etag (derived from the content length, so it is skipped when the length is unknown)
+	if (content_length_n >= 0)
 	{
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_send_header: ngx_http_set_etag failed %i", rc);
-		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		rc = ngx_http_set_etag(r);
+		if (rc != NGX_OK)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_send_header: ngx_http_set_etag failed %i", rc);
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
 	}
 
 	// send the response headers
@@ -765,6 +1083,7 @@ static ngx_int_t
 ngx_http_vod_alloc_read_buffer(ngx_http_vod_ctx_t *ctx, size_t size, int alloc_params_index)
 {
 	ngx_http_vod_alloc_params_t* alloc_params = ctx->alloc_params + alloc_params_index;
+	buffer_pool_t* buffer_pool = ctx->submodule_context.request_context.output_buffer_pool;
 	u_char* start = ctx->read_buffer.start;
 
 	size += alloc_params->extra_size;
@@ -773,20 +1092,34 @@ ngx_http_vod_alloc_read_buffer(ngx_http_vod_ctx_t *ctx, size_t size, int alloc_p
 		start + size > ctx->read_buffer.end ||					// buffer too small
 		((intptr_t)start & (alloc_params->alignment - 1)) != 0)	// buffer not conforming to alignment
 	{
-		if (alloc_params->alignment > 1)
-		{
-			start = ngx_pmemalign(ctx->submodule_context.request_context.pool, size, alloc_params->alignment);
-		}
-		else
+		// try to get a recycled buffer from the pool, the size is updated to the size of the pool buffer
+		start = NULL;
+		if (buffer_pool != NULL)
 		{
-			start = ngx_palloc(ctx->submodule_context.request_context.pool, size);
+			start = buffer_pool_alloc_aligned(
+				&ctx->submodule_context.request_context, 
+				buffer_pool, 
+				alloc_params->alignment, 
+				&size);
 		}
 
 		if (start == NULL)
 		{
-			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_alloc_read_buffer: failed to allocate read buffer of size %uz", size);
-			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+			if (alloc_params->alignment > 1)
+			{
+				start = ngx_pmemalign(ctx->submodule_context.request_context.pool, size, alloc_params->alignment);
+			}
+			else
+			{
+				start = ngx_palloc(ctx->submodule_context.request_context.pool, size);
+			}
+
+			if (start == NULL)
+			{
+				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_alloc_read_buffer: failed to allocate read buffer of size %uz", size);
+				return NGX_HTTP_INTERNAL_SERVER_ERROR;
+			}
 		}
 
 		ctx->read_buffer.start = start;
@@ -800,62 +1133,299 @@ ngx_http_vod_alloc_read_buffer(ngx_http_vod_ctx_t *ctx, size_t size, int alloc_p
 	return NGX_OK;
 }
 
-////// DRM
+////// Cache locks
 
 static void
-ngx_http_vod_drm_info_request_finished(void* context, ngx_int_t rc, ngx_buf_t* response, ssize_t content_length)
+ngx_http_vod_cache_unlock(void* data)
 {
-	ngx_http_vod_loc_conf_t *conf;
-	ngx_http_vod_ctx_t *ctx;
-	ngx_http_request_t *r = context;
-	ngx_str_t drm_info;
+	ngx_http_vod_cache_lock_t* lock = data;
 
-	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
-	conf = ctx->submodule_context.conf;
+	ngx_buffer_cache_unlock(lock->cache, lock->key);
+}
 
-	if (rc != NGX_OK)
+static void
+ngx_http_vod_cache_lock_wait_handler(ngx_event_t* ev)
+{
+	ngx_http_vod_ctx_t *ctx = ev->data;
+	ngx_int_t rc;
+
+	ctx->submodule_context.r->main->blocked--;
+
+	// Note: the state machine starts by fetching the cache again
+	rc = ctx->state_machine(ctx);
+	if (rc == NGX_AGAIN)
 	{
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_drm_info_request_finished: upstream request failed %i", rc);
-		goto finalize_request;
+		return;
 	}
 
-	if (response->last >= response->end)
+	ngx_http_vod_finalize_request(ctx, rc);
+}
+
+static void
+ngx_http_vod_cache_lock_wait_cleanup(void* data)
+{
+	ngx_http_vod_ctx_t *ctx = data;
+
+	if (ctx->cache_lock_event.timer_set)
 	{
-		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-			"ngx_http_vod_drm_info_request_finished: not enough room in buffer for null terminator");
-		rc = NGX_HTTP_BAD_GATEWAY;
-		goto finalize_request;
+		ngx_del_timer(&ctx->cache_lock_event);
+		ctx->submodule_context.r->main->blocked--;
 	}
+}
 
-	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_GET_DRM_INFO);
-
-	drm_info.data = response->pos;
-	drm_info.len = content_length;
-	*response->last = '\0';
+/*
+	takes the cache lock of the key without waiting. returns NGX_OK when the lock was taken, 
+	or NGX_DECLINED when another request is already building the buffer
+*/
+static ngx_int_t
+ngx_http_vod_cache_try_lock(ngx_http_vod_ctx_t *ctx, ngx_buffer_cache_t* cache, u_char* key)
+{
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	ngx_http_vod_cache_lock_t* lock;
+	ngx_pool_cleanup_t* cln;
 
-	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-		"ngx_http_vod_drm_info_request_finished: result %V", &drm_info);
+	if (!conf->cache_lock)
+	{
+		return NGX_OK;
+	}
 
-	// parse the drm info
-	rc = conf->submodule.parse_drm_info(&ctx->submodule_context, &drm_info, &ctx->cur_sequence->drm_info);
-	if (rc != NGX_OK)
+	if (!ngx_buffer_cache_lock(cache, key, conf->cache_lock_timeout))
 	{
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_drm_info_request_finished: invalid drm info response %V", &drm_info);
-		rc = NGX_HTTP_SERVICE_UNAVAILABLE;
-		goto finalize_request;
+		return NGX_DECLINED;
 	}
 
-	// save to cache
-	if (conf->drm_info_cache != NULL)
+	cln = ngx_pool_cleanup_add(ctx->submodule_context.r->pool, sizeof(*lock));
+	if (cln == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_cache_try_lock: ngx_pool_cleanup_add failed");
+		ngx_buffer_cache_unlock(cache, key);
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	lock = cln->data;
+	lock->cache = cache;
+	ngx_memcpy(lock->key, key, sizeof(lock->key));
+	cln->handler = ngx_http_vod_cache_unlock;
+
+	return NGX_OK;
+}
+
+/*
+	called after a cache miss, before building the missing buffer. returns NGX_OK when the caller 
+	should build the buffer, or NGX_AGAIN when another request is already building it. in the latter case,
+	the state machine is called again after a short delay, and is expected to start by fetching the cache
+*/
+static ngx_int_t
+ngx_http_vod_cache_lock(
+	ngx_http_vod_ctx_t *ctx,
+	ngx_buffer_cache_t** caches,
+	uint32_t cache_count,
+	u_char* key)
+{
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_http_cleanup_t* http_cln;
+	ngx_buffer_cache_t* cache = NULL;
+	uint32_t cache_index;
+	ngx_int_t rc;
+
+	if (!conf->cache_lock)
+	{
+		return NGX_OK;
+	}
+
+	// Note: the locks are kept in the first available cache, even if the buffer is eventually saved to another cache
+	for (cache_index = 0; cache_index < cache_count; cache_index++)
+	{
+		if (caches[cache_index] != NULL)
+		{
+			cache = caches[cache_index];
+			break;
+		}
+	}
+
+	if (cache == NULL)
+	{
+		return NGX_OK;
+	}
+
+	rc = ngx_http_vod_cache_try_lock(ctx, cache, key);
+	if (rc != NGX_DECLINED)
+	{
+		if (rc == NGX_OK)
+		{
+			ctx->cache_lock_wait_start = 0;
+		}
+		return rc;
+	}
+
+	// locked by another request, check whether we already waited enough for this key
+	if (ctx->cache_lock_wait_start == 0 ||
+		ngx_memcmp(ctx->cache_lock_key, key, sizeof(ctx->cache_lock_key)) != 0)
+	{
+		ctx->cache_lock_wait_start = ngx_current_msec;
+		ngx_memcpy(ctx->cache_lock_key, key, sizeof(ctx->cache_lock_key));
+	}
+	else if (ngx_current_msec - ctx->cache_lock_wait_start >= conf->cache_lock_timeout)
+	{
+		ngx_log_error(NGX_LOG_WARN, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_cache_lock: timed out waiting for the cache lock");
+		ctx->cache_lock_wait_start = 0;
+		return NGX_OK;
+	}
+
+	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+		"ngx_http_vod_cache_lock: waiting for the cache lock");
+
+	if (ctx->cache_lock_event.handler == NULL)
+	{
+		http_cln = ngx_http_cleanup_add(r, 0);
+		if (http_cln == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_cache_lock: ngx_http_cleanup_add failed");
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+
+		http_cln->handler = ngx_http_vod_cache_lock_wait_cleanup;
+		http_cln->data = ctx;
+
+		ctx->cache_lock_event.handler = ngx_http_vod_cache_lock_wait_handler;
+		ctx->cache_lock_event.data = ctx;
+		ctx->cache_lock_event.log = r->connection->log;
+	}
+
+	ngx_add_timer(&ctx->cache_lock_event, CACHE_LOCK_WAIT_INTERVAL);
+	r->main->blocked++;
+
+	return NGX_AGAIN;
+}
+
+////// DRM
+
+/*
+	the drm info of all the sequences that missed the cache is requested concurrently, the state machine
+	resumes once all the requests complete.
+	when vod_drm_refresh_time is set, cached drm info older than the refresh time is still used, but
+	a background request is sent to refresh it. the key lock of the cache makes sure a single request
+	refreshes each entry, the previous entry is replaced only if the new response is parsed successfully
+*/
+static ngx_int_t
+ngx_http_vod_drm_info_start_request(
+	ngx_http_vod_ctx_t *ctx,
+	ngx_child_request_callback_t callback,
+	void* callback_context,
+	ngx_buf_t* response_buffer,
+	ngx_flag_t background)
+{
+	ngx_child_request_params_t child_params;
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_int_t rc;
+
+	// allocate a separate buffer for each request
+	ctx->read_buffer.start = NULL;
+	rc = ngx_http_vod_alloc_read_buffer(ctx, conf->drm_max_info_length, READER_HTTP);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	*response_buffer = ctx->read_buffer;
+
+	ngx_memzero(&child_params, sizeof(child_params));
+	child_params.method = NGX_HTTP_GET;
+	child_params.background = background;
+
+	// Note: the request uri may reference the current sequence (e.g. $vod_suburi)
+	if (conf->drm_request_uri != NULL)
+	{
+		if (ngx_http_complex_value(
+			r,
+			conf->drm_request_uri,
+			&child_params.base_uri) != NGX_OK)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_drm_info_start_request: ngx_http_complex_value failed");
+			return NGX_ERROR;
+		}
+	}
+	else
+	{
+		child_params.base_uri = ctx->cur_sequence->stripped_uri;
+	}
+
+	rc = ngx_child_request_start(
+		r,
+		callback,
+		callback_context,
+		&conf->drm_upstream_location,
+		&child_params,
+		response_buffer);
+	if (rc != NGX_AGAIN)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_drm_info_start_request: ngx_child_request_start failed %i", rc);
+	}
+
+	return rc;
+}
+
+static void
+ngx_http_vod_drm_info_request_finished(void* context, ngx_int_t rc, ngx_buf_t* response, ssize_t content_length)
+{
+	ngx_http_vod_drm_info_request_t* request = context;
+	ngx_http_vod_loc_conf_t *conf;
+	ngx_http_vod_ctx_t *ctx = request->ctx;
+	ngx_http_request_t *r = ctx->submodule_context.r;
+	ngx_str_t* drm_info;
+
+	conf = ctx->submodule_context.conf;
+
+	if (rc != NGX_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_drm_info_request_finished: upstream request failed %i", rc);
+		ctx->drm_info_rc = rc;
+		goto done;
+	}
+
+	if (response->last >= response->end)
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+			"ngx_http_vod_drm_info_request_finished: not enough room in buffer for null terminator");
+		ctx->drm_info_rc = NGX_HTTP_BAD_GATEWAY;
+		goto done;
+	}
+
+	drm_info = &ctx->drm_infos[request->sequence - ctx->submodule_context.media_set.sequences];
+	drm_info->data = response->pos;
+	drm_info->len = content_length;
+	*response->last = '\0';
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
+		"ngx_http_vod_drm_info_request_finished: result %V", drm_info);
+
+	// parse the drm info
+	rc = conf->submodule.parse_drm_info(&ctx->submodule_context, drm_info, &request->sequence->drm_info);
+	if (rc != NGX_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_drm_info_request_finished: invalid drm info response %V", drm_info);
+		ctx->drm_info_rc = NGX_HTTP_SERVICE_UNAVAILABLE;
+		goto done;
+	}
+
+	// save to cache
+	if (conf->drm_info_cache != NULL)
 	{
 		if (ngx_buffer_cache_store_perf(
 			ctx->perf_counters,
 			conf->drm_info_cache,
-			ctx->cur_sequence->uri_key,
-			drm_info.data,
-			drm_info.len))
+			request->sequence->uri_key,
+			drm_info->data,
+			drm_info->len))
 		{
 			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
 				"ngx_http_vod_drm_info_request_finished: stored in drm info cache");
@@ -867,38 +1437,164 @@ ngx_http_vod_drm_info_request_finished(void* context, ngx_int_t rc, ngx_buf_t* r
 		}
 	}
 
-	ctx->cur_sequence++;
+done:
 
-	rc = ngx_http_vod_run_state_machine(ctx);
-	if (rc == NGX_AGAIN)
+	ctx->pending_drm_requests--;
+	if (ctx->pending_drm_requests > 0)
 	{
+		// still waiting for other sequences
 		return;
 	}
 
-	if (rc != NGX_OK && rc != NGX_DONE)
+	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_GET_DRM_INFO);
+
+	rc = ctx->drm_info_rc;
+	if (rc == NGX_OK)
 	{
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_drm_info_request_finished: ngx_http_vod_run_state_machine failed %i", rc);
-	}
+		rc = ngx_http_vod_run_state_machine(ctx);
+		if (rc == NGX_AGAIN)
+		{
+			return;
+		}
 
-finalize_request:
+		if (rc != NGX_OK && rc != NGX_DONE)
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_drm_info_request_finished: ngx_http_vod_run_state_machine failed %i", rc);
+		}
+	}
 
 	ngx_http_vod_finalize_request(ctx, rc);
 }
 
+static void
+ngx_http_vod_drm_info_refresh_finished(void* context, ngx_int_t rc, ngx_buf_t* response, ssize_t content_length)
+{
+	ngx_http_vod_drm_info_refresh_t* refresh = context;
+	ngx_http_vod_loc_conf_t *conf;
+	ngx_http_vod_ctx_t *ctx = refresh->ctx;
+	ngx_log_t* log = ctx->submodule_context.request_context.log;
+	ngx_str_t drm_info;
+	void* parsed_drm_info;
+
+	conf = ctx->submodule_context.conf;
+
+	if (rc != NGX_OK)
+	{
+		ngx_log_error(NGX_LOG_WARN, log, 0,
+			"ngx_http_vod_drm_info_refresh_finished: upstream request failed %i, keeping the cached drm info", rc);
+		goto unlock;
+	}
+
+	if (response->last >= response->end)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"ngx_http_vod_drm_info_refresh_finished: not enough room in buffer for null terminator");
+		goto unlock;
+	}
+
+	drm_info.data = response->pos;
+	drm_info.len = content_length;
+	*response->last = '\0';
+
+	// validate the response before replacing the cached drm info
+	if (conf->submodule.parse_drm_info(&ctx->submodule_context, &drm_info, &parsed_drm_info) != NGX_OK)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"ngx_http_vod_drm_info_refresh_finished: invalid drm info response %V", &drm_info);
+		goto unlock;
+	}
+
+	if (ngx_buffer_cache_replace(conf->drm_info_cache, refresh->key, drm_info.data, drm_info.len))
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_http_vod_drm_info_refresh_finished: drm info cache entry refreshed");
+	}
+	else
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_http_vod_drm_info_refresh_finished: failed to replace drm info cache entry");
+	}
+
+unlock:
+
+	ngx_buffer_cache_unlock(conf->drm_info_cache, refresh->key);
+}
+
+static void
+ngx_http_vod_drm_info_refresh(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_vod_drm_info_refresh_t* refresh;
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	u_char* key = ctx->cur_sequence->uri_key;
+
+	if (!ngx_buffer_cache_lock(conf->drm_info_cache, key, conf->cache_lock_timeout))
+	{
+		// already being refreshed by another request
+		return;
+	}
+
+	refresh = ngx_palloc(ctx->submodule_context.request_context.pool, sizeof(*refresh));
+	if (refresh == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_drm_info_refresh: ngx_palloc failed");
+		goto unlock;
+	}
+
+	refresh->ctx = ctx;
+	ngx_memcpy(refresh->key, key, sizeof(refresh->key));
+
+	if (ngx_http_vod_drm_info_start_request(
+		ctx,
+		ngx_http_vod_drm_info_refresh_finished,
+		refresh,
+		&refresh->buf,
+		1) != NGX_AGAIN)
+	{
+		goto unlock;
+	}
+
+	return;
+
+unlock:
+
+	// Note: failing to refresh is not an error, the cached drm info is used until it expires
+	ngx_buffer_cache_unlock(conf->drm_info_cache, key);
+}
+
 static ngx_int_t
 ngx_http_vod_state_machine_get_drm_info(ngx_http_vod_ctx_t *ctx)
 {
-	ngx_child_request_params_t child_params;
+	ngx_http_vod_drm_info_request_t* request;
 	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	media_sequence_t* sequences = ctx->submodule_context.media_set.sequences;
 	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_str_t* drm_info;
+	ngx_str_t* drm_infos_end;
 	ngx_int_t rc;
-	ngx_str_t drm_info;
+	time_t write_time;
+
+	if (ctx->drm_infos == NULL)
+	{
+		ctx->drm_infos = ngx_pcalloc(r->pool, sizeof(ctx->drm_infos[0]) * ctx->submodule_context.media_set.sequence_count);
+		if (ctx->drm_infos == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_state_machine_get_drm_info: ngx_pcalloc failed");
+			return NGX_ERROR;
+		}
+
+		ctx->pending_drm_requests = 0;
+		ctx->drm_info_rc = NGX_OK;
+	}
 
 	for (;
 		ctx->cur_sequence < ctx->submodule_context.media_set.sequences_end;
 		ctx->cur_sequence++)
 	{
+		drm_info = &ctx->drm_infos[ctx->cur_sequence - sequences];
+
 		if (conf->drm_info_cache != NULL)
 		{
 			// try to read the drm info from cache
@@ -908,20 +1604,27 @@ ngx_http_vod_state_machine_get_drm_info(ngx_http_vod_ctx_t *ctx)
 				&conf->drm_info_cache, 
 				1, 
 				ctx->cur_sequence->uri_key, 
-				&drm_info.data, 
-				&drm_info.len) >= 0)
+				&drm_info->data, 
+				&drm_info->len,
+				&write_time) >= 0)
 			{
 				ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-					"ngx_http_vod_state_machine_get_drm_info: drm info cache hit, size is %uz", drm_info.len);
+					"ngx_http_vod_state_machine_get_drm_info: drm info cache hit, size is %uz", drm_info->len);
 
-				rc = conf->submodule.parse_drm_info(&ctx->submodule_context, &drm_info, &ctx->cur_sequence->drm_info);
+				rc = conf->submodule.parse_drm_info(&ctx->submodule_context, drm_info, &ctx->cur_sequence->drm_info);
 				if (rc != NGX_OK)
 				{
 					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-						"ngx_http_vod_state_machine_get_drm_info: invalid drm info in cache %V", &drm_info);
+						"ngx_http_vod_state_machine_get_drm_info: invalid drm info in cache %V", drm_info);
 					return rc;
 				}
 
+				if (conf->drm_refresh_time > 0 &&
+					ngx_time() >= write_time + conf->drm_refresh_time)
+				{
+					ngx_http_vod_drm_info_refresh(ctx);
+				}
+
 				continue;
 			}
 			else
@@ -933,63 +1636,166 @@ ngx_http_vod_state_machine_get_drm_info(ngx_http_vod_ctx_t *ctx)
 
 		r->connection->log->action = "getting drm info";
 
-		rc = ngx_http_vod_alloc_read_buffer(ctx, conf->drm_max_info_length, READER_HTTP);
-		if (rc != NGX_OK)
+		request = ngx_palloc(r->pool, sizeof(*request));
+		if (request == NULL)
 		{
-			return rc;
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_state_machine_get_drm_info: ngx_palloc failed");
+			rc = NGX_ERROR;
+			goto failed;
 		}
 
-		ngx_memzero(&child_params, sizeof(child_params));
-		child_params.method = NGX_HTTP_GET;
+		request->ctx = ctx;
+		request->sequence = ctx->cur_sequence;
 
-		if (conf->drm_request_uri != NULL)
+		if (ctx->pending_drm_requests <= 0)
 		{
-			if (ngx_http_complex_value(
-				r,
-				conf->drm_request_uri,
-				&child_params.base_uri) != NGX_OK)
-			{
-				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-					"ngx_http_vod_state_machine_get_drm_info: ngx_http_complex_value failed");
-				return NGX_ERROR;
-			}
+			ngx_perf_counter_start(ctx->perf_counter_context);
 		}
-		else
+
+		rc = ngx_http_vod_drm_info_start_request(
+			ctx,
+			ngx_http_vod_drm_info_request_finished,
+			request,
+			&request->buf,
+			0);
+		if (rc != NGX_AGAIN)
 		{
-			child_params.base_uri = ctx->cur_sequence->stripped_uri;
+			goto failed;
 		}
 
-		ngx_perf_counter_start(ctx->perf_counter_context);
+		ctx->pending_drm_requests++;
+	}
 
-		rc = ngx_child_request_start(
-			r,
-			ngx_http_vod_drm_info_request_finished,
-			r,
-			&conf->drm_upstream_location,
-			&child_params,
-			&ctx->read_buffer);
-		if (rc != NGX_AGAIN)
+	if (ctx->pending_drm_requests > 0)
+	{
+		return NGX_AGAIN;
+	}
+
+	// Note: the dependencies are updated in sequence order, so that the manifest key does not
+	//		depend on the order in which the responses arrived
+	if (ctx->manifest_cache_enabled)
+	{
+		drm_infos_end = ctx->drm_infos + ctx->submodule_context.media_set.sequence_count;
+		for (drm_info = ctx->drm_infos; drm_info < drm_infos_end; drm_info++)
 		{
-			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-				"ngx_http_vod_state_machine_get_drm_info: ngx_child_request_start failed %i", rc);
+			ngx_md5_update(&ctx->dependencies_md5, drm_info->data, drm_info->len);
 		}
-		return rc;
 	}
 
 	return NGX_OK;
+
+failed:
+
+	if (ctx->pending_drm_requests <= 0)
+	{
+		return rc;
+	}
+
+	// wait for the requests that were started, the error is returned once they complete
+	ctx->drm_info_rc = rc;
+	ctx->cur_sequence = ctx->submodule_context.media_set.sequences_end;
+
+	return NGX_AGAIN;
 }
 
 ////// Common media processing
 
-static ngx_int_t 
-ngx_http_vod_parse_metadata(
-	ngx_http_vod_ctx_t *ctx, 
-	ngx_flag_t fetched_from_cache)
+static void
+ngx_http_vod_get_frame_index_key(media_clip_source_t* cur_source, media_frame_index_t* frame_index, u_char* key)
 {
-	get_clip_ranges_params_t get_ranges_params;
-	media_parse_params_t parse_params;
-	const ngx_http_vod_request_t* request = ctx->request;
-	media_clip_source_t* cur_source = ctx->cur_source;
+	ngx_md5_t md5;
+
+	ngx_md5_init(&md5);
+	ngx_md5_update(&md5, cur_source->file_key, sizeof(cur_source->file_key));
+	ngx_md5_update(&md5, &frame_index->media_type, sizeof(frame_index->media_type));
+	ngx_md5_update(&md5, &frame_index->track_index, sizeof(frame_index->track_index));
+	ngx_md5_final(key, &md5);
+}
+
+static void
+ngx_http_vod_fetch_frame_indexes(ngx_http_vod_ctx_t* ctx)
+{
+	media_frame_index_t* cur_index;
+	media_frame_index_t* last_index;
+	ngx_buffer_cache_t* cache = ctx->submodule_context.conf->frames_cache;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+
+	cur_index = ctx->base_metadata->frame_indexes;
+	last_index = cur_index + ctx->base_metadata->tracks.nelts;
+	for (; cur_index < last_index; cur_index++)
+	{
+		ngx_http_vod_get_frame_index_key(ctx->cur_source, cur_index, key);
+
+		if (ngx_buffer_cache_fetch_perf(
+			ctx->perf_counters,
+			ctx->submodule_context.r->pool,
+			cache,
+			key,
+			&cur_index->data.data,
+			&cur_index->data.len))
+		{
+			ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_fetch_frame_indexes: frames cache hit, media type %uD track %uD", 
+				cur_index->media_type, cur_index->track_index);
+		}
+		else
+		{
+			ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_fetch_frame_indexes: frames cache miss, media type %uD track %uD", 
+				cur_index->media_type, cur_index->track_index);
+		}
+	}
+}
+
+static void
+ngx_http_vod_store_frame_indexes(ngx_http_vod_ctx_t* ctx)
+{
+	media_frame_index_t* cur_index;
+	media_frame_index_t* last_index;
+	ngx_buffer_cache_t* cache = ctx->submodule_context.conf->frames_cache;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+
+	cur_index = ctx->base_metadata->frame_indexes;
+	last_index = cur_index + ctx->base_metadata->tracks.nelts;
+	for (; cur_index < last_index; cur_index++)
+	{
+		if (!cur_index->save)
+		{
+			continue;
+		}
+
+		ngx_http_vod_get_frame_index_key(ctx->cur_source, cur_index, key);
+
+		if (ngx_buffer_cache_store_perf(
+			ctx->perf_counters,
+			cache,
+			key,
+			cur_index->data.data,
+			cur_index->data.len))
+		{
+			ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_store_frame_indexes: stored frame index in cache, media type %uD track %uD", 
+				cur_index->media_type, cur_index->track_index);
+		}
+		else
+		{
+			ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_store_frame_indexes: failed to store frame index in cache, media type %uD track %uD", 
+				cur_index->media_type, cur_index->track_index);
+		}
+	}
+}
+
+static ngx_int_t 
+ngx_http_vod_parse_metadata(
+	ngx_http_vod_ctx_t *ctx, 
+	ngx_flag_t fetched_from_cache)
+{
+	get_clip_ranges_params_t get_ranges_params;
+	media_parse_params_t parse_params;
+	const ngx_http_vod_request_t* request = ctx->request;
+	media_clip_source_t* cur_source = ctx->cur_source;
 	request_context_t* request_context = &ctx->submodule_context.request_context;
 	segmenter_conf_t* segmenter = &ctx->submodule_context.conf->segmenter;
 	get_clip_ranges_result_t clip_ranges;
@@ -1046,6 +1852,19 @@ ngx_http_vod_parse_metadata(
 	{
 		parse_params.parse_type |= PARSE_FLAG_EDIT_LIST;
 	}
+
+	if ((ctx->submodule_context.conf->metadata_cache != NULL || ctx->submodule_context.conf->index_cache != NULL) && 
+		!fetched_from_cache)
+	{
+		// build the sample index, it is saved to the metadata cache with the moov atom
+		parse_params.parse_type |= PARSE_FLAG_SAMPLE_INDEX;
+	}
+
+	if (ctx->submodule_context.conf->frames_cache != NULL && 
+		request->request_class == REQUEST_CLASS_SEGMENT)
+	{
+		parse_params.parse_type |= PARSE_FLAG_FRAME_INDEX;
+	}
 	parse_params.codecs_mask = request->codecs_mask;
 
 	if (ctx->submodule_context.request_params.sequence_tracks_mask != NULL)
@@ -1181,6 +2000,11 @@ ngx_http_vod_parse_metadata(
 
 	parse_params.max_frames_size = ctx->submodule_context.conf->max_frames_size;
 
+	if (ctx->base_metadata->frame_indexes != NULL)
+	{
+		ngx_http_vod_fetch_frame_indexes(ctx);
+	}
+
 	// parse the frames
 	rc = ctx->format->read_frames(
 		&ctx->submodule_context.request_context,
@@ -1198,21 +2022,26 @@ ngx_http_vod_parse_metadata(
 		return ngx_http_vod_status_to_ngx_error(rc);
 	}
 
+	if (rc == VOD_OK && ctx->base_metadata->frame_indexes != NULL)
+	{
+		ngx_http_vod_store_frame_indexes(ctx);
+	}
+
 	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_MEDIA_PARSE);
 
 	return rc;
 }
 
 static ngx_int_t
-ngx_http_vod_identify_format(ngx_http_vod_ctx_t* ctx)
+ngx_http_vod_identify_format(
+	ngx_http_vod_ctx_t* ctx,
+	vod_str_t* buffer,
+	media_format_t** format,
+	void** metadata_reader_context)
 {
 	media_format_t** cur_format_ptr;
 	media_format_t* cur_format;
 	vod_status_t rc;
-	vod_str_t buffer;
-
-	buffer.data = ctx->read_buffer.pos;
-	buffer.len = ctx->read_buffer.last - ctx->read_buffer.pos;
 
 	for (cur_format_ptr = media_formats; ; cur_format_ptr++)
 	{
@@ -1226,9 +2055,9 @@ ngx_http_vod_identify_format(ngx_http_vod_ctx_t* ctx)
 
 		rc = cur_format->init_metadata_reader(
 			&ctx->submodule_context.request_context,
-			&buffer,
+			buffer,
 			ctx->submodule_context.conf->max_metadata_size,
-			&ctx->metadata_reader_context);
+			metadata_reader_context);
 		if (rc == VOD_NOT_FOUND)
 		{
 			continue;
@@ -1241,7 +2070,7 @@ ngx_http_vod_identify_format(ngx_http_vod_ctx_t* ctx)
 			return ngx_http_vod_status_to_ngx_error(rc);
 		}
 
-		ctx->format = cur_format;
+		*format = cur_format;
 		break;
 	}
 
@@ -1409,7 +2238,10 @@ ngx_http_vod_read_metadata(ngx_http_vod_ctx_t* ctx)
 	if (ctx->metadata_reader_context == NULL)
 	{
 		// identify the format
-		rc = ngx_http_vod_identify_format(ctx);
+		read_buffer.data = ctx->read_buffer.pos;
+		read_buffer.len = ctx->read_buffer.last - ctx->read_buffer.pos;
+
+		rc = ngx_http_vod_identify_format(ctx, &read_buffer, &ctx->format, &ctx->metadata_reader_context);
 		if (rc != NGX_OK)
 		{
 			return rc;
@@ -1503,13 +2335,217 @@ ngx_http_vod_read_frames(ngx_http_vod_ctx_t *ctx)
 	return NGX_OK;
 }
 
+#if (NGX_THREADS)
+static void
+ngx_http_vod_index_cache_fetched(void* context, ngx_flag_t found, u_char* buffer, size_t buffer_size)
+{
+	ngx_http_vod_index_cache_fetch_t* fetch = context;
+	ngx_http_vod_ctx_t* ctx = fetch->ctx;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_connection_t* c = r->connection;
+	ngx_int_t rc;
+
+	r->main->blocked--;
+	r->aio = 0;
+
+	if (found && ngx_http_vod_parse_multipart(ctx, buffer, buffer_size, fetch->header, fetch->out_parts))
+	{
+		rc = NGX_OK;
+	}
+	else
+	{
+		rc = NGX_DECLINED;
+	}
+
+	fetch->callback(fetch->callback_context, rc);
+
+	ngx_http_run_posted_requests(c);
+}
+#endif // NGX_THREADS
+
+/*
+	returns NGX_OK on hit and NGX_DECLINED on miss. when a thread pool is configured, the fetch runs on
+	the thread pool and NGX_AGAIN is returned, the callback is then called with NGX_OK / NGX_DECLINED
+*/
+static ngx_int_t
+ngx_http_vod_fetch_index_cache(
+	ngx_http_vod_ctx_t *ctx,
+	media_clip_source_t* source,
+	multipart_cache_header_t* multipart_header,
+	ngx_str_t** out_parts,
+	ngx_http_vod_index_cache_callback_t callback,
+	void* callback_context)
+{
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+#if (NGX_THREADS)
+	ngx_http_vod_index_cache_fetch_t* fetch;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_int_t rc;
+#endif
+	time_t mtime;
+	off_t size;
+
+	if (ctx->get_file_info(source->reader_context, &size, &mtime) != NGX_OK)
+	{
+		return NGX_DECLINED;
+	}
+
+#if (NGX_THREADS)
+	if (conf->open_file_thread_pool != NULL)
+	{
+		fetch = ngx_palloc(r->pool, sizeof(*fetch));
+		if (fetch == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_fetch_index_cache: ngx_palloc failed");
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+
+		fetch->ctx = ctx;
+		fetch->header = multipart_header;
+		fetch->out_parts = out_parts;
+		fetch->callback = callback;
+		fetch->callback_context = callback_context;
+
+		rc = ngx_index_cache_fetch_async(
+			conf->index_cache,
+			conf->open_file_thread_pool,
+			r->pool,
+			ctx->submodule_context.request_context.log,
+			source->file_key,
+			size,
+			mtime,
+			ngx_http_vod_index_cache_fetched,
+			fetch);
+		if (rc == NGX_AGAIN)
+		{
+			r->main->blocked++;
+			r->aio = 1;
+			return NGX_AGAIN;
+		}
+
+		// failed to post the task, fall back to fetching synchronously
+	}
+#endif // NGX_THREADS
+
+	if (!ngx_index_cache_fetch_multipart_perf(
+		ctx,
+		conf->index_cache,
+		source->file_key,
+		size,
+		mtime,
+		multipart_header,
+		out_parts))
+	{
+		return NGX_DECLINED;
+	}
+
+	return NGX_OK;
+}
+
+static void
+ngx_http_vod_index_cache_fetch_completed(void* context, ngx_int_t rc)
+{
+	ngx_http_vod_ctx_t *ctx = context;
+
+	ctx->index_cache_hit = rc == NGX_OK;
+
+	rc = ctx->state_machine(ctx);
+	if (rc == NGX_AGAIN)
+	{
+		return;
+	}
+
+	ngx_http_vod_finalize_request(ctx, rc);
+}
+
+static ngx_http_vod_metadata_read_t*
+ngx_http_vod_get_metadata_read(ngx_http_vod_ctx_t *ctx, media_clip_source_t* source)
+{
+	ngx_http_vod_metadata_read_t* cur_read;
+	ngx_http_vod_metadata_read_t* last_read;
+
+	last_read = ctx->metadata_reads + ctx->metadata_read_count;
+	for (cur_read = ctx->metadata_reads; cur_read < last_read; cur_read++)
+	{
+		if (cur_read->source == source)
+		{
+			return cur_read;
+		}
+	}
+
+	return NULL;
+}
+
+static void
+ngx_http_vod_store_metadata(ngx_http_vod_ctx_t *ctx, ngx_flag_t index_cache)
+{
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	multipart_cache_header_t multipart_header;
+	media_clip_source_t* cur_source = ctx->cur_source;
+	time_t mtime;
+	off_t size;
+
+	multipart_header.type = ctx->format->id;
+	multipart_header.part_count = ctx->metadata_part_count;
+
+	if (conf->metadata_cache != NULL)
+	{
+		if (ngx_buffer_cache_store_multipart_perf(
+			ctx,
+			conf->metadata_cache,
+			cur_source->file_key,
+			&multipart_header,
+			ctx->metadata_parts))
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_store_metadata: stored metadata in cache");
+		}
+		else
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_store_metadata: failed to store metadata in cache");
+		}
+	}
+
+	if (!index_cache)
+	{
+		return;
+	}
+
+	if (ctx->get_file_info(cur_source->reader_context, &size, &mtime) != NGX_OK)
+	{
+		return;
+	}
+
+	if (ngx_index_cache_store_multipart_perf(
+		ctx,
+		conf->index_cache,
+		cur_source->file_key,
+		size,
+		mtime,
+		&multipart_header,
+		ctx->metadata_parts))
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_store_metadata: stored metadata in index cache");
+	}
+	else
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_store_metadata: failed to store metadata in index cache");
+	}
+}
+
 static ngx_int_t
 ngx_http_vod_state_machine_parse_metadata(ngx_http_vod_ctx_t *ctx)
 {
 	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	ngx_http_vod_metadata_read_t* metadata_read;
 	multipart_cache_header_t multipart_header;
 	media_clip_source_t* cur_source;
 	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_flag_t cache_hit;
 	ngx_int_t rc;
 
 	if (ctx->cur_source == NULL)
@@ -1527,16 +2563,31 @@ ngx_http_vod_state_machine_parse_metadata(ngx_http_vod_ctx_t *ctx)
 			if (conf->metadata_cache != NULL)
 			{
 				// try to read the metadata from cache
-				if (ngx_buffer_cache_fetch_multipart_perf(
-					ctx,
-					conf->metadata_cache,
-					cur_source->file_key,
-					&multipart_header,
-					&ctx->metadata_parts))
+				metadata_read = ngx_http_vod_get_metadata_read(ctx, cur_source);
+				if (metadata_read != NULL && metadata_read->metadata_cache_hit)
+				{
+					// already fetched by open_sources
+					multipart_header = metadata_read->multipart_header;
+					ctx->metadata_parts = metadata_read->parts;
+					cache_hit = 1;
+				}
+				else
+				{
+					cache_hit = ngx_buffer_cache_fetch_multipart_perf(
+						ctx,
+						conf->metadata_cache,
+						cur_source->file_key,
+						&multipart_header,
+						&ctx->metadata_parts);
+				}
+
+				if (cache_hit)
 				{
 					ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
 						"ngx_http_vod_state_machine_parse_metadata: metadata cache hit");
 
+					ctx->metadata_part_count = multipart_header.part_count;
+
 					rc = ngx_http_vod_init_format(ctx, multipart_header.type);
 					if (rc != NGX_OK)
 					{
@@ -1567,6 +2618,17 @@ ngx_http_vod_state_machine_parse_metadata(ngx_http_vod_ctx_t *ctx)
 				{
 					ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
 						"ngx_http_vod_state_machine_parse_metadata: metadata cache miss");
+
+					// Note: when the metadata was read by open_sources, the lock is already held
+					if (metadata_read == NULL)
+					{
+						rc = ngx_http_vod_cache_lock(ctx, &conf->metadata_cache, 1, cur_source->file_key);
+						if (rc != NGX_OK)
+						{
+							return rc;
+						}
+					}
+
 					ctx->state = STATE_READ_METADATA_OPEN_FILE;
 				}
 			}
@@ -1575,7 +2637,12 @@ ngx_http_vod_state_machine_parse_metadata(ngx_http_vod_ctx_t *ctx)
 				ctx->state = STATE_READ_METADATA_OPEN_FILE;
 			}
 
-			// open the file
+			// open the file, if it was not already opened by open_sources
+			if (cur_source->reader_context != NULL)
+			{
+				break;
+			}
+
 			rc = ctx->open_file(r, &cur_source->mapped_uri, &cur_source->reader_context);
 			if (rc != NGX_OK)
 			{
@@ -1589,6 +2656,109 @@ ngx_http_vod_state_machine_parse_metadata(ngx_http_vod_ctx_t *ctx)
 			break;
 
 		case STATE_READ_METADATA_OPEN_FILE:
+			cur_source = ctx->cur_source;
+			ctx->index_cache_hit = 0;
+
+			if (conf->index_cache != NULL && ctx->get_file_info != NULL)
+			{
+				// try to read the metadata from the index cache
+				metadata_read = ngx_http_vod_get_metadata_read(ctx, cur_source);
+				if (metadata_read != NULL)
+				{
+					// the index cache was already checked by open_sources
+					ctx->index_cache_hit = metadata_read->index_cache_hit;
+					ctx->index_cache_header = metadata_read->multipart_header;
+					ctx->metadata_parts = metadata_read->parts;
+				}
+				else
+				{
+					ctx->state = STATE_READ_METADATA_INDEX_CACHE;
+
+					rc = ngx_http_vod_fetch_index_cache(
+						ctx,
+						cur_source,
+						&ctx->index_cache_header,
+						&ctx->metadata_parts,
+						ngx_http_vod_index_cache_fetch_completed,
+						ctx);
+					switch (rc)
+					{
+					case NGX_OK:
+						ctx->index_cache_hit = 1;
+						break;
+
+					case NGX_DECLINED:
+						break;
+
+					default:
+						return rc;
+					}
+				}
+			}
+			// fallthrough
+
+		case STATE_READ_METADATA_INDEX_CACHE:
+			cur_source = ctx->cur_source;
+
+			if (ctx->index_cache_hit)
+			{
+				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+					"ngx_http_vod_state_machine_parse_metadata: index cache hit");
+
+				ctx->metadata_part_count = ctx->index_cache_header.part_count;
+
+				rc = ngx_http_vod_init_format(ctx, ctx->index_cache_header.type);
+				if (rc != NGX_OK)
+				{
+					return rc;
+				}
+
+				rc = ngx_http_vod_parse_metadata(ctx, 1);
+				if (rc != NGX_OK && rc != NGX_AGAIN)
+				{
+					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+						"ngx_http_vod_state_machine_parse_metadata: ngx_http_vod_parse_metadata failed %i", rc);
+					return rc;
+				}
+
+				// save the metadata to the shared memory cache
+				ngx_http_vod_store_metadata(ctx, 0);
+
+				if (rc == NGX_OK)
+				{
+					// move to the next source
+					ctx->state = STATE_READ_METADATA_INITIAL;
+
+					ctx->cur_source = cur_source->next;
+					if (ctx->cur_source == NULL)
+					{
+						return NGX_OK;
+					}
+					break;
+				}
+
+				ctx->state = STATE_READ_FRAMES_OPEN_FILE;
+				break;
+			}
+
+			if (conf->index_cache != NULL && ctx->get_file_info != NULL)
+			{
+				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+					"ngx_http_vod_state_machine_parse_metadata: index cache miss");
+			}
+
+			metadata_read = ngx_http_vod_get_metadata_read(ctx, cur_source);
+			if (metadata_read != NULL && metadata_read->rc == NGX_OK)
+			{
+				// the metadata was already read by open_sources, concurrently with the other sources
+				ctx->format = metadata_read->format;
+				ctx->metadata_parts = metadata_read->parts;
+				ctx->metadata_part_count = metadata_read->multipart_header.part_count;
+				ctx->read_buffer = metadata_read->read_buffer;
+				ctx->state = STATE_READ_METADATA_PARSE;
+				break;
+			}
+
 			// allocate the initial read buffer
 			rc = ngx_http_vod_alloc_read_buffer(ctx, conf->initial_read_size, ctx->alloc_params_index);
 			if (rc != NGX_OK)
@@ -1604,8 +2774,6 @@ ngx_http_vod_state_machine_parse_metadata(ngx_http_vod_ctx_t *ctx)
 			ctx->read_offset = 0;
 			ctx->requested_offset = 0;
 
-			cur_source = ctx->cur_source;
-
 			ngx_perf_counter_start(ctx->perf_counter_context);
 
 			rc = ctx->async_read(cur_source->reader_context, &ctx->read_buffer, conf->initial_read_size, 0);
@@ -1635,7 +2803,9 @@ ngx_http_vod_state_machine_parse_metadata(ngx_http_vod_ctx_t *ctx)
 				}
 				return rc;
 			}
+			// fallthrough
 
+		case STATE_READ_METADATA_PARSE:
 			// parse the metadata
 			rc = ngx_http_vod_parse_metadata(ctx, 0);
 			if (rc != NGX_OK && rc != NGX_AGAIN)
@@ -1648,27 +2818,7 @@ ngx_http_vod_state_machine_parse_metadata(ngx_http_vod_ctx_t *ctx)
 			// save the metadata to cache
 			cur_source = ctx->cur_source;
 
-			if (conf->metadata_cache != NULL)
-			{
-				multipart_header.type = ctx->format->id;
-				multipart_header.part_count = ctx->metadata_part_count;
-
-				if (ngx_buffer_cache_store_multipart_perf(
-					ctx,
-					conf->metadata_cache,
-					cur_source->file_key,
-					&multipart_header,
-					ctx->metadata_parts))
-				{
-					ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-						"ngx_http_vod_state_machine_parse_metadata: stored metadata in cache");
-				}
-				else
-				{
-					ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-						"ngx_http_vod_state_machine_parse_metadata: failed to store metadata in cache");
-				}
-			}
+			ngx_http_vod_store_metadata(ctx, conf->index_cache != NULL && ctx->get_file_info != NULL);
 
 			if (ctx->request != NULL)
 			{
@@ -1912,39 +3062,195 @@ ngx_http_vod_update_timescale(ngx_http_vod_ctx_t *ctx)
 	return NGX_OK;
 }
 
-////// Metadata request handling
+////// Live playlist state
 
-static ngx_int_t
-ngx_http_vod_handle_metadata_request(ngx_http_vod_ctx_t *ctx)
+static void
+ngx_http_vod_get_live_playlist_state_key(ngx_http_vod_ctx_t* ctx, uint32_t segment_index, u_char* key)
+{
+	ngx_md5_t md5;
+
+	ngx_md5_init(&md5);
+	ngx_md5_update(&md5, ctx->request_key, sizeof(ctx->request_key));
+	ngx_md5_update(&md5, &segment_index, sizeof(segment_index));
+	ngx_md5_final(key, &md5);
+}
+
+ngx_int_t
+ngx_http_vod_fetch_live_playlist_state(ngx_http_request_t *r, uint32_t segment_index, ngx_str_t* result)
 {
 	ngx_http_vod_loc_conf_t* conf;
-	ngx_buffer_cache_t* cache;
-	ngx_str_t cache_buffers[3];
-	ngx_str_t content_type;
-	ngx_str_t response = ngx_null_string;
+	ngx_http_vod_ctx_t* ctx;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+	conf = ctx->submodule_context.conf;
+	if (conf->live_playlist_cache == NULL)
+	{
+		return NGX_DECLINED;
+	}
+
+	ngx_http_vod_get_live_playlist_state_key(ctx, segment_index, key);
+
+	if (ngx_buffer_cache_fetch_copy_perf(
+		r,
+		ctx->perf_counters,
+		&conf->live_playlist_cache,
+		1,
+		key,
+		&result->data,
+		&result->len,
+		NULL) < 0)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_fetch_live_playlist_state: live playlist cache miss, segment index %uD", segment_index);
+		return NGX_DECLINED;
+	}
+
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"ngx_http_vod_fetch_live_playlist_state: live playlist cache hit, segment index %uD, size is %uz", 
+		segment_index, result->len);
+
+	return NGX_OK;
+}
+
+void
+ngx_http_vod_store_live_playlist_state(ngx_http_request_t *r, uint32_t segment_index, ngx_str_t* state)
+{
+	ngx_http_vod_loc_conf_t* conf;
+	ngx_http_vod_ctx_t* ctx;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+	conf = ctx->submodule_context.conf;
+	if (conf->live_playlist_cache == NULL)
+	{
+		return;
+	}
+
+	ngx_http_vod_get_live_playlist_state_key(ctx, segment_index, key);
+
+	// Note: the store fails if the window was already saved by another request, this is expected
+	if (ngx_buffer_cache_store_perf(
+		ctx->perf_counters,
+		conf->live_playlist_cache,
+		key,
+		state->data,
+		state->len))
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_store_live_playlist_state: stored in live playlist cache");
+	}
+	else
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_store_live_playlist_state: failed to store state in live playlist cache");
+	}
+}
+
+////// Metadata request handling
+
+static ngx_int_t
+ngx_http_vod_get_manifest_values(
+	ngx_http_request_t* r,
+	ngx_http_vod_loc_conf_t* conf,
+	ngx_str_t* values)
+{
 	ngx_int_t rc;
-	int cache_type;
 
-	rc = ngx_http_vod_update_timescale(ctx);
+	ngx_memzero(values, sizeof(values[0]) * MANIFEST_VALUE_COUNT);
+
+	rc = ngx_http_vod_get_base_url(r, conf->base_url, &empty_string, &values[MANIFEST_VALUE_BASE_URL]);
 	if (rc != NGX_OK)
 	{
 		return rc;
 	}
 
-	ngx_perf_counter_start(ctx->perf_counter_context);
+	if (conf->segments_base_url != NULL)
+	{
+		rc = ngx_http_vod_get_base_url(r, conf->segments_base_url, &empty_string, &values[MANIFEST_VALUE_SEGMENTS_BASE_URL]);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+	}
 
-	rc = ctx->request->handle_metadata_request(
-		&ctx->submodule_context,
-		&response,
-		&content_type);
-	if (rc != NGX_OK)
+	if (conf->hls.encryption_key_uri != NULL)
 	{
-		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-			"ngx_http_vod_handle_metadata_request: handle_metadata_request failed %i", rc);
-		return rc;
+		if (ngx_http_complex_value(
+			r,
+			conf->hls.encryption_key_uri,
+			&values[MANIFEST_VALUE_ENCRYPTION_KEY_URI]) != NGX_OK)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_get_manifest_values: ngx_http_complex_value failed");
+			return NGX_ERROR;
+		}
 	}
 
-	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_BUILD_MANIFEST);
+	return NGX_OK;
+}
+
+static void
+ngx_http_vod_get_manifest_key(ngx_http_vod_ctx_t* ctx, u_char* key)
+{
+	ngx_http_core_srv_conf_t* cscf;
+	ngx_http_core_loc_conf_t* clcf;
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	media_clip_source_t* cur_source;
+	media_sequence_t* cur_sequence;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	media_set_t* media_set = &ctx->submodule_context.media_set;
+	ngx_md5_t* md5 = &ctx->dependencies_md5;
+	u_char value_flags[MANIFEST_VALUE_COUNT];
+	ngx_uint_t i;
+
+	// the packager configuration
+	cscf = ngx_http_get_module_srv_conf(r, ngx_http_core_module);
+	clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+	ngx_md5_update(md5, cscf->server_name.data, cscf->server_name.len);
+	ngx_md5_update(md5, clcf->name.data, clcf->name.len);
+
+	// the request params
+	ngx_md5_update(md5, r->uri.data, r->uri.len);
+
+	// Note: the values themselves are not part of the key, but an empty value changes the structure of the manifest
+	//		(e.g. relative urls are used when the base url is empty)
+	for (i = 0; i < MANIFEST_VALUE_COUNT; i++)
+	{
+		value_flags[i] = ctx->manifest_values[i].len != 0;
+	}
+	ngx_md5_update(md5, value_flags, sizeof(value_flags));
+
+	// the media set
+	for (cur_source = media_set->sources_head; cur_source != NULL; cur_source = cur_source->next)
+	{
+		ngx_md5_update(md5, cur_source->mapped_uri.data, cur_source->mapped_uri.len);
+		ngx_md5_update(md5, &cur_source->clip_from, sizeof(cur_source->clip_from));
+		ngx_md5_update(md5, &cur_source->clip_to, sizeof(cur_source->clip_to));
+	}
+
+	if (conf->drm_enabled || conf->secret_key != NULL)
+	{
+		for (cur_sequence = media_set->sequences; cur_sequence < media_set->sequences_end; cur_sequence++)
+		{
+			ngx_md5_update(md5, cur_sequence->encryption_key, sizeof(cur_sequence->encryption_key));
+		}
+	}
+
+	ngx_md5_final(key, md5);
+}
+
+static ngx_int_t
+ngx_http_vod_send_metadata_response(
+	ngx_http_vod_ctx_t *ctx, 
+	ngx_str_t* content_type, 
+	ngx_str_t* response)
+{
+	ngx_http_vod_loc_conf_t* conf;
+	ngx_buffer_cache_t* cache;
+	ngx_str_t cache_buffers[3];
+	ngx_int_t rc;
+	int cache_type;
 
 	conf = ctx->submodule_context.conf;
 	if (ctx->submodule_context.media_set.type != MEDIA_SET_LIVE ||
@@ -1958,35 +3264,225 @@ ngx_http_vod_handle_metadata_request(ngx_http_vod_ctx_t *ctx)
 	}
 
 	cache = conf->response_cache[cache_type];
-	if (cache != NULL && response.data != NULL)
+	if (cache != NULL && response->data != NULL)
 	{
-		cache_buffers[0].data = (u_char*)&content_type.len;
-		cache_buffers[0].len = sizeof(content_type.len);
-		cache_buffers[1] = content_type;
-		cache_buffers[2] = response;
+		cache_buffers[0].data = (u_char*)&content_type->len;
+		cache_buffers[0].len = sizeof(content_type->len);
+		cache_buffers[1] = *content_type;
+		cache_buffers[2] = *response;
 
 		if (ngx_buffer_cache_store_gather_perf(ctx->perf_counters, cache, ctx->request_key, cache_buffers, 3))
 		{
 			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_handle_metadata_request: stored in response cache");
+				"ngx_http_vod_send_metadata_response: stored in response cache");
 		}
 		else
 		{
 			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_handle_metadata_request: failed to store response in cache");
+				"ngx_http_vod_send_metadata_response: failed to store response in cache");
 		}
 	}
 
-	rc = ngx_http_vod_send_header(ctx->submodule_context.r, response.len, &content_type, cache_type);
+	rc = ngx_http_vod_send_header(ctx->submodule_context.r, response->len, content_type, cache_type);
 	if (rc != NGX_OK)
 	{
 		return rc;
 	}
 	
-	return ngx_http_vod_send_response(ctx->submodule_context.r, &response, NULL);
+	return ngx_http_vod_send_response(ctx->submodule_context.r, response, NULL);
+}
+
+static ngx_int_t
+ngx_http_vod_fetch_manifest(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_str_t content_type;
+	ngx_str_t response;
+	u_char* cache_buffer;
+	size_t cache_buffer_size;
+	ngx_int_t rc;
+
+	// live manifests change over time
+	if (ctx->submodule_context.media_set.type == MEDIA_SET_LIVE)
+	{
+		ctx->manifest_cache_enabled = 0;
+		return NGX_DECLINED;
+	}
+
+	ngx_http_vod_get_manifest_key(ctx, ctx->manifest_key);
+
+	if (ngx_buffer_cache_fetch_copy_perf(
+		r,
+		ctx->perf_counters,
+		&conf->manifest_cache,
+		1,
+		ctx->manifest_key,
+		&cache_buffer,
+		&cache_buffer_size,
+		NULL) < 0)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_fetch_manifest: manifest cache miss");
+		return NGX_DECLINED;
+	}
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+		"ngx_http_vod_fetch_manifest: manifest cache hit, size is %uz", cache_buffer_size);
+
+	// extract the content type
+	if (cache_buffer_size < sizeof(size_t))
+	{
+		return NGX_DECLINED;
+	}
+
+	ngx_memcpy(&content_type.len, cache_buffer, sizeof(size_t));
+	cache_buffer += sizeof(size_t);
+	cache_buffer_size -= sizeof(size_t);
+	content_type.data = cache_buffer;
+
+	if (cache_buffer_size < content_type.len)
+	{
+		return NGX_DECLINED;
+	}
+
+	// expand the template
+	rc = ngx_manifest_template_expand(
+		r->pool,
+		ctx->submodule_context.request_context.log,
+		cache_buffer + content_type.len,
+		cache_buffer_size - content_type.len,
+		ctx->manifest_values,
+		MANIFEST_VALUE_COUNT,
+		&response);
+	if (rc != NGX_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_fetch_manifest: ngx_manifest_template_expand failed %i", rc);
+		return NGX_DECLINED;
+	}
+
+	ctx->manifest_cache_enabled = 0;
+
+	return ngx_http_vod_send_metadata_response(ctx, &content_type, &response);
+}
+
+ngx_flag_t
+ngx_http_vod_get_manifest_placeholder(ngx_http_request_t *r, ngx_uint_t value_index, ngx_str_t* result)
+{
+	ngx_http_vod_ctx_t* ctx;
+
+	// Note: an empty value changes the structure of the manifest, so it is not replaced with a placeholder
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+	if (ctx == NULL || !ctx->manifest_cache_enabled || ctx->manifest_values[value_index].len == 0)
+	{
+		return 0;
+	}
+
+	ngx_manifest_template_get_placeholder(value_index, result);
+	return 1;
+}
+
+/* Note: the response is built with placeholders, it is replaced with the expanded template */
+static ngx_int_t
+ngx_http_vod_store_manifest(
+	ngx_http_vod_ctx_t *ctx,
+	ngx_str_t* content_type,
+	ngx_str_t* response)
+{
+	ngx_str_t cache_buffers[3];
+	ngx_int_t rc;
+
+	rc = ngx_manifest_template_build(
+		ctx->submodule_context.r->pool,
+		ctx->submodule_context.request_context.log,
+		response,
+		MANIFEST_VALUE_COUNT,
+		&cache_buffers[2]);
+	if (rc != NGX_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_store_manifest: ngx_manifest_template_build failed %i", rc);
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	rc = ngx_manifest_template_expand(
+		ctx->submodule_context.r->pool,
+		ctx->submodule_context.request_context.log,
+		cache_buffers[2].data,
+		cache_buffers[2].len,
+		ctx->manifest_values,
+		MANIFEST_VALUE_COUNT,
+		response);
+	if (rc != NGX_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_store_manifest: ngx_manifest_template_expand failed %i", rc);
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	cache_buffers[0].data = (u_char*)&content_type->len;
+	cache_buffers[0].len = sizeof(content_type->len);
+	cache_buffers[1] = *content_type;
+
+	if (ngx_buffer_cache_store_gather_perf(
+		ctx->perf_counters, 
+		ctx->submodule_context.conf->manifest_cache, 
+		ctx->manifest_key, 
+		cache_buffers, 
+		3))
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_store_manifest: stored in manifest cache");
+	}
+	else
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_store_manifest: failed to store manifest in cache");
+	}
+
+	return NGX_OK;
 }
 
-////// Segment request handling
+static ngx_int_t
+ngx_http_vod_handle_metadata_request(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_str_t content_type;
+	ngx_str_t response = ngx_null_string;
+	ngx_int_t rc;
+
+	rc = ngx_http_vod_update_timescale(ctx);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	ngx_perf_counter_start(ctx->perf_counter_context);
+
+	rc = ctx->request->handle_metadata_request(
+		&ctx->submodule_context,
+		&response,
+		&content_type);
+	if (rc != NGX_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_handle_metadata_request: handle_metadata_request failed %i", rc);
+		return rc;
+	}
+
+	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_BUILD_MANIFEST);
+
+	if (ctx->manifest_cache_enabled && response.data != NULL)
+	{
+		rc = ngx_http_vod_store_manifest(ctx, &content_type, &response);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+	}
+
+	return ngx_http_vod_send_metadata_response(ctx, &content_type, &response);
+}
 
 static ngx_int_t
 ngx_http_vod_state_machine_open_files(ngx_http_vod_ctx_t *ctx)
@@ -2090,41 +3586,54 @@ ngx_http_vod_write_segment_header_buffer(void* ctx, u_char* buffer, uint32_t siz
 	return VOD_OK;
 }
 
-static vod_status_t 
-ngx_http_vod_write_segment_buffer(void* ctx, u_char* buffer, uint32_t size)
+static vod_status_t
+ngx_http_vod_write_segment_start_stream(ngx_http_vod_write_segment_context_t* context)
 {
-	ngx_http_vod_write_segment_context_t* context = (ngx_http_vod_write_segment_context_t*)ctx;
-	ngx_buf_t *b;
-	ngx_chain_t *chain;
-	ngx_chain_t out;
 	ngx_int_t rc;
 
-	// create a wrapping ngx_buf_t
-	b = ngx_calloc_buf(context->r->pool);
-	if (b == NULL) 
+	// the size of the segment is unknown, send the headers without a content length (chunked transfer encoding)
+	rc = ngx_http_vod_send_header(context->r, -1, NULL, CACHE_TYPE_VOD);
+	if (rc != NGX_OK)
 	{
-		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
-			"ngx_http_vod_write_segment_buffer: ngx_calloc_buf failed");
-		return VOD_ALLOC_FAILED;
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
+			"ngx_http_vod_write_segment_start_stream: ngx_http_vod_send_header failed %i", rc);
+		return VOD_UNEXPECTED;
 	}
 
-	b->pos = buffer;
-	b->last = buffer + size;
-	b->temporary = 1;
+	// output the buffers that were written so far
+	context->chain_end->next = NULL;
 
-	if (context->r->header_sent)
+	rc = ngx_http_output_filter(context->r, context->chain_head);
+	if (rc != NGX_OK && rc != NGX_AGAIN)
 	{
-		// headers already sent, output the chunk
-		out.buf = b;
-		out.next = NULL;
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
+			"ngx_http_vod_write_segment_start_stream: ngx_http_output_filter failed %i", rc);
+		return VOD_ALLOC_FAILED;
+	}
 
-		rc = ngx_http_output_filter(context->r, &out);
+	return VOD_OK;
+}
+
+static vod_status_t 
+ngx_http_vod_write_segment_buf(ngx_http_vod_write_segment_context_t* context, ngx_buf_t* b, size_t size)
+{
+	ngx_chain_t *chain;
+	ngx_chain_t out;
+	ngx_int_t rc;
+
+	if (context->r->header_sent)
+	{
+		// headers already sent, output the chunk
+		out.buf = b;
+		out.next = NULL;
+
+		rc = ngx_http_output_filter(context->r, &out);
 		if (rc != NGX_OK && rc != NGX_AGAIN)
 		{
 			// either the connection dropped, or some allocation failed
 			// in case the connection dropped, the error code doesn't matter anyway
 			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
-				"ngx_http_vod_write_segment_buffer: ngx_http_output_filter failed %i", rc);
+				"ngx_http_vod_write_segment_buf: ngx_http_output_filter failed %i", rc);
 			return VOD_ALLOC_FAILED;
 		}
 	}
@@ -2137,7 +3646,7 @@ ngx_http_vod_write_segment_buffer(void* ctx, u_char* buffer, uint32_t size)
 			if (chain == NULL) 
 			{
 				ngx_log_debug0(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
-					"ngx_http_vod_write_segment_buffer: ngx_alloc_chain_link failed");
+					"ngx_http_vod_write_segment_buf: ngx_alloc_chain_link failed");
 				return VOD_ALLOC_FAILED;
 			}
 
@@ -2149,9 +3658,58 @@ ngx_http_vod_write_segment_buffer(void* ctx, u_char* buffer, uint32_t size)
 
 	context->total_size += size;
 
+	if (context->max_buffered_size != 0 &&
+		!context->r->header_sent &&
+		context->total_size > context->max_buffered_size)
+	{
+		return ngx_http_vod_write_segment_start_stream(context);
+	}
+
 	return VOD_OK;
 }
 
+static vod_status_t 
+ngx_http_vod_write_segment_buffer(void* ctx, u_char* buffer, uint32_t size)
+{
+	ngx_http_vod_write_segment_context_t* context = (ngx_http_vod_write_segment_context_t*)ctx;
+	ngx_buf_t *b;
+
+	// create a wrapping ngx_buf_t
+	b = ngx_calloc_buf(context->r->pool);
+	if (b == NULL) 
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
+			"ngx_http_vod_write_segment_buffer: ngx_calloc_buf failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	b->pos = buffer;
+	b->last = buffer + size;
+	b->temporary = 1;
+
+	return ngx_http_vod_write_segment_buf(context, b, size);
+}
+
+static vod_status_t
+ngx_http_vod_write_segment_file(void* ctx, void* source, uint64_t offset, uint32_t size)
+{
+	ngx_http_vod_write_segment_context_t* context = (ngx_http_vod_write_segment_context_t*)ctx;
+	media_clip_source_t* cur_source = source;
+	ngx_buf_t *b;
+	ngx_int_t rc;
+
+	// create a file ngx_buf_t, the data is sent from the file (e.g. using sendfile) without reading it to memory
+	rc = ngx_file_reader_get_file_buf(cur_source->reader_context, offset, offset + size, &b);
+	if (rc != NGX_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, context->r->connection->log, 0,
+			"ngx_http_vod_write_segment_file: ngx_file_reader_get_file_buf failed %i", rc);
+		return rc == NGX_HTTP_NOT_FOUND ? VOD_BAD_DATA : VOD_ALLOC_FAILED;
+	}
+
+	return ngx_http_vod_write_segment_buf(context, b, size);
+}
+
 static ngx_int_t 
 ngx_http_vod_init_frame_processing(ngx_http_vod_ctx_t *ctx)
 {
@@ -2176,11 +3734,20 @@ ngx_http_vod_init_frame_processing(ngx_http_vod_ctx_t *ctx)
 	ctx->write_segment_buffer_context.chain_head = &ctx->out;
 	ctx->write_segment_buffer_context.chain_end = &ctx->out;
 	ctx->write_segment_buffer_context.total_size = 0;
+	ctx->write_segment_buffer_context.max_buffered_size = 0;
 
 	segment_writer.write_tail = ngx_http_vod_write_segment_buffer;
 	segment_writer.write_head = ngx_http_vod_write_segment_header_buffer;
+	segment_writer.write_file = NULL;
 	segment_writer.context = &ctx->write_segment_buffer_context;
 
+	// the frames of local files can be sent as is from the file, when the output does not change them
+	if (ctx->submodule_context.conf->sendfile_frames &&
+		ctx->submodule_context.conf->request_handler != ngx_http_vod_remote_request_handler)
+	{
+		segment_writer.write_file = ngx_http_vod_write_segment_file;
+	}
+
 	// initialize the protocol specific frame processor
 	ngx_perf_counter_start(ctx->perf_counter_context);
 
@@ -2205,8 +3772,19 @@ ngx_http_vod_init_frame_processing(ngx_http_vod_ctx_t *ctx)
 	r->headers_out.content_type.len = content_type.len;
 	r->headers_out.content_type.data = content_type.data;
 
-	// if the frame processor can't determine the size in advance we have to build the whole response before we can start sending it
-	if (ctx->content_length != 0)
+	// if the frame processor can't determine the size in advance we have to build the whole response before we can start sending it,
+	// unless the request supports streaming, in which case the response is sent using chunked encoding once it exceeds the threshold
+	if (ctx->content_length == 0)
+	{
+		if ((ctx->request->flags & REQUEST_FLAG_STREAM_UNKNOWN_SIZE) != 0 &&
+			ctx->submodule_context.conf->max_buffered_segment_size != 0 &&
+			r->headers_in.range == NULL &&
+			!r->header_only && r->method != NGX_HTTP_HEAD)
+		{
+			ctx->write_segment_buffer_context.max_buffered_size = ctx->submodule_context.conf->max_buffered_segment_size;
+		}
+	}
+	else
 	{
 		// send the response header
 		rc = ngx_http_vod_send_header(r, ctx->content_length, NULL, CACHE_TYPE_VOD);
@@ -2257,6 +3835,162 @@ ngx_http_vod_init_frame_processing(ngx_http_vod_ctx_t *ctx)
 	return NGX_OK;
 }
 
+static void
+ngx_http_vod_parallel_read_completed(void* context, ngx_int_t rc, ngx_buf_t* buf, ssize_t bytes_read)
+{
+	ngx_http_vod_parallel_read_t* read = context;
+	ngx_http_vod_ctx_t *ctx = read->ctx;
+
+	if (rc != NGX_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_parallel_read_completed: read failed %i", rc);
+		ctx->parallel_read_rc = rc;
+	}
+	else if (bytes_read <= 0)
+	{
+		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_parallel_read_completed: bytes read is zero");
+		ctx->parallel_read_rc = ngx_http_vod_status_to_ngx_error(VOD_BAD_DATA);
+	}
+	else
+	{
+		read_cache_parallel_read_completed(&ctx->read_cache_state, read->index, buf != NULL ? buf : &read->buf);
+	}
+
+	ctx->pending_reads--;
+	if (ctx->pending_reads > 0)
+	{
+		// still waiting for other reads
+		return;
+	}
+
+	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, ctx->perf_counter_async_read);
+
+	// Note: the state machine is resumed only once all the reads complete, since the read buffers
+	//		are referenced by the upstreams until then
+	rc = ctx->parallel_read_rc;
+	if (rc == NGX_OK)
+	{
+		rc = ctx->state_machine(ctx);
+		if (rc == NGX_AGAIN)
+		{
+			return;
+		}
+	}
+
+	ngx_http_vod_finalize_request(ctx, rc);
+}
+
+static ngx_int_t
+ngx_http_vod_start_parallel_reads(ngx_http_vod_ctx_t *ctx)
+{
+	read_cache_get_read_buffer_t* read_bufs;
+	ngx_http_vod_parallel_read_t* reads;
+	ngx_http_vod_parallel_read_t* cur_read;
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	size_t read_count;
+	size_t i;
+	ngx_int_t rc;
+
+	read_bufs = ngx_palloc(ctx->submodule_context.request_context.pool, sizeof(read_bufs[0]) * conf->max_parallel_reads);
+	if (read_bufs == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_start_parallel_reads: ngx_palloc failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	rc = read_cache_get_parallel_reads(
+		&ctx->read_cache_state,
+		ctx->submodule_context.media_set.sources_head,
+		conf->max_parallel_reads,
+		read_bufs,
+		&read_count);
+	if (rc != VOD_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_start_parallel_reads: read_cache_get_parallel_reads failed %i", rc);
+		return ngx_http_vod_status_to_ngx_error(rc);
+	}
+
+	if (read_count <= 0)
+	{
+		return NGX_OK;
+	}
+
+	reads = ngx_palloc(ctx->submodule_context.request_context.pool, sizeof(reads[0]) * read_count);
+	if (reads == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_start_parallel_reads: ngx_palloc failed (2)");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	ctx->pending_reads = 0;
+	ctx->parallel_read_rc = NGX_OK;
+
+	ngx_perf_counter_start(ctx->perf_counter_context);
+
+	for (i = 0; i < read_count; i++)
+	{
+		// allocate a separate buffer for each read
+		ctx->read_buffer.start = NULL;
+		rc = ngx_http_vod_alloc_read_buffer(ctx, read_bufs[i].size, ctx->alloc_params_index);
+		if (rc != NGX_OK)
+		{
+			break;
+		}
+
+		cur_read = &reads[i];
+		cur_read->ctx = ctx;
+		cur_read->buf = ctx->read_buffer;
+		cur_read->index = i;
+
+		rc = ctx->parallel_read(
+			read_bufs[i].source->reader_context,
+			&cur_read->buf,
+			read_bufs[i].size,
+			read_bufs[i].offset,
+			ngx_http_vod_parallel_read_completed,
+			cur_read);
+		switch (rc)
+		{
+		case NGX_OK:
+			// read completed synchronously (e.g. from the block cache)
+			read_cache_parallel_read_completed(&ctx->read_cache_state, i, &cur_read->buf);
+			continue;
+
+		case NGX_AGAIN:
+			ctx->pending_reads++;
+			continue;
+		}
+
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_start_parallel_reads: parallel_read failed %i", rc);
+		break;
+	}
+
+	if (ctx->pending_reads <= 0)
+	{
+		if (i < read_count)
+		{
+			return rc;
+		}
+
+		ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, ctx->perf_counter_async_read);
+		return NGX_OK;
+	}
+
+	if (i < read_count)
+	{
+		// wait for the reads that were started, the error is returned once they complete
+		ctx->parallel_read_rc = rc;
+	}
+
+	return NGX_AGAIN;
+}
+
 static ngx_int_t 
 ngx_http_vod_process_media_frames(ngx_http_vod_ctx_t *ctx)
 {
@@ -2301,7 +4035,8 @@ ngx_http_vod_process_media_frames(ngx_http_vod_ctx_t *ctx)
 			ctx->read_buffer.end = read_buf.buffer + cache_buffer_size;
 		}
 
-		rc = ngx_http_vod_alloc_read_buffer(ctx, cache_buffer_size, ctx->alloc_params_index);
+		// Note: coalesced reads may be larger than the cache buffer size
+		rc = ngx_http_vod_alloc_read_buffer(ctx, ngx_max(cache_buffer_size, read_buf.size), ctx->alloc_params_index);
 		if (rc != NGX_OK)
 		{
 			return rc;
@@ -2332,6 +4067,72 @@ ngx_http_vod_process_media_frames(ngx_http_vod_ctx_t *ctx)
 	}
 }
 
+static void
+ngx_http_vod_prefetch_next_segment(ngx_http_vod_ctx_t *ctx)
+{
+	media_clip_source_t* cur_source;
+	frame_list_part_t* part;
+	media_track_t* cur_track;
+	uint64_t segment_size;
+	uint64_t start_offset;
+	uint64_t end_offset;
+
+	if (!ctx->submodule_context.conf->segment_prefetch || ctx->prefetch == NULL)
+	{
+		return;
+	}
+
+	// Note: the offsets of the next segment are not known without parsing its frames, assuming the frames
+	//		of the next segment of each track follow the current ones in the file and have a similar size.
+	//		the range is calculated per track, since the tracks of non-interleaved files are stored apart
+	for (cur_source = ctx->submodule_context.media_set.sources_head; cur_source != NULL; cur_source = cur_source->next)
+	{
+		if (cur_source->reader_context == NULL)
+		{
+			continue;
+		}
+
+		segment_size = 0;
+		for (cur_track = cur_source->track_array.first_track; cur_track < cur_source->track_array.last_track; cur_track++)
+		{
+			segment_size += cur_track->total_frames_size;
+		}
+
+		for (cur_track = cur_source->track_array.first_track; cur_track < cur_source->track_array.last_track; cur_track++)
+		{
+			start_offset = ULLONG_MAX;
+			end_offset = 0;
+
+			for (part = &cur_track->frames; part != NULL; part = part->next)
+			{
+				if (part->frames_source != &frames_source_cache || part->first_frame >= part->last_frame)
+				{
+					continue;
+				}
+
+				start_offset = vod_min(start_offset, part->first_frame->offset);
+				end_offset = vod_max(end_offset, part->last_frame[-1].offset + part->last_frame[-1].size);
+			}
+
+			if (end_offset <= start_offset)
+			{
+				continue;
+			}
+
+			// the frames are scattered in the file, the next segment is not likely to follow them
+			if (end_offset - start_offset > segment_size * MAX_PREFETCH_SEGMENT_SIZE_RATIO)
+			{
+				ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+					"ngx_http_vod_prefetch_next_segment: skipping track %uD, range %uL exceeds segment size %uL",
+					cur_track->index, end_offset - start_offset, segment_size);
+				continue;
+			}
+
+			ctx->prefetch(cur_source->reader_context, end_offset, end_offset - start_offset);
+		}
+	}
+}
+
 static ngx_int_t
 ngx_http_vod_finalize_segment_response(ngx_http_vod_ctx_t *ctx)
 {
@@ -2341,7 +4142,8 @@ ngx_http_vod_finalize_segment_response(ngx_http_vod_ctx_t *ctx)
 	// if we already sent the headers and all the buffers, just signal completion and return
 	if (r->header_sent)
 	{
-		if (ctx->write_segment_buffer_context.total_size != ctx->content_length)
+		if (ctx->content_length != 0 &&
+			ctx->write_segment_buffer_context.total_size != ctx->content_length)
 		{
 			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
 				"ngx_http_vod_finalize_segment_response: actual content length %uz is different than reported length %uz",
@@ -2528,13 +4330,46 @@ ngx_http_vod_run_state_machine(ngx_http_vod_ctx_t *ctx)
 			return rc;
 		}
 
-		ctx->state = STATE_READ_METADATA_INITIAL;
+		ctx->state = STATE_FETCH_MANIFEST;
 		ctx->cur_sequence = ctx->submodule_context.media_set.sequences;
 		// fallthrough
 
+	case STATE_FETCH_MANIFEST:
+		if (ctx->manifest_cache_enabled)
+		{
+			rc = ngx_http_vod_fetch_manifest(ctx);
+			if (rc != NGX_DECLINED)
+			{
+				return rc;
+			}
+		}
+
+		ctx->state = STATE_OPEN_SOURCES;
+
+		if (ctx->open_sources != NULL &&
+			ctx->request != NULL &&
+			ctx->request->request_class == REQUEST_CLASS_SEGMENT &&
+			ctx->cur_source != NULL &&
+			ctx->cur_source->next != NULL)
+		{
+			// multiple sources - open them concurrently, instead of one by one as part of reading the metadata
+			rc = ctx->open_sources(ctx);
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
+		}
+		// fallthrough
+
+	case STATE_OPEN_SOURCES:
+		ctx->state = STATE_READ_METADATA_INITIAL;
+		// fallthrough
+
 	case STATE_READ_METADATA_INITIAL:
 	case STATE_READ_METADATA_OPEN_FILE:
+	case STATE_READ_METADATA_INDEX_CACHE:
 	case STATE_READ_METADATA_READ:
+	case STATE_READ_METADATA_PARSE:
 	case STATE_READ_FRAMES_OPEN_FILE:
 	case STATE_READ_FRAMES_READ:
 
@@ -2591,6 +4426,20 @@ ngx_http_vod_run_state_machine(ngx_http_vod_ctx_t *ctx)
 				&ctx->submodule_context.request_context,
 				ctx->submodule_context.conf->cache_buffer_size,
 				ctx->alignment);
+
+			if (ctx->submodule_context.conf->max_coalesced_read_size > 0)
+			{
+				rc = read_cache_enable_coalescing(
+					&ctx->read_cache_state,
+					ctx->submodule_context.conf->max_coalesced_read_size,
+					ctx->submodule_context.conf->coalesced_read_max_gap);
+				if (rc != VOD_OK)
+				{
+					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+						"ngx_http_vod_run_state_machine: read_cache_enable_coalescing failed %i", rc);
+					return ngx_http_vod_status_to_ngx_error(rc);
+				}
+			}
 		}
 
 		ctx->state = STATE_OPEN_FILE;
@@ -2692,11 +4541,27 @@ ngx_http_vod_run_state_machine(ngx_http_vod_ctx_t *ctx)
 
 		if (ctx->frame_processor_state == NULL)
 		{
+			ngx_http_vod_prefetch_next_segment(ctx);
 			return ngx_http_vod_finalize_segment_response(ctx);
 		}
 
 		ctx->submodule_context.request_context.log->action = "processing frames";
 		ctx->state = STATE_PROCESS_FRAMES;
+
+		// read the coalesced ranges of the segment concurrently, the frames are processed once all reads complete
+		if (ctx->parallel_read != NULL && ctx->submodule_context.conf->max_parallel_reads > 0)
+		{
+			rc = ngx_http_vod_start_parallel_reads(ctx);
+			if (rc != NGX_OK)
+			{
+				if (rc != NGX_AGAIN)
+				{
+					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+						"ngx_http_vod_run_state_machine: ngx_http_vod_start_parallel_reads failed %i", rc);
+				}
+				return rc;
+			}
+		}
 		// fallthrough
 
 	case STATE_PROCESS_FRAMES:
@@ -2711,6 +4576,7 @@ ngx_http_vod_run_state_machine(ngx_http_vod_ctx_t *ctx)
 			return rc;
 		}
 
+		ngx_http_vod_prefetch_next_segment(ctx);
 		return ngx_http_vod_finalize_segment_response(ctx);
 
 	case STATE_DUMP_OPEN_FILE:
@@ -2943,7 +4809,7 @@ ngx_http_vod_start_processing_media_file(ngx_http_vod_ctx_t *ctx)
 	}
 	else
 	{
-		ctx->state = STATE_READ_METADATA_INITIAL;
+		ctx->state = STATE_FETCH_MANIFEST;
 	}
 
 	return ngx_http_vod_run_state_machine(ctx);
@@ -3097,6 +4963,10 @@ ngx_http_vod_init_file_reader_internal(ngx_http_request_t *r, ngx_str_t* path, v
 
 	*context = state;
 
+#if (NGX_HAVE_IO_URING)
+	state->use_io_uring = ctx->submodule_context.conf->io_uring;
+#endif
+
 	ngx_perf_counter_start(ctx->perf_counter_context);
 
 #if (NGX_THREADS)
@@ -3141,27 +5011,571 @@ ngx_http_vod_init_file_reader_internal(ngx_http_request_t *r, ngx_str_t* path, v
 
 		if (rc != NGX_AGAIN)
 		{
-			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-				"ngx_http_vod_init_file_reader_internal: ngx_file_reader_init failed %i", rc);
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_init_file_reader_internal: ngx_file_reader_init failed %i", rc);
+		}
+		return rc;
+	}
+
+	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_OPEN_FILE);
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_init_file_reader(ngx_http_request_t *r, ngx_str_t* path, void** context)
+{
+	return ngx_http_vod_init_file_reader_internal(r, path, context, 0);
+}
+
+static ngx_int_t
+ngx_http_vod_init_file_reader_with_fallback(ngx_http_request_t *r, ngx_str_t* path, void** context)
+{
+	return ngx_http_vod_init_file_reader_internal(r, path, context, 1);
+}
+
+static void ngx_http_vod_metadata_read_completed(void* context, ngx_int_t rc, ngx_buf_t* buf, ssize_t bytes_read);
+static void ngx_http_vod_metadata_read_finished(ngx_http_vod_metadata_read_t* read, ngx_int_t rc);
+
+static ngx_int_t
+ngx_http_vod_metadata_read_start(ngx_http_vod_metadata_read_t* read, media_format_read_request_t* read_req)
+{
+	ngx_http_vod_ctx_t* ctx = read->ctx;
+	size_t read_size;
+	off_t read_offset;
+	ngx_int_t rc;
+
+	// align the read size and offset
+	read_offset = read_req->read_offset & (~(ctx->alignment - 1));
+	if (read_req->read_size == 0)
+	{
+		read_size = ctx->submodule_context.conf->initial_read_size;
+	}
+	else
+	{
+		read_size = read_req->read_size + read_req->read_offset - read_offset;
+	}
+
+	read_size = (read_size + ctx->alignment - 1) & (~(ctx->alignment - 1));
+
+	// allocate the read buffer, the previous buffer is reused unless there are references to it
+	ctx->read_buffer = read->read_buffer;
+	if (read_req->realloc_buffer)
+	{
+		ctx->read_buffer.start = NULL;
+	}
+
+	rc = ngx_http_vod_alloc_read_buffer(ctx, read_size, ctx->alloc_params_index);
+	read->read_buffer = ctx->read_buffer;
+	ctx->read_buffer.start = NULL;
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	// perform the read
+	read->read_offset = read_offset;
+	read->requested_offset = read_req->read_offset;
+
+	return ngx_async_file_read_callback(
+		read->source->reader_context,
+		&read->read_buffer,
+		read_size,
+		read_offset,
+		ngx_http_vod_metadata_read_completed,
+		read);
+}
+
+static ngx_int_t
+ngx_http_vod_metadata_read_process(ngx_http_vod_metadata_read_t* read)
+{
+	media_format_read_metadata_result_t result;
+	ngx_http_vod_ctx_t* ctx = read->ctx;
+	vod_str_t read_buffer;
+	size_t buffer_size;
+	off_t buffer_offset;
+	ngx_int_t rc;
+
+	for (;;)
+	{
+		// adjust the buffer pointer following the alignment
+		buffer_offset = read->requested_offset - read->read_offset;
+		buffer_size = read->read_buffer.last - read->read_buffer.pos;
+
+		if (buffer_size < (size_t)buffer_offset)
+		{
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_metadata_read_process: buffer size %uz is smaller than buffer offset %O",
+				buffer_size, buffer_offset);
+			return ngx_http_vod_status_to_ngx_error(VOD_BAD_DATA);
+		}
+
+		read_buffer.data = read->read_buffer.pos + buffer_offset;
+		read_buffer.len = buffer_size - buffer_offset;
+
+		if (read->format == NULL)
+		{
+			rc = ngx_http_vod_identify_format(ctx, &read_buffer, &read->format, &read->metadata_reader_context);
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
+		}
+
+		// run the read state machine
+		rc = read->format->read_metadata(
+			read->metadata_reader_context,
+			read->requested_offset,
+			&read_buffer,
+			&result);
+		if (rc == VOD_OK)
+		{
+			read->parts = result.parts;
+			read->multipart_header.type = read->format->id;
+			read->multipart_header.part_count = result.part_count;
+			return NGX_OK;
+		}
+
+		if (rc != VOD_AGAIN)
+		{
+			ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_metadata_read_process: read_metadata(%V) failed %i", &read->format->name, rc);
+			return ngx_http_vod_status_to_ngx_error(rc);
+		}
+
+		// issue another read request
+		rc = ngx_http_vod_metadata_read_start(read, &result.read_req);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+	}
+}
+
+static void
+ngx_http_vod_metadata_read_completed(void* context, ngx_int_t rc, ngx_buf_t* buf, ssize_t bytes_read)
+{
+	ngx_http_vod_metadata_read_t* read = context;
+	ngx_http_vod_ctx_t *ctx = read->ctx;
+
+	if (rc != NGX_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_metadata_read_completed: read failed %i", rc);
+	}
+	else if (bytes_read <= 0)
+	{
+		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_metadata_read_completed: bytes read is zero");
+		rc = ngx_http_vod_status_to_ngx_error(VOD_BAD_DATA);
+	}
+	else
+	{
+		rc = ngx_http_vod_metadata_read_process(read);
+		if (rc == NGX_AGAIN)
+		{
+			// another read was issued for this source
+			return;
+		}
+	}
+
+	ngx_http_vod_metadata_read_finished(read, rc);
+}
+
+static void
+ngx_http_vod_metadata_read_index_cache_completed(void* context, ngx_int_t rc)
+{
+	ngx_http_vod_metadata_read_t* read = context;
+	media_format_read_request_t read_req;
+
+	if (rc == NGX_OK)
+	{
+		read->index_cache_hit = 1;
+	}
+	else
+	{
+		// index cache miss, read the metadata from the file
+		ngx_memzero(&read_req, sizeof(read_req));
+
+		rc = ngx_http_vod_metadata_read_start(read, &read_req);
+		if (rc == NGX_OK)
+		{
+			// read completed synchronously
+			rc = ngx_http_vod_metadata_read_process(read);
+		}
+
+		if (rc == NGX_AGAIN)
+		{
+			return;
+		}
+	}
+
+	ngx_http_vod_metadata_read_finished(read, rc);
+}
+
+static void
+ngx_http_vod_metadata_read_finished(ngx_http_vod_metadata_read_t* read, ngx_int_t rc)
+{
+	ngx_http_vod_ctx_t *ctx = read->ctx;
+
+	// Note: errors are not handled here, the metadata of sources that failed is read again by 
+	//		the state machine, so that the error is handled in a single place
+	read->rc = rc;
+
+	ctx->pending_metadata_reads--;
+	if (ctx->pending_metadata_reads > 0)
+	{
+		// still waiting for other sources
+		ctx->submodule_context.r->aio = 1;
+		return;
+	}
+
+	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_READ_FILE);
+
+	// run the state machine
+	rc = ctx->state_machine(ctx);
+	if (rc == NGX_AGAIN)
+	{
+		return;
+	}
+
+	ngx_http_vod_finalize_request(ctx, rc);
+}
+
+static ngx_int_t
+ngx_http_vod_read_sources_metadata(ngx_http_vod_ctx_t *ctx)
+{
+	media_format_read_request_t read_req;
+	ngx_http_vod_metadata_read_t* cur_read;
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	media_clip_source_t* cur_source;
+	ngx_uint_t source_count;
+	ngx_int_t rc;
+
+	source_count = 0;
+	for (cur_source = ctx->cur_source; cur_source != NULL; cur_source = cur_source->next)
+	{
+		source_count++;
+	}
+
+	ctx->metadata_reads = ngx_palloc(ctx->submodule_context.r->pool, sizeof(ctx->metadata_reads[0]) * source_count);
+	if (ctx->metadata_reads == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_read_sources_metadata: ngx_palloc failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	ctx->metadata_read_count = 0;
+	ctx->pending_metadata_reads = 0;
+
+	ngx_memzero(&read_req, sizeof(read_req));
+
+	ngx_perf_counter_start(ctx->perf_counter_context);
+
+	for (cur_source = ctx->cur_source;
+		cur_source != NULL;
+		cur_source = cur_source->next)
+	{
+		if (cur_source->reader_context == NULL)
+		{
+			// failed to open, handled by the state machine
+			continue;
+		}
+
+		cur_read = &ctx->metadata_reads[ctx->metadata_read_count];
+		ngx_memzero(cur_read, sizeof(*cur_read));
+		cur_read->ctx = ctx;
+		cur_read->source = cur_source;
+
+		if (conf->metadata_cache != NULL)
+		{
+			// the metadata of cached sources is parsed by the state machine, using the fetched parts
+			if (ngx_buffer_cache_fetch_multipart_perf(
+				ctx,
+				conf->metadata_cache,
+				cur_source->file_key,
+				&cur_read->multipart_header,
+				&cur_read->parts))
+			{
+				cur_read->metadata_cache_hit = 1;
+				cur_read->rc = NGX_OK;
+				ctx->metadata_read_count++;
+				continue;
+			}
+
+			rc = ngx_http_vod_cache_try_lock(ctx, conf->metadata_cache, cur_source->file_key);
+			if (rc == NGX_DECLINED)
+			{
+				// another request is reading the metadata of this source, the state machine waits for it
+				continue;
+			}
+
+			if (rc != NGX_OK)
+			{
+				return rc;
+			}
+		}
+
+		ctx->metadata_read_count++;
+
+		if (conf->index_cache != NULL && ctx->get_file_info != NULL)
+		{
+			rc = ngx_http_vod_fetch_index_cache(
+				ctx,
+				cur_source,
+				&cur_read->multipart_header,
+				&cur_read->parts,
+				ngx_http_vod_metadata_read_index_cache_completed,
+				cur_read);
+			switch (rc)
+			{
+			case NGX_OK:
+				cur_read->index_cache_hit = 1;
+				cur_read->rc = NGX_OK;
+				continue;
+
+			case NGX_AGAIN:
+				// the metadata is read once the fetch completes, in case of a miss
+				ctx->pending_metadata_reads++;
+				cur_read->rc = NGX_AGAIN;
+				continue;
+
+			case NGX_DECLINED:
+				break;
+
+			default:
+				return rc;
+			}
+		}
+
+		rc = ngx_http_vod_metadata_read_start(cur_read, &read_req);
+		if (rc == NGX_OK)
+		{
+			// read completed synchronously
+			rc = ngx_http_vod_metadata_read_process(cur_read);
+		}
+
+		if (rc == NGX_AGAIN)
+		{
+			ctx->pending_metadata_reads++;
+		}
+
+		cur_read->rc = rc;
+	}
+
+	if (ctx->pending_metadata_reads > 0)
+	{
+		return NGX_AGAIN;
+	}
+
+	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_READ_FILE);
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_vod_open_sources_sync(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_file_reader_state_t* state;
+	ngx_http_core_loc_conf_t *clcf;
+	media_clip_source_t* cur_source;
+	ngx_http_request_t *r = ctx->submodule_context.r;
+
+	clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+	ngx_perf_counter_start(ctx->perf_counter_context);
+
+	for (cur_source = ctx->cur_source;
+		cur_source != NULL;
+		cur_source = cur_source->next)
+	{
+		if (cur_source->reader_context != NULL)
+		{
+			continue;
+		}
+
+		state = ngx_pcalloc(r->pool, sizeof(*state));
+		if (state == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_open_sources_sync: ngx_pcalloc failed");
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+
+#if (NGX_HAVE_IO_URING)
+		state->use_io_uring = ctx->submodule_context.conf->io_uring;
+#endif
+
+		if (ngx_file_reader_init(
+			state,
+			ngx_http_vod_handle_read_completed,
+			ctx,
+			r,
+			clcf,
+			&cur_source->mapped_uri) == NGX_OK)
+		{
+			cur_source->reader_context = state;
+		}
+
+		// Note: sources that failed to open are opened again when their metadata is read
+	}
+
+	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_OPEN_FILE);
+
+	return NGX_OK;
+}
+
+#if (NGX_THREADS)
+static void
+ngx_http_vod_open_sources_completed(void* context, ngx_int_t rc)
+{
+	ngx_http_vod_ctx_t *ctx = (ngx_http_vod_ctx_t *)context;
+	ngx_file_reader_state_t* state;
+	media_clip_source_t* cur_source;
+
+	ctx->pending_opens--;
+	if (ctx->pending_opens > 0)
+	{
+		// still waiting for other sources
+		ctx->submodule_context.r->aio = 1;
+		return;
+	}
+
+	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_ASYNC_OPEN_FILE);
+
+	// Note: errors are not handled here, the sources that failed to open are opened again
+	//		when their metadata is read, so that the error / fallback are handled in a single place
+	for (cur_source = ctx->cur_source;
+		cur_source != NULL;
+		cur_source = cur_source->next)
+	{
+		state = cur_source->reader_context;
+		if (state != NULL && state->file.fd == NGX_INVALID_FILE)
+		{
+			cur_source->reader_context = NULL;
+		}
+	}
+
+	// read the metadata of the sources
+	rc = ngx_http_vod_read_sources_metadata(ctx);
+	if (rc == NGX_OK)
+	{
+		// run the state machine
+		rc = ctx->state_machine(ctx);
+	}
+
+	if (rc == NGX_AGAIN)
+	{
+		return;
+	}
+
+	ngx_http_vod_finalize_request(ctx, rc);
+}
+
+static ngx_int_t
+ngx_http_vod_open_sources_async(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	ngx_file_reader_state_t* state;
+	ngx_http_core_loc_conf_t *clcf;
+	media_clip_source_t* cur_source;
+	ngx_http_request_t *r = ctx->submodule_context.r;
+	void* open_context;
+	ngx_int_t rc;
+
+	clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+	ctx->pending_opens = 0;
+
+	ngx_perf_counter_start(ctx->perf_counter_context);
+
+	for (cur_source = ctx->cur_source;
+		cur_source != NULL;
+		cur_source = cur_source->next)
+	{
+		if (cur_source->reader_context != NULL)
+		{
+			continue;
+		}
+
+		state = ngx_pcalloc(r->pool, sizeof(*state));
+		if (state == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+				"ngx_http_vod_open_sources_async: ngx_pcalloc failed");
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+
+		state->file.fd = NGX_INVALID_FILE;
+#if (NGX_HAVE_IO_URING)
+		state->use_io_uring = conf->io_uring;
+#endif
+
+		// Note: each open requires a separate context, since the opens run concurrently
+		open_context = NULL;
+
+		rc = ngx_file_reader_init_async(
+			state,
+			&open_context,
+			conf->open_file_thread_pool,
+			ngx_http_vod_open_sources_completed,
+			ngx_http_vod_handle_read_completed,
+			ctx,
+			r,
+			clcf,
+			&cur_source->mapped_uri);
+		switch (rc)
+		{
+		case NGX_AGAIN:
+			ctx->pending_opens++;
+			// fallthrough
+
+		case NGX_OK:
+			cur_source->reader_context = state;
+			break;
+
+		default:
+			// the source will be opened again when its metadata is read
+			break;
 		}
-		return rc;
+	}
+
+	if (ctx->pending_opens > 0)
+	{
+		return NGX_AGAIN;
 	}
 
 	ngx_perf_counter_end(ctx->perf_counters, ctx->perf_counter_context, PC_OPEN_FILE);
 
 	return NGX_OK;
 }
+#endif // NGX_THREADS
 
 static ngx_int_t
-ngx_http_vod_init_file_reader(ngx_http_request_t *r, ngx_str_t* path, void** context)
+ngx_http_vod_open_sources(ngx_http_vod_ctx_t *ctx)
 {
-	return ngx_http_vod_init_file_reader_internal(r, path, context, 0);
-}
+	ngx_int_t rc;
 
-static ngx_int_t
-ngx_http_vod_init_file_reader_with_fallback(ngx_http_request_t *r, ngx_str_t* path, void** context)
-{
-	return ngx_http_vod_init_file_reader_internal(r, path, context, 1);
+#if (NGX_THREADS)
+	if (ctx->submodule_context.conf->open_file_thread_pool != NULL)
+	{
+		rc = ngx_http_vod_open_sources_async(ctx);
+	}
+	else
+	{
+#endif
+		rc = ngx_http_vod_open_sources_sync(ctx);
+#if (NGX_THREADS)
+	}
+#endif
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	// read the metadata of the sources concurrently, parsing is performed by the state machine one source at a time
+	return ngx_http_vod_read_sources_metadata(ctx);
 }
 
 // Note: this function initializes r->exten in order to have nginx select the correct mime type for the request
@@ -3227,7 +5641,13 @@ ngx_http_vod_dump_file(ngx_http_vod_ctx_t* ctx)
 ////// Remote & mapped modes
 
 static ngx_int_t
-ngx_http_vod_async_http_read(ngx_http_vod_http_reader_state_t *state, ngx_buf_t *buf, size_t size, off_t offset)
+ngx_http_vod_http_read(
+	ngx_http_vod_http_reader_state_t *state, 
+	ngx_buf_t *buf, 
+	size_t size, 
+	off_t offset, 
+	ngx_child_request_callback_t callback, 
+	void* callback_context)
 {
 	ngx_http_vod_loc_conf_t *conf;
 	ngx_http_vod_ctx_t *ctx;
@@ -3245,13 +5665,251 @@ ngx_http_vod_async_http_read(ngx_http_vod_http_reader_state_t *state, ngx_buf_t
 
 	return ngx_child_request_start(
 		state->r,
-		ngx_http_vod_handle_read_completed,
-		ctx,
+		callback,
+		callback_context,
 		&conf->upstream_location,
 		&child_params,
 		buf);
 }
 
+static ngx_int_t
+ngx_http_vod_async_http_read(ngx_http_vod_http_reader_state_t *state, ngx_buf_t *buf, size_t size, off_t offset)
+{
+	ngx_http_vod_ctx_t *ctx;
+
+	ctx = ngx_http_get_module_ctx(state->r, ngx_http_vod_module);
+
+	return ngx_http_vod_http_read(state, buf, size, offset, ngx_http_vod_handle_read_completed, ctx);
+}
+
+static void
+ngx_http_vod_block_cache_get_key(
+	ngx_http_vod_ctx_t *ctx,
+	ngx_http_vod_http_reader_state_t *state,
+	uint64_t block_index,
+	u_char* key)
+{
+	ngx_md5_t md5;
+	uint64_t block_size = ctx->submodule_context.conf->block_cache_block_size;
+
+	ngx_md5_init(&md5);
+	if (ctx->file_key_prefix != NULL)
+	{
+		ngx_md5_update(&md5, ctx->file_key_prefix->data, ctx->file_key_prefix->len);
+	}
+	ngx_md5_update(&md5, state->cur_remote_suburi.data, state->cur_remote_suburi.len);
+	ngx_md5_update(&md5, &block_size, sizeof(block_size));
+	ngx_md5_update(&md5, &block_index, sizeof(block_index));
+	ngx_md5_final(key, &md5);
+}
+
+static void
+ngx_http_vod_block_cache_read_completed(void* context, ngx_int_t rc, ngx_buf_t* buf, ssize_t bytes_read)
+{
+	ngx_http_vod_block_read_t* read = context;
+	ngx_http_vod_ctx_t *ctx = read->ctx;
+	ngx_buf_t* target = read->buf;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+	u_char* pos;
+	u_char* end;
+	uint64_t block_index;
+	size_t block_size;
+	size_t size;
+	off_t skip;
+
+	if (rc != NGX_OK)
+	{
+		goto done;
+	}
+
+	if (buf == NULL)
+	{
+		buf = &read->response;
+	}
+
+	// save the blocks to the cache
+	// Note: a block that is smaller than the block size is the last block of the file
+	block_size = ctx->submodule_context.conf->block_cache_block_size;
+	block_index = read->block_offset / block_size;
+
+	for (pos = buf->pos; pos < buf->last; pos += size, block_index++)
+	{
+		size = ngx_min(block_size, (size_t)(buf->last - pos));
+
+		ngx_http_vod_block_cache_get_key(ctx, read->state, block_index, key);
+
+		if (ngx_buffer_cache_store_perf(
+			ctx->perf_counters,
+			ctx->submodule_context.conf->block_cache,
+			key,
+			pos,
+			size))
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_block_cache_read_completed: stored block %uL in cache", block_index);
+		}
+		else
+		{
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_block_cache_read_completed: failed to store block %uL in cache", block_index);
+		}
+	}
+
+	// copy the requested range to the buffer of the caller
+	skip = read->offset - read->block_offset;
+	if (skip < buf->last - buf->pos)
+	{
+		pos = buf->pos + skip;
+		end = buf->pos + ngx_min(read->end_offset - read->block_offset, buf->last - buf->pos);
+		target->last = ngx_copy(target->last, pos, end - pos);
+	}
+
+	ngx_pfree(ctx->submodule_context.r->pool, read->response.start);
+
+done:
+
+	read->callback(read->callback_context, rc, target, target->last - target->pos);
+}
+
+static ngx_int_t
+ngx_http_vod_block_cache_read(
+	ngx_http_vod_http_reader_state_t *state,
+	ngx_buf_t *buf,
+	size_t size,
+	off_t offset,
+	ngx_child_request_callback_t callback,
+	void* callback_context)
+{
+	ngx_perf_counter_context(pcctx);
+	ngx_buffer_cache_entry_t* entry;
+	ngx_http_vod_block_read_t* read;
+	ngx_http_vod_loc_conf_t *conf;
+	ngx_http_vod_ctx_t *ctx;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+	u_char* block;
+	size_t block_size;
+	size_t block_data_size;
+	size_t read_size;
+	off_t block_offset;
+	off_t end_offset = offset + size;
+	off_t last_block_end;
+	ngx_int_t rc;
+
+	ctx = ngx_http_get_module_ctx(state->r, ngx_http_vod_module);
+	conf = ctx->submodule_context.conf;
+	block_size = conf->block_cache_block_size;
+
+	// copy the blocks that are found in the cache
+	while (offset < end_offset)
+	{
+		block_offset = offset - offset % block_size;
+
+		ngx_http_vod_block_cache_get_key(ctx, state, block_offset / block_size, key);
+
+		ngx_perf_counter_start(pcctx);
+
+		if (!ngx_buffer_cache_fetch(conf->block_cache, key, &block, &block_data_size, &entry))
+		{
+			ngx_perf_counter_end(ctx->perf_counters, pcctx, PC_FETCH_CACHE);
+			break;
+		}
+
+		ngx_perf_counter_end(ctx->perf_counters, pcctx, PC_FETCH_CACHE);
+
+		if (offset - block_offset < (off_t)block_data_size)
+		{
+			read_size = ngx_min(end_offset, block_offset + (off_t)block_data_size) - offset;
+			buf->last = ngx_copy(buf->last, block + (offset - block_offset), read_size);
+			offset += read_size;
+		}
+
+		ngx_buffer_cache_release(entry);
+
+		if (block_data_size < block_size)
+		{
+			// the last block of the file
+			end_offset = offset;
+			break;
+		}
+	}
+
+	if (offset >= end_offset)
+	{
+		if (buf->last <= buf->pos)
+		{
+			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
+				"ngx_http_vod_block_cache_read: offset %O is beyond the end of the file", offset);
+			return ngx_http_vod_status_to_ngx_error(VOD_BAD_DATA);
+		}
+
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_block_cache_read: read %uz bytes from cache", (size_t)(buf->last - buf->pos));
+		return NGX_OK;
+	}
+
+	// read the missing blocks and the read ahead blocks from the upstream
+	read = ngx_palloc(ctx->submodule_context.r->pool, sizeof(*read));
+	if (read == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_block_cache_read: ngx_palloc failed");
+		return NGX_ERROR;
+	}
+
+	read->ctx = ctx;
+	read->state = state;
+	read->callback = callback;
+	read->callback_context = callback_context;
+	read->buf = buf;
+	read->offset = offset;
+	read->end_offset = end_offset;
+	read->block_offset = offset - offset % block_size;
+
+	last_block_end = end_offset + block_size - 1;
+	last_block_end -= last_block_end % block_size;
+	last_block_end += conf->block_cache_read_ahead * block_size;
+
+	read_size = last_block_end - read->block_offset;
+
+	ngx_memzero(&read->response, sizeof(read->response));
+	read->response.start = ngx_palloc(ctx->submodule_context.r->pool, read_size + conf->max_upstream_headers_size + 1);
+	if (read->response.start == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
+			"ngx_http_vod_block_cache_read: ngx_palloc failed (2)");
+		return NGX_ERROR;
+	}
+
+	read->response.pos = read->response.start;
+	read->response.last = read->response.start;
+	read->response.end = read->response.start + read_size + conf->max_upstream_headers_size + 1;
+	read->response.temporary = 1;
+
+	rc = ngx_http_vod_http_read(
+		state,
+		&read->response,
+		read_size,
+		read->block_offset,
+		ngx_http_vod_block_cache_read_completed,
+		read);
+	if (rc != NGX_AGAIN)
+	{
+		ngx_pfree(ctx->submodule_context.r->pool, read->response.start);
+	}
+
+	return rc;
+}
+
+static ngx_int_t
+ngx_http_vod_block_cache_async_read(ngx_http_vod_http_reader_state_t *state, ngx_buf_t *buf, size_t size, off_t offset)
+{
+	ngx_http_vod_ctx_t *ctx;
+
+	ctx = ngx_http_get_module_ctx(state->r, ngx_http_vod_module);
+
+	return ngx_http_vod_block_cache_read(state, buf, size, offset, ngx_http_vod_handle_read_completed, ctx);
+}
+
 static ngx_int_t
 ngx_http_vod_dump_http_part(ngx_http_vod_http_reader_state_t *state, off_t start, off_t end)
 {
@@ -3325,61 +5983,241 @@ ngx_http_vod_http_reader_open_file(ngx_http_request_t* r, ngx_str_t* path, void*
 		}
 	}
 
-	state = ngx_palloc(r->pool, sizeof(*state));
-	if (state == NULL)
+	state = ngx_palloc(r->pool, sizeof(*state));
+	if (state == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_http_reader_open_file: ngx_palloc failed");
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	// Note: for http, no need to open any files, just save the remote uri
+	state->r = r;
+	state->cur_remote_suburi = *path;
+	*context = state;
+
+	return NGX_OK;
+}
+
+////// Local mode only
+
+ngx_int_t
+ngx_http_vod_local_request_handler(ngx_http_request_t *r)
+{
+	ngx_http_vod_ctx_t *ctx;
+	ngx_int_t rc;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+
+	// map all uris to paths
+	rc = ngx_http_vod_map_uris_to_paths(ctx);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	// initialize for reading files
+	ctx->alloc_params_index = READER_FILE;
+	ctx->alignment = ctx->alloc_params[READER_FILE].alignment;
+
+	ctx->open_file = ngx_http_vod_init_file_reader_with_fallback;
+	ctx->async_read = (ngx_http_vod_async_read_func_t)ngx_async_file_read;
+	ctx->dump_part = (ngx_http_vod_dump_part_t)ngx_file_reader_dump_file_part;
+	ctx->dump_request = ngx_http_vod_dump_file;
+	ctx->get_file_info = (ngx_http_vod_get_file_info_t)ngx_file_reader_get_file_info;
+	ctx->prefetch = (ngx_http_vod_prefetch_t)ngx_file_reader_prefetch;
+	ctx->open_sources = ngx_http_vod_open_sources;
+	ctx->perf_counter_async_read = PC_ASYNC_READ_FILE;
+
+	// start the state machine
+	rc = ngx_http_vod_start_processing_media_file(ctx);
+	if (rc != NGX_AGAIN && rc != NGX_DONE && rc != NGX_OK)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_local_request_handler: ngx_http_vod_start_processing_media_file failed %i", rc);
+	}
+
+	return rc;
+}
+
+////// Mapped mode only
+
+static ngx_flag_t
+ngx_http_vod_map_media_set_is_single_source(ngx_http_vod_ctx_t *ctx)
+{
+	return ctx->submodule_context.media_set.sequence_count == 1 &&
+		ctx->submodule_context.media_set.sequences[0].clips[0]->type == MEDIA_CLIP_SOURCE;
+}
+
+/*
+	when the mapping context has a refresh time, cached mappings older than the refresh time are still used,
+	but a background request is sent to refresh them. the key lock of the cache makes sure a single request
+	refreshes each entry, the previous entry is replaced only if the new response passes the same parsing
+	that is applied to mappings that are read on a cache miss, and it is stored in the cache that the 
+	parsing selects
+*/
+static void
+ngx_http_vod_map_refresh_finished(void* context, ngx_int_t rc, ngx_buf_t* response, ssize_t content_length)
+{
+	ngx_http_vod_media_set_mapping_t mapping_result;
+	ngx_http_vod_mapping_refresh_t* refresh = context;
+	ngx_http_vod_ctx_t* ctx = refresh->ctx;
+	ngx_buffer_cache_t* cache;
+	ngx_str_t mapping;
+	ngx_log_t* log = ctx->submodule_context.request_context.log;
+
+	if (rc != NGX_OK)
+	{
+		ngx_log_error(NGX_LOG_WARN, log, 0,
+			"ngx_http_vod_map_refresh_finished: upstream request failed %i, keeping the cached mapping", rc);
+		goto unlock;
+	}
+
+	if (response->last == response->pos)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"ngx_http_vod_map_refresh_finished: empty mapping response");
+		goto unlock;
+	}
+
+	if (response->last >= response->end)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"ngx_http_vod_map_refresh_finished: not enough room in buffer for null terminator");
+		goto unlock;
+	}
+
+	*response->last = '\0';
+
+	mapping.data = response->pos;
+	mapping.len = response->last - response->pos;
+
+	// validate the response before replacing the cached mapping
+	rc = ngx_http_vod_map_media_set_parse(
+		ctx,
+		refresh->source,
+		&mapping,
+		refresh->single_source,
+		&mapping_result);
+	if (rc != NGX_OK)
+	{
+		ngx_log_error(NGX_LOG_WARN, log, 0,
+			"ngx_http_vod_map_refresh_finished: invalid mapping %i, keeping the cached mapping", rc);
+		goto unlock;
+	}
+
+	cache = ctx->mapping.caches[mapping_result.cache_index];
+	if (cache != refresh->cache)
+	{
+		// the mapping changed its type (e.g. vod -> live), the entry moves to another cache
+		ngx_buffer_cache_delete(refresh->cache, refresh->key);
+		if (cache == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+				"ngx_http_vod_map_refresh_finished: mapping cache entry removed");
+			goto unlock;
+		}
+	}
+
+	if (ngx_buffer_cache_replace(
+		cache,
+		refresh->key,
+		response->pos,
+		response->last + 1 - response->pos))		// store with the null
 	{
-		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_http_reader_open_file: ngx_palloc failed");
-		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_http_vod_map_refresh_finished: mapping cache entry refreshed");
+	}
+	else
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_http_vod_map_refresh_finished: failed to replace mapping cache entry");
 	}
 
-	// Note: for http, no need to open any files, just save the remote uri
-	state->r = r;
-	state->cur_remote_suburi = *path;
-	*context = state;
+unlock:
 
-	return NGX_OK;
+	ngx_buffer_cache_unlock(refresh->cache, refresh->key);
 }
 
-////// Local mode only
-
-ngx_int_t
-ngx_http_vod_local_request_handler(ngx_http_request_t *r)
+static void
+ngx_http_vod_map_refresh(ngx_http_vod_ctx_t *ctx, ngx_str_t* uri, ngx_buffer_cache_t* cache)
 {
-	ngx_http_vod_ctx_t *ctx;
+	ngx_http_vod_http_reader_state_t* state;
+	ngx_http_vod_mapping_refresh_t* refresh;
+	ngx_child_request_params_t child_params;
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	ngx_http_request_t* r = ctx->submodule_context.r;
 	ngx_int_t rc;
 
-	ctx = ngx_http_get_module_ctx(r, ngx_http_vod_module);
+	if (!ngx_buffer_cache_lock(cache, ctx->mapping.cache_key, conf->cache_lock_timeout))
+	{
+		// already being refreshed by another request
+		return;
+	}
 
-	// map all uris to paths
-	rc = ngx_http_vod_map_uris_to_paths(ctx);
+	refresh = ngx_palloc(r->pool, sizeof(*refresh));
+	if (refresh == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_map_refresh: ngx_palloc failed");
+		goto unlock;
+	}
+
+	refresh->ctx = ctx;
+	refresh->cache = cache;
+	ngx_memcpy(refresh->key, ctx->mapping.cache_key, sizeof(refresh->key));
+
+	// Note: saved since the mapping is validated after the request state changes
+	refresh->source = ctx->cur_source;
+	refresh->single_source = ngx_http_vod_map_media_set_is_single_source(ctx);
+
+	// Note: initializes the upstream extra args
+	rc = ngx_http_vod_http_reader_open_file(r, uri, (void**)&state);
 	if (rc != NGX_OK)
 	{
-		return rc;
+		goto unlock;
 	}
 
-	// initialize for reading files
-	ctx->alloc_params_index = READER_FILE;
-	ctx->alignment = ctx->alloc_params[READER_FILE].alignment;
+	// allocate a separate buffer for the response, the read buffer may be referenced by previous mappings
+	ctx->read_buffer.start = NULL;
+	rc = ngx_http_vod_alloc_read_buffer(ctx, ctx->mapping.max_response_size, ctx->alloc_params_index);
+	if (rc != NGX_OK)
+	{
+		goto unlock;
+	}
 
-	ctx->open_file = ngx_http_vod_init_file_reader_with_fallback;
-	ctx->async_read = (ngx_http_vod_async_read_func_t)ngx_async_file_read;
-	ctx->dump_part = (ngx_http_vod_dump_part_t)ngx_file_reader_dump_file_part;
-	ctx->dump_request = ngx_http_vod_dump_file;
-	ctx->perf_counter_async_read = PC_ASYNC_READ_FILE;
+	refresh->buf = ctx->read_buffer;
+	ctx->read_buffer.start = NULL;
 
-	// start the state machine
-	rc = ngx_http_vod_start_processing_media_file(ctx);
-	if (rc != NGX_AGAIN && rc != NGX_DONE && rc != NGX_OK)
+	ngx_memzero(&child_params, sizeof(child_params));
+	child_params.method = NGX_HTTP_GET;
+	child_params.base_uri = state->cur_remote_suburi;
+	child_params.extra_args = ctx->upstream_extra_args;
+	child_params.range_start = 0;
+	child_params.range_end = ctx->mapping.max_response_size;
+	child_params.background = 1;
+
+	rc = ngx_child_request_start(
+		r,
+		ngx_http_vod_map_refresh_finished,
+		refresh,
+		&conf->upstream_location,
+		&child_params,
+		&refresh->buf);
+	if (rc != NGX_AGAIN)
 	{
 		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"ngx_http_vod_local_request_handler: ngx_http_vod_start_processing_media_file failed %i", rc);
+			"ngx_http_vod_map_refresh: ngx_child_request_start failed %i", rc);
+		goto unlock;
 	}
 
-	return rc;
-}
+	return;
 
-////// Mapped mode only
+unlock:
+
+	// Note: failing to refresh is not an error, the cached mapping is used until it expires
+	ngx_buffer_cache_unlock(cache, ctx->mapping.cache_key);
+}
 
 static ngx_int_t
 ngx_http_vod_map_run_step(ngx_http_vod_ctx_t *ctx)
@@ -3391,6 +6229,7 @@ ngx_http_vod_map_run_step(ngx_http_vod_ctx_t *ctx)
 	ngx_str_t uri;
 	ngx_md5_t md5;
 	ngx_int_t rc;
+	time_t write_time;
 	int cache_index;
 
 	switch (ctx->state)
@@ -3414,20 +6253,33 @@ ngx_http_vod_map_run_step(ngx_http_vod_ctx_t *ctx)
 		ngx_md5_final(ctx->mapping.cache_key, &md5);
 
 		// try getting the mapping from cache
-		if (ngx_buffer_cache_fetch_copy_perf(
+		cache_index = ngx_buffer_cache_fetch_copy_perf(
 			ctx->submodule_context.r,
 			ctx->perf_counters,
 			ctx->mapping.caches,
 			ctx->mapping.cache_count,
 			ctx->mapping.cache_key,
 			&mapping.data,
-			&mapping.len) >= 0)
+			&mapping.len,
+			&write_time);
+		if (cache_index >= 0)
 		{
 			mapping.len--;		// remove the null
 
 			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
 				"ngx_http_vod_map_run_step: mapping cache hit %V", &mapping);
 
+			if (ctx->mapping.refresh_time > 0 &&
+				ngx_time() >= write_time + ctx->mapping.refresh_time)
+			{
+				ngx_http_vod_map_refresh(ctx, &uri, ctx->mapping.caches[cache_index]);
+			}
+
+			if (ctx->manifest_cache_enabled)
+			{
+				ngx_md5_update(&ctx->dependencies_md5, mapping.data, mapping.len);
+			}
+
 			rc = ctx->mapping.apply(ctx, &mapping, &cache_index);
 			if (rc != NGX_OK)
 			{
@@ -3442,6 +6294,12 @@ ngx_http_vod_map_run_step(ngx_http_vod_ctx_t *ctx)
 				"ngx_http_vod_map_run_step: mapping cache miss");
 		}
 
+		rc = ngx_http_vod_cache_lock(ctx, ctx->mapping.caches, ctx->mapping.cache_count, ctx->mapping.cache_key);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+
 		// open the mapping file
 		ctx->submodule_context.request_context.log->action = "getting mapping";
 
@@ -3513,6 +6371,12 @@ ngx_http_vod_map_run_step(ngx_http_vod_ctx_t *ctx)
 
 		mapping.data = response->pos;
 		mapping.len = response->last - response->pos;
+
+		if (ctx->manifest_cache_enabled)
+		{
+			ngx_md5_update(&ctx->dependencies_md5, mapping.data, mapping.len);
+		}
+
 		rc = ctx->mapping.apply(ctx, &mapping, &cache_index);
 		if (rc != NGX_OK)
 		{
@@ -3565,6 +6429,9 @@ ngx_http_vod_map_source_clip_done(ngx_http_vod_ctx_t *ctx)
 	ctx->async_read = (ngx_http_vod_async_read_func_t)ngx_async_file_read;
 	ctx->dump_part = (ngx_http_vod_dump_part_t)ngx_file_reader_dump_file_part;
 	ctx->dump_request = ngx_http_vod_dump_file;
+	ctx->get_file_info = (ngx_http_vod_get_file_info_t)ngx_file_reader_get_file_info;
+	ctx->prefetch = (ngx_http_vod_prefetch_t)ngx_file_reader_prefetch;
+	ctx->open_sources = ngx_http_vod_open_sources;
 	ctx->perf_counter_async_read = PC_ASYNC_READ_FILE;
 
 	// run the main state machine
@@ -3652,6 +6519,7 @@ ngx_http_vod_map_source_clip_start(ngx_http_vod_ctx_t *ctx)
 
 	ctx->mapping.caches = conf->mapping_cache;
 	ctx->mapping.cache_count = 1;
+	ctx->mapping.refresh_time = 0;
 	ctx->mapping.get_uri = ngx_http_vod_map_source_clip_get_uri;
 	ctx->mapping.apply = ngx_http_vod_map_source_clip_apply;
 
@@ -3759,6 +6627,7 @@ ngx_http_vod_map_dynamic_clip_start(ngx_http_vod_ctx_t *ctx)
 
 	ctx->mapping.caches = &conf->dynamic_mapping_cache;
 	ctx->mapping.cache_count = 1;
+	ctx->mapping.refresh_time = 0;
 	ctx->mapping.get_uri = ngx_http_vod_map_dynamic_clip_get_uri;
 	ctx->mapping.apply = ngx_http_vod_map_dynamic_clip_apply;
 
@@ -3785,6 +6654,11 @@ ngx_http_vod_map_dynamic_clip_apply_from_string(ngx_http_vod_ctx_t *ctx)
 		return NGX_ERROR;
 	}
 
+	if (ctx->manifest_cache_enabled)
+	{
+		ngx_md5_update(&ctx->dependencies_md5, mapping.data, mapping.len);
+	}
+
 	rc = dynamic_clip_apply_mapping_string(
 		&ctx->submodule_context.request_context,
 		&ctx->submodule_context.media_set,
@@ -3824,16 +6698,24 @@ ngx_http_vod_map_media_set_get_uri(ngx_http_vod_ctx_t *ctx, ngx_str_t* uri)
 	return NGX_OK;
 }
 
+/*
+	parses the mapping of a source without changing the request state, returns NGX_DECLINED when the
+	upstream reports that the file was not found. used both for applying mappings and for validating
+	refreshed mappings before they replace the cached ones
+*/
 static ngx_int_t
-ngx_http_vod_map_media_set_apply(ngx_http_vod_ctx_t *ctx, ngx_str_t* mapping, int* cache_index)
+ngx_http_vod_map_media_set_parse(
+	ngx_http_vod_ctx_t *ctx,
+	media_clip_source_t* cur_source,
+	ngx_str_t* mapping,
+	ngx_flag_t single_source,
+	ngx_http_vod_media_set_mapping_t* result)
 {
 	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
 	ngx_perf_counter_context(perf_counter_context);
-	media_clip_source_t *cur_source = ctx->cur_source;
 	media_clip_source_t* mapped_source;
-	media_sequence_t* sequence;
-	media_set_t mapped_media_set;
-	ngx_str_t path;
+	media_set_t* mapped_media_set = &result->media_set;
+	ngx_str_t* path = &result->path;
 	ngx_int_t rc;
 	bool_t parse_all_clips;
 
@@ -3845,39 +6727,29 @@ ngx_http_vod_map_media_set_apply(ngx_http_vod_ctx_t *ctx, ngx_str_t* mapping, in
 		memchr(mapping->data + conf->path_response_prefix.len, '"',
 		mapping->len - conf->path_response_prefix.len - conf->path_response_postfix.len) == NULL)
 	{
-		path.len = mapping->len - conf->path_response_prefix.len - conf->path_response_postfix.len;
-		if (path.len <= 0)
+		path->len = mapping->len - conf->path_response_prefix.len - conf->path_response_postfix.len;
+		if (path->len <= 0)
 		{
 			// file not found
 			ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_map_media_set_apply: empty path returned from upstream %V",
+				"ngx_http_vod_map_media_set_parse: empty path returned from upstream %V",
 				&cur_source->stripped_uri);
-
-			// try the fallback
-			rc = ngx_http_vod_dump_request_to_fallback(ctx->submodule_context.r);
-			if (rc != NGX_AGAIN)
-			{
-				rc = NGX_HTTP_NOT_FOUND;
-			}
-			return rc;
+			return NGX_DECLINED;
 		}
 
 		// copy the path to make it null terminated
-		path.data = ngx_palloc(ctx->submodule_context.request_context.pool, path.len + 1);
-		if (path.data == NULL)
+		path->data = ngx_palloc(ctx->submodule_context.request_context.pool, path->len + 1);
+		if (path->data == NULL)
 		{
 			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-				"ngx_http_vod_map_media_set_apply: ngx_palloc failed");
+				"ngx_http_vod_map_media_set_parse: ngx_palloc failed");
 			return NGX_HTTP_INTERNAL_SERVER_ERROR;
 		}
-		ngx_memcpy(path.data, mapping->data + conf->path_response_prefix.len, path.len);
-		path.data[path.len] = '\0';
-
-		// move to the next suburi
-		cur_source->sequence->mapped_uri = path;
-		cur_source->mapped_uri = path;
+		ngx_memcpy(path->data, mapping->data + conf->path_response_prefix.len, path->len);
+		path->data[path->len] = '\0';
 
-		*cache_index = CACHE_TYPE_VOD;
+		result->type = MAPPING_TYPE_PATH;
+		result->cache_index = CACHE_TYPE_VOD;
 
 		return NGX_OK;
 	}
@@ -3896,49 +6768,38 @@ ngx_http_vod_map_media_set_apply(ngx_http_vod_ctx_t *ctx, ngx_str_t* mapping, in
 		&ctx->submodule_context.conf->segmenter,
 		&cur_source->uri,
 		parse_all_clips,
-		&mapped_media_set);
+		mapped_media_set);
 
 	if (rc == VOD_NOT_FOUND)
 	{
-		// file not found, try the fallback
-		rc = ngx_http_vod_dump_request_to_fallback(ctx->submodule_context.r);
-		if (rc != NGX_AGAIN)
-		{
-			rc = NGX_HTTP_NOT_FOUND;
-		}
-		return rc;
+		// file not found
+		return NGX_DECLINED;
 	}
 
 	if (rc != VOD_OK)
 	{
 		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->submodule_context.request_context.log, 0,
-			"ngx_http_vod_map_media_set_apply: media_set_parse_json failed %i", rc);
+			"ngx_http_vod_map_media_set_parse: media_set_parse_json failed %i", rc);
 		return ngx_http_vod_status_to_ngx_error(rc);
 	}
 
 	ngx_perf_counter_end(ctx->perf_counters, perf_counter_context, PC_PARSE_MEDIA_SET);
 
-	if (mapped_media_set.sequence_count == 1 &&
-		mapped_media_set.durations == NULL &&
-		mapped_media_set.sequences[0].clips[0]->type == MEDIA_CLIP_SOURCE &&
-		!mapped_media_set.has_multi_sequences)
+	if (mapped_media_set->sequence_count == 1 &&
+		mapped_media_set->durations == NULL &&
+		mapped_media_set->sequences[0].clips[0]->type == MEDIA_CLIP_SOURCE &&
+		!mapped_media_set->has_multi_sequences)
 	{
-		mapped_source = (media_clip_source_t*)*mapped_media_set.sequences[0].clips;
+		mapped_source = (media_clip_source_t*)*mapped_media_set->sequences[0].clips;
 
 		if (mapped_source->clip_from == 0 &&
 			mapped_source->clip_to == UINT_MAX &&
 			mapped_source->tracks_mask[MEDIA_TYPE_AUDIO] == 0xffffffff &&
 			mapped_source->tracks_mask[MEDIA_TYPE_VIDEO] == 0xffffffff)
 		{
-			// mapping result is a simple file path, set the uri of the current source
-			sequence = cur_source->sequence;
-			sequence->mapped_uri = mapped_source->mapped_uri;
-			sequence->language = mapped_media_set.sequences->language;
-			sequence->label = mapped_media_set.sequences->label;
-			cur_source->mapped_uri = mapped_source->mapped_uri;
-			cur_source->encryption_key = mapped_source->encryption_key;
-
-			*cache_index = CACHE_TYPE_VOD;
+			// mapping result is a simple file path
+			result->type = MAPPING_TYPE_SOURCE;
+			result->cache_index = CACHE_TYPE_VOD;
 
 			return NGX_OK;
 		}
@@ -3947,31 +6808,90 @@ ngx_http_vod_map_media_set_apply(ngx_http_vod_ctx_t *ctx, ngx_str_t* mapping, in
 	if (ctx->request == NULL)
 	{
 		ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-			"ngx_http_vod_map_media_set_apply: unsupported - non-trivial mapping in progressive download");
+			"ngx_http_vod_map_media_set_parse: unsupported - non-trivial mapping in progressive download");
 		return NGX_HTTP_BAD_REQUEST;
 	}
 
-	if (ctx->submodule_context.media_set.sequence_count == 1 &&
-		ctx->submodule_context.media_set.sequences[0].clips[0]->type == MEDIA_CLIP_SOURCE)
+	if (single_source)
 	{
-		// media set was a single source, replace it with the mapping result
-		ctx->submodule_context.media_set = mapped_media_set;
-
-		// cur_source is pointing to the old media set, move it to the end of the new one
-		ctx->cur_source = NULL;
+		// media set was a single source, it is replaced with the mapping result
+		result->type = MAPPING_TYPE_MEDIA_SET;
 
 		// Note: this is ok because CACHE_TYPE_xxx matches MEDIA_TYPE_xxx in order
-		*cache_index = mapped_media_set.type;
+		result->cache_index = mapped_media_set->type;
 
 		return NGX_OK;
 	}
 
 	ngx_log_error(NGX_LOG_ERR, ctx->submodule_context.request_context.log, 0,
-		"ngx_http_vod_map_media_set_apply: unsupported - multi uri/filtered request %V did not return a simple json",
+		"ngx_http_vod_map_media_set_parse: unsupported - multi uri/filtered request %V did not return a simple json",
 		&cur_source->stripped_uri);
 	return NGX_HTTP_BAD_REQUEST;
 }
 
+static ngx_int_t
+ngx_http_vod_map_media_set_apply(ngx_http_vod_ctx_t *ctx, ngx_str_t* mapping, int* cache_index)
+{
+	ngx_http_vod_media_set_mapping_t result;
+	media_clip_source_t *cur_source = ctx->cur_source;
+	media_clip_source_t* mapped_source;
+	media_sequence_t* sequence;
+	ngx_int_t rc;
+
+	rc = ngx_http_vod_map_media_set_parse(
+		ctx,
+		cur_source,
+		mapping,
+		ngx_http_vod_map_media_set_is_single_source(ctx),
+		&result);
+	if (rc == NGX_DECLINED)
+	{
+		// file not found, try the fallback
+		rc = ngx_http_vod_dump_request_to_fallback(ctx->submodule_context.r);
+		if (rc != NGX_AGAIN)
+		{
+			rc = NGX_HTTP_NOT_FOUND;
+		}
+		return rc;
+	}
+
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	switch (result.type)
+	{
+	case MAPPING_TYPE_PATH:
+		// move to the next suburi
+		cur_source->sequence->mapped_uri = result.path;
+		cur_source->mapped_uri = result.path;
+		break;
+
+	case MAPPING_TYPE_SOURCE:
+		// set the uri of the current source
+		mapped_source = (media_clip_source_t*)*result.media_set.sequences[0].clips;
+		sequence = cur_source->sequence;
+		sequence->mapped_uri = mapped_source->mapped_uri;
+		sequence->language = result.media_set.sequences->language;
+		sequence->label = result.media_set.sequences->label;
+		cur_source->mapped_uri = mapped_source->mapped_uri;
+		cur_source->encryption_key = mapped_source->encryption_key;
+		break;
+
+	default:		// MAPPING_TYPE_MEDIA_SET
+		ctx->submodule_context.media_set = result.media_set;
+
+		// cur_source is pointing to the old media set, move it to the end of the new one
+		ctx->cur_source = NULL;
+		break;
+	}
+
+	*cache_index = result.cache_index;
+
+	return NGX_OK;
+}
+
 static ngx_int_t
 ngx_http_vod_map_media_set_state_machine(ngx_http_vod_ctx_t *ctx)
 {
@@ -4055,6 +6975,8 @@ ngx_http_vod_mapped_request_handler(ngx_http_request_t *r)
 
 		ctx->open_file = ngx_http_vod_http_reader_open_file;
 		ctx->async_read = (ngx_http_vod_async_read_func_t)ngx_http_vod_async_http_read;
+
+		ctx->mapping.refresh_time = conf->mapping_refresh_time;
 	}
 
 	// initialize the mapping context
@@ -4092,9 +7014,19 @@ ngx_http_vod_remote_request_handler(ngx_http_request_t *r)
 	ctx->alignment = ctx->alloc_params[READER_HTTP].alignment;
 
 	ctx->open_file = ngx_http_vod_http_reader_open_file;
-	ctx->async_read = (ngx_http_vod_async_read_func_t)ngx_http_vod_async_http_read;
+	if (ctx->submodule_context.conf->block_cache != NULL)
+	{
+		ctx->async_read = (ngx_http_vod_async_read_func_t)ngx_http_vod_block_cache_async_read;
+		ctx->parallel_read = (ngx_http_vod_parallel_read_func_t)ngx_http_vod_block_cache_read;
+	}
+	else
+	{
+		ctx->async_read = (ngx_http_vod_async_read_func_t)ngx_http_vod_async_http_read;
+		ctx->parallel_read = (ngx_http_vod_parallel_read_func_t)ngx_http_vod_http_read;
+	}
 	ctx->dump_part = (ngx_http_vod_dump_part_t)ngx_http_vod_dump_http_part;
 	ctx->dump_request = ngx_http_vod_dump_http_request;
+	ctx->get_file_info = NULL;
 	ctx->perf_counter_async_read = PC_ASYNC_READ_FILE;
 	ctx->file_key_prefix = (r->headers_in.host != NULL ? &r->headers_in.host->value : NULL);
 
@@ -4178,6 +7110,91 @@ ngx_http_vod_parse_uri(
 	return NGX_OK;
 }
 
+static ngx_int_t
+ngx_http_vod_send_cached_response(
+	ngx_http_request_t *r,
+	ngx_perf_counters_t* perf_counters,
+	ngx_http_vod_loc_conf_t *conf,
+	u_char* request_key)
+{
+	u_char* cache_buffer;
+	size_t cache_buffer_size;
+	ngx_str_t content_type;
+	ngx_str_t response;
+	ngx_int_t rc;
+	int cache_type;
+
+	cache_type = ngx_buffer_cache_fetch_copy_perf(
+		r,
+		perf_counters,
+		conf->response_cache,
+		CACHE_TYPE_COUNT,
+		request_key,
+		&cache_buffer,
+		&cache_buffer_size,
+		NULL);
+	if (cache_type < 0 ||
+		cache_buffer_size <= sizeof(size_t))
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+			"ngx_http_vod_send_cached_response: response cache miss");
+		return NGX_DECLINED;
+	}
+
+	ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		"ngx_http_vod_send_cached_response: response cache hit, size is %uz", cache_buffer_size);
+
+	// extract the content type
+	content_type.len = *(size_t*)cache_buffer;
+	cache_buffer += sizeof(size_t);
+	cache_buffer_size -= sizeof(size_t);
+	content_type.data = cache_buffer;
+
+	if (cache_buffer_size < content_type.len)
+	{
+		return NGX_DECLINED;
+	}
+
+	// extract the response buffer
+	response.data = cache_buffer + content_type.len;
+	response.len = cache_buffer_size - content_type.len;
+
+	// update request flags
+	r->root_tested = !r->error_page;
+	r->allow_ranges = 1;
+
+	// return the response
+	rc = ngx_http_vod_send_header(r, response.len, &content_type, cache_type);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	return ngx_http_vod_send_response(r, &response, NULL);
+}
+
+static ngx_int_t
+ngx_http_vod_state_machine_response_cache(ngx_http_vod_ctx_t *ctx)
+{
+	ngx_http_vod_loc_conf_t* conf = ctx->submodule_context.conf;
+	ngx_http_request_t* r = ctx->submodule_context.r;
+	ngx_int_t rc;
+
+	rc = ngx_http_vod_send_cached_response(r, ctx->perf_counters, conf, ctx->request_key);
+	if (rc != NGX_DECLINED)
+	{
+		return rc;
+	}
+
+	rc = ngx_http_vod_cache_lock(ctx, conf->response_cache, CACHE_TYPE_COUNT, ctx->request_key);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	return conf->request_handler(r);
+}
+
 ngx_int_t
 ngx_http_vod_handler(ngx_http_request_t *r)
 {
@@ -4190,14 +7207,10 @@ ngx_http_vod_handler(ngx_http_request_t *r)
 	ngx_http_core_loc_conf_t *clcf;
 	ngx_http_vod_loc_conf_t *conf;
 	u_char request_key[BUFFER_CACHE_KEY_SIZE];
-	u_char* cache_buffer;
-	size_t cache_buffer_size;
 	ngx_md5_t md5;
-	ngx_str_t content_type;
+	ngx_str_t manifest_values[MANIFEST_VALUE_COUNT];
 	ngx_str_t response;
-	ngx_str_t base_url;
 	ngx_int_t rc;
-	int cache_type;
 
 	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_vod_handler: started");
 
@@ -4284,78 +7297,25 @@ ngx_http_vod_handler(ngx_http_request_t *r)
 	if (request != NULL && 
 		request->handle_metadata_request != NULL)
 	{
-		// calc request key from host + uri
-		ngx_md5_init(&md5);
-
-		base_url.len = 0;
-		rc = ngx_http_vod_get_base_url(r, conf->base_url, &empty_string, &base_url);
+		rc = ngx_http_vod_get_manifest_values(r, conf, manifest_values);
 		if (rc != NGX_OK)
 		{
 			return rc;
 		}
-		ngx_md5_update(&md5, base_url.data, base_url.len);
-
-		if (conf->segments_base_url != NULL)
-		{
-			base_url.len = 0;
-			rc = ngx_http_vod_get_base_url(r, conf->segments_base_url, &empty_string, &base_url);
-			if (rc != NGX_OK)
-			{
-				return rc;
-			}
-			ngx_md5_update(&md5, base_url.data, base_url.len);
-		}
 
+		// calc request key from host + uri
+		ngx_md5_init(&md5);
+		ngx_md5_update(&md5, manifest_values[MANIFEST_VALUE_BASE_URL].data, manifest_values[MANIFEST_VALUE_BASE_URL].len);
+		ngx_md5_update(&md5, manifest_values[MANIFEST_VALUE_SEGMENTS_BASE_URL].data, manifest_values[MANIFEST_VALUE_SEGMENTS_BASE_URL].len);
 		ngx_md5_update(&md5, r->uri.data, r->uri.len);
 
 		ngx_md5_final(request_key, &md5);
 
 		// try to fetch from cache
-		cache_type = ngx_buffer_cache_fetch_copy_perf(
-			r,
-			perf_counters,
-			conf->response_cache,
-			CACHE_TYPE_COUNT,
-			request_key,
-			&cache_buffer,
-			&cache_buffer_size);
-		if (cache_type >= 0 &&
-			cache_buffer_size > sizeof(size_t))
-		{
-			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-				"ngx_http_vod_handler: response cache hit, size is %uz", cache_buffer_size);
-
-			// extract the content type
-			content_type.len = *(size_t*)cache_buffer;
-			cache_buffer += sizeof(size_t);
-			cache_buffer_size -= sizeof(size_t);
-			content_type.data = cache_buffer;
-
-			if (cache_buffer_size >= content_type.len)
-			{
-				// extract the response buffer
-				response.data = cache_buffer + content_type.len;
-				response.len = cache_buffer_size - content_type.len;
-
-				// update request flags
-				r->root_tested = !r->error_page;
-				r->allow_ranges = 1;
-
-				// return the response
-				rc = ngx_http_vod_send_header(r, response.len, &content_type, cache_type);
-				if (rc != NGX_OK)
-				{
-					return rc;
-				}
-
-				rc = ngx_http_vod_send_response(r, &response, NULL);
-				goto done;
-			}
-		}
-		else
+		rc = ngx_http_vod_send_cached_response(r, perf_counters, conf, request_key);
+		if (rc != NGX_DECLINED)
 		{
-			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-				"ngx_http_vod_handler: response cache miss");
+			goto done;
 		}
 	}
 
@@ -4370,6 +7330,20 @@ ngx_http_vod_handler(ngx_http_request_t *r)
 	}
 
 	ngx_memcpy(ctx->request_key, request_key, sizeof(request_key));
+
+	// Note: only text manifests are saved as templates, binary responses (e.g. init segments,
+	//		encryption keys) may contain byte sequences that look like placeholders
+	if (request != NULL &&
+		request->handle_metadata_request != NULL &&
+		request->request_class == REQUEST_CLASS_MANIFEST &&
+		(request->flags & REQUEST_FLAG_BINARY_RESPONSE) == 0 &&
+		conf->manifest_cache != NULL)
+	{
+		ctx->manifest_cache_enabled = 1;
+		ngx_md5_init(&ctx->dependencies_md5);
+		ngx_memcpy(ctx->manifest_values, manifest_values, sizeof(manifest_values));
+	}
+
 	ctx->submodule_context.r = r;
 	ctx->submodule_context.conf = conf;
 	ctx->submodule_context.request_params = request_params;
@@ -4390,6 +7364,19 @@ ngx_http_vod_handler(ngx_http_request_t *r)
 
 	ngx_http_set_ctx(r, ctx, ngx_http_vod_module);
 
+	if (request != NULL &&
+		request->handle_metadata_request != NULL)
+	{
+		// make sure only one request builds the response, the others wait for it to be saved to the cache
+		ctx->state_machine = ngx_http_vod_state_machine_response_cache;
+
+		rc = ngx_http_vod_cache_lock(ctx, conf->response_cache, CACHE_TYPE_COUNT, ctx->request_key);
+		if (rc != NGX_OK)
+		{
+			goto done;
+		}
+	}
+
 	// call the mode specific handler (remote/mapped/local)
 	rc = conf->request_handler(r);
 
@@ -7,6 +7,14 @@
 // macros
 #define NGINX_VOD_VERSION "1.0"
 
+// enums
+enum {
+	MANIFEST_VALUE_BASE_URL,
+	MANIFEST_VALUE_SEGMENTS_BASE_URL,
+	MANIFEST_VALUE_ENCRYPTION_KEY_URI,
+	MANIFEST_VALUE_COUNT
+};
+
 // globals
 extern ngx_module_t  ngx_http_vod_module;
 
@@ -21,6 +29,16 @@ ngx_int_t ngx_http_vod_set_clip_id_var(ngx_http_request_t *r, ngx_http_variable_
 ngx_int_t ngx_http_vod_set_dynamic_mapping_var(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
 ngx_int_t ngx_http_vod_set_request_params_var(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
 
+// live playlists
+ngx_int_t ngx_http_vod_fetch_live_playlist_state(ngx_http_request_t *r, uint32_t segment_index, ngx_str_t* result);
+void ngx_http_vod_store_live_playlist_state(ngx_http_request_t *r, uint32_t segment_index, ngx_str_t* state);
+
+// manifest cache
+ngx_flag_t ngx_http_vod_get_manifest_placeholder(ngx_http_request_t *r, ngx_uint_t value_index, ngx_str_t* result);
+
+// index cache
+uint32_t ngx_http_vod_get_index_cache_format();
+
 // handlers
 ngx_int_t ngx_http_vod_local_request_handler(ngx_http_request_t *r);
 ngx_int_t ngx_http_vod_mapped_request_handler(ngx_http_request_t *r);
@@ -144,6 +144,7 @@ ngx_http_vod_mss_init_frame_processor(
 			&submodule_context->request_context,
 			submodule_context->media_set.sequences,
 			segment_writer->write_tail,
+			segment_writer->write_file,
 			segment_writer->context,
 			reuse_buffers,
 			&state);
@@ -5,6 +5,7 @@
 #include "ngx_http_vod_conf.h"
 #include "ngx_perf_counters.h"
 #include "ngx_buffer_cache.h"
+#include "vod/buffer_pool.h"
 
 // macros
 #define DEFINE_STAT(x) { #x, sizeof(#x) - 1, offsetof(ngx_buffer_cache_stats_t, x) }
@@ -13,6 +14,10 @@
 #define PATH_PERF_COUNTERS_OPEN "<performance_counters>\r\n"
 #define PATH_PERF_COUNTERS_CLOSE "</performance_counters>\r\n"
 #define PERF_COUNTER_FORMAT "<sum>%uA</sum>\r\n<count>%uA</count>\r\n<max>%uA</max>\r\n<max_time>%uA</max_time>\r\n<max_pid>%uA</max_pid>\r\n"
+#define BUFFER_POOL_OPEN "<output_buffer_pool>\r\n"
+#define BUFFER_POOL_CLOSE "</output_buffer_pool>\r\n"
+#define BUFFER_POOL_CLASS_FORMAT "<size_class>\r\n<size>%uz</size>\r\n<count>%uz</count>\r\n<free>%uz</free>\r\n<hit>%uL</hit>\r\n<miss>%uL</miss>\r\n</size_class>\r\n"
+#define BUFFER_POOL_UNPOOLED_FORMAT "<unpooled>%uL</unpooled>\r\n"
 
 // typedefs
 typedef struct {
@@ -50,6 +55,8 @@ static ngx_http_vod_stat_def_t buffer_cache_stat_defs[] = {
 	DEFINE_STAT(evicted),
 	DEFINE_STAT(evicted_bytes),
 	DEFINE_STAT(reset),
+	DEFINE_STAT(lock_ok),
+	DEFINE_STAT(lock_busy),
 	DEFINE_STAT(entries),
 	DEFINE_STAT(data_size),
 	{ NULL, 0, 0 }
@@ -61,6 +68,11 @@ static ngx_http_vod_cache_info_t cache_infos[] = {
 		ngx_string("<metadata_cache>\r\n"),
 		ngx_string("</metadata_cache>\r\n"),
 	},
+	{
+		offsetof(ngx_http_vod_loc_conf_t, frames_cache),
+		ngx_string("<frames_cache>\r\n"),
+		ngx_string("</frames_cache>\r\n"),
+	},
 	{
 		offsetof(ngx_http_vod_loc_conf_t, response_cache[CACHE_TYPE_VOD]),
 		ngx_string("<response_cache>\r\n"),
@@ -71,6 +83,16 @@ static ngx_http_vod_cache_info_t cache_infos[] = {
 		ngx_string("<live_response_cache>\r\n"),
 		ngx_string("</live_response_cache>\r\n"),
 	},
+	{
+		offsetof(ngx_http_vod_loc_conf_t, manifest_cache),
+		ngx_string("<manifest_cache>\r\n"),
+		ngx_string("</manifest_cache>\r\n"),
+	},
+	{
+		offsetof(ngx_http_vod_loc_conf_t, live_playlist_cache),
+		ngx_string("<live_playlist_cache>\r\n"),
+		ngx_string("</live_playlist_cache>\r\n"),
+	},
 	{
 		offsetof(ngx_http_vod_loc_conf_t, mapping_cache[CACHE_TYPE_VOD]),
 		ngx_string("<mapping_cache>\r\n"),
@@ -86,6 +108,11 @@ static ngx_http_vod_cache_info_t cache_infos[] = {
 		ngx_string("<drm_info_cache>\r\n"),
 		ngx_string("</drm_info_cache>\r\n"),
 	},
+	{
+		offsetof(ngx_http_vod_loc_conf_t, block_cache),
+		ngx_string("<block_cache>\r\n"),
+		ngx_string("</block_cache>\r\n"),
+	},
 };
 
 static u_char*
@@ -139,6 +166,12 @@ ngx_http_vod_status_reset(ngx_http_request_t *r)
 		ngx_buffer_cache_reset_stats(cur_cache);
 	}
 
+	// Note: the buffer pool stats are kept per worker process, only the stats of the current worker are reset
+	if (conf->output_buffer_pool != NULL)
+	{
+		buffer_pool_reset_stats(conf->output_buffer_pool);
+	}
+
 	if (perf_counters != NULL)
 	{
 		for (i = 0; i < PC_COUNT; i++)
@@ -159,6 +192,7 @@ ngx_http_vod_status_handler(ngx_http_request_t *r)
 {
 	ngx_perf_counters_t* perf_counters;
 	ngx_buffer_cache_stats_t stats;
+	buffer_pool_stats_t buffer_pool_stats;
 	ngx_http_vod_loc_conf_t *conf;
 	ngx_http_vod_stat_def_t* cur_stat;
 	ngx_buffer_cache_t *cur_cache;
@@ -197,6 +231,16 @@ ngx_http_vod_status_handler(ngx_http_request_t *r)
 		result_size += cache_infos[i].open_tag.len + cache_stats_len + cache_infos[i].close_tag.len;
 	}
 
+	if (conf->output_buffer_pool != NULL)
+	{
+		buffer_pool_get_stats(conf->output_buffer_pool, &buffer_pool_stats);
+
+		result_size += sizeof(BUFFER_POOL_OPEN) +
+			buffer_pool_stats.class_count * (sizeof(BUFFER_POOL_CLASS_FORMAT) + 5 * NGX_INT64_LEN) +
+			sizeof(BUFFER_POOL_UNPOOLED_FORMAT) + NGX_INT64_LEN +
+			sizeof(BUFFER_POOL_CLOSE);
+	}
+
 	if (perf_counters != NULL)
 	{
 		result_size += sizeof(PATH_PERF_COUNTERS_OPEN);
@@ -236,6 +280,22 @@ ngx_http_vod_status_handler(ngx_http_request_t *r)
 		p = ngx_copy(p, cache_infos[i].close_tag.data, cache_infos[i].close_tag.len);
 	}
 
+	if (conf->output_buffer_pool != NULL)
+	{
+		p = ngx_copy(p, BUFFER_POOL_OPEN, sizeof(BUFFER_POOL_OPEN) - 1);
+		for (i = 0; i < buffer_pool_stats.class_count; i++)
+		{
+			p = ngx_sprintf(p, BUFFER_POOL_CLASS_FORMAT,
+				buffer_pool_stats.classes[i].size,
+				buffer_pool_stats.classes[i].count,
+				buffer_pool_stats.classes[i].free,
+				buffer_pool_stats.classes[i].hit,
+				buffer_pool_stats.classes[i].miss);
+		}
+		p = ngx_sprintf(p, BUFFER_POOL_UNPOOLED_FORMAT, buffer_pool_stats.unpooled);
+		p = ngx_copy(p, BUFFER_POOL_CLOSE, sizeof(BUFFER_POOL_CLOSE) - 1);
+	}
+
 	if (perf_counters != NULL)
 	{
 		p = ngx_copy(p, PATH_PERF_COUNTERS_OPEN, sizeof(PATH_PERF_COUNTERS_OPEN) - 1);
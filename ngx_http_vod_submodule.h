@@ -24,6 +24,8 @@
 #define REQUEST_FLAG_SINGLE_TRACK (0x1)
 #define REQUEST_FLAG_SINGLE_TRACK_PER_MEDIA_TYPE (0x2)
 #define REQUEST_FLAG_TIME_DEPENDENT_ON_LIVE (0x4)
+#define REQUEST_FLAG_STREAM_UNKNOWN_SIZE (0x8)		// the frame processor does not use write_head, the segment can be sent before its size is known
+#define REQUEST_FLAG_BINARY_RESPONSE (0x10)		// the metadata response is binary, it can not be saved as a manifest template
 
 // request classes
 enum {
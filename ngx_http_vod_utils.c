@@ -1,4 +1,5 @@
 #include "ngx_http_vod_utils.h"
+#include "ngx_http_vod_module.h"
 
 static const ngx_int_t error_map[VOD_ERROR_LAST - VOD_ERROR_FIRST] = {
 	NGX_HTTP_NOT_FOUND,				// VOD_BAD_DATA
@@ -138,9 +139,12 @@ ngx_http_vod_get_base_url(
 	ngx_str_t* file_uri,
 	ngx_str_t* result)
 {
+	ngx_http_vod_loc_conf_t* conf;
 	ngx_flag_t use_https;
+	ngx_str_t placeholder = ngx_null_string;
 	ngx_str_t base_url;
 	ngx_str_t* host_name = NULL;
+	ngx_uint_t value_index;
 	size_t uri_path_len;
 	size_t result_size;
 	u_char* last_slash;
@@ -177,6 +181,15 @@ ngx_http_vod_get_base_url(
 		result_size = sizeof("https://") - 1 + host_name->len;
 	}
 
+	// when the manifest is cached, the url prefix is replaced with a placeholder, that is expanded on each request
+	conf = ngx_http_get_module_loc_conf(r, ngx_http_vod_module);
+	value_index = conf_base_url != NULL && conf_base_url == conf->segments_base_url ? 
+		MANIFEST_VALUE_SEGMENTS_BASE_URL : MANIFEST_VALUE_BASE_URL;
+	if (ngx_http_vod_get_manifest_placeholder(r, value_index, &placeholder))
+	{
+		result_size = placeholder.len;
+	}
+
 	if (file_uri->len)
 	{
 		last_slash = ngx_http_vod_memrchr(file_uri->data, '/', file_uri->len);
@@ -207,7 +220,11 @@ ngx_http_vod_get_base_url(
 	// build the url
 	result->data = p;
 
-	if (conf_base_url != NULL)
+	if (placeholder.len != 0)
+	{
+		p = ngx_copy(p, placeholder.data, placeholder.len);
+	}
+	else if (conf_base_url != NULL)
 	{
 		p = vod_copy(p, base_url.data, base_url.len);
 	}
@@ -0,0 +1,903 @@
+#include "ngx_index_cache.h"
+
+/*
+	the index cache persists buffers (e.g. the parsed metadata of media files) to local disk,
+	so that they survive restarts and binary upgrades, unlike the shared memory caches.
+
+	each buffer is saved to a separate file, named according to the hex of its key, under the
+	configured path (optionally spread in sub directories, using the same levels as proxy_cache_path).
+	the file starts with a header that holds the size and modification time of the source file,
+	files whose header does not match the source are ignored, and overwritten by the next store.
+	the header also holds the format of the cached buffers, a fingerprint provided by the caller
+	(e.g. the sizes of the serialized structs), files saved by a build with a different format are
+	ignored as well. the header is saved in the native byte order, so files saved on a machine with
+	a different endianness fail the magic check.
+	files are written to a temporary name in the root directory and renamed once complete,
+	so that readers never see partially written files.
+
+	on fetch, the file is memory mapped (copy on write) and unmapped when the request pool is destroyed.
+	when a thread pool is given, the file operations (open / mmap / write / rename) run on the thread pool,
+	instead of blocking the event loop. the mapped pages are also touched by the thread, so that the
+	page faults of a cold cache are not taken by the event loop either.
+
+	the path is registered with nginx, so that it is created on startup, and its manager runs in the cache
+	manager process. the manager deletes files that were not used for longer than the inactive period,
+	and when the total size exceeds max size, deletes the least recently used files. in order to track
+	usage without writing on every fetch, the modification time of a file is updated by the fetch only
+	when it is older than half of the inactive period.
+*/
+
+// constants
+#define INDEX_CACHE_MAGIC (0x78646976)		// vidx
+#define INDEX_CACHE_VERSION (2)				// Note: must be incremented when the layout of the header changes
+#define INDEX_CACHE_MANAGER_INTERVAL (60)	// sec
+#define INDEX_CACHE_TEMP_FILE_TIMEOUT (600)	// sec, temp files older than this were left behind by crashed workers
+
+// typedefs
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t format;
+	uint32_t reserved;
+	uint64_t source_size;
+	int64_t source_mtime;
+	uint64_t data_size;
+} ngx_index_cache_header_t;
+
+typedef struct {
+	u_char* data;
+	size_t size;
+	ngx_log_t* log;
+} ngx_index_cache_mapping_t;
+
+typedef struct {
+	ngx_str_t name;
+	off_t size;
+	time_t mtime;
+} ngx_index_cache_file_t;
+
+typedef struct {
+	ngx_index_cache_t* cache;
+	ngx_pool_t* pool;
+	ngx_array_t files;
+	off_t total_size;
+	time_t now;
+} ngx_index_cache_manager_ctx_t;
+
+static ngx_int_t
+ngx_index_cache_get_file_name(ngx_path_t* path, ngx_pool_t* pool, ngx_log_t* log, u_char* key, ngx_str_t* result)
+{
+	u_char* p;
+
+	result->len = path->name.len + 1 + path->len + 2 * INDEX_CACHE_KEY_SIZE;
+	result->data = ngx_pnalloc(pool, result->len + 1);
+	if (result->data == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_index_cache_get_file_name: ngx_pnalloc failed");
+		return NGX_ERROR;
+	}
+
+	ngx_memcpy(result->data, path->name.data, path->name.len);
+
+	p = result->data + path->name.len + 1 + path->len;
+	p = ngx_hex_dump(p, key, INDEX_CACHE_KEY_SIZE);
+	*p = '\0';
+
+	ngx_create_hashed_filename(path, result->data, result->len);
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_index_cache_get_temp_file_name(ngx_path_t* path, ngx_pool_t* pool, ngx_log_t* log, u_char* key, ngx_str_t* result)
+{
+	u_char* p;
+
+	result->data = ngx_pnalloc(pool,
+		path->name.len + 1 + 2 * INDEX_CACHE_KEY_SIZE + 1 + NGX_INT64_LEN + sizeof(".tmp"));
+	if (result->data == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_index_cache_get_temp_file_name: ngx_pnalloc failed");
+		return NGX_ERROR;
+	}
+
+	p = ngx_copy(result->data, path->name.data, path->name.len);
+	*p++ = '/';
+	p = ngx_hex_dump(p, key, INDEX_CACHE_KEY_SIZE);
+	p = ngx_sprintf(p, ".%P.tmp", ngx_pid);
+	result->len = p - result->data;
+	*p = '\0';
+
+	return NGX_OK;
+}
+
+static void
+ngx_index_cache_unmap(void* data)
+{
+	ngx_index_cache_mapping_t* mapping = data;
+
+	if (munmap(mapping->data, mapping->size) == -1)
+	{
+		ngx_log_error(NGX_LOG_ALERT, mapping->log, ngx_errno,
+			"ngx_index_cache_unmap: munmap(%p, %uz) failed", mapping->data, mapping->size);
+	}
+}
+
+/* Note: called from the thread pool, must not allocate from request pools */
+static ngx_flag_t
+ngx_index_cache_map_file(
+	ngx_index_cache_t* cache,
+	ngx_str_t* name,
+	ngx_log_t* log,
+	off_t source_size,
+	time_t source_mtime,
+	ngx_flag_t touch_pages,
+	ngx_index_cache_mapping_t* mapping)
+{
+	ngx_index_cache_header_t* header;
+	ngx_file_info_t fi;
+	ngx_fd_t fd;
+	ngx_err_t err;
+	off_t file_size;
+	u_char* data;
+	u_char* p;
+	size_t page_size;
+	volatile u_char value;
+
+	fd = ngx_open_file(name->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+	if (fd == NGX_INVALID_FILE)
+	{
+		err = ngx_errno;
+		if (err != NGX_ENOENT && err != NGX_ENOTDIR)
+		{
+			ngx_log_error(NGX_LOG_ERR, log, err,
+				"ngx_index_cache_map_file: " ngx_open_file_n " \"%s\" failed", name->data);
+		}
+		return 0;
+	}
+
+	if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+			"ngx_index_cache_map_file: " ngx_fd_info_n " \"%s\" failed", name->data);
+		goto close;
+	}
+
+	file_size = ngx_file_size(&fi);
+	if (file_size < (off_t)sizeof(*header) || file_size > NGX_MAX_SIZE_T_VALUE)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"ngx_index_cache_map_file: invalid size %O of \"%s\"", file_size, name->data);
+		goto close;
+	}
+
+	// Note: the mapping is private and writable, since parsers may update the buffers in place
+	data = mmap(NULL, (size_t)file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+			"ngx_index_cache_map_file: mmap \"%s\" failed", name->data);
+		goto close;
+	}
+
+	// validate the header
+	header = (ngx_index_cache_header_t*)data;
+	if (header->magic != INDEX_CACHE_MAGIC ||
+		header->version != INDEX_CACHE_VERSION)
+	{
+		ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_index_cache_map_file: ignoring \"%s\", magic 0x%uxD version %uD",
+			name->data, header->magic, header->version);
+		goto unmap;
+	}
+
+	if (header->format != cache->format)
+	{
+		ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_index_cache_map_file: ignoring \"%s\", format 0x%uxD expected 0x%uxD",
+			name->data, header->format, cache->format);
+		goto unmap;
+	}
+
+	if (header->source_size != (uint64_t)source_size ||
+		header->source_mtime != (int64_t)source_mtime)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_index_cache_map_file: \"%s\" does not match the source file", name->data);
+		goto unmap;
+	}
+
+	if (header->data_size != (uint64_t)file_size - sizeof(*header))
+	{
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"ngx_index_cache_map_file: data size %uL of \"%s\" does not match the file size %O",
+			header->data_size, name->data, file_size);
+		goto unmap;
+	}
+
+	// mark the file as used
+	if (cache->inactive != 0 &&
+		ngx_file_mtime(&fi) < ngx_time() - cache->inactive / 2 &&
+		ngx_set_file_time(name->data, fd, ngx_time()) != NGX_OK)
+	{
+		ngx_log_error(NGX_LOG_WARN, log, ngx_errno,
+			"ngx_index_cache_map_file: " ngx_set_file_time_n " \"%s\" failed", name->data);
+	}
+
+	if (touch_pages)
+	{
+		page_size = ngx_pagesize;
+		for (p = data; p < data + file_size; p += page_size)
+		{
+			value = *p;
+		}
+		(void)value;
+	}
+
+	if (ngx_close_file(fd) == NGX_FILE_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+			"ngx_index_cache_map_file: " ngx_close_file_n " \"%s\" failed", name->data);
+	}
+
+	mapping->data = data;
+	mapping->size = (size_t)file_size;
+	mapping->log = log;
+
+	return 1;
+
+unmap:
+
+	if (munmap(data, (size_t)file_size) == -1)
+	{
+		ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+			"ngx_index_cache_map_file: munmap(%p, %O) failed", data, file_size);
+	}
+
+close:
+
+	if (ngx_close_file(fd) == NGX_FILE_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+			"ngx_index_cache_map_file: " ngx_close_file_n " \"%s\" failed", name->data);
+	}
+
+	return 0;
+}
+
+ngx_flag_t
+ngx_index_cache_fetch(
+	ngx_index_cache_t* cache,
+	ngx_pool_t* pool,
+	ngx_log_t* log,
+	u_char* key,
+	off_t source_size,
+	time_t source_mtime,
+	u_char** buffer,
+	size_t* buffer_size)
+{
+	ngx_index_cache_mapping_t* mapping;
+	ngx_pool_cleanup_t* cln;
+	ngx_str_t name;
+
+	if (ngx_index_cache_get_file_name(cache->path, pool, log, key, &name) != NGX_OK)
+	{
+		return 0;
+	}
+
+	cln = ngx_pool_cleanup_add(pool, sizeof(*mapping));
+	if (cln == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_index_cache_fetch: ngx_pool_cleanup_add failed");
+		return 0;
+	}
+
+	mapping = cln->data;
+
+	if (!ngx_index_cache_map_file(cache, &name, log, source_size, source_mtime, 0, mapping))
+	{
+		return 0;
+	}
+
+	cln->handler = ngx_index_cache_unmap;
+
+	*buffer = mapping->data + sizeof(ngx_index_cache_header_t);
+	*buffer_size = mapping->size - sizeof(ngx_index_cache_header_t);
+
+	return 1;
+}
+
+/* Note: called from the thread pool, must not allocate from request pools */
+static ngx_flag_t
+ngx_index_cache_write_file(
+	ngx_str_t* temp_name,
+	ngx_str_t* name,
+	ngx_log_t* log,
+	ngx_index_cache_header_t* header,
+	ngx_str_t* buffers,
+	size_t buffer_count)
+{
+	ngx_ext_rename_file_t ext;
+	ngx_str_t* cur_buffer;
+	ngx_str_t* last_buffer = buffers + buffer_count;
+	ngx_file_t file;
+	ngx_int_t rc;
+
+	// write the temp file
+	ngx_memzero(&file, sizeof(file));
+	file.name = *temp_name;
+	file.log = log;
+
+	file.fd = ngx_open_file(temp_name->data, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE, NGX_FILE_OWNER_ACCESS);
+	if (file.fd == NGX_INVALID_FILE)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+			"ngx_index_cache_write_file: " ngx_open_file_n " \"%s\" failed", temp_name->data);
+		return 0;
+	}
+
+	if (ngx_write_file(&file, (u_char*)header, sizeof(*header), 0) == NGX_ERROR)
+	{
+		goto failed;
+	}
+
+	for (cur_buffer = buffers; cur_buffer < last_buffer; cur_buffer++)
+	{
+		if (cur_buffer->len == 0)
+		{
+			continue;
+		}
+
+		if (ngx_write_file(&file, cur_buffer->data, cur_buffer->len, file.offset) == NGX_ERROR)
+		{
+			goto failed;
+		}
+	}
+
+	// move it to its final location, creating the level directories as needed
+	ext.access = 0;
+	ext.path_access = NGX_FILE_OWNER_ACCESS;
+	ext.time = -1;
+	ext.create_path = 1;
+	ext.delete_file = 1;
+	ext.fd = file.fd;
+	ext.log = log;
+
+	rc = ngx_ext_rename_file(temp_name, name, &ext);
+
+	if (ngx_close_file(file.fd) == NGX_FILE_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+			"ngx_index_cache_write_file: " ngx_close_file_n " \"%s\" failed", temp_name->data);
+	}
+
+	return rc == NGX_OK;
+
+failed:
+
+	if (ngx_close_file(file.fd) == NGX_FILE_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+			"ngx_index_cache_write_file: " ngx_close_file_n " \"%s\" failed", temp_name->data);
+	}
+
+	if (ngx_delete_file(temp_name->data) == NGX_FILE_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+			"ngx_index_cache_write_file: " ngx_delete_file_n " \"%s\" failed", temp_name->data);
+	}
+
+	return 0;
+}
+
+static void
+ngx_index_cache_init_header(
+	ngx_index_cache_t* cache,
+	ngx_index_cache_header_t* header,
+	off_t source_size,
+	time_t source_mtime,
+	ngx_str_t* buffers,
+	size_t buffer_count)
+{
+	ngx_str_t* cur_buffer;
+	ngx_str_t* last_buffer = buffers + buffer_count;
+
+	header->magic = INDEX_CACHE_MAGIC;
+	header->version = INDEX_CACHE_VERSION;
+	header->format = cache->format;
+	header->reserved = 0;
+	header->source_size = source_size;
+	header->source_mtime = source_mtime;
+	header->data_size = 0;
+	for (cur_buffer = buffers; cur_buffer < last_buffer; cur_buffer++)
+	{
+		header->data_size += cur_buffer->len;
+	}
+}
+
+ngx_flag_t
+ngx_index_cache_store_gather(
+	ngx_index_cache_t* cache,
+	ngx_pool_t* pool,
+	ngx_log_t* log,
+	u_char* key,
+	off_t source_size,
+	time_t source_mtime,
+	ngx_str_t* buffers,
+	size_t buffer_count)
+{
+	ngx_index_cache_header_t header;
+	ngx_str_t temp_name;
+	ngx_str_t name;
+
+	if (ngx_index_cache_get_file_name(cache->path, pool, log, key, &name) != NGX_OK)
+	{
+		return 0;
+	}
+
+	if (ngx_index_cache_get_temp_file_name(cache->path, pool, log, key, &temp_name) != NGX_OK)
+	{
+		return 0;
+	}
+
+	ngx_index_cache_init_header(cache, &header, source_size, source_mtime, buffers, buffer_count);
+
+	return ngx_index_cache_write_file(&temp_name, &name, log, &header, buffers, buffer_count);
+}
+
+#if (NGX_THREADS)
+
+typedef struct {
+	ngx_index_cache_t* cache;
+	ngx_str_t name;
+	off_t source_size;
+	time_t source_mtime;
+	ngx_log_t* log;
+	ngx_pool_cleanup_t* cln;
+	ngx_flag_t found;
+	ngx_index_cache_fetch_callback_t callback;
+	void* context;
+} ngx_index_cache_fetch_ctx_t;
+
+typedef struct {
+	ngx_pool_t* pool;
+	ngx_str_t name;
+	ngx_str_t temp_name;
+	ngx_index_cache_header_t header;
+	ngx_str_t buffer;
+} ngx_index_cache_store_ctx_t;
+
+static void
+ngx_index_cache_fetch_thread_handler(void* data, ngx_log_t* log)
+{
+	ngx_index_cache_fetch_ctx_t* ctx = data;
+
+	ctx->found = ngx_index_cache_map_file(
+		ctx->cache,
+		&ctx->name,
+		ctx->log,
+		ctx->source_size,
+		ctx->source_mtime,
+		1,
+		ctx->cln->data);
+}
+
+static void
+ngx_index_cache_fetch_event_handler(ngx_event_t* ev)
+{
+	ngx_index_cache_fetch_ctx_t* ctx = ev->data;
+	ngx_index_cache_mapping_t* mapping;
+
+	if (!ctx->found)
+	{
+		ctx->callback(ctx->context, 0, NULL, 0);
+		return;
+	}
+
+	// the mapping is released with the pool
+	ctx->cln->handler = ngx_index_cache_unmap;
+
+	mapping = ctx->cln->data;
+
+	ctx->callback(
+		ctx->context,
+		1,
+		mapping->data + sizeof(ngx_index_cache_header_t),
+		mapping->size - sizeof(ngx_index_cache_header_t));
+}
+
+ngx_int_t
+ngx_index_cache_fetch_async(
+	ngx_index_cache_t* cache,
+	ngx_thread_pool_t* thread_pool,
+	ngx_pool_t* pool,
+	ngx_log_t* log,
+	u_char* key,
+	off_t source_size,
+	time_t source_mtime,
+	ngx_index_cache_fetch_callback_t callback,
+	void* context)
+{
+	ngx_index_cache_fetch_ctx_t* ctx;
+	ngx_thread_task_t* task;
+
+	task = ngx_thread_task_alloc(pool, sizeof(*ctx));
+	if (task == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_index_cache_fetch_async: ngx_thread_task_alloc failed");
+		return NGX_ERROR;
+	}
+
+	ctx = task->ctx;
+
+	if (ngx_index_cache_get_file_name(cache->path, pool, log, key, &ctx->name) != NGX_OK)
+	{
+		return NGX_ERROR;
+	}
+
+	// Note: the cleanup is allocated in advance, since the pool cannot be used by the thread
+	ctx->cln = ngx_pool_cleanup_add(pool, sizeof(ngx_index_cache_mapping_t));
+	if (ctx->cln == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_index_cache_fetch_async: ngx_pool_cleanup_add failed");
+		return NGX_ERROR;
+	}
+
+	ctx->cache = cache;
+	ctx->source_size = source_size;
+	ctx->source_mtime = source_mtime;
+	ctx->log = log;
+	ctx->found = 0;
+	ctx->callback = callback;
+	ctx->context = context;
+
+	task->handler = ngx_index_cache_fetch_thread_handler;
+	task->event.data = ctx;
+	task->event.handler = ngx_index_cache_fetch_event_handler;
+
+	if (ngx_thread_task_post(thread_pool, task) != NGX_OK)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_index_cache_fetch_async: ngx_thread_task_post failed");
+		return NGX_ERROR;
+	}
+
+	return NGX_AGAIN;
+}
+
+static void
+ngx_index_cache_store_thread_handler(void* data, ngx_log_t* log)
+{
+	ngx_index_cache_store_ctx_t* ctx = data;
+
+	if (ngx_index_cache_write_file(&ctx->temp_name, &ctx->name, log, &ctx->header, &ctx->buffer, 1))
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_index_cache_store_thread_handler: saved \"%s\"", ctx->name.data);
+	}
+}
+
+static void
+ngx_index_cache_store_event_handler(ngx_event_t* ev)
+{
+	ngx_index_cache_store_ctx_t* ctx = ev->data;
+
+	// Note: the task is allocated on the pool, the thread pool does not access it after calling the handler
+	ngx_destroy_pool(ctx->pool);
+}
+
+ngx_flag_t
+ngx_index_cache_store_gather_async(
+	ngx_index_cache_t* cache,
+	ngx_thread_pool_t* thread_pool,
+	u_char* key,
+	off_t source_size,
+	time_t source_mtime,
+	ngx_str_t* buffers,
+	size_t buffer_count)
+{
+	ngx_index_cache_store_ctx_t* ctx;
+	ngx_thread_task_t* task;
+	ngx_str_t* cur_buffer;
+	ngx_str_t* last_buffer = buffers + buffer_count;
+	ngx_pool_t* pool;
+	ngx_log_t* log = ngx_cycle->log;
+	u_char* p;
+
+	// Note: the write may complete after the request was freed, so it uses its own pool
+	pool = ngx_create_pool(1024, log);
+	if (pool == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_index_cache_store_gather_async: ngx_create_pool failed");
+		return 0;
+	}
+
+	task = ngx_thread_task_alloc(pool, sizeof(*ctx));
+	if (task == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_index_cache_store_gather_async: ngx_thread_task_alloc failed");
+		goto failed;
+	}
+
+	ctx = task->ctx;
+	ctx->pool = pool;
+
+	if (ngx_index_cache_get_file_name(cache->path, pool, log, key, &ctx->name) != NGX_OK)
+	{
+		goto failed;
+	}
+
+	if (ngx_index_cache_get_temp_file_name(cache->path, pool, log, key, &ctx->temp_name) != NGX_OK)
+	{
+		goto failed;
+	}
+
+	ngx_index_cache_init_header(cache, &ctx->header, source_size, source_mtime, buffers, buffer_count);
+
+	ctx->buffer.len = ctx->header.data_size;
+	ctx->buffer.data = ngx_pnalloc(pool, ctx->buffer.len);
+	if (ctx->buffer.data == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_index_cache_store_gather_async: ngx_pnalloc failed");
+		goto failed;
+	}
+
+	p = ctx->buffer.data;
+	for (cur_buffer = buffers; cur_buffer < last_buffer; cur_buffer++)
+	{
+		p = ngx_copy(p, cur_buffer->data, cur_buffer->len);
+	}
+
+	task->handler = ngx_index_cache_store_thread_handler;
+	task->event.data = ctx;
+	task->event.handler = ngx_index_cache_store_event_handler;
+
+	if (ngx_thread_task_post(thread_pool, task) != NGX_OK)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_index_cache_store_gather_async: ngx_thread_task_post failed");
+		goto failed;
+	}
+
+	return 1;
+
+failed:
+
+	ngx_destroy_pool(pool);
+	return 0;
+}
+
+#endif // NGX_THREADS
+
+static ngx_int_t
+ngx_index_cache_manager_noop(ngx_tree_ctx_t* ctx, ngx_str_t* path)
+{
+	return NGX_OK;
+}
+
+static void
+ngx_index_cache_delete_file(ngx_str_t* name)
+{
+	ngx_err_t err;
+
+	if (ngx_delete_file(name->data) == NGX_FILE_ERROR)
+	{
+		err = ngx_errno;
+		if (err != NGX_ENOENT)
+		{
+			ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, err,
+				"ngx_index_cache_delete_file: " ngx_delete_file_n " \"%s\" failed", name->data);
+		}
+	}
+}
+
+static ngx_int_t
+ngx_index_cache_manager_file(ngx_tree_ctx_t* ctx, ngx_str_t* path)
+{
+	ngx_index_cache_manager_ctx_t* manager_ctx = ctx->data;
+	ngx_index_cache_t* cache = manager_ctx->cache;
+	ngx_index_cache_file_t* file;
+
+	if (path->len > sizeof(".tmp") - 1 &&
+		ngx_strcmp(path->data + path->len - (sizeof(".tmp") - 1), ".tmp") == 0)
+	{
+		// temp files are deleted only when they were abandoned
+		if (ctx->mtime < manager_ctx->now - INDEX_CACHE_TEMP_FILE_TIMEOUT)
+		{
+			ngx_index_cache_delete_file(path);
+		}
+		return NGX_OK;
+	}
+
+	if (cache->inactive != 0 && ctx->mtime < manager_ctx->now - cache->inactive)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+			"ngx_index_cache_manager_file: deleting inactive file \"%s\"", path->data);
+		ngx_index_cache_delete_file(path);
+		return NGX_OK;
+	}
+
+	manager_ctx->total_size += ctx->fs_size;
+
+	if (cache->max_size == 0)
+	{
+		return NGX_OK;
+	}
+
+	// save the file in order to evict the least recently used files when the size limit is exceeded
+	file = ngx_array_push(&manager_ctx->files);
+	if (file == NULL)
+	{
+		return NGX_ABORT;
+	}
+
+	file->name.data = ngx_pnalloc(manager_ctx->pool, path->len + 1);
+	if (file->name.data == NULL)
+	{
+		return NGX_ABORT;
+	}
+	ngx_memcpy(file->name.data, path->data, path->len + 1);		// copy the null
+	file->name.len = path->len;
+	file->size = ctx->fs_size;
+	file->mtime = ctx->mtime;
+
+	return NGX_OK;
+}
+
+static int ngx_libc_cdecl
+ngx_index_cache_compare_files(const void* one, const void* two)
+{
+	const ngx_index_cache_file_t* first = one;
+	const ngx_index_cache_file_t* second = two;
+
+	if (first->mtime != second->mtime)
+	{
+		return first->mtime < second->mtime ? -1 : 1;
+	}
+
+	return 0;
+}
+
+#if defined(nginx_version) && nginx_version >= 1011005
+static ngx_msec_t
+#else
+static time_t
+#endif
+ngx_index_cache_manager(void* data)
+{
+	ngx_index_cache_manager_ctx_t manager_ctx;
+	ngx_index_cache_t* cache = data;
+	ngx_index_cache_file_t* cur_file;
+	ngx_index_cache_file_t* last_file;
+	ngx_tree_ctx_t tree;
+
+	manager_ctx.pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+	if (manager_ctx.pool == NULL)
+	{
+		goto done;
+	}
+
+	if (ngx_array_init(&manager_ctx.files, manager_ctx.pool, 64, sizeof(ngx_index_cache_file_t)) != NGX_OK)
+	{
+		goto destroy;
+	}
+
+	manager_ctx.cache = cache;
+	manager_ctx.total_size = 0;
+	manager_ctx.now = ngx_time();
+
+	tree.init_handler = NULL;
+	tree.file_handler = ngx_index_cache_manager_file;
+	tree.pre_tree_handler = ngx_index_cache_manager_noop;
+	tree.post_tree_handler = ngx_index_cache_manager_noop;
+	tree.spec_handler = ngx_index_cache_manager_noop;
+	tree.data = &manager_ctx;
+	tree.alloc = 0;
+	tree.log = ngx_cycle->log;
+
+	if (ngx_walk_tree(&tree, &cache->path->name) != NGX_OK)
+	{
+		goto destroy;
+	}
+
+	ngx_log_debug2(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+		"ngx_index_cache_manager: \"%V\" size %O", &cache->path->name, manager_ctx.total_size);
+
+	if (cache->max_size == 0 || manager_ctx.total_size <= cache->max_size)
+	{
+		goto destroy;
+	}
+
+	// delete the least recently used files
+	ngx_qsort(manager_ctx.files.elts, manager_ctx.files.nelts, sizeof(ngx_index_cache_file_t),
+		ngx_index_cache_compare_files);
+
+	cur_file = manager_ctx.files.elts;
+	last_file = cur_file + manager_ctx.files.nelts;
+	for (; cur_file < last_file && manager_ctx.total_size > cache->max_size; cur_file++)
+	{
+		ngx_index_cache_delete_file(&cur_file->name);
+		manager_ctx.total_size -= cur_file->size;
+	}
+
+destroy:
+
+	ngx_destroy_pool(manager_ctx.pool);
+
+done:
+
+#if defined(nginx_version) && nginx_version >= 1011005
+	return INDEX_CACHE_MANAGER_INTERVAL * 1000;
+#else
+	return INDEX_CACHE_MANAGER_INTERVAL;
+#endif
+}
+
+ngx_index_cache_t*
+ngx_index_cache_create(
+	ngx_conf_t* cf,
+	ngx_path_t* path,
+	off_t max_size,
+	time_t inactive,
+	uint32_t format)
+{
+	ngx_index_cache_t* cache;
+	ngx_path_t** paths;
+	ngx_uint_t i;
+
+	// the same path may be configured in several locations
+	paths = cf->cycle->paths.elts;
+	for (i = 0; i < cf->cycle->paths.nelts; i++)
+	{
+		if (paths[i]->manager != ngx_index_cache_manager ||
+			paths[i]->name.len != path->name.len ||
+			ngx_strcmp(paths[i]->name.data, path->name.data) != 0)
+		{
+			continue;
+		}
+
+		cache = paths[i]->data;
+		if (cache->max_size != max_size ||
+			cache->inactive != inactive ||
+			cache->format != format ||
+			ngx_memcmp(paths[i]->level, path->level, sizeof(path->level)) != 0)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+				"index cache path \"%V\" was already defined in %s:%ui with different parameters",
+				&path->name, paths[i]->conf_file, paths[i]->line);
+			return NULL;
+		}
+
+		return cache;
+	}
+
+	cache = ngx_pcalloc(cf->pool, sizeof(*cache));
+	if (cache == NULL)
+	{
+		return NULL;
+	}
+
+	cache->path = path;
+	cache->max_size = max_size;
+	cache->inactive = inactive;
+	cache->format = format;
+
+	path->manager = ngx_index_cache_manager;
+	path->data = cache;
+
+	// Note: creates the directory on startup, and runs the manager in the cache manager process
+	if (ngx_add_path(cf, &cache->path) != NGX_OK)
+	{
+		return NULL;
+	}
+
+	return cache;
+}
@@ -0,0 +1,79 @@
+#ifndef _NGX_INDEX_CACHE_H_INCLUDED_
+#define _NGX_INDEX_CACHE_H_INCLUDED_
+
+// includes
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <nginx.h>
+
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
+
+// constants
+#define INDEX_CACHE_KEY_SIZE (16)
+#define INDEX_CACHE_DEFAULT_INACTIVE (7 * 86400)		// sec
+
+// typedefs
+typedef struct {
+	ngx_path_t* path;
+	off_t max_size;			// 0 = unlimited
+	time_t inactive;		// 0 = unlimited
+	uint32_t format;		// fingerprint of the layout of the cached buffers, files of other formats are ignored
+} ngx_index_cache_t;
+
+typedef void(*ngx_index_cache_fetch_callback_t)(void* context, ngx_flag_t found, u_char* buffer, size_t buffer_size);
+
+// functions
+ngx_index_cache_t* ngx_index_cache_create(
+	ngx_conf_t* cf,
+	ngx_path_t* path,
+	off_t max_size,
+	time_t inactive,
+	uint32_t format);
+
+ngx_flag_t ngx_index_cache_fetch(
+	ngx_index_cache_t* cache,
+	ngx_pool_t* pool,
+	ngx_log_t* log,
+	u_char* key,
+	off_t source_size,
+	time_t source_mtime,
+	u_char** buffer,
+	size_t* buffer_size);
+
+ngx_flag_t ngx_index_cache_store_gather(
+	ngx_index_cache_t* cache,
+	ngx_pool_t* pool,
+	ngx_log_t* log,
+	u_char* key,
+	off_t source_size,
+	time_t source_mtime,
+	ngx_str_t* buffers,
+	size_t buffer_count);
+
+#if (NGX_THREADS)
+// Note: returns NGX_AGAIN when the fetch was posted, the callback is always called asynchronously
+ngx_int_t ngx_index_cache_fetch_async(
+	ngx_index_cache_t* cache,
+	ngx_thread_pool_t* thread_pool,
+	ngx_pool_t* pool,
+	ngx_log_t* log,
+	u_char* key,
+	off_t source_size,
+	time_t source_mtime,
+	ngx_index_cache_fetch_callback_t callback,
+	void* context);
+
+// Note: the buffers are copied, the write completes in the background
+ngx_flag_t ngx_index_cache_store_gather_async(
+	ngx_index_cache_t* cache,
+	ngx_thread_pool_t* thread_pool,
+	u_char* key,
+	off_t source_size,
+	time_t source_mtime,
+	ngx_str_t* buffers,
+	size_t buffer_count);
+#endif // NGX_THREADS
+
+#endif // _NGX_INDEX_CACHE_H_INCLUDED_
@@ -0,0 +1,308 @@
+#include "ngx_io_uring.h"
+
+#if (NGX_HAVE_IO_URING)
+
+#include <ngx_event.h>
+#include <liburing.h>
+#include <sys/eventfd.h>
+
+/*
+	each worker process lazily creates a single io_uring instance, the first time a read is requested.
+	the completions are signaled on an eventfd that is registered with the nginx event loop, so no
+	thread is blocked waiting for them. reads are async without O_DIRECT, since the kernel punts
+	buffered reads that miss the page cache to its own workers.
+
+	reads are not submitted immediately - the submission queue entries are only prepared, and an event
+	is posted to submit them. since posted events run after all the ready events and expired timers were
+	handled, all the reads requested during an event loop iteration are submitted in a single syscall.
+
+	the entries that were prepared and not consumed by the kernel yet are tracked in order, since the
+	kernel consumes them in order. when the submission fails with a transient error (e.g. the completion
+	queue overflowed), it is retried on a timer. on any other error, or when the retries are exhausted,
+	the pending entries are turned into nops, and their requests are completed with the error.
+*/
+
+// constants
+#define IO_URING_ENTRIES (256)
+#define IO_URING_SUBMIT_RETRY_DELAY (10)		// msec
+#define IO_URING_SUBMIT_MAX_RETRIES (5)
+
+// typedefs
+typedef struct {
+	struct io_uring ring;
+	ngx_connection_t* conn;
+	ngx_event_t submit_event;
+	ngx_flag_t initialized;
+	ngx_flag_t failed;
+	ngx_uint_t submit_retries;
+
+	// the prepared entries that were not consumed yet, a NULL request is used for nops
+	struct io_uring_sqe* pending_sqes[IO_URING_ENTRIES];
+	ngx_io_uring_request_t* pending_requests[IO_URING_ENTRIES];
+	ngx_uint_t pending_count;
+} ngx_io_uring_state_t;
+
+// globals
+static ngx_io_uring_state_t ngx_io_uring_state;
+
+static int
+ngx_io_uring_flush(ngx_io_uring_state_t* state)
+{
+	ngx_uint_t count;
+	int rc;
+
+	rc = io_uring_submit(&state->ring);
+	if (rc <= 0)
+	{
+		return rc;
+	}
+
+	// remove the consumed entries
+	count = ngx_min((ngx_uint_t)rc, state->pending_count);
+	state->pending_count -= count;
+
+	ngx_memmove(state->pending_sqes, state->pending_sqes + count,
+		state->pending_count * sizeof(state->pending_sqes[0]));
+	ngx_memmove(state->pending_requests, state->pending_requests + count,
+		state->pending_count * sizeof(state->pending_requests[0]));
+
+	return rc;
+}
+
+static void
+ngx_io_uring_fail_pending(ngx_io_uring_state_t* state, ngx_err_t err)
+{
+	ngx_io_uring_request_t* requests[IO_URING_ENTRIES];
+	ngx_uint_t request_count = 0;
+	ngx_uint_t i;
+
+	// the entries stay in the submission queue, turn them into nops so that they are ignored
+	for (i = 0; i < state->pending_count; i++)
+	{
+		io_uring_prep_nop(state->pending_sqes[i]);
+		io_uring_sqe_set_data(state->pending_sqes[i], NULL);
+
+		if (state->pending_requests[i] != NULL)
+		{
+			requests[request_count++] = state->pending_requests[i];
+			state->pending_requests[i] = NULL;
+		}
+	}
+
+	// Note: the handlers may issue more reads, so they are called after the state was updated
+	for (i = 0; i < request_count; i++)
+	{
+		requests[i]->handler(requests[i]->data, -err);
+	}
+}
+
+static void
+ngx_io_uring_submit_handler(ngx_event_t* ev)
+{
+	ngx_io_uring_state_t* state = ev->data;
+	ngx_err_t err;
+	int rc;
+
+	if (ev->timer_set)
+	{
+		ngx_del_timer(ev);
+	}
+
+	rc = ngx_io_uring_flush(state);
+	if (rc >= 0)
+	{
+		ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+			"ngx_io_uring_submit_handler: submitted %d entries", rc);
+
+		state->submit_retries = 0;
+
+		if (state->pending_count > 0 && !ev->posted)
+		{
+			// partial submission
+			ngx_post_event(ev, &ngx_posted_events);
+		}
+		return;
+	}
+
+	err = -rc;
+	if ((err == NGX_EAGAIN || err == NGX_EBUSY || err == NGX_EINTR) &&
+		state->submit_retries < IO_URING_SUBMIT_MAX_RETRIES)
+	{
+		ngx_log_error(NGX_LOG_WARN, ev->log, err,
+			"ngx_io_uring_submit_handler: io_uring_submit failed, retrying");
+
+		state->submit_retries++;
+		ngx_add_timer(ev, IO_URING_SUBMIT_RETRY_DELAY);
+		return;
+	}
+
+	ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+		"ngx_io_uring_submit_handler: io_uring_submit failed, failing %ui entries", state->pending_count);
+
+	state->submit_retries = 0;
+
+	ngx_io_uring_fail_pending(state, err);
+}
+
+static void
+ngx_io_uring_completion_handler(ngx_event_t* ev)
+{
+	ngx_io_uring_request_t* request;
+	ngx_io_uring_state_t* state = &ngx_io_uring_state;
+	struct io_uring_cqe* cqe;
+	ngx_connection_t* c = ev->data;
+	uint64_t value;
+	ssize_t result;
+
+	if (read(c->fd, &value, sizeof(value)) == -1 && ngx_errno != NGX_EAGAIN)
+	{
+		ngx_log_error(NGX_LOG_ALERT, ev->log, ngx_errno,
+			"ngx_io_uring_completion_handler: read() failed");
+	}
+
+	while (io_uring_peek_cqe(&state->ring, &cqe) == 0)
+	{
+		request = io_uring_cqe_get_data(cqe);
+		result = cqe->res;
+
+		io_uring_cqe_seen(&state->ring, cqe);
+
+		if (request == NULL)
+		{
+			// nop of a request that failed to submit
+			continue;
+		}
+
+		// Note: the handler may issue more reads
+		request->handler(request->data, result);
+	}
+}
+
+static ngx_int_t
+ngx_io_uring_init(ngx_io_uring_state_t* state, ngx_log_t* log)
+{
+	ngx_connection_t* c;
+	ngx_fd_t efd;
+	int rc;
+
+	rc = io_uring_queue_init(IO_URING_ENTRIES, &state->ring, 0);
+	if (rc < 0)
+	{
+		ngx_log_error(NGX_LOG_ALERT, log, -rc,
+			"ngx_io_uring_init: io_uring_queue_init failed");
+		return NGX_ERROR;
+	}
+
+	efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd == -1)
+	{
+		ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+			"ngx_io_uring_init: eventfd() failed");
+		goto failed;
+	}
+
+	rc = io_uring_register_eventfd(&state->ring, efd);
+	if (rc < 0)
+	{
+		ngx_log_error(NGX_LOG_ALERT, log, -rc,
+			"ngx_io_uring_init: io_uring_register_eventfd failed");
+		goto close;
+	}
+
+	c = ngx_get_connection(efd, ngx_cycle->log);
+	if (c == NULL)
+	{
+		goto close;
+	}
+
+	c->log = ngx_cycle->log;
+	c->read->log = c->log;
+	c->read->handler = ngx_io_uring_completion_handler;
+	c->read->data = c;
+
+	if (ngx_add_event(c->read, NGX_READ_EVENT, 0) != NGX_OK)
+	{
+		ngx_free_connection(c);
+		goto close;
+	}
+
+	state->conn = c;
+	state->submit_event.handler = ngx_io_uring_submit_handler;
+	state->submit_event.data = state;
+	state->submit_event.log = ngx_cycle->log;
+
+	return NGX_OK;
+
+close:
+
+	if (close(efd) == -1)
+	{
+		ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+			"ngx_io_uring_init: close() failed");
+	}
+
+failed:
+
+	io_uring_queue_exit(&state->ring);
+	return NGX_ERROR;
+}
+
+ngx_int_t
+ngx_io_uring_read(
+	ngx_io_uring_request_t* request,
+	ngx_log_t* log,
+	ngx_fd_t fd,
+	u_char* buf,
+	size_t size,
+	off_t offset)
+{
+	ngx_io_uring_state_t* state = &ngx_io_uring_state;
+	struct io_uring_sqe* sqe;
+
+	if (!state->initialized)
+	{
+		state->initialized = 1;
+		state->failed = ngx_io_uring_init(state, log) != NGX_OK;
+	}
+
+	if (state->failed)
+	{
+		return NGX_DECLINED;
+	}
+
+	sqe = io_uring_get_sqe(&state->ring);
+	if (sqe == NULL)
+	{
+		// the submission queue is full, submit the pending entries now
+		// Note: on failure, the posted submit event retries or fails the pending entries
+		if (ngx_io_uring_flush(state) < 0)
+		{
+			return NGX_DECLINED;
+		}
+
+		sqe = io_uring_get_sqe(&state->ring);
+		if (sqe == NULL)
+		{
+			return NGX_DECLINED;
+		}
+	}
+
+	io_uring_prep_read(sqe, fd, buf, size, offset);
+	io_uring_sqe_set_data(sqe, request);
+
+	state->pending_sqes[state->pending_count] = sqe;
+	state->pending_requests[state->pending_count] = request;
+	state->pending_count++;
+
+	if (!state->submit_event.posted)
+	{
+		ngx_post_event(&state->submit_event, &ngx_posted_events);
+	}
+
+	ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
+		"ngx_io_uring_read: queued read of fd %d offset %O size %uz", fd, offset, size);
+
+	return NGX_AGAIN;
+}
+
+#endif // NGX_HAVE_IO_URING
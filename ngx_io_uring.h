@@ -0,0 +1,25 @@
+#ifndef _NGX_IO_URING_H_INCLUDED_
+#define _NGX_IO_URING_H_INCLUDED_
+
+// includes
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+// typedefs
+typedef void(*ngx_io_uring_handler_t)(void* data, ssize_t result);
+
+typedef struct {
+	ngx_io_uring_handler_t handler;
+	void* data;
+} ngx_io_uring_request_t;
+
+// functions
+ngx_int_t ngx_io_uring_read(
+	ngx_io_uring_request_t* request,
+	ngx_log_t* log,
+	ngx_fd_t fd,
+	u_char* buf,
+	size_t size,
+	off_t offset);
+
+#endif // _NGX_IO_URING_H_INCLUDED_
@@ -0,0 +1,252 @@
+#include "ngx_manifest_template.h"
+
+/*
+	a manifest template is a response in which the per request parts (e.g. the host name in absolute urls)
+	were replaced with references to values that are evaluated on each request.
+	when the manifest cache is enabled, the manifest is built with placeholders instead of the per request 
+	values. a placeholder is composed of the value index, enclosed in PLACEHOLDER_MARK bytes - a control 
+	character that is not used in the manifest formats.
+	the template is laid out as -
+		uint32_t part_count
+		ngx_manifest_template_part_t parts[part_count]
+		u_char literals[]		// the literal data of all the parts, in order
+	each part is a literal followed by a value reference, the value index of the last part is NO_VALUE.
+	the template may be stored at any alignment, so the integers are read with memcpy.
+*/
+
+// constants
+#define NO_VALUE (0xffffffff)
+#define PLACEHOLDER_MARK (0x01)
+#define PLACEHOLDER_SIZE (3)
+
+// typedefs
+typedef struct {
+	uint32_t literal_size;
+	uint32_t value_index;
+} ngx_manifest_template_part_t;
+
+// globals
+static u_char placeholders[] = "\x01" "0" "\x01" "1" "\x01" "2" "\x01" "3" "\x01";
+
+void
+ngx_manifest_template_get_placeholder(ngx_uint_t value_index, ngx_str_t* result)
+{
+	result->data = placeholders + value_index * (PLACEHOLDER_SIZE - 1);
+	result->len = PLACEHOLDER_SIZE;
+}
+
+ngx_int_t
+ngx_manifest_template_build(
+	ngx_pool_t* pool,
+	ngx_log_t* log,
+	ngx_str_t* response,
+	ngx_uint_t value_count,
+	ngx_str_t* result)
+{
+	ngx_manifest_template_part_t* cur_part;
+	ngx_array_t parts;
+	u_char* literal_start;
+	u_char* end = response->data + response->len;
+	u_char* pos;
+	u_char* p;
+	size_t literals_size;
+	uint32_t part_count;
+	ngx_uint_t i;
+
+	if (value_count > NGX_MANIFEST_TEMPLATE_MAX_VALUES)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"ngx_manifest_template_build: value count %ui exceeds the limit", value_count);
+		return NGX_ERROR;
+	}
+
+	if (ngx_array_init(&parts, pool, 8, sizeof(*cur_part)) != NGX_OK)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_manifest_template_build: ngx_array_init failed");
+		return NGX_ERROR;
+	}
+
+	// find the placeholders
+	literals_size = 0;
+	literal_start = response->data;
+	pos = response->data;
+	for (;;)
+	{
+		pos = ngx_strlchr(pos, end, PLACEHOLDER_MARK);
+		if (pos == NULL)
+		{
+			break;
+		}
+
+		if (end - pos < PLACEHOLDER_SIZE ||
+			pos[1] < '0' || pos[1] >= (u_char)('0' + value_count) ||
+			pos[2] != PLACEHOLDER_MARK)
+		{
+			pos++;
+			continue;
+		}
+
+		cur_part = ngx_array_push(&parts);
+		if (cur_part == NULL)
+		{
+			ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+				"ngx_manifest_template_build: ngx_array_push failed");
+			return NGX_ERROR;
+		}
+
+		cur_part->literal_size = pos - literal_start;
+		cur_part->value_index = pos[1] - '0';
+		literals_size += cur_part->literal_size;
+
+		pos += PLACEHOLDER_SIZE;
+		literal_start = pos;
+	}
+
+	cur_part = ngx_array_push(&parts);
+	if (cur_part == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_manifest_template_build: ngx_array_push failed");
+		return NGX_ERROR;
+	}
+
+	cur_part->literal_size = end - literal_start;
+	cur_part->value_index = NO_VALUE;
+	literals_size += cur_part->literal_size;
+
+	// build the template
+	result->len = sizeof(uint32_t) + parts.nelts * sizeof(*cur_part) + literals_size;
+	result->data = ngx_pnalloc(pool, result->len);
+	if (result->data == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_manifest_template_build: ngx_pnalloc failed");
+		return NGX_ERROR;
+	}
+
+	p = result->data;
+	part_count = parts.nelts;
+	p = ngx_copy(p, &part_count, sizeof(part_count));
+	p = ngx_copy(p, parts.elts, parts.nelts * sizeof(*cur_part));
+
+	pos = response->data;
+	cur_part = parts.elts;
+	for (i = 0; i < parts.nelts; i++, cur_part++)
+	{
+		p = ngx_copy(p, pos, cur_part->literal_size);
+		pos += cur_part->literal_size;
+		if (cur_part->value_index != NO_VALUE)
+		{
+			pos += PLACEHOLDER_SIZE;
+		}
+	}
+
+	return NGX_OK;
+}
+
+ngx_int_t
+ngx_manifest_template_expand(
+	ngx_pool_t* pool,
+	ngx_log_t* log,
+	u_char* template,
+	size_t template_size,
+	ngx_str_t* values,
+	ngx_uint_t value_count,
+	ngx_str_t* result)
+{
+	ngx_manifest_template_part_t cur_part;
+	ngx_str_t* cur_value;
+	uint32_t part_count;
+	uint32_t i;
+	u_char* parts;
+	size_t literals_size;
+	size_t result_size;
+	u_char* literals;
+	u_char* p;
+
+	// validate the parts
+	if (template_size < sizeof(uint32_t))
+	{
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"ngx_manifest_template_expand: template size %uz too small", template_size);
+		return NGX_ERROR;
+	}
+
+	ngx_memcpy(&part_count, template, sizeof(part_count));
+	template += sizeof(uint32_t);
+	template_size -= sizeof(uint32_t);
+
+	if (part_count == 0 || part_count > template_size / sizeof(cur_part))
+	{
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"ngx_manifest_template_expand: invalid part count %uD", part_count);
+		return NGX_ERROR;
+	}
+
+	parts = template;
+	literals = parts + part_count * sizeof(cur_part);
+
+	literals_size = 0;
+	result_size = 0;
+	for (i = 0; i < part_count; i++)
+	{
+		ngx_memcpy(&cur_part, parts + i * sizeof(cur_part), sizeof(cur_part));
+
+		literals_size += cur_part.literal_size;
+		result_size += cur_part.literal_size;
+
+		if (cur_part.value_index == NO_VALUE)
+		{
+			continue;
+		}
+
+		if (cur_part.value_index >= value_count)
+		{
+			ngx_log_error(NGX_LOG_ERR, log, 0,
+				"ngx_manifest_template_expand: invalid value index %uD", cur_part.value_index);
+			return NGX_ERROR;
+		}
+
+		result_size += values[cur_part.value_index].len;
+	}
+
+	if (literals_size != template_size - part_count * sizeof(cur_part))
+	{
+		ngx_log_error(NGX_LOG_ERR, log, 0,
+			"ngx_manifest_template_expand: literals size %uz does not match template size %uz",
+			literals_size, template_size);
+		return NGX_ERROR;
+	}
+
+	// build the response
+	p = ngx_pnalloc(pool, result_size);
+	if (p == NULL)
+	{
+		ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0,
+			"ngx_manifest_template_expand: ngx_pnalloc failed");
+		return NGX_ERROR;
+	}
+
+	result->data = p;
+
+	for (i = 0; i < part_count; i++)
+	{
+		ngx_memcpy(&cur_part, parts + i * sizeof(cur_part), sizeof(cur_part));
+
+		p = ngx_copy(p, literals, cur_part.literal_size);
+		literals += cur_part.literal_size;
+
+		if (cur_part.value_index == NO_VALUE)
+		{
+			continue;
+		}
+
+		cur_value = &values[cur_part.value_index];
+		p = ngx_copy(p, cur_value->data, cur_value->len);
+	}
+
+	result->len = p - result->data;
+
+	return NGX_OK;
+}
@@ -0,0 +1,30 @@
+#ifndef _NGX_MANIFEST_TEMPLATE_H_INCLUDED_
+#define _NGX_MANIFEST_TEMPLATE_H_INCLUDED_
+
+// includes
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+// constants
+#define NGX_MANIFEST_TEMPLATE_MAX_VALUES (4)
+
+// functions
+void ngx_manifest_template_get_placeholder(ngx_uint_t value_index, ngx_str_t* result);
+
+ngx_int_t ngx_manifest_template_build(
+	ngx_pool_t* pool,
+	ngx_log_t* log,
+	ngx_str_t* response,
+	ngx_uint_t value_count,
+	ngx_str_t* result);
+
+ngx_int_t ngx_manifest_template_expand(
+	ngx_pool_t* pool,
+	ngx_log_t* log,
+	u_char* template,
+	size_t template_size,
+	ngx_str_t* values,
+	ngx_uint_t value_count,
+	ngx_str_t* result);
+
+#endif // _NGX_MANIFEST_TEMPLATE_H_INCLUDED_
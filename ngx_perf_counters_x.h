@@ -1,5 +1,7 @@
 PC(FETCH_CACHE,				fetch_cache)
 PC(STORE_CACHE,				store_cache)
+PC(FETCH_INDEX_CACHE,		fetch_index_cache)
+PC(STORE_INDEX_CACHE,		store_index_cache)
 PC(MAP_PATH,				map_path)
 PC(PARSE_MEDIA_SET,			parse_media_set)
 PC(GET_DRM_INFO,			get_drm_info)
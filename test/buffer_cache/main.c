@@ -4,11 +4,17 @@
 
 // macros
 #define RAND(min, max) (rand() % ((max) - (min) + 1) + (min))
+#define SIZE_EVICTED ((size_t)-1)
+#define HELD_ENTRIES (16)
+#define MAX_REPLACE_SIZE (32)
+#define LEAKED_REF_INTERVAL (100)
 //#define VERBOSE
 
 // globals
 ngx_time_t ngx_time;
 ngx_shm_zone_t shm_zone;
+ngx_buffer_cache_t* test_cache;
+ngx_pool_t* test_pool;
 volatile ngx_cycle_t  *ngx_cycle;
 volatile ngx_time_t	 *ngx_cached_time = &ngx_time;
 
@@ -29,6 +35,18 @@ ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
 {
 }
 
+void ngx_cdecl
+ngx_conf_log_error(ngx_uint_t level, ngx_conf_t *cf, ngx_err_t err,
+	const char *fmt, ...)
+{
+}
+
+ngx_int_t
+ngx_shmtx_create(ngx_shmtx_t *mtx, ngx_shmtx_sh_t *addr, u_char *name)
+{
+	return NGX_OK;
+}
+
 void
 ngx_shmtx_lock(ngx_shmtx_t *mtx)
 {
@@ -47,8 +65,11 @@ ngx_shared_memory_add(ngx_conf_t *cf, ngx_str_t *name, size_t size, void *tag)
 
 // buffer cache initialization
 ngx_flag_t
-init_buffer_cache(size_t size)
+init_buffer_cache(size_t size, ngx_uint_t partitions)
 {
+	ngx_str_t name = ngx_string("test");
+	ngx_conf_t cf;
+
 	ngx_time.sec = 0;
 	ngx_memzero(&shm_zone, sizeof(shm_zone));
 	shm_zone.shm.size = size;
@@ -57,14 +78,36 @@ init_buffer_cache(size_t size)
 	{
 		return 0;
 	}
-	ngx_buffer_cache_create_zone(NULL, NULL, 0, NULL);
-	shm_zone.init(&shm_zone, NULL);
+
+	test_pool = ngx_create_pool(1024, NULL);
+	if (test_pool == NULL)
+	{
+		return 0;
+	}
+
+	ngx_memzero(&cf, sizeof(cf));
+	cf.pool = test_pool;
+
+	test_cache = ngx_buffer_cache_create(&cf, &name, size, 0, partitions, NULL, NULL);
+	if (test_cache == NULL)
+	{
+		return 0;
+	}
+
+	if (shm_zone.init(&shm_zone, NULL) != NGX_OK)
+	{
+		return 0;
+	}
 	return 1;
 }
 
 void
 free_buffer_cache()
 {
+	ngx_destroy_pool(test_pool);
+	test_pool = NULL;
+	test_cache = NULL;
+
 	free(shm_zone.shm.addr);
 	shm_zone.shm.addr = NULL;
 }
@@ -80,11 +123,11 @@ void print_queue(ngx_queue_t* queue, const char* name, u_char* relative_offset)
 	{
 		entry = container_of(cur, ngx_buffer_cache_entry_t, queue_node);
 
-		printf("\tSO=%lx BS=%zx ST=%lu\n", entry->start_offset - relative_offset, entry->buffer_size, entry->state);
+		printf("\tSO=%lx BS=%zx ST=%lu RC=%lu\n", entry->start_offset - relative_offset, entry->buffer_size, entry->state, entry->ref_count);
 	}
 }
 
-void print_cache_status(ngx_buffer_cache_t *cache)
+void print_cache_status(ngx_buffer_cache_sh_t *cache)
 {
 	printf("ES=%lx EE=%lx BS=%lx BW=%lx BR=%lx BE=%lx\n", 
 		(u_char*)cache->entries_start - (u_char*)cache->entries_start,
@@ -137,8 +180,9 @@ int validate_random_buffer(unsigned int seed, const u_char* buffer, size_t size)
 	return 1;
 }
 
-int run_test_cycle(time_t seed, size_t cache_size, int iterations, int size_factor)
+int run_test_cycle(time_t seed, size_t cache_size, ngx_uint_t partitions, int iterations, int size_factor)
 {
+	ngx_buffer_cache_entry_t* entry;
 	ngx_buffer_cache_stats_t stats;
 	u_char key[BUFFER_CACHE_KEY_SIZE];
 	u_char* fetch_buffer;
@@ -146,10 +190,11 @@ int run_test_cycle(time_t seed, size_t cache_size, int iterations, int size_fact
 	size_t* sizes_buffer;
 	size_t size;
 	size_t max_size;
-	int min_existing_index = 0;
+	uint32_t hash;
+	int existing_count;
 	int i, j;
 
-	printf("starting test - seed %llu cache_size %zu iterations %d size factor %d\n", (unsigned long long)seed, cache_size, iterations, size_factor);
+	printf("starting test - seed %llu cache_size %zu partitions %lu iterations %d size factor %d\n", (unsigned long long)seed, cache_size, (unsigned long)partitions, iterations, size_factor);
 
 	srand(seed);
 	
@@ -167,7 +212,7 @@ int run_test_cycle(time_t seed, size_t cache_size, int iterations, int size_fact
 		return 0;
 	}
 
-	if (!init_buffer_cache(cache_size))
+	if (!init_buffer_cache(cache_size, partitions))
 	{
 		printf("Error: failed to initialize the buffer cache\n");
 		return 0;
@@ -175,19 +220,24 @@ int run_test_cycle(time_t seed, size_t cache_size, int iterations, int size_fact
 
 	for (i = 0; i < iterations; i++)
 	{
-		ngx_buffer_cache_t *cache;
-		ngx_slab_pool_t *shpool;
+		ngx_buffer_cache_sh_t *cache;
 
-		shpool = (ngx_slab_pool_t *)shm_zone.shm.addr;
-		cache = shpool->data;
+		((uint32_t*)&key)[0] = i;
+
+		// get the partition the key will be stored in
+		cache = test_cache->sh;
+		if (partitions > 1)
+		{
+			hash = ngx_crc32_short(key, BUFFER_CACHE_KEY_SIZE);
+			cache += (hash >> 16) % partitions;
+		}
 
 #ifdef VERBOSE
 		printf("%d. ", i);
 		print_cache_status(cache);
 #endif
 
-		ngx_time.sec += ENTRY_LOCK_EXPIRATION + 1;
-		((uint32_t*)&key)[0] = i;
+		ngx_time.sec += CACHE_LOCK_EXPIRATION + 1;
 
 		if (RAND(0, iterations) == 0)
 		{
@@ -206,16 +256,24 @@ int run_test_cycle(time_t seed, size_t cache_size, int iterations, int size_fact
 		printf("storing size=%zx\n", size);
 #endif
 				
-		if (!ngx_buffer_cache_store(&shm_zone, key, store_buffer, size))
+		if (!ngx_buffer_cache_store(test_cache, key, store_buffer, size))
 		{
 			printf("Error: store failed\n");
 			return 0;
 		}
 		
-		for (j = min_existing_index; j <= i; j++)
+		// Note: with multiple partitions, the eviction order is not global, tracking the evicted keys
+		//		by setting their size to SIZE_EVICTED
+		existing_count = 0;
+		for (j = 0; j <= i; j++)
 		{
+			if (sizes_buffer[j] == SIZE_EVICTED)
+			{
+				continue;
+			}
+
 			((uint32_t*)&key)[0] = j;
-			if (ngx_buffer_cache_fetch(&shm_zone, key, &fetch_buffer, &size))
+			if (ngx_buffer_cache_fetch(test_cache, key, &fetch_buffer, &size, &entry))
 			{
 				if (sizes_buffer[j] != size)
 				{
@@ -228,27 +286,31 @@ int run_test_cycle(time_t seed, size_t cache_size, int iterations, int size_fact
 					printf("Error: invalid buffer content\n");
 					return 0;
 				}
+
+				ngx_buffer_cache_release(entry);
+
+				existing_count++;
 			}
 			else
 			{
-				min_existing_index++;
-			}			
+				sizes_buffer[j] = SIZE_EVICTED;
+			}
 		}
 
 #ifdef VERBOSE
-		printf("validated %d buffers\n", i + 1 - min_existing_index);
+		printf("validated %d buffers\n", existing_count);
 #endif
 
-		ngx_buffer_cache_get_stats(&shm_zone, &stats);
+		ngx_buffer_cache_get_stats(test_cache, &stats);
 		if (stats.store_ok != i + 1)
 		{
 			printf("Error: invalid store_ok value, actual=%lu expected=%d\n", stats.store_ok, i + 1);
 			return 0;
 		}
 		
-		if (stats.store_ok - stats.evicted != i + 1 - min_existing_index)
+		if (stats.store_ok - stats.evicted != existing_count)
 		{
-			printf("Error: unexpected number of items in the cache, stats=%lu fetched=%d\n", stats.store_ok - stats.evicted, i + 1 - min_existing_index);
+			printf("Error: unexpected number of items in the cache, stats=%lu fetched=%d\n", stats.store_ok - stats.evicted, existing_count);
 			return 0;
 		}
 		
@@ -271,11 +333,191 @@ int run_test_cycle(time_t seed, size_t cache_size, int iterations, int size_fact
 	return 1;
 }
 
+int run_replace_test_cycle(time_t seed, size_t cache_size, int key_count, int iterations)
+{
+	ngx_buffer_cache_entry_t* held_entries[HELD_ENTRIES];
+	u_char* held_buffers[HELD_ENTRIES];
+	size_t held_sizes[HELD_ENTRIES];
+	int held_seeds[HELD_ENTRIES];
+	ngx_buffer_cache_entry_t* entry;
+	ngx_buffer_cache_sh_t *cache;
+	u_char key[BUFFER_CACHE_KEY_SIZE];
+	u_char store_buffer[MAX_REPLACE_SIZE];
+	u_char* fetch_buffer;
+	size_t* sizes_buffer;
+	int* seeds_buffer;
+	size_t size;
+	int existing_count;
+	int store_errors;
+	int i, j, k;
+
+	printf("starting replace test - seed %llu cache_size %zu keys %d iterations %d\n", (unsigned long long)seed, cache_size, key_count, iterations);
+
+	srand(seed);
+
+	sizes_buffer = malloc(sizeof(sizes_buffer[0]) * key_count);
+	seeds_buffer = malloc(sizeof(seeds_buffer[0]) * key_count);
+	if (sizes_buffer == NULL || seeds_buffer == NULL)
+	{
+		printf("Error: failed to allocate keys buffers\n");
+		return 0;
+	}
+
+	for (j = 0; j < key_count; j++)
+	{
+		sizes_buffer[j] = SIZE_EVICTED;
+	}
+
+	ngx_memzero(held_entries, sizeof(held_entries));
+
+	if (!init_buffer_cache(cache_size, 1))
+	{
+		printf("Error: failed to initialize the buffer cache\n");
+		return 0;
+	}
+
+	cache = test_cache->sh;
+	ngx_memzero(key, sizeof(key));
+	store_errors = 0;
+
+	for (i = 0; i < iterations; i++)
+	{
+		ngx_time.sec++;
+
+		// replace a random key with small buffers, so that the index size is the limit
+		j = RAND(0, key_count - 1);
+		((uint32_t*)&key)[0] = j;
+
+		size = RAND(0, MAX_REPLACE_SIZE);
+		generate_random_buffer(i, store_buffer, size);
+
+		if (ngx_buffer_cache_replace(test_cache, key, store_buffer, size))
+		{
+			sizes_buffer[j] = size;
+			seeds_buffer[j] = i;
+		}
+		else
+		{
+			// the previous entry was removed even if the store failed
+			sizes_buffer[j] = SIZE_EVICTED;
+			store_errors++;
+		}
+
+		// hold references to random keys, so that some replaced / oldest entries remain referenced.
+		// the buffers of held entries must not change until they are released
+		j = i % HELD_ENTRIES;
+		if (held_entries[j] != NULL)
+		{
+			if (!validate_random_buffer(held_seeds[j], held_buffers[j], held_sizes[j]))
+			{
+				printf("Error: invalid held buffer content\n");
+				return 0;
+			}
+
+			// simulate a reference leaked by a killed process
+			if (RAND(0, LEAKED_REF_INTERVAL) != 0)
+			{
+				ngx_buffer_cache_release(held_entries[j]);
+			}
+			held_entries[j] = NULL;
+		}
+
+		k = RAND(0, key_count - 1);
+		((uint32_t*)&key)[0] = k;
+		if (ngx_buffer_cache_fetch(test_cache, key, &held_buffers[j], &held_sizes[j], &held_entries[j]))
+		{
+			held_seeds[j] = seeds_buffer[k];
+		}
+		else
+		{
+			held_entries[j] = NULL;
+		}
+
+		// validate all keys hold their last value
+		existing_count = 0;
+		for (j = 0; j < key_count; j++)
+		{
+			if (sizes_buffer[j] == SIZE_EVICTED)
+			{
+				continue;
+			}
+
+			((uint32_t*)&key)[0] = j;
+			if (ngx_buffer_cache_fetch(test_cache, key, &fetch_buffer, &size, &entry))
+			{
+				if (sizes_buffer[j] != size)
+				{
+					printf("Error: invalid buffer size\n");
+					return 0;
+				}
+
+				if (!validate_random_buffer(seeds_buffer[j], fetch_buffer, size))
+				{
+					printf("Error: invalid buffer content\n");
+					return 0;
+				}
+
+				ngx_buffer_cache_release(entry);
+
+				existing_count++;
+			}
+			else
+			{
+				sizes_buffer[j] = SIZE_EVICTED;
+			}
+		}
+
+		if (cache->index_count > cache->index_max_count)
+		{
+			printf("Error: index count exceeds the limit, count=%u max=%u\n", cache->index_count, cache->index_max_count);
+			return 0;
+		}
+
+		if (cache->index_count != (uint32_t)existing_count)
+		{
+			printf("Error: unexpected number of items in the index, index=%u fetched=%d\n", cache->index_count, existing_count);
+			return 0;
+		}
+
+		if (((i + 1) & 0xFF) == 0)
+		{
+			printf(".");
+		}
+	}
+
+	for (j = 0; j < HELD_ENTRIES; j++)
+	{
+		if (held_entries[j] != NULL)
+		{
+			ngx_buffer_cache_release(held_entries[j]);
+		}
+	}
+
+	// stores fail while the oldest entry is referenced, make sure leaked references do not block the cache
+	if (store_errors > iterations / 4)
+	{
+		printf("Error: too many store errors, errors=%d iterations=%d\n", store_errors, iterations);
+		return 0;
+	}
+
+	free_buffer_cache();
+
+	free(seeds_buffer);
+
+	free(sizes_buffer);
+
+	printf("\n");
+
+	return 1;
+}
+
 int main()
 {
 	setbuf(stdout, NULL);		// disable stdout buffering (for progress indication)
 	
-	while (run_test_cycle(time(NULL), RAND(2 * 1024 * 1024, 16 * 1024 * 1024), 1000, 1 << RAND(0, 6)));
+	while (run_test_cycle(time(NULL), RAND(2 * 1024 * 1024, 16 * 1024 * 1024), 1, 1000, 1 << RAND(0, 6)) &&
+		run_test_cycle(time(NULL), RAND(8 * 1024 * 1024, 16 * 1024 * 1024), RAND(2, 4), 1000, 1 << RAND(0, 6)) &&
+		run_replace_test_cycle(time(NULL), RAND(512 * 1024, 1024 * 1024), RAND(4096, 8192), 5000));
 
 	return 0;
 }
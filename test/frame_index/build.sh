@@ -0,0 +1,13 @@
+#!/bin/bash
+
+if [ -z "$NGX_ROOT" ]; then 
+	echo "NGX_ROOT not set"
+	exit 1
+fi
+
+if [ -z "$VOD_ROOT" ]; then 
+	echo "VOD_ROOT not set"
+	exit 1
+fi
+
+cc -Wall -g -ofitest $VOD_ROOT/test/frame_index/main.c $VOD_ROOT/vod/mp4/mp4_parser.c $VOD_ROOT/vod/mp4/mp4_parser_base.c $VOD_ROOT/vod/mp4/mp4_frame_index.c $VOD_ROOT/vod/mp4/mp4_sample_index.c $VOD_ROOT/vod/mp4/mp4_decrypt.c $VOD_ROOT/vod/mp4/mp4_aes_ctr.c $VOD_ROOT/vod/codec_config.c $VOD_ROOT/vod/common.c $VOD_ROOT/vod/language_code.c $VOD_ROOT/vod/media_format.c $VOD_ROOT/vod/parse_utils.c $VOD_ROOT/vod/buffer_pool.c $VOD_ROOT/vod/input/frames_source_cache.c $VOD_ROOT/vod/input/read_cache.c $NGX_ROOT/src/core/ngx_array.c $NGX_ROOT/src/core/ngx_string.c $NGX_ROOT/src/core/ngx_palloc.c $NGX_ROOT/src/os/unix/ngx_alloc.c -I $NGX_ROOT/src/core  -I $NGX_ROOT/src/event -I $NGX_ROOT/src/event/modules -I $NGX_ROOT/src/os/unix -I $NGX_ROOT/objs -I $VOD_ROOT -lz -lcrypto
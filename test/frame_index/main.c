@@ -0,0 +1,472 @@
+// include
+#include <stdio.h>
+#include <ngx_core.h>
+#include <vod/mp4/mp4_parser.h>
+#include <vod/mp4/mp4_format.h>
+#include <vod/media_set.h>
+#include <vod/segmenter.h>
+#include <vod/language_code.h>
+
+// constants
+#define SEGMENT_DURATION (10000)
+
+// typedefs
+typedef struct {
+	uint32_t clip_from;
+	uint32_t clip_to;
+	uint64_t start;
+	uint64_t end;
+	bool_t align_to_key_frames;
+} test_case_t;
+
+typedef struct {
+	vod_status_t rc;
+	media_track_array_t tracks;
+	media_range_t range;
+} parse_result_t;
+
+// globals
+volatile ngx_cycle_t  *ngx_cycle;
+ngx_pool_t* init_pool;
+ngx_pool_t* test_pool;
+ngx_log_t test_log;
+u_char* file_buffer;
+size_t file_size;
+vod_str_t saved_indexes[MAX_TRACK_COUNT];
+int error_count;
+int test_count;
+int indexed_count;
+
+// nginx function stubs
+#if (NGX_HAVE_VARIADIC_MACROS)
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+	const char *fmt, ...)
+
+#else
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+	const char *fmt, va_list args)
+
+#endif
+{
+}
+
+static int
+load_file(const char* path)
+{
+	FILE* fp;
+	long size;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL)
+	{
+		printf("Error: failed to open %s\n", path);
+		return 0;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	file_buffer = malloc(size);
+	if (file_buffer == NULL || fread(file_buffer, 1, size, fp) != (size_t)size)
+	{
+		printf("Error: failed to read %s\n", path);
+		fclose(fp);
+		return 0;
+	}
+
+	file_size = size;
+	fclose(fp);
+	return 1;
+}
+
+static vod_status_t
+parse_metadata(
+	request_context_t* request_context,
+	file_info_t* file_info,
+	int parse_type,
+	media_base_metadata_t** result)
+{
+	media_parse_params_t parse_params;
+	uint32_t tracks_mask[MEDIA_TYPE_COUNT];
+	vod_str_t parts[MP4_METADATA_PART_COUNT];
+	vod_status_t rc;
+	off_t moov_offset;
+	size_t moov_size;
+
+	rc = mp4_parser_get_moov_atom_info(request_context, file_buffer, file_size, &moov_offset, &moov_size);
+	if (rc != VOD_OK || moov_size == 0)
+	{
+		printf("Error: failed to find the moov atom\n");
+		return VOD_BAD_DATA;
+	}
+
+	vod_memzero(parts, sizeof(parts));
+	parts[MP4_METADATA_PART_MOOV].data = file_buffer + moov_offset;
+	parts[MP4_METADATA_PART_MOOV].len = moov_size;
+
+	vod_memset(tracks_mask, 0xff, sizeof(tracks_mask));
+
+	vod_memzero(&parse_params, sizeof(parse_params));
+	parse_params.required_tracks_mask = tracks_mask;
+	parse_params.codecs_mask = -1;
+	parse_params.clip_from = file_info->source->clip_from;
+	parse_params.clip_to = file_info->source->clip_to;
+	parse_params.parse_type = parse_type;
+
+	return mp4_parser_parse_basic_metadata(
+		request_context,
+		&parse_params,
+		parts,
+		MP4_METADATA_PART_COUNT,
+		file_info,
+		result);
+}
+
+// Note: index_mode 0 = sample tables, 1 = build the frame index, 2 = use a previously built frame index
+static void
+parse_frames(test_case_t* test, int index_mode, parse_result_t* result)
+{
+	request_context_t request_context;
+	media_parse_params_t parse_params;
+	media_base_metadata_t* base;
+	read_cache_state_t read_cache_state;
+	media_clip_source_t source;
+	media_sequence_t sequence;
+	segmenter_conf_t segmenter;
+	file_info_t file_info;
+	vod_str_t frame_data;
+	media_format_read_request_t read_req;
+	uint32_t i;
+	int parse_type;
+
+	vod_memzero(&request_context, sizeof(request_context));
+	request_context.pool = test_pool;
+	request_context.log = &test_log;
+
+	vod_memzero(&sequence, sizeof(sequence));
+	vod_memzero(&source, sizeof(source));
+	source.sequence = &sequence;
+	source.clip_from = test->clip_from;
+	source.clip_to = test->clip_to;
+
+	vod_memzero(&file_info, sizeof(file_info));
+	file_info.source = &source;
+
+	parse_type = PARSE_FLAG_FRAMES_ALL | PARSE_FLAG_EDIT_LIST;
+	if (index_mode != 0)
+	{
+		parse_type |= PARSE_FLAG_FRAME_INDEX;
+	}
+
+	result->rc = parse_metadata(&request_context, &file_info, parse_type, &base);
+	if (result->rc != VOD_OK)
+	{
+		return;
+	}
+
+	if (index_mode == 2)
+	{
+		for (i = 0; i < base->tracks.nelts && i < MAX_TRACK_COUNT; i++)
+		{
+			base->frame_indexes[i].data = saved_indexes[i];
+		}
+	}
+
+	result->range.start = test->start;
+	result->range.end = test->end;
+	result->range.timescale = 1000;
+
+	vod_memzero(&parse_params, sizeof(parse_params));
+	parse_params.clip_from = test->clip_from;
+	parse_params.clip_to = test->clip_to;
+	parse_params.range = &result->range;
+	parse_params.max_frame_count = 1024 * 1024;
+	parse_params.max_frames_size = 16 * 1024 * 1024;
+	parse_params.parse_type = PARSE_FLAG_FRAMES_ALL;
+
+	vod_memzero(&segmenter, sizeof(segmenter));
+	segmenter.align_to_key_frames = test->align_to_key_frames;
+
+	vod_memzero(&read_cache_state, sizeof(read_cache_state));
+	vod_memzero(&frame_data, sizeof(frame_data));
+
+	result->rc = mp4_parser_parse_frames(
+		&request_context,
+		base,
+		&parse_params,
+		&segmenter,
+		&read_cache_state,
+		&frame_data,
+		&read_req,
+		&result->tracks);
+	if (result->rc != VOD_OK)
+	{
+		return;
+	}
+
+	if (index_mode == 1)
+	{
+		for (i = 0; i < base->tracks.nelts && i < MAX_TRACK_COUNT; i++)
+		{
+			if (base->frame_indexes[i].save)
+			{
+				saved_indexes[i] = base->frame_indexes[i].data;
+				indexed_count++;
+			}
+		}
+	}
+}
+
+static void
+compare_results(test_case_t* test, const char* name, parse_result_t* expected, parse_result_t* actual)
+{
+	media_track_t* expected_track;
+	media_track_t* actual_track;
+	uint32_t track_index;
+
+#define report_error(fmt, ...)																\
+	{																						\
+		printf("Error: %s, clip=%u-%u range=%llu-%llu align=%d: " fmt "\n",					\
+			name, test->clip_from, test->clip_to,											\
+			(unsigned long long)test->start, (unsigned long long)test->end,					\
+			(int)test->align_to_key_frames, ##__VA_ARGS__);									\
+		error_count++;																		\
+		return;																				\
+	}
+
+	if (expected->rc != actual->rc)
+	{
+		report_error("rc %d expected %d", (int)actual->rc, (int)expected->rc);
+	}
+
+	if (expected->rc != VOD_OK)
+	{
+		return;
+	}
+
+	if (expected->range.start != actual->range.start ||
+		expected->range.end != actual->range.end ||
+		expected->range.timescale != actual->range.timescale)
+	{
+		report_error("range %llu-%llu/%u expected %llu-%llu/%u",
+			(unsigned long long)actual->range.start, (unsigned long long)actual->range.end, actual->range.timescale,
+			(unsigned long long)expected->range.start, (unsigned long long)expected->range.end, expected->range.timescale);
+	}
+
+	if (expected->tracks.total_track_count != actual->tracks.total_track_count)
+	{
+		report_error("track count %u expected %u", actual->tracks.total_track_count, expected->tracks.total_track_count);
+	}
+
+	for (expected_track = expected->tracks.first_track, actual_track = actual->tracks.first_track, track_index = 0;
+		expected_track < expected->tracks.last_track;
+		expected_track++, actual_track++, track_index++)
+	{
+		if (expected_track->frame_count != actual_track->frame_count)
+		{
+			report_error("track %u frame count %u expected %u", track_index, actual_track->frame_count, expected_track->frame_count);
+		}
+
+		if (expected_track->frame_count > 0 &&
+			memcmp(expected_track->frames.first_frame, actual_track->frames.first_frame, sizeof(input_frame_t) * expected_track->frame_count) != 0)
+		{
+			report_error("track %u frames differ", track_index);
+		}
+
+		if (expected_track->first_frame_index != actual_track->first_frame_index ||
+			expected_track->first_frame_time_offset != actual_track->first_frame_time_offset ||
+			expected_track->clip_from_frame_offset != actual_track->clip_from_frame_offset)
+		{
+			report_error("track %u first frame %u/%llu/%d expected %u/%llu/%d", track_index,
+				actual_track->first_frame_index, (unsigned long long)actual_track->first_frame_time_offset, actual_track->clip_from_frame_offset,
+				expected_track->first_frame_index, (unsigned long long)expected_track->first_frame_time_offset, expected_track->clip_from_frame_offset);
+		}
+
+		if (expected_track->total_frames_duration != actual_track->total_frames_duration ||
+			expected_track->total_frames_size != actual_track->total_frames_size ||
+			expected_track->key_frame_count != actual_track->key_frame_count ||
+			expected_track->frames.clip_to != actual_track->frames.clip_to)
+		{
+			report_error("track %u totals %llu/%llu/%u/%u expected %llu/%llu/%u/%u", track_index,
+				(unsigned long long)actual_track->total_frames_duration, (unsigned long long)actual_track->total_frames_size,
+				actual_track->key_frame_count, actual_track->frames.clip_to,
+				(unsigned long long)expected_track->total_frames_duration, (unsigned long long)expected_track->total_frames_size,
+				expected_track->key_frame_count, expected_track->frames.clip_to);
+		}
+	}
+
+#undef report_error
+}
+
+static void
+run_test(test_case_t* test)
+{
+	parse_result_t expected;
+	parse_result_t built;
+	parse_result_t cached;
+
+	vod_memzero(saved_indexes, sizeof(saved_indexes));
+	test_count++;
+
+	parse_frames(test, 0, &expected);
+	parse_frames(test, 1, &built);
+	parse_frames(test, 2, &cached);
+
+	compare_results(test, "build", &expected, &built);
+	compare_results(test, "cached", &expected, &cached);
+
+	ngx_reset_pool(test_pool);
+}
+
+static uint32_t
+get_duration()
+{
+	request_context_t request_context;
+	media_base_metadata_t* base;
+	media_clip_source_t source;
+	media_sequence_t sequence;
+	file_info_t file_info;
+	uint32_t result;
+
+	vod_memzero(&request_context, sizeof(request_context));
+	request_context.pool = test_pool;
+	request_context.log = &test_log;
+
+	vod_memzero(&sequence, sizeof(sequence));
+	vod_memzero(&source, sizeof(source));
+	source.sequence = &sequence;
+	source.clip_to = UINT_MAX;
+
+	vod_memzero(&file_info, sizeof(file_info));
+	file_info.source = &source;
+
+	if (parse_metadata(&request_context, &file_info, PARSE_FLAG_EDIT_LIST, &base) != VOD_OK || base->timescale == 0)
+	{
+		return 0;
+	}
+
+	result = (base->duration * 1000) / base->timescale;
+
+	ngx_reset_pool(test_pool);
+
+	return result;
+}
+
+static void
+run_file_tests(uint32_t duration)
+{
+	static const uint32_t clip_from_values[] = { 0, 3333 };
+	test_case_t test;
+	uint32_t clip_to_values[2];
+	uint32_t clip_index;
+	uint32_t from_index;
+	uint32_t clip_duration;
+	uint64_t start;
+
+	clip_to_values[0] = UINT_MAX;
+	clip_to_values[1] = duration > 5000 ? duration - 5000 : duration;
+
+	for (test.align_to_key_frames = 0; test.align_to_key_frames <= 1; test.align_to_key_frames++)
+	{
+		for (from_index = 0; from_index < vod_array_entries(clip_from_values); from_index++)
+		{
+			test.clip_from = clip_from_values[from_index];
+			if (test.clip_from >= duration)
+			{
+				continue;
+			}
+
+			for (clip_index = 0; clip_index < vod_array_entries(clip_to_values); clip_index++)
+			{
+				test.clip_to = clip_to_values[clip_index];
+				if (test.clip_to <= test.clip_from)
+				{
+					continue;
+				}
+
+				clip_duration = vod_min(test.clip_to, duration) - test.clip_from;
+
+				// the whole clip
+				test.start = 0;
+				test.end = ULLONG_MAX;
+				run_test(&test);
+
+				// the segments of the clip, and one segment past the end
+				for (start = 0; start <= clip_duration; start += SEGMENT_DURATION)
+				{
+					test.start = start;
+					test.end = start + SEGMENT_DURATION;
+					run_test(&test);
+				}
+
+				printf(".");
+			}
+		}
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	uint32_t duration;
+	int i;
+
+	if (argc < 2)
+	{
+		printf("Usage:\n\t%s <mp4 file> [<mp4 file> ...]\n", argv[0]);
+		return 1;
+	}
+
+	setbuf(stdout, NULL);		// disable stdout buffering (for progress indication)
+
+	init_pool = ngx_create_pool(1024 * 1024, NULL);
+	test_pool = ngx_create_pool(1024 * 1024, NULL);
+	if (init_pool == NULL || test_pool == NULL)
+	{
+		printf("Error: failed to create the pools\n");
+		return 1;
+	}
+
+	if (language_code_process_init(init_pool, &test_log) != VOD_OK)
+	{
+		printf("Error: language_code_process_init failed\n");
+		return 1;
+	}
+
+	for (i = 1; i < argc; i++)
+	{
+		printf("%s ", argv[i]);
+
+		if (!load_file(argv[i]))
+		{
+			continue;
+		}
+
+		duration = get_duration();
+		if (duration == 0)
+		{
+			printf("Error: failed to get the duration\n");
+		}
+		else
+		{
+			run_file_tests(duration);
+		}
+
+		free(file_buffer);
+		file_buffer = NULL;
+
+		printf("\n");
+	}
+
+	ngx_destroy_pool(test_pool);
+	ngx_destroy_pool(init_pool);
+
+	// Note: tracks that can't be indexed (e.g. encrypted) are parsed from the sample tables on all passes
+	printf("%d tests, %d indexed tracks, %d errors\n", test_count, indexed_count, error_count);
+
+	return error_count > 0 ? 1 : 0;
+}
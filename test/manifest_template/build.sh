@@ -0,0 +1,13 @@
+#!/bin/bash
+
+if [ -z "$NGX_ROOT" ]; then 
+	echo "NGX_ROOT not set"
+	exit 1
+fi
+
+if [ -z "$VOD_ROOT" ]; then 
+	echo "VOD_ROOT not set"
+	exit 1
+fi
+
+cc -Wall -g -omttest $VOD_ROOT/test/manifest_template/main.c $VOD_ROOT/ngx_manifest_template.c $NGX_ROOT/src/core/ngx_array.c $NGX_ROOT/src/core/ngx_string.c $NGX_ROOT/src/core/ngx_palloc.c $NGX_ROOT/src/os/unix/ngx_alloc.c -I $NGX_ROOT/src/core  -I $NGX_ROOT/src/event -I $NGX_ROOT/src/event/modules -I $NGX_ROOT/src/os/unix -I $NGX_ROOT/objs -I $VOD_ROOT
@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <ngx_core.h>
+#include <ngx_manifest_template.h>
+
+// globals
+volatile ngx_cycle_t  *ngx_cycle;
+ngx_pool_t *pool;
+ngx_log_t ngx_log;
+int error_count;
+
+// nginx function stubs
+#if (NGX_HAVE_VARIADIC_MACROS)
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+	const char *fmt, ...)
+
+#else
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+	const char *fmt, va_list args)
+
+#endif
+{
+}
+
+#define assert(cond) if (!(cond)) { printf("Error: assertion failed, file=%s line=%d\n", __FILE__, __LINE__); error_count++; }
+
+static ngx_int_t
+round_trip(ngx_str_t* response, ngx_str_t* values, ngx_uint_t value_count, ngx_str_t* result)
+{
+	ngx_str_t template;
+	u_char* copy;
+
+	if (ngx_manifest_template_build(pool, &ngx_log, response, value_count, &template) != NGX_OK)
+	{
+		return NGX_ERROR;
+	}
+
+	// the template is read from the cache at an arbitrary alignment
+	copy = ngx_pnalloc(pool, template.len + 1);
+	if (copy == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	ngx_memcpy(copy + 1, template.data, template.len);
+
+	return ngx_manifest_template_expand(pool, &ngx_log, copy + 1, template.len, values, value_count, result);
+}
+
+static void
+placeholder_tests()
+{
+	ngx_str_t values[] = {
+		ngx_string("http://host1"),
+		ngx_string("key.key"),
+	};
+	ngx_str_t placeholder0;
+	ngx_str_t placeholder1;
+	ngx_str_t response;
+	ngx_str_t result;
+	u_char buffer[256];
+	u_char expected[256];
+	u_char* p;
+	u_char* e;
+	ngx_int_t rc;
+
+	ngx_manifest_template_get_placeholder(0, &placeholder0);
+	ngx_manifest_template_get_placeholder(1, &placeholder1);
+
+	// placeholders mixed with stray \x01 bytes that do not form a valid placeholder
+	p = buffer;
+	e = expected;
+
+	p = ngx_copy(p, "\x01", 1);									e = ngx_copy(e, "\x01", 1);
+	p = ngx_copy(p, placeholder0.data, placeholder0.len);		e = ngx_copy(e, values[0].data, values[0].len);
+	p = ngx_copy(p, "/seg-1.ts\n\x01\x01", 12);					e = ngx_copy(e, "/seg-1.ts\n\x01\x01", 12);
+	p = ngx_copy(p, "\x01" "2" "\x01", 3);						e = ngx_copy(e, "\x01" "2" "\x01", 3);		// index >= value count
+	p = ngx_copy(p, "\x01" "0x", 3);							e = ngx_copy(e, "\x01" "0x", 3);			// missing closing mark
+	p = ngx_copy(p, placeholder1.data, placeholder1.len);		e = ngx_copy(e, values[1].data, values[1].len);
+	p = ngx_copy(p, placeholder0.data, placeholder0.len);		e = ngx_copy(e, values[0].data, values[0].len);
+	p = ngx_copy(p, "\x01" "1", 2);								e = ngx_copy(e, "\x01" "1", 2);			// truncated at the end
+
+	response.data = buffer;
+	response.len = p - buffer;
+
+	rc = round_trip(&response, values, 2, &result);
+	assert(rc == NGX_OK);
+	assert(rc != NGX_OK || (result.len == (size_t)(e - expected) && ngx_memcmp(result.data, expected, result.len) == 0));
+
+	// no placeholders
+	response.data = (u_char*)"#EXTM3U\n";
+	response.len = sizeof("#EXTM3U\n") - 1;
+
+	rc = round_trip(&response, values, 2, &result);
+	assert(rc == NGX_OK);
+	assert(rc != NGX_OK || (result.len == response.len && ngx_memcmp(result.data, response.data, result.len) == 0));
+
+	// empty response
+	response.data = buffer;
+	response.len = 0;
+
+	rc = round_trip(&response, values, 2, &result);
+	assert(rc == NGX_OK);
+	assert(rc != NGX_OK || result.len == 0);
+}
+
+static void
+binary_tests()
+{
+	ngx_str_t values[] = {
+		ngx_string("http://host1"),
+	};
+	ngx_str_t response;
+	ngx_str_t result;
+	u_char buffer[1024];
+	ngx_uint_t i;
+	ngx_int_t rc;
+
+	// a binary buffer that contains all byte values, and a placeholder-like sequence
+	for (i = 0; i < sizeof(buffer); i++)
+	{
+		buffer[i] = (u_char)(i * 7);
+	}
+
+	ngx_memcpy(buffer + 100, "\x01" "0" "\x01", 3);
+
+	response.data = buffer;
+	response.len = sizeof(buffer);
+
+	// without values, the buffer is preserved as is
+	rc = round_trip(&response, values, 0, &result);
+	assert(rc == NGX_OK);
+	assert(rc != NGX_OK || (result.len == response.len && ngx_memcmp(result.data, response.data, result.len) == 0));
+
+	// with values, the placeholder-like sequence is replaced - binary responses must not be saved as templates
+	rc = round_trip(&response, values, 1, &result);
+	assert(rc == NGX_OK);
+	assert(rc != NGX_OK || result.len != response.len || ngx_memcmp(result.data, response.data, result.len) != 0);
+}
+
+static void
+bad_template_tests()
+{
+	static u_char zero_parts[] = { 0, 0, 0, 0 };
+	static u_char bad_literal_size[] = { 1, 0, 0, 0, 5, 0, 0, 0, 0xff, 0xff, 0xff, 0xff, 'a', 'b' };
+	ngx_str_t result;
+	ngx_int_t rc;
+
+	rc = ngx_manifest_template_expand(pool, &ngx_log, zero_parts, 2, NULL, 0, &result);
+	assert(rc == NGX_ERROR);
+
+	rc = ngx_manifest_template_expand(pool, &ngx_log, zero_parts, sizeof(zero_parts), NULL, 0, &result);
+	assert(rc == NGX_ERROR);
+
+	rc = ngx_manifest_template_expand(pool, &ngx_log, bad_literal_size, sizeof(bad_literal_size), NULL, 0, &result);
+	assert(rc == NGX_ERROR);
+}
+
+int main()
+{
+	pool = ngx_create_pool(1024 * 1024, &ngx_log);
+
+	placeholder_tests();
+	binary_tests();
+	bad_template_tests();
+
+	if (error_count > 0)
+	{
+		printf("%d errors\n", error_count);
+		return 1;
+	}
+
+	printf("OK\n");
+	return 0;
+}
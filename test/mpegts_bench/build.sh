@@ -0,0 +1,21 @@
+#!/bin/bash
+
+if [ -z "$NGX_ROOT" ]; then 
+	echo "NGX_ROOT not set"
+	exit 1
+fi
+
+if [ -z "$VOD_ROOT" ]; then 
+	echo "VOD_ROOT not set"
+	exit 1
+fi
+
+CC_OPTS="-Wall -O2 $VOD_ROOT/test/mpegts_bench/main.c $VOD_ROOT/vod/write_buffer_queue.c $VOD_ROOT/vod/buffer_pool.c $NGX_ROOT/src/core/ngx_string.c $NGX_ROOT/src/core/ngx_palloc.c $NGX_ROOT/src/os/unix/ngx_alloc.c -I $NGX_ROOT/src/core  -I $NGX_ROOT/src/event -I $NGX_ROOT/src/event/modules -I $NGX_ROOT/src/os/unix -I $NGX_ROOT/objs -I $VOD_ROOT"
+
+cc -omtbench $VOD_ROOT/vod/hls/mpegts_encoder_filter.c $CC_OPTS || exit 1
+
+# optionally, build the mpegts encoder of another revision, for comparing the output and the throughput
+if [ -n "$BASE_REV" ]; then
+	git -C $VOD_ROOT show $BASE_REV:vod/hls/mpegts_encoder_filter.c > mpegts_encoder_filter_base.c || exit 1
+	cc -omtbench_base mpegts_encoder_filter_base.c -iquote $VOD_ROOT/vod/hls $CC_OPTS || exit 1
+fi
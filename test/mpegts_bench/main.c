@@ -0,0 +1,444 @@
+// include
+#include <stdio.h>
+#include <time.h>
+#include <ngx_core.h>
+#include <vod/hls/mpegts_encoder_filter.h>
+
+// constants
+#define VIDEO_FRAME_COUNT (300)
+#define AUDIO_FRAMES_PER_VIDEO_FRAME (2)
+#define MIN_VIDEO_FRAME_SIZE (60000)
+#define MAX_VIDEO_FRAME_SIZE (72000)
+#define MIN_AUDIO_FRAME_SIZE (300)
+#define MAX_AUDIO_FRAME_SIZE (700)
+#define FRAME_DATA_SIZE (MAX_VIDEO_FRAME_SIZE + 1024)
+#define CHUNK_SIZE (100)		// smaller than the packet payload, forces a per packet write
+#define BENCH_ITERATIONS (20)
+#define BENCH_RUNS (6)
+
+// typedefs
+typedef struct {
+	int media_type;
+	uint32_t size;
+	uint64_t pts;
+	bool_t last_stream_frame;
+} test_frame_t;
+
+typedef struct {
+	u_char* data;
+	size_t size;
+	size_t alloc;
+} output_t;
+
+// globals
+volatile ngx_cycle_t  *ngx_cycle;
+ngx_log_t test_log;
+test_frame_t frames[VIDEO_FRAME_COUNT * (1 + AUDIO_FRAMES_PER_VIDEO_FRAME)];
+u_char frame_data[FRAME_DATA_SIZE];
+size_t total_frames_size;
+int error_count;
+
+// nginx function stubs
+#if (NGX_HAVE_VARIADIC_MACROS)
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+	const char *fmt, ...)
+
+#else
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+	const char *fmt, va_list args)
+
+#endif
+{
+}
+
+static uint32_t
+next_random(uint32_t* seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 8;
+}
+
+static void
+init_frames()
+{
+	test_frame_t* cur_frame = frames;
+	uint32_t seed = 1;
+	uint32_t i;
+	uint32_t j;
+
+	for (i = 0; i < sizeof(frame_data); i++)
+	{
+		frame_data[i] = (u_char)next_random(&seed);
+	}
+
+	for (i = 0; i < VIDEO_FRAME_COUNT; i++)
+	{
+		cur_frame->media_type = MEDIA_TYPE_VIDEO;
+		cur_frame->size = MIN_VIDEO_FRAME_SIZE + next_random(&seed) % (MAX_VIDEO_FRAME_SIZE - MIN_VIDEO_FRAME_SIZE);
+		cur_frame->pts = i * 3600;
+		total_frames_size += cur_frame->size;
+		cur_frame++;
+
+		for (j = 0; j < AUDIO_FRAMES_PER_VIDEO_FRAME; j++)
+		{
+			cur_frame->media_type = MEDIA_TYPE_AUDIO;
+			cur_frame->size = MIN_AUDIO_FRAME_SIZE + next_random(&seed) % (MAX_AUDIO_FRAME_SIZE - MIN_AUDIO_FRAME_SIZE);
+			cur_frame->pts = (i * AUDIO_FRAMES_PER_VIDEO_FRAME + j) * 1800;
+			total_frames_size += cur_frame->size;
+			cur_frame++;
+		}
+	}
+
+	frames[vod_array_entries(frames) - 1].last_stream_frame = TRUE;
+	frames[vod_array_entries(frames) - 1 - AUDIO_FRAMES_PER_VIDEO_FRAME].last_stream_frame = TRUE;
+}
+
+static vod_status_t
+write_output(void* context, u_char* buffer, uint32_t size)
+{
+	output_t* output = context;
+	u_char* new_data;
+
+	if (output == NULL)
+	{
+		return VOD_OK;		// benchmark, discard the data
+	}
+
+	if (output->size + size > output->alloc)
+	{
+		output->alloc = (output->size + size) * 2;
+		new_data = realloc(output->data, output->alloc);
+		if (new_data == NULL)
+		{
+			return VOD_ALLOC_FAILED;
+		}
+		output->data = new_data;
+	}
+
+	memcpy(output->data + output->size, buffer, size);
+	output->size += size;
+	return VOD_OK;
+}
+
+static vod_status_t
+mux(bool_t interleave_frames, bool_t align_frames, uint32_t chunk_size, output_t* output)
+{
+	mpegts_encoder_init_streams_state_t stream_state;
+	hls_encryption_params_t encryption_params;
+	mpegts_encoder_state_t states[MEDIA_TYPE_COUNT];
+	mpegts_encoder_state_t* state;
+	request_context_t request_context;
+	write_buffer_queue_t queue;
+	media_track_t tracks[MEDIA_TYPE_COUNT];
+	output_frame_t output_frame;
+	test_frame_t* cur_frame;
+	test_frame_t* last_frame;
+	vod_str_t ts_header;
+	ngx_pool_t* pool;
+	off_t min_offset;
+	uint32_t cur_size;
+	uint32_t offset;
+	uint32_t pos;
+	uint32_t i;
+	vod_status_t rc;
+
+	pool = ngx_create_pool(1024 * 1024, &test_log);
+	if (pool == NULL)
+	{
+		return VOD_ALLOC_FAILED;
+	}
+
+	ngx_memzero(&request_context, sizeof(request_context));
+	request_context.pool = pool;
+	request_context.log = &test_log;
+
+	ngx_memzero(&encryption_params, sizeof(encryption_params));
+	encryption_params.type = HLS_ENC_NONE;
+
+	write_buffer_queue_init(&queue, &request_context, write_output, output, TRUE, 0);
+
+	rc = mpegts_encoder_init_streams(&request_context, &encryption_params, &queue, &stream_state, 0);
+	if (rc != VOD_OK)
+	{
+		goto done;
+	}
+
+	ngx_memzero(tracks, sizeof(tracks));
+	tracks[MEDIA_TYPE_VIDEO].media_info.media_type = MEDIA_TYPE_VIDEO;
+	tracks[MEDIA_TYPE_VIDEO].media_info.codec_id = VOD_CODEC_ID_AVC;
+	tracks[MEDIA_TYPE_AUDIO].media_info.media_type = MEDIA_TYPE_AUDIO;
+	tracks[MEDIA_TYPE_AUDIO].media_info.codec_id = VOD_CODEC_ID_AAC;
+
+	for (i = 0; i < MEDIA_TYPE_COUNT; i++)
+	{
+		rc = mpegts_encoder_init(&states[i], &stream_state, &tracks[i], &queue, interleave_frames, align_frames);
+		if (rc != VOD_OK)
+		{
+			goto done;
+		}
+	}
+
+	mpegts_encoder_finalize_streams(&stream_state, &ts_header);
+
+	rc = write_output(output, ts_header.data, ts_header.len);
+	if (rc != VOD_OK)
+	{
+		goto done;
+	}
+
+	last_frame = frames + vod_array_entries(frames);
+	for (cur_frame = frames; cur_frame < last_frame; cur_frame++)
+	{
+		state = &states[cur_frame->media_type];
+
+		output_frame.pts = cur_frame->pts;
+		output_frame.dts = cur_frame->pts;
+		output_frame.key = cur_frame->media_type == MEDIA_TYPE_AUDIO || cur_frame == frames;
+		output_frame.size = cur_frame->size;
+		output_frame.header_size = 0;
+
+		rc = mpegts_encoder.start_frame(state, &output_frame);
+		if (rc != VOD_OK)
+		{
+			goto done;
+		}
+
+		// vary the alignment of the source data
+		offset = (cur_frame - frames) % 1024;
+
+		for (pos = 0; pos < cur_frame->size; pos += cur_size)
+		{
+			cur_size = ngx_min(chunk_size, cur_frame->size - pos);
+
+			rc = mpegts_encoder.write(state, frame_data + offset + pos, cur_size);
+			if (rc != VOD_OK)
+			{
+				goto done;
+			}
+		}
+
+		rc = mpegts_encoder.flush_frame(state, cur_frame->last_stream_frame);
+		if (rc != VOD_OK)
+		{
+			goto done;
+		}
+
+		// send the packets that are no longer modified (same as hls_muxer_send)
+		min_offset = states[MEDIA_TYPE_VIDEO].send_queue_offset;
+		if (states[MEDIA_TYPE_AUDIO].send_queue_offset < min_offset)
+		{
+			min_offset = states[MEDIA_TYPE_AUDIO].send_queue_offset;
+		}
+
+		rc = write_buffer_queue_send(&queue, min_offset);
+		if (rc != VOD_OK)
+		{
+			goto done;
+		}
+	}
+
+	rc = write_buffer_queue_flush(&queue);
+
+done:
+
+	ngx_destroy_pool(pool);
+	return rc;
+}
+
+static double
+get_time()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+compare_outputs(const char* name, output_t* output, output_t* expected)
+{
+	size_t i;
+
+	if (output->size == expected->size &&
+		ngx_memcmp(output->data, expected->data, output->size) == 0)
+	{
+		return;
+	}
+
+	for (i = 0; i < output->size && i < expected->size; i++)
+	{
+		if (output->data[i] != expected->data[i])
+		{
+			break;
+		}
+	}
+
+	printf("Error: %s - output differs at offset %zu (packet %zu), size %zu expected %zu\n",
+		name, i, i / MPEGTS_PACKET_SIZE, output->size, expected->size);
+	error_count++;
+}
+
+static int
+write_file(const char* path, output_t* output)
+{
+	FILE* fp;
+
+	fp = fopen(path, "wb");
+	if (fp == NULL)
+	{
+		printf("Error: failed to open %s\n", path);
+		return 0;
+	}
+
+	if (fwrite(output->data, 1, output->size, fp) != output->size)
+	{
+		printf("Error: failed to write %s\n", path);
+		fclose(fp);
+		return 0;
+	}
+
+	fclose(fp);
+	return 1;
+}
+
+static int
+read_file(const char* path, output_t* output)
+{
+	FILE* fp;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL)
+	{
+		printf("Error: failed to open %s\n", path);
+		return 0;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	output->size = output->alloc = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	output->data = malloc(output->alloc);
+	if (output->data == NULL || fread(output->data, 1, output->size, fp) != output->size)
+	{
+		printf("Error: failed to read %s\n", path);
+		fclose(fp);
+		return 0;
+	}
+
+	fclose(fp);
+	return 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+	output_t reference;
+	output_t chunked;
+	output_t output;
+	double best_time;
+	double start;
+	double cur_time;
+	bool_t interleave_frames;
+	bool_t align_frames;
+	char name[64];
+	int iteration;
+	int run;
+
+	if (argc > 3)
+	{
+		printf("Usage:\n\t%s [output file] [reference file]\n", argv[0]);
+		return 1;
+	}
+
+	init_frames();
+
+	// verify that writing whole frames produces the same output as writing each packet separately,
+	// for all the muxer configurations
+	for (interleave_frames = FALSE; interleave_frames <= TRUE; interleave_frames++)
+	{
+		for (align_frames = FALSE; align_frames <= TRUE; align_frames++)
+		{
+			sprintf(name, "interleave=%d align=%d", (int)interleave_frames, (int)align_frames);
+
+			ngx_memzero(&output, sizeof(output));
+			ngx_memzero(&chunked, sizeof(chunked));
+
+			if (mux(interleave_frames, align_frames, UINT32_MAX, &output) != VOD_OK ||
+				mux(interleave_frames, align_frames, CHUNK_SIZE, &chunked) != VOD_OK)
+			{
+				printf("Error: %s - mux failed\n", name);
+				return 1;
+			}
+
+			compare_outputs(name, &output, &chunked);
+
+			free(chunked.data);
+			free(output.data);
+		}
+	}
+
+	// the default muxer configuration, compared to the output of another build (e.g. the baseline)
+	ngx_memzero(&output, sizeof(output));
+	if (mux(FALSE, TRUE, UINT32_MAX, &output) != VOD_OK)
+	{
+		printf("Error: mux failed\n");
+		return 1;
+	}
+
+	if (argc > 1 && !write_file(argv[1], &output))
+	{
+		return 1;
+	}
+
+	if (argc > 2)
+	{
+		if (!read_file(argv[2], &reference))
+		{
+			return 1;
+		}
+
+		compare_outputs("reference", &output, &reference);
+		free(reference.data);
+	}
+
+	printf("muxed %zu frame bytes to %zu ts bytes\n", total_frames_size, output.size);
+	free(output.data);
+
+	// benchmark
+	best_time = 0;
+	for (run = 0; run < BENCH_RUNS; run++)
+	{
+		start = get_time();
+
+		for (iteration = 0; iteration < BENCH_ITERATIONS; iteration++)
+		{
+			if (mux(FALSE, TRUE, UINT32_MAX, NULL) != VOD_OK)
+			{
+				printf("Error: mux failed\n");
+				return 1;
+			}
+		}
+
+		cur_time = get_time() - start;
+		if (run == 0 || cur_time < best_time)
+		{
+			best_time = cur_time;
+		}
+	}
+
+	printf("throughput: %.0f MB/s (best of %d runs)\n",
+		(double)total_frames_size * BENCH_ITERATIONS / best_time / (1024 * 1024), BENCH_RUNS);
+
+	if (error_count > 0)
+	{
+		printf("%d errors\n", error_count);
+		return 1;
+	}
+
+	printf("OK\n");
+	return 0;
+}
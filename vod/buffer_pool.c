@@ -1,30 +1,62 @@
 #include "buffer_pool.h"
 
+/*
+	the buffer pool holds a free list of preallocated buffers per size class.
+	an allocation is served by the smallest class whose buffers are large enough, if the class has
+	no free buffers, larger classes are tried. buffers are returned to their free list when the pool
+	of the request that allocated them is destroyed, so they are recycled across requests.
+	since the pool is created on configuration load, each worker process has its own copy of the
+	free lists, and no locking is required.
+*/
+
 // macros
 #define next_buffer(buf) (*(void**)buf)
 
+// constants
+#define BUFFER_POOL_ALIGNMENT (4096)
+
 // typedefs
-struct buffer_pool_s {
+typedef struct {
 	size_t size;
+	size_t count;
+	size_t alignment;		// the alignment of all the buffers of the class
+	size_t free;
 	void* head;
+	uint64_t hit;
+	uint64_t miss;
+} buffer_pool_class_t;
+
+struct buffer_pool_s {
+	buffer_pool_class_t classes[BUFFER_POOL_MAX_SIZE_CLASSES];
+	buffer_pool_class_t* classes_end;
+	uint64_t unpooled;
 };
 
 typedef struct {
-	buffer_pool_t* buffer_pool;
+	buffer_pool_class_t* size_class;
 	void* buffer;
 } buffer_pool_cleanup_t;
 
 buffer_pool_t*
-buffer_pool_create(vod_pool_t* pool, vod_log_t* log, size_t buffer_size, size_t count)
+buffer_pool_create(
+	vod_pool_t* pool, 
+	vod_log_t* log, 
+	buffer_pool_size_class_t* size_classes, 
+	uint32_t class_count)
 {
+	buffer_pool_size_class_t* cur_size_class;
+	buffer_pool_class_t* cur_class;
+	buffer_pool_class_t* prev_class;
+	buffer_pool_class_t temp_class;
 	buffer_pool_t* buffer_pool;
 	u_char* cur_buffer;
+	size_t count;
 	void* head;
 
-	if ((buffer_size & 0x0F) != 0)
+	if (class_count == 0 || class_count > BUFFER_POOL_MAX_SIZE_CLASSES)
 	{
 		vod_log_error(VOD_LOG_ERR, log, 0,
-			"buffer_pool_create: invalid size %uz must be a multiple of 16", buffer_size);
+			"buffer_pool_create: invalid number of size classes %uD", class_count);
 		return NULL;
 	}
 
@@ -36,23 +68,75 @@ buffer_pool_create(vod_pool_t* pool, vod_log_t* log, size_t buffer_size, size_t
 		return NULL;
 	}
 
-	cur_buffer = vod_alloc(pool, buffer_size * count);
-	if (cur_buffer == NULL)
+	vod_memzero(buffer_pool, sizeof(*buffer_pool));
+
+	// add the classes sorted by size
+	buffer_pool->classes_end = buffer_pool->classes;
+	for (cur_size_class = size_classes; cur_size_class < size_classes + class_count; cur_size_class++)
 	{
-		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, log, 0,
-			"buffer_pool_create: vod_alloc failed (2)");
-		return NULL;
+		if (cur_size_class->size <= 0 || (cur_size_class->size & 0x0F) != 0)
+		{
+			vod_log_error(VOD_LOG_ERR, log, 0,
+				"buffer_pool_create: invalid size %uz must be a multiple of 16", cur_size_class->size);
+			return NULL;
+		}
+
+		cur_class = buffer_pool->classes_end++;
+		cur_class->size = cur_size_class->size;
+		cur_class->count = cur_size_class->count;
+
+		for (; cur_class > buffer_pool->classes; cur_class--)
+		{
+			prev_class = cur_class - 1;
+			if (prev_class->size < cur_class->size)
+			{
+				break;
+			}
+
+			if (prev_class->size == cur_class->size)
+			{
+				vod_log_error(VOD_LOG_ERR, log, 0,
+					"buffer_pool_create: duplicate size %uz", cur_class->size);
+				return NULL;
+			}
+
+			temp_class = *prev_class;
+			*prev_class = *cur_class;
+			*cur_class = temp_class;
+		}
 	}
 
-	head = NULL;
-	for (; count > 0; count--, cur_buffer += buffer_size)
+	// allocate the buffers
+	for (cur_class = buffer_pool->classes; cur_class < buffer_pool->classes_end; cur_class++)
 	{
-		next_buffer(cur_buffer) = head;
-		head = cur_buffer;
-	}
+		// Note: the buffers of a class are aligned to the largest power of 2 that divides the size (up to a page)
+		cur_class->alignment = vod_min(cur_class->size & ~(cur_class->size - 1), BUFFER_POOL_ALIGNMENT);
+
+		if (cur_class->count <= 0)
+		{
+			continue;
+		}
+
+		cur_buffer = vod_alloc(pool, cur_class->size * cur_class->count + BUFFER_POOL_ALIGNMENT - 1);
+		if (cur_buffer == NULL)
+		{
+			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, log, 0,
+				"buffer_pool_create: vod_alloc failed (2)");
+			return NULL;
+		}
+
+		cur_buffer = (u_char*)vod_align((uintptr_t)cur_buffer, BUFFER_POOL_ALIGNMENT);
 
-	buffer_pool->size = buffer_size;
-	buffer_pool->head = head;
+		head = NULL;
+		for (count = cur_class->count; count > 0; count--, cur_buffer += cur_class->size)
+		{
+			next_buffer(cur_buffer) = head;
+			head = cur_buffer;
+		}
+
+		cur_class->head = head;
+		cur_class->free = cur_class->count;
+	}
 
 	return buffer_pool;
 }
@@ -61,49 +145,128 @@ static void
 buffer_pool_buffer_cleanup(void *data)
 {
 	buffer_pool_cleanup_t* c = data;
-	buffer_pool_t* buffer_pool = c->buffer_pool;
+	buffer_pool_class_t* size_class = c->size_class;
 	void* buffer = c->buffer;
 
-	next_buffer(buffer) = buffer_pool->head;
-	buffer_pool->head = buffer;
+	next_buffer(buffer) = size_class->head;
+	size_class->head = buffer;
+	size_class->free++;
 }
 
 void*
-buffer_pool_alloc(request_context_t* request_context, buffer_pool_t* buffer_pool, size_t* buffer_size)
+buffer_pool_alloc_aligned(
+	request_context_t* request_context, 
+	buffer_pool_t* buffer_pool, 
+	size_t alignment, 
+	size_t* buffer_size)
 {
 	buffer_pool_cleanup_t* buf_cln;
+	buffer_pool_class_t* first_class;
+	buffer_pool_class_t* cur_class;
 	vod_pool_cleanup_t* cln;
 	void* result;
 
-	if (buffer_pool == NULL)
+	// find the smallest class that fits
+	for (first_class = buffer_pool->classes; ; first_class++)
 	{
-		return vod_alloc(request_context->pool, *buffer_size);
+		if (first_class >= buffer_pool->classes_end)
+		{
+			buffer_pool->unpooled++;
+			return NULL;
+		}
+
+		if (first_class->size >= *buffer_size && first_class->alignment >= alignment)
+		{
+			break;
+		}
 	}
 
-	if (buffer_pool->head == NULL)
+	// find a class that has a free buffer
+	for (cur_class = first_class; ; cur_class++)
 	{
-		*buffer_size = buffer_pool->size;
-		return vod_alloc(request_context->pool, *buffer_size);
+		if (cur_class >= buffer_pool->classes_end)
+		{
+			first_class->miss++;
+			return NULL;
+		}
+
+		if (cur_class->head != NULL && cur_class->alignment >= alignment)
+		{
+			break;
+		}
 	}
 
 	cln = vod_pool_cleanup_add(request_context->pool, sizeof(buffer_pool_cleanup_t));
 	if (cln == NULL)
 	{
 		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-			"buffer_pool_alloc: vod_pool_cleanup_add failed");
+			"buffer_pool_alloc_aligned: vod_pool_cleanup_add failed");
 		return NULL;
 	}
 
-	result = buffer_pool->head;
-	buffer_pool->head = next_buffer(result);
+	result = cur_class->head;
+	cur_class->head = next_buffer(result);
+	cur_class->free--;
+	cur_class->hit++;
 
 	cln->handler = buffer_pool_buffer_cleanup;
 
 	buf_cln = cln->data;
 	buf_cln->buffer = result;
-	buf_cln->buffer_pool = buffer_pool;
+	buf_cln->size_class = cur_class;
 
-	*buffer_size = buffer_pool->size;
+	*buffer_size = cur_class->size;
 
 	return result;
 }
+
+void*
+buffer_pool_alloc(request_context_t* request_context, buffer_pool_t* buffer_pool, size_t* buffer_size)
+{
+	void* result;
+
+	if (buffer_pool != NULL)
+	{
+		result = buffer_pool_alloc_aligned(request_context, buffer_pool, 1, buffer_size);
+		if (result != NULL)
+		{
+			return result;
+		}
+	}
+
+	return vod_alloc(request_context->pool, *buffer_size);
+}
+
+void
+buffer_pool_get_stats(buffer_pool_t* buffer_pool, buffer_pool_stats_t* stats)
+{
+	buffer_pool_class_stats_t* cur_stats;
+	buffer_pool_class_t* cur_class;
+
+	cur_stats = stats->classes;
+	for (cur_class = buffer_pool->classes; cur_class < buffer_pool->classes_end; cur_class++, cur_stats++)
+	{
+		cur_stats->size = cur_class->size;
+		cur_stats->count = cur_class->count;
+		cur_stats->free = cur_class->free;
+		cur_stats->hit = cur_class->hit;
+		cur_stats->miss = cur_class->miss;
+	}
+
+	stats->class_count = buffer_pool->classes_end - buffer_pool->classes;
+	stats->unpooled = buffer_pool->unpooled;
+}
+
+void
+buffer_pool_reset_stats(buffer_pool_t* buffer_pool)
+{
+	buffer_pool_class_t* cur_class;
+
+	for (cur_class = buffer_pool->classes; cur_class < buffer_pool->classes_end; cur_class++)
+	{
+		cur_class->hit = 0;
+		cur_class->miss = 0;
+	}
+
+	buffer_pool->unpooled = 0;
+}
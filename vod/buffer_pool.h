@@ -4,8 +4,46 @@
 // includes
 #include "common.h"
 
+// constants
+#define BUFFER_POOL_MAX_SIZE_CLASSES (8)
+
+// typedefs
+typedef struct {
+	size_t size;
+	size_t count;
+} buffer_pool_size_class_t;
+
+typedef struct {
+	size_t size;
+	size_t count;
+	size_t free;
+	uint64_t hit;			// allocations served by the class
+	uint64_t miss;			// allocations that matched the class, but no free buffer was available
+} buffer_pool_class_stats_t;
+
+typedef struct {
+	uint32_t class_count;
+	buffer_pool_class_stats_t classes[BUFFER_POOL_MAX_SIZE_CLASSES];
+	uint64_t unpooled;		// allocations larger than all the classes
+} buffer_pool_stats_t;
+
 // functions
-buffer_pool_t* buffer_pool_create(vod_pool_t* pool, vod_log_t* log, size_t buffer_size, size_t count);
+buffer_pool_t* buffer_pool_create(
+	vod_pool_t* pool, 
+	vod_log_t* log, 
+	buffer_pool_size_class_t* size_classes, 
+	uint32_t class_count);
+
 void* buffer_pool_alloc(request_context_t* reqeust_context, buffer_pool_t* buffer_pool, size_t* buffer_size);
 
+void* buffer_pool_alloc_aligned(
+	request_context_t* request_context, 
+	buffer_pool_t* buffer_pool, 
+	size_t alignment, 
+	size_t* buffer_size);
+
+void buffer_pool_get_stats(buffer_pool_t* buffer_pool, buffer_pool_stats_t* stats);
+
+void buffer_pool_reset_stats(buffer_pool_t* buffer_pool);
+
 #endif // __BUFFER_POOL_H__
@@ -272,10 +272,12 @@ typedef struct vod_array_part_s {
 } vod_array_part_t;
 
 typedef vod_status_t(*write_callback_t)(void* context, u_char* buffer, uint32_t size);
+typedef vod_status_t(*write_file_callback_t)(void* context, void* source, uint64_t offset, uint32_t size);
 
 typedef struct {
 	write_callback_t write_tail;
 	write_callback_t write_head;
+	write_file_callback_t write_file;	// optional, outputs a range of the source file without reading it
 	void* context;
 } segment_writer_t;
 
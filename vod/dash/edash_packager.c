@@ -12,6 +12,9 @@
 #define VOD_EDASH_MANIFEST_CONTENT_PROTECTION_CENC									\
 	"        <ContentProtection schemeIdUri=\"urn:mpeg:dash:mp4protection:2011\" value=\"cenc\"/>\n"
 
+#define VOD_EDASH_MANIFEST_CONTENT_PROTECTION_CBCS									\
+	"        <ContentProtection schemeIdUri=\"urn:mpeg:dash:mp4protection:2011\" value=\"cbcs\"/>\n"
+
 #define VOD_EDASH_MANIFEST_CONTENT_PROTECTION_PREFIX								\
 	"        <ContentProtection schemeIdUri=\"urn:uuid:"
 
@@ -38,6 +41,11 @@ typedef struct {
 	u_char default_kid[DRM_KID_SIZE];
 } tenc_atom_t;
 
+typedef struct {
+	u_char default_constant_iv_size;
+	u_char default_constant_iv[DRM_IV_SIZE];
+} tenc_constant_iv_t;
+
 typedef struct {
 	u_char version[1];
 	u_char flags[3];
@@ -48,6 +56,8 @@ typedef struct {
 typedef struct {
 	uint32_t media_type;
 	bool_t has_clear_lead;
+	uint32_t scheme;
+	const u_char* constant_iv;
 	u_char* default_kid;
 	stsd_entry_header_t* original_stsd_entry;
 	uint32_t original_stsd_entry_size;
@@ -68,8 +78,17 @@ edash_packager_write_content_protection(void* context, u_char* p, media_track_t*
 {
 	drm_info_t* drm_info = (drm_info_t*)track->file_info.drm_info;
 	drm_system_info_t* cur_info;
+	uint32_t scheme = *(uint32_t*)context;
+
+	if (scheme == MP4_ENCRYPT_SCHEME_CBCS)
+	{
+		p = vod_copy(p, VOD_EDASH_MANIFEST_CONTENT_PROTECTION_CBCS, sizeof(VOD_EDASH_MANIFEST_CONTENT_PROTECTION_CBCS) - 1);
+	}
+	else
+	{
+		p = vod_copy(p, VOD_EDASH_MANIFEST_CONTENT_PROTECTION_CENC, sizeof(VOD_EDASH_MANIFEST_CONTENT_PROTECTION_CENC) - 1);
+	}
 
-	p = vod_copy(p, VOD_EDASH_MANIFEST_CONTENT_PROTECTION_CENC, sizeof(VOD_EDASH_MANIFEST_CONTENT_PROTECTION_CENC) - 1);
 	for (cur_info = drm_info->pssh_array.first; cur_info < drm_info->pssh_array.last; cur_info++)
 	{
 		p = vod_copy(p, VOD_EDASH_MANIFEST_CONTENT_PROTECTION_PREFIX, sizeof(VOD_EDASH_MANIFEST_CONTENT_PROTECTION_PREFIX) - 1);
@@ -85,6 +104,7 @@ edash_packager_build_mpd(
 	dash_manifest_config_t* conf,
 	vod_str_t* base_url,
 	media_set_t* media_set,
+	uint32_t scheme,
 	vod_str_t* result)
 {
 	media_sequence_t* cur_sequence;
@@ -114,7 +134,7 @@ edash_packager_build_mpd(
 		media_set,
 		representation_tags_size,
 		edash_packager_write_content_protection,
-		NULL,
+		&scheme,
 		result);
 	if (rc != VOD_OK)
 	{
@@ -134,11 +154,15 @@ edash_packager_init_stsd_writer_context(
 	uint32_t media_type, 
 	raw_atom_t* original_stsd, 
 	bool_t has_clear_lead,
+	uint32_t scheme,
+	const u_char* constant_iv,
 	u_char* default_kid,
 	stsd_writer_context_t* result)
 {
 	result->media_type = media_type;
 	result->has_clear_lead = has_clear_lead;
+	result->scheme = scheme;
+	result->constant_iv = constant_iv;
 	result->default_kid = default_kid;
 
 	if (original_stsd->size < original_stsd->header_size + sizeof(stsd_atom_t) + sizeof(stsd_entry_header_t))
@@ -160,6 +184,10 @@ edash_packager_init_stsd_writer_context(
 	}
 
 	result->tenc_atom_size = ATOM_HEADER_SIZE + sizeof(tenc_atom_t);
+	if (scheme == MP4_ENCRYPT_SCHEME_CBCS)
+	{
+		result->tenc_atom_size += sizeof(tenc_constant_iv_t);
+	}
 	result->schi_atom_size = ATOM_HEADER_SIZE + result->tenc_atom_size;
 	result->schm_atom_size = ATOM_HEADER_SIZE + sizeof(schm_atom_t);
 	result->frma_atom_size = ATOM_HEADER_SIZE + sizeof(frma_atom_t);
@@ -203,7 +231,14 @@ edash_packager_write_stsd(void* ctx, u_char* p)
 	// sinf.schm
 	write_atom_header(p, context->schm_atom_size, 's', 'c', 'h', 'm');
 	write_be32(p, 0);							// version + flags
-	write_atom_name(p, 'c', 'e', 'n', 'c');		// scheme type
+	if (context->scheme == MP4_ENCRYPT_SCHEME_CBCS)
+	{
+		write_atom_name(p, 'c', 'b', 'c', 's');		// scheme type
+	}
+	else
+	{
+		write_atom_name(p, 'c', 'e', 'n', 'c');		// scheme type
+	}
 	write_be32(p, 0x10000);						// scheme version
 
 	// sinf.schi
@@ -211,9 +246,30 @@ edash_packager_write_stsd(void* ctx, u_char* p)
 
 	// sinf.schi.tenc
 	write_atom_header(p, context->tenc_atom_size, 't', 'e', 'n', 'c');
-	write_be32(p, 0);							// version + flags
-	write_be32(p, 0x108);						// default is encrypted (1) + iv size (8)
-	p = vod_copy(p, context->default_kid, DRM_KID_SIZE);			// default key id
+	if (context->scheme == MP4_ENCRYPT_SCHEME_CBCS)
+	{
+		write_be32(p, 0x1000000);				// version (1) + flags
+		*p++ = 0;								// reserved
+		if (context->media_type == MEDIA_TYPE_VIDEO)
+		{
+			*p++ = (MP4_ENCRYPT_CBCS_VIDEO_CRYPT_BLOCKS << 4) | MP4_ENCRYPT_CBCS_VIDEO_SKIP_BLOCKS;	// crypt / skip byte block
+		}
+		else
+		{
+			*p++ = 0;							// no pattern - full sample encryption
+		}
+		*p++ = 1;								// default is protected
+		*p++ = 0;								// per sample iv size (constant iv)
+		p = vod_copy(p, context->default_kid, DRM_KID_SIZE);			// default key id
+		*p++ = DRM_IV_SIZE;						// constant iv size
+		p = vod_copy(p, context->constant_iv, DRM_IV_SIZE);			// constant iv
+	}
+	else
+	{
+		write_be32(p, 0);							// version + flags
+		write_be32(p, 0x108);						// default is encrypted (1) + iv size (8)
+		p = vod_copy(p, context->default_kid, DRM_KID_SIZE);			// default key id
+	}
 
 	// clear entry
 	if (context->has_clear_lead)
@@ -250,6 +306,8 @@ edash_packager_build_init_mp4(
 	request_context_t* request_context,
 	media_set_t* media_set,
 	bool_t has_clear_lead,
+	uint32_t scheme,
+	const u_char* iv,
 	bool_t size_only,
 	vod_str_t* result)
 {
@@ -266,6 +324,8 @@ edash_packager_build_init_mp4(
 		first_track->media_info.media_type,
 		&first_track->raw_atoms[RTA_STSD],
 		has_clear_lead,
+		scheme,
+		iv,
 		drm_info->key_id,
 		&stsd_writer_context);
 	if (rc != VOD_OK)
@@ -387,12 +447,20 @@ edash_packager_audio_build_fragment_header(
 	vod_status_t rc;
 
 	// get the header extensions
-	header_extensions.extra_traf_atoms_size =
-		state->saiz_atom_size + 
-		state->saio_atom_size + 
-		ATOM_HEADER_SIZE + sizeof(senc_atom_t) + MP4_AES_CTR_IV_SIZE * state->sequence->total_frame_count;
-	header_extensions.write_extra_traf_atoms_callback = edash_packager_audio_write_encryption_atoms;
-	header_extensions.write_extra_traf_atoms_context = state;
+	if (state->scheme == MP4_ENCRYPT_SCHEME_CBCS)
+	{
+		// constant iv and no subsamples, the samples have no auxiliary information
+		vod_memzero(&header_extensions, sizeof(header_extensions));
+	}
+	else
+	{
+		header_extensions.extra_traf_atoms_size =
+			state->saiz_atom_size +
+			state->saio_atom_size +
+			ATOM_HEADER_SIZE + sizeof(senc_atom_t) + MP4_AES_CTR_IV_SIZE * state->sequence->total_frame_count;
+		header_extensions.write_extra_traf_atoms_callback = edash_packager_audio_write_encryption_atoms;
+		header_extensions.write_extra_traf_atoms_context = state;
+	}
 
 	// build the fragment header
 	rc = dash_packager_build_fragment_header(
@@ -452,6 +520,7 @@ edash_packager_get_fragment_writer(
 	request_context_t* request_context,
 	media_set_t* media_set,
 	uint32_t segment_index,
+	uint32_t scheme,
 	bool_t single_nalu_per_frame,
 	segment_writer_t* segment_writer,
 	const u_char* iv,
@@ -464,7 +533,9 @@ edash_packager_get_fragment_writer(
 	uint32_t media_type = media_set->sequences[0].media_type;
 	vod_status_t rc;
 
-	if (mp4_encrypt_passthrough_init(&passthrough_context, media_set->sequences))
+	// Note: the passthrough is only supported for cenc, since the source files use ctr
+	if (scheme == MP4_ENCRYPT_SCHEME_CENC &&
+		mp4_encrypt_passthrough_init(&passthrough_context, media_set->sequences))
 	{
 		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
 			"edash_packager_get_fragment_writer: using encryption passthrough");
@@ -505,6 +576,7 @@ edash_packager_get_fragment_writer(
 			request_context, 
 			media_set, 
 			segment_index, 
+			scheme,
 			single_nalu_per_frame,
 			edash_packager_video_build_fragment_header,
 			segment_writer, 
@@ -518,6 +590,7 @@ edash_packager_get_fragment_writer(
 			request_context, 
 			media_set,
 			segment_index, 
+			scheme,
 			segment_writer, 
 			iv);
 		if (rc != VOD_OK)
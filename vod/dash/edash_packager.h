@@ -10,12 +10,15 @@ vod_status_t edash_packager_build_mpd(
 	dash_manifest_config_t* conf,
 	vod_str_t* base_url,
 	media_set_t* media_set,
+	uint32_t scheme,
 	vod_str_t* result);
 
 vod_status_t edash_packager_build_init_mp4(
 	request_context_t* request_context,
 	media_set_t* media_set,
 	bool_t has_clear_lead,
+	uint32_t scheme,
+	const u_char* iv,
 	bool_t size_only,
 	vod_str_t* result);
 
@@ -24,6 +27,7 @@ vod_status_t edash_packager_get_fragment_writer(
 	request_context_t* request_context,
 	media_set_t* media_set,
 	uint32_t segment_index,
+	uint32_t scheme,
 	bool_t single_nalu_per_frame,
 	segment_writer_t* segment_writer,
 	const u_char* iv,
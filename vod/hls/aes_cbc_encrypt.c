@@ -2,8 +2,6 @@
 
 #if (VOD_HAVE_OPENSSL_EVP)
 
-#include "../buffer_pool.h"
-
 static void 
 aes_cbc_encrypt_cleanup(aes_cbc_encrypt_context_t* state)
 {
@@ -44,6 +42,7 @@ aes_cbc_encrypt_init(
 	state->callback = callback;
 	state->callback_context = callback_context;
 	state->request_context = request_context;
+	state->pending_size = 0;
 
 	EVP_CIPHER_CTX_init(&state->cipher);
 	
@@ -59,6 +58,25 @@ aes_cbc_encrypt_init(
 	return VOD_OK;
 }
 
+static vod_status_t
+aes_cbc_encrypt_blocks(
+	aes_cbc_encrypt_context_t* state,
+	u_char* buffer,
+	uint32_t size)
+{
+	int out_size;
+
+	// Note: size is a multiple of the block size, so the encryption does not buffer any data
+	if (1 != EVP_EncryptUpdate(&state->cipher, buffer, &out_size, buffer, size))
+	{
+		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+			"aes_cbc_encrypt_blocks: EVP_EncryptUpdate failed");
+		return VOD_UNEXPECTED;
+	}
+
+	return VOD_OK;
+}
+
 vod_status_t 
 aes_cbc_encrypt(
 	aes_cbc_encrypt_context_t* state,
@@ -67,9 +85,11 @@ aes_cbc_encrypt(
 	bool_t flush)
 {
 	u_char* output;
+	u_char* p;
+	uint32_t size;
 	int out_size;
 
-	output = vod_alloc(state->request_context->pool, aes_round_up_to_block(src->len) + AES_BLOCK_SIZE);
+	output = vod_alloc(state->request_context->pool, aes_round_up_to_block(state->pending_size + src->len) + AES_BLOCK_SIZE);
 	if (output == NULL)
 	{
 		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
@@ -77,18 +97,25 @@ aes_cbc_encrypt(
 		return VOD_ALLOC_FAILED;
 	}
 
-	if (1 != EVP_EncryptUpdate(&state->cipher, output, &out_size, src->data, src->len))
-	{
-		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
-			"aes_cbc_encrypt: EVP_EncryptUpdate failed");
-		return VOD_UNEXPECTED;
-	}
+	p = vod_copy(output, state->pending, state->pending_size);
+	p = vod_copy(p, src->data, src->len);
+	size = p - output;
 
 	dest->data = output;
-	dest->len = out_size;
 
 	if (flush)
 	{
+		state->pending_size = 0;
+
+		if (1 != EVP_EncryptUpdate(&state->cipher, output, &out_size, output, size))
+		{
+			vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+				"aes_cbc_encrypt: EVP_EncryptUpdate failed");
+			return VOD_UNEXPECTED;
+		}
+
+		dest->len = out_size;
+
 		if (1 != EVP_EncryptFinal_ex(&state->cipher, output + out_size, &out_size))
 		{
 			vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
@@ -97,9 +124,17 @@ aes_cbc_encrypt(
 		}
 
 		dest->len += out_size;
+
+		return VOD_OK;
 	}
 
-	return VOD_OK;
+	state->pending_size = size % AES_BLOCK_SIZE;
+	size -= state->pending_size;
+	vod_memcpy(state->pending, output + size, state->pending_size);
+
+	dest->len = size;
+
+	return aes_cbc_encrypt_blocks(state, output, size);
 }
 
 vod_status_t 
@@ -108,44 +143,33 @@ aes_cbc_encrypt_write(
 	u_char* buffer,
 	uint32_t size)
 {
-	u_char* encrypted_buffer;
-	size_t required_size = aes_round_up_to_block(size);
-	size_t buffer_size = required_size;
-	int out_size;
+	vod_status_t rc;
 
-	encrypted_buffer = buffer_pool_alloc(
-		state->request_context,
-		state->request_context->output_buffer_pool,
-		&buffer_size);
-	if (encrypted_buffer == NULL)
+	// prepend the leftover of the previous write, using the space reserved before the buffer
+	if (state->pending_size > 0)
 	{
-		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
-			"aes_cbc_encrypt_write: buffer_pool_alloc failed");
-		return VOD_ALLOC_FAILED;
+		buffer -= state->pending_size;
+		size += state->pending_size;
+		vod_memcpy(buffer, state->pending, state->pending_size);
 	}
 
-	if (buffer_size < required_size)
-	{
-		// Note: this should never happen since the buffer pool size is a multiple of 16
-		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
-			"aes_cbc_encrypt_write: allocated size %uz smaller than required size %uz", 
-			buffer_size, required_size);
-		return VOD_UNEXPECTED;
-	}
+	// keep the partial block at the end for the next write
+	state->pending_size = size % AES_BLOCK_SIZE;
+	size -= state->pending_size;
+	vod_memcpy(state->pending, buffer + size, state->pending_size);
 
-	if (1 != EVP_EncryptUpdate(&state->cipher, encrypted_buffer, &out_size, buffer, size))
+	if (size == 0)
 	{
-		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
-			"aes_cbc_encrypt_write: EVP_EncryptUpdate failed");
-		return VOD_UNEXPECTED;
+		return VOD_OK;
 	}
 
-	if (out_size == 0)
+	rc = aes_cbc_encrypt_blocks(state, buffer, size);
+	if (rc != VOD_OK)
 	{
-		return VOD_OK;
+		return rc;
 	}
 
-	return state->callback(state->callback_context, encrypted_buffer, out_size);
+	return state->callback(state->callback_context, buffer, size);
 }
 
 vod_status_t 
@@ -153,6 +177,16 @@ aes_cbc_encrypt_flush(aes_cbc_encrypt_context_t* state)
 {
 	int last_block_len;
 
+	// Note: the pending data is smaller than a block, so it is only buffered by the cipher
+	if (1 != EVP_EncryptUpdate(&state->cipher, state->last_block, &last_block_len, state->pending, state->pending_size))
+	{
+		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+			"aes_cbc_encrypt_flush: EVP_EncryptUpdate failed");
+		return VOD_UNEXPECTED;
+	}
+
+	state->pending_size = 0;
+
 	if (1 != EVP_EncryptFinal_ex(&state->cipher, state->last_block, &last_block_len))
 	{
 		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
@@ -13,6 +13,8 @@ typedef struct {
 	EVP_CIPHER_CTX cipher;
 #endif //(VOD_HAVE_OPENSSL_EVP)
 	u_char last_block[AES_BLOCK_SIZE];
+	u_char pending[AES_BLOCK_SIZE];
+	uint32_t pending_size;
 } aes_cbc_encrypt_context_t;
 
 // functions
@@ -30,6 +32,7 @@ vod_status_t aes_cbc_encrypt(
 	vod_str_t* src, 
 	bool_t flush);
 
+// Note: the buffer is encrypted in place, and must be preceded by AES_BLOCK_SIZE writable bytes
 vod_status_t aes_cbc_encrypt_write(
 	aes_cbc_encrypt_context_t* ctx, 
 	u_char* buffer, 
@@ -217,7 +217,7 @@ hls_muxer_init_base(
 	const media_filter_t* next_filter;
 	void* next_filter_context;
 	vod_status_t rc;
-	bool_t reuse_buffers;
+	uint32_t reserved_size;
 
 	*simulation_supported = hls_muxer_simulation_supported(media_set, encryption_params);
 
@@ -241,12 +241,12 @@ hls_muxer_init_base(
 
 		write_callback = (write_callback_t)aes_cbc_encrypt_write;
 		write_context = state->encrypted_write_context;
-		reuse_buffers = TRUE;		// aes_cbc_encrypt allocates new buffers
+		reserved_size = AES_BLOCK_SIZE;		// aes_cbc_encrypt prepends the partial block of the previous buffer
 	}
 	else
 	{
 		state->encrypted_write_context = NULL;
-		reuse_buffers = FALSE;
+		reserved_size = 0;
 	}
 
 	// init the write queue
@@ -255,7 +255,8 @@ hls_muxer_init_base(
 		request_context,
 		write_callback,
 		write_context,
-		reuse_buffers);
+		FALSE,
+		reserved_size);
 
 	// init the packetizer streams and get the packet ids / stream ids
 	rc = mpegts_encoder_init_streams(
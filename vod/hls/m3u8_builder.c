@@ -19,6 +19,10 @@ static const char m3u8_stream_inf_audio[] = "#EXT-X-STREAM-INF:PROGRAM-ID=1,BAND
 static const u_char m3u8_discontinuity[] = "#EXT-X-DISCONTINUITY\n";
 static const char byte_range_tag_format[] = "#EXT-X-BYTERANGE:%uD@%uD\n";
 static const u_char m3u8_url_suffix[] = ".m3u8";
+static const char m3u8_map_tag[] = "#EXT-X-MAP:URI=\"";
+static const char m3u8_map_suffix[] = ".mp4\"\n";
+static const char ts_segment_suffix[] = ".ts\n";
+static const char fmp4_segment_suffix[] = ".m4s\n";
 
 static const char encryption_key_tag_method[] = "#EXT-X-KEY:METHOD=";
 static const char encryption_key_tag_uri[] = ",URI=\"";
@@ -36,6 +40,20 @@ typedef struct {
 	vod_str_t* segment_file_name_prefix;
 } write_segment_context_t;
 
+// live state layout: header, segments[segment_count], text[text_size]
+typedef struct {
+	uint32_t segment_count;
+	uint32_t text_size;
+} m3u8_live_state_header_t;
+
+typedef struct {
+	uint64_t start_time;
+	uint32_t segment_index;
+	uint32_t duration;
+	uint32_t offset;		// the offset of the segment in the text, excluding any discontinuity tag
+	uint32_t size;
+} m3u8_live_state_segment_t;
+
 // Notes: 
 //	1. not using vod_sprintf in order to avoid the use of floats
 //  2. scale must be a power of 10
@@ -78,7 +96,8 @@ m3u8_builder_append_segment_name_ex(
                                  uint64_t segment_start_time,
                                  uint32_t segment_duration_millis,
                                  uint32_t segment_index,
-                                 vod_str_t* tracks_spec)
+                                 vod_str_t* tracks_spec,
+                                 vod_str_t* segment_suffix)
 {
     p = vod_copy(p, base_url->data, base_url->len);
     p = vod_copy(p, segment_file_name_prefix->data, segment_file_name_prefix->len);
@@ -87,7 +106,7 @@ m3u8_builder_append_segment_name_ex(
     p = vod_sprintf(p, "%uD-", segment_duration_millis);
     p = vod_sprintf(p, "%uD", segment_index + 1);
     p = vod_copy(p, tracks_spec->data, tracks_spec->len);
-    p = vod_copy(p, ".ts\n", sizeof(".ts\n") - 1);
+    p = vod_copy(p, segment_suffix->data, segment_suffix->len);
     return p;
 }
 
@@ -133,6 +152,58 @@ m3u8_builder_append_iframe_string(void* context, uint32_t segment_index, uint32_
 		&ctx->tracks_spec);
 }
 
+static vod_status_t
+m3u8_builder_parse_live_state(
+	request_context_t* request_context,
+	vod_str_t* state,
+	m3u8_live_state_segment_t** first_segment,
+	m3u8_live_state_segment_t** last_segment,
+	u_char** text)
+{
+	m3u8_live_state_header_t* header;
+	m3u8_live_state_segment_t* cur_segment;
+	m3u8_live_state_segment_t* end_segment;
+
+	if (state->len < sizeof(*header))
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"m3u8_builder_parse_live_state: state size %uz too small", state->len);
+		return VOD_BAD_DATA;
+	}
+
+	header = (m3u8_live_state_header_t*)state->data;
+	if (header->segment_count > (state->len - sizeof(*header)) / sizeof(*cur_segment) ||
+		header->text_size != state->len - sizeof(*header) - header->segment_count * sizeof(*cur_segment))
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"m3u8_builder_parse_live_state: invalid segment count %uD / text size %uD, state size %uz", 
+			header->segment_count, header->text_size, state->len);
+		return VOD_BAD_DATA;
+	}
+
+	cur_segment = (m3u8_live_state_segment_t*)(header + 1);
+	end_segment = cur_segment + header->segment_count;
+
+	for (; cur_segment < end_segment; cur_segment++)
+	{
+		if (cur_segment->offset > header->text_size ||
+			cur_segment->size > header->text_size - cur_segment->offset)
+		{
+			vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+				"m3u8_builder_parse_live_state: invalid segment offset %uD / size %uD, text size %uD",
+				cur_segment->offset, cur_segment->size, header->text_size);
+			return VOD_BAD_DATA;
+		}
+	}
+
+	// Note: the outputs are set only when the whole state is valid
+	*first_segment = (m3u8_live_state_segment_t*)(header + 1);
+	*last_segment = end_segment;
+	*text = (u_char*)end_segment;
+
+	return VOD_OK;
+}
+
 static uint32_t
 m3u8_builder_get_sequences_mask(media_set_t* media_set)
 {
@@ -289,8 +360,16 @@ m3u8_builder_build_index_playlist(
 	request_params_t* request_params,
 	hls_encryption_params_t* encryption_params,
 	media_set_t* media_set,
+	m3u8_live_state_t* live_state,
 	vod_str_t* result)
 {
+	m3u8_live_state_header_t* state_header;
+	m3u8_live_state_segment_t* live_segments = NULL;
+	m3u8_live_state_segment_t* live_segments_end = NULL;
+	m3u8_live_state_segment_t* cur_live_segment = NULL;
+	m3u8_live_state_segment_t* out_segments = NULL;
+	m3u8_live_state_segment_t* out_segments_end = NULL;
+	m3u8_live_state_segment_t* out_segment = NULL;
 	segment_durations_t segment_durations;
 	segment_duration_item_t* cur_item;
 	segment_duration_item_t* last_item;
@@ -301,10 +380,15 @@ m3u8_builder_build_index_playlist(
 	uint32_t segment_index;
 	uint32_t last_segment_index;
 	vod_str_t tracks_spec;
+	vod_str_t segment_suffix;
 	uint32_t scale;
 	size_t segment_length;
 	size_t result_size;
+	vod_str_t prev_state;
 	vod_status_t rc;
+	u_char* live_text = NULL;
+	u_char* segments_start;
+	u_char* segment_start;
 	u_char* p;
     
     uint64_t dtsStart;
@@ -340,6 +424,17 @@ m3u8_builder_build_index_playlist(
 		return rc;
 	}
 
+	if (conf->container_format == HLS_CONTAINER_FORMAT_FMP4)
+	{
+		segment_suffix.data = (u_char*)fmp4_segment_suffix;
+		segment_suffix.len = sizeof(fmp4_segment_suffix) - 1;
+	}
+	else
+	{
+		segment_suffix.data = (u_char*)ts_segment_suffix;
+		segment_suffix.len = sizeof(ts_segment_suffix) - 1;
+	}
+
 	// get the required buffer length
 	duration_millis = segment_durations.end_time - segment_durations.start_time;
 	last_segment_index = media_set->initial_segment_index + segment_durations.segment_count;
@@ -349,7 +444,7 @@ m3u8_builder_build_index_playlist(
 	segment_length = sizeof("#EXTINF:.000,\n") - 1 + vod_get_int_print_len(vod_div_ceil(duration_millis, 1000)) +
 		segments_base_url->len + conf->segment_file_name_prefix.len + 1
     + vod_get_int_print_len(dtsStart) + 2 + vod_get_int_print_len(duration_millis) // additional data: dts_start_time + "-" + segment_duration
-    + vod_get_int_print_len(last_segment_index) + tracks_spec.len + sizeof(".ts\n") - 1;
+    + vod_get_int_print_len(last_segment_index) + tracks_spec.len + segment_suffix.len;
 
   	result_size =
 		sizeof(M3U8_HEADER_PART1) + VOD_INT64_LEN +
@@ -359,6 +454,13 @@ m3u8_builder_build_index_playlist(
 		segment_durations.discontinuities * (sizeof(m3u8_discontinuity) - 1) +
 		sizeof(m3u8_footer);
 
+	if (conf->container_format == HLS_CONTAINER_FORMAT_FMP4)
+	{
+		result_size += sizeof(m3u8_map_tag) - 1 +
+			segments_base_url->len + conf->init_file_name_prefix.len + tracks_spec.len +
+			sizeof(m3u8_map_suffix) - 1;
+	}
+
 	if (encryption_params->type != HLS_ENC_NONE)
 	{
 		result_size +=
@@ -471,10 +573,70 @@ m3u8_builder_build_index_playlist(
 		conf->m3u8_version, 
 		media_set->initial_segment_index + 1);
 
+	if (conf->container_format == HLS_CONTAINER_FORMAT_FMP4)
+	{
+		p = vod_copy(p, m3u8_map_tag, sizeof(m3u8_map_tag) - 1);
+		p = vod_copy(p, segments_base_url->data, segments_base_url->len);
+		p = vod_copy(p, conf->init_file_name_prefix.data, conf->init_file_name_prefix.len);
+		p = vod_copy(p, tracks_spec.data, tracks_spec.len);
+		p = vod_copy(p, m3u8_map_suffix, sizeof(m3u8_map_suffix) - 1);
+	}
+
 	// write the segments
 	scale = conf->m3u8_version >= 3 ? 1000 : 1;
 	last_item = segment_durations.items + segment_durations.item_count;
 
+	if (live_state != NULL && media_set->type == MEDIA_SET_LIVE && segment_durations.item_count > 0)
+	{
+		// get the state of a previous build of the window, or of the window that preceded it.
+		//	the segments that were already rendered are copied from the state, instead of being rendered again
+		live_state->segment_index = last_item[-1].segment_index + last_item[-1].repeat_count;
+
+		rc = live_state->get_state(live_state->context, live_state->segment_index, &prev_state);
+		if (rc == VOD_NOT_FOUND && live_state->segment_index > 0)
+		{
+			rc = live_state->get_state(live_state->context, live_state->segment_index - 1, &prev_state);
+		}
+
+		switch (rc)
+		{
+		case VOD_OK:
+			rc = m3u8_builder_parse_live_state(
+				request_context,
+				&prev_state,
+				&live_segments,
+				&live_segments_end,
+				&live_text);
+			if (rc != VOD_OK)
+			{
+				// the state is only an optimization, render the whole window
+				vod_log_error(VOD_LOG_WARN, request_context->log, 0,
+					"m3u8_builder_build_index_playlist: ignoring invalid live state of segment %uD",
+					live_state->segment_index);
+			}
+			break;
+
+		case VOD_NOT_FOUND:
+			break;
+
+		default:
+			return rc;
+		}
+
+		out_segments = vod_alloc(request_context->pool, sizeof(out_segments[0]) * segment_durations.segment_count);
+		if (out_segments == NULL)
+		{
+			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+				"m3u8_builder_build_index_playlist: vod_alloc failed (1)");
+			return VOD_ALLOC_FAILED;
+		}
+		out_segments_end = out_segments + segment_durations.segment_count;
+	}
+
+	cur_live_segment = live_segments;
+	out_segment = out_segments;
+	segments_start = p;
+
 	for (cur_item = segment_durations.items; cur_item < last_item; cur_item++)
 	{
 		segment_index = cur_item->segment_index;
@@ -485,22 +647,74 @@ m3u8_builder_build_index_playlist(
 			p = vod_copy(p, m3u8_discontinuity, sizeof(m3u8_discontinuity) - 1);
 		}
 
-        segment_duration = rescale_time(cur_item->duration, segment_durations.timescale, scale);
-		// write the first segment
-		extinf.data = p;
-		p = m3u8_builder_append_extinf_tag(p, rescale_time(cur_item->duration, segment_durations.timescale, scale), scale);
-		extinf.len = p - extinf.data;
-		p = m3u8_builder_append_segment_name_ex(p, segments_base_url, &conf->segment_file_name_prefix, dtsStart, segment_duration, segment_index, &tracks_spec);
-		segment_index++;
-        dtsStart += segment_duration;
-	
-        // write any additional segments
-		for (; segment_index < last_segment_index; segment_index++)
+		segment_duration = rescale_time(cur_item->duration, segment_durations.timescale, scale);
+		extinf.len = 0;
+
+		do
+		{
+			segment_start = p;
+
+			for (; cur_live_segment < live_segments_end && cur_live_segment->segment_index < segment_index; cur_live_segment++);
+
+			if (cur_live_segment < live_segments_end &&
+				cur_live_segment->segment_index == segment_index &&
+				cur_live_segment->duration == segment_duration &&
+				cur_live_segment->start_time == dtsStart)
+			{
+				// rendered by a previous build
+				p = vod_copy(p, live_text + cur_live_segment->offset, cur_live_segment->size);
+			}
+			else
+			{
+				if (extinf.len == 0)
+				{
+					extinf.data = p;
+					p = m3u8_builder_append_extinf_tag(p, segment_duration, scale);
+					extinf.len = p - extinf.data;
+				}
+				else
+				{
+					p = vod_copy(p, extinf.data, extinf.len);
+				}
+
+				p = m3u8_builder_append_segment_name_ex(p, segments_base_url, &conf->segment_file_name_prefix, dtsStart, segment_duration, segment_index, &tracks_spec, &segment_suffix);
+			}
+
+			if (out_segment < out_segments_end)
+			{
+				out_segment->start_time = dtsStart;
+				out_segment->segment_index = segment_index;
+				out_segment->duration = segment_duration;
+				out_segment->offset = segment_start - segments_start;
+				out_segment->size = p - segment_start;
+				out_segment++;
+			}
+
+			segment_index++;
+			dtsStart += segment_duration;
+		} while (segment_index < last_segment_index);
+	}
+
+	// save the state
+	if (out_segments != NULL)
+	{
+		live_state->state.len = sizeof(*state_header) + 
+			(out_segment - out_segments) * sizeof(*out_segment) +
+			(p - segments_start);
+		live_state->state.data = vod_alloc(request_context->pool, live_state->state.len);
+		if (live_state->state.data == NULL)
 		{
-			p = vod_copy(p, extinf.data, extinf.len);
-			p = m3u8_builder_append_segment_name_ex(p, segments_base_url, &conf->segment_file_name_prefix, dtsStart, segment_duration, segment_index, &tracks_spec);
-            dtsStart += segment_duration;
+			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+				"m3u8_builder_build_index_playlist: vod_alloc failed (2)");
+			return VOD_ALLOC_FAILED;
 		}
+
+		state_header = (m3u8_live_state_header_t*)live_state->state.data;
+		state_header->segment_count = out_segment - out_segments;
+		state_header->text_size = p - segments_start;
+
+		segment_start = vod_copy(state_header + 1, out_segments, (out_segment - out_segments) * sizeof(*out_segment));
+		vod_memcpy(segment_start, segments_start, p - segments_start);
 	}
 
 	// write the footer
@@ -590,16 +804,24 @@ m3u8_builder_build_master_playlist(
 	vod_status_t rc;
 	uint32_t muxed_tracks;
 	uint32_t bitrate;
+	uint32_t flags;
 	size_t max_video_stream_inf;
 	size_t base_url_len;
 	size_t result_size;
 	u_char* p;
 
 	// get the adaptations sets
+	// Note: fmp4 segments contain a single track, the audio is always output as alternative audio
+	flags = ADAPTATION_SETS_FLAG_SINGLE_LANG_TRACK;
+	if (conf->container_format != HLS_CONTAINER_FORMAT_FMP4)
+	{
+		flags |= ADAPTATION_SETS_FLAG_MUXED;
+	}
+
 	rc = manifest_utils_get_adaptation_sets(
 		request_context, 
 		media_set, 
-		ADAPTATION_SETS_FLAG_MUXED | ADAPTATION_SETS_FLAG_SINGLE_LANG_TRACK, 
+		flags, 
 		&adaptation_sets);
 	if (rc != VOD_OK)
 	{
@@ -757,14 +979,30 @@ m3u8_builder_build_master_playlist(
 			if (tracks[MEDIA_TYPE_AUDIO] != NULL)
 			{
 				audio = &tracks[MEDIA_TYPE_AUDIO]->media_info;
+			}
+			else if (adaptation_sets.first->type == ADAPTATION_TYPE_VIDEO &&
+				first_audio_adaptation_set != NULL &&
+				first_audio_adaptation_set < adaptation_sets.last)
+			{
+				// demuxed audio, report the default rendition
+				audio = &first_audio_adaptation_set->first[0]->media_info;
+			}
+			else
+			{
+				audio = NULL;
+			}
+
+			if (audio != NULL)
+			{
 				bitrate += audio->bitrate;
 			}
+
 			p = vod_sprintf(p, m3u8_stream_inf_video,
 				bitrate,
 				(uint32_t)video->u.video.width,
 				(uint32_t)video->u.video.height,
 				&video->codec_name);
-			if (tracks[MEDIA_TYPE_AUDIO] != NULL)
+			if (audio != NULL)
 			{
 				*p++ = ',';
 				p = vod_copy(p, audio->codec_name.data, audio->codec_name.len);
@@ -813,7 +1051,11 @@ m3u8_builder_init_config(
 	uint32_t max_segment_duration, 
 	hls_encryption_type_t encryption_method)
 {
-	if (encryption_method == HLS_ENC_SAMPLE_AES ||
+	if (conf->container_format == HLS_CONTAINER_FORMAT_FMP4)
+	{
+		conf->m3u8_version = 6;		// EXT-X-MAP without EXT-X-I-FRAMES-ONLY
+	}
+	else if (encryption_method == HLS_ENC_SAMPLE_AES ||
 		conf->encryption_key_format.len != 0 ||
 		conf->encryption_key_format_versions.len != 0)
 	{
@@ -12,17 +12,37 @@
 static const char iframes_m3u8_header_format[] = "#EXTM3U\n#EXT-X-TARGETDURATION:%d\n#EXT-X-VERSION:4\n#EXT-X-MEDIA-SEQUENCE:1\n#EXT-X-PLAYLIST-TYPE:VOD\n#EXT-X-I-FRAMES-ONLY\n";
 
 // typedefs
+typedef enum {
+	HLS_CONTAINER_FORMAT_MPEGTS,
+	HLS_CONTAINER_FORMAT_FMP4,
+} hls_container_format_t;
+
 typedef struct {
 	int m3u8_version;
+	vod_uint_t container_format;
 	u_char iframes_m3u8_header[MAX_IFRAMES_M3U8_HEADER_SIZE];
 	size_t iframes_m3u8_header_len;
 	vod_str_t index_file_name_prefix;
 	vod_str_t segment_file_name_prefix;
+	vod_str_t init_file_name_prefix;
 	vod_str_t encryption_key_file_name;
 	vod_str_t encryption_key_format;
 	vod_str_t encryption_key_format_versions;
 } m3u8_config_t;
 
+// returns VOD_NOT_FOUND if there is no saved state whose window ends at segment_index
+typedef vod_status_t(*m3u8_get_live_state_t)(void* context, uint32_t segment_index, vod_str_t* result);
+
+typedef struct {
+	// input
+	m3u8_get_live_state_t get_state;
+	void* context;
+
+	// output - the state of the current build, should be saved by the caller
+	uint32_t segment_index;		// the end of the window (exclusive)
+	vod_str_t state;
+} m3u8_live_state_t;
+
 // functions
 vod_status_t m3u8_builder_build_master_playlist(
 	request_context_t* request_context,
@@ -39,6 +59,7 @@ vod_status_t m3u8_builder_build_index_playlist(
 	request_params_t* request_params,
 	hls_encryption_params_t* encryption_params,
 	media_set_t* media_set,
+	m3u8_live_state_t* live_state,
 	vod_str_t* result);
 
 vod_status_t m3u8_builder_build_iframe_playlist(
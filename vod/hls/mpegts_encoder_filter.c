@@ -874,13 +874,65 @@ mpegts_encoder_start_frame(void* context, output_frame_t* frame)
 	return VOD_OK;
 }
 
+static vod_status_t
+mpegts_encoder_write_packets(mpegts_encoder_state_t* state, const u_char* buffer, uint32_t count)
+{
+	u_char header[SIZEOF_MPEGTS_HEADER];
+	uint32_t cur_count;
+	unsigned cc = state->cc;
+	u_char* p = NULL;
+
+	header[0] = 0x47;
+	header[1] = (u_char)(state->stream_info.pid >> 8);
+	header[2] = (u_char)state->stream_info.pid;
+
+	while (count > 0)
+	{
+		// get as many consecutive packets as the current queue buffer can hold
+		cur_count = count;
+
+		p = write_buffer_queue_get_buffers(state->queue, MPEGTS_PACKET_SIZE, &cur_count, state);
+		if (p == NULL)
+		{
+			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+				"mpegts_encoder_write_packets: write_buffer_queue_get_buffers failed");
+			return VOD_ALLOC_FAILED;
+		}
+
+		count -= cur_count;
+
+		// Note: the copies have a constant size, and are therefore inlined by the compiler
+		for (; cur_count > 0; cur_count--)
+		{
+			header[3] = 0x10 | (cc & 0x0f); /* payload */
+			cc++;
+
+			vod_memcpy(p, header, SIZEOF_MPEGTS_HEADER);
+			vod_memcpy(p + SIZEOF_MPEGTS_HEADER, buffer, MPEGTS_PACKET_USABLE_SIZE);
+
+			p += MPEGTS_PACKET_SIZE;
+			buffer += MPEGTS_PACKET_USABLE_SIZE;
+		}
+	}
+
+	// update the state as if the packets were written one by one
+	state->cc = cc;
+	state->last_queue_offset = state->queue->cur_offset - MPEGTS_PACKET_SIZE;
+	state->last_frame_pts = NO_TIMESTAMP;
+	state->cur_packet_start = p - MPEGTS_PACKET_SIZE;
+	state->cur_packet_end = p;
+	state->cur_pos = p;
+
+	return VOD_OK;
+}
+
 static vod_status_t 
 mpegts_encoder_write(void* context, const u_char* buffer, uint32_t size)
 {
 	mpegts_encoder_state_t* state = (mpegts_encoder_state_t*)context;
+	uint32_t full_packets_size;
 	uint32_t packet_used_size;
 	uint32_t cur_size;
-	uint32_t initial_size;
 	u_char* cur_packet;
 	vod_status_t rc;
 	bool_t write_direct;
@@ -948,22 +1000,20 @@ mpegts_encoder_write(void* context, const u_char* buffer, uint32_t size)
 	size -= cur_size;
 
 	// write full packets
-	initial_size = size;
-
-	while (size >= MPEGTS_PACKET_USABLE_SIZE)
+	full_packets_size = size - size % MPEGTS_PACKET_USABLE_SIZE;
+	if (full_packets_size > 0)
 	{
-		rc = mpegts_encoder_init_packet(state, TRUE);
+		rc = mpegts_encoder_write_packets(state, buffer, full_packets_size / MPEGTS_PACKET_USABLE_SIZE);
 		if (rc != VOD_OK)
 		{
 			return rc;
 		}
 
-		vod_memcpy(state->cur_pos, buffer, MPEGTS_PACKET_USABLE_SIZE);
-		buffer += MPEGTS_PACKET_USABLE_SIZE;
-		size -= MPEGTS_PACKET_USABLE_SIZE;
-	}
+		buffer += full_packets_size;
+		size -= full_packets_size;
 
-	state->flushed_frame_bytes += initial_size - size;
+		state->flushed_frame_bytes += full_packets_size;
+	}
 
 	// write any residue
 	if (size > 0)
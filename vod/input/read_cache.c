@@ -3,6 +3,24 @@
 
 #define MIN_BUFFER_COUNT (2)
 
+/*
+	coalescing:
+	when enabled, the first time a source misses the cache, the byte ranges of all the frames 
+	of the source are collected, and merged when the gap between them is at most max_gap. 
+	each miss then reads the whole merged range that contains the requested offset (up to 
+	max_coalesced_size), instead of a single buffer_size chunk. as a result, a segment whose 
+	frames are stored close to each other is usually read in a single operation, even if the 
+	audio and video frames are not interleaved the same way they are written to the segment.
+*/
+
+/*
+	parallel reads:
+	when coalescing is enabled, the coalesced ranges of all the sources can be returned in advance, 
+	so that the caller can read them concurrently, before the frames are processed. each range is 
+	assigned to a separate buffer slot, the slots are filled by read_cache_parallel_read_completed.
+	ranges that exceed the slot count are read on demand, as usual.
+*/
+
 void 
 read_cache_init(read_cache_state_t* state, request_context_t* request_context, size_t buffer_size, size_t alignment)
 {
@@ -11,6 +29,210 @@ read_cache_init(read_cache_state_t* state, request_context_t* request_context, s
 	state->alignment = alignment;
 	state->buffer_count = 0;
 	state->reuse_buffers = TRUE;
+	state->max_coalesced_size = 0;
+}
+
+vod_status_t
+read_cache_enable_coalescing(read_cache_state_t* state, size_t max_coalesced_size, size_t max_gap)
+{
+	if (vod_array_init(&state->source_ranges, state->request_context->pool, 2, sizeof(read_cache_source_ranges_t)) != VOD_OK)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+			"read_cache_enable_coalescing: vod_array_init failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	state->max_coalesced_size = max_coalesced_size;
+	state->max_gap = max_gap;
+
+	return VOD_OK;
+}
+
+static int
+read_cache_compare_ranges(const void* p1, const void* p2)
+{
+	uint64_t o1 = ((read_cache_range_t*)p1)->start_offset;
+	uint64_t o2 = ((read_cache_range_t*)p2)->start_offset;
+
+	if (o1 < o2)
+	{
+		return -1;
+	}
+	else if (o1 > o2)
+	{
+		return 1;
+	}
+
+	return 0;
+}
+
+static read_cache_source_ranges_t*
+read_cache_get_source_ranges(read_cache_state_t* state, media_clip_source_t* source)
+{
+	read_cache_source_ranges_t* result;
+	read_cache_source_ranges_t* cur;
+	read_cache_source_ranges_t* last;
+	read_cache_range_t* cur_range;
+	read_cache_range_t* output;
+	frame_list_part_t* part;
+	media_track_t* cur_track;
+	input_frame_t* cur_frame;
+	size_t frame_count;
+
+	cur = state->source_ranges.elts;
+	last = cur + state->source_ranges.nelts;
+	for (; cur < last; cur++)
+	{
+		if (cur->source == source)
+		{
+			return cur;
+		}
+	}
+
+	// get the number of frames
+	frame_count = 0;
+	for (cur_track = source->track_array.first_track; cur_track < source->track_array.last_track; cur_track++)
+	{
+		for (part = &cur_track->frames; part != NULL; part = part->next)
+		{
+			frame_count += part->last_frame - part->first_frame;
+		}
+	}
+
+	result = vod_array_push(&state->source_ranges);
+	if (result == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+			"read_cache_get_source_ranges: vod_array_push failed");
+		return NULL;
+	}
+
+	result->source = source;
+	result->ranges = NULL;
+	result->ranges_end = NULL;
+
+	if (frame_count <= 0)
+	{
+		return result;
+	}
+
+	result->ranges = vod_alloc(state->request_context->pool, sizeof(result->ranges[0]) * frame_count);
+	if (result->ranges == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+			"read_cache_get_source_ranges: vod_alloc failed");
+		return result;
+	}
+
+	// collect the frame ranges
+	cur_range = result->ranges;
+	for (cur_track = source->track_array.first_track; cur_track < source->track_array.last_track; cur_track++)
+	{
+		for (part = &cur_track->frames; part != NULL; part = part->next)
+		{
+			for (cur_frame = part->first_frame; cur_frame < part->last_frame; cur_frame++)
+			{
+				cur_range->start_offset = cur_frame->offset;
+				cur_range->end_offset = cur_frame->offset + cur_frame->size;
+				cur_range++;
+			}
+		}
+	}
+
+	qsort(result->ranges, frame_count, sizeof(result->ranges[0]), read_cache_compare_ranges);
+
+	// merge ranges that overlap or are close to each other
+	output = result->ranges;
+	for (cur_range = result->ranges + 1; cur_range < result->ranges + frame_count; cur_range++)
+	{
+		if (cur_range->start_offset <= output->end_offset + state->max_gap)
+		{
+			if (cur_range->end_offset > output->end_offset)
+			{
+				output->end_offset = cur_range->end_offset;
+			}
+			continue;
+		}
+
+		output++;
+		*output = *cur_range;
+	}
+
+	result->ranges_end = output + 1;
+
+	vod_log_debug2(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+		"read_cache_get_source_ranges: merged %uz frames to %uz ranges", 
+		frame_count, (size_t)(result->ranges_end - result->ranges));
+
+	return result;
+}
+
+static bool_t
+read_cache_get_coalesced_read(
+	read_cache_state_t* state,
+	read_cache_request_t* request,
+	uint64_t* offset,
+	uint32_t* read_size)
+{
+	read_cache_source_ranges_t* source_ranges;
+	read_cache_range_t* left;
+	read_cache_range_t* right;
+	read_cache_range_t* mid;
+	uint64_t start_offset;
+	uint64_t end_offset;
+	size_t alignment = state->alignment - 1;
+
+	source_ranges = read_cache_get_source_ranges(state, request->source);
+	if (source_ranges == NULL || source_ranges->ranges == NULL)
+	{
+		return FALSE;
+	}
+
+	// binary search for the range that contains the offset
+	left = source_ranges->ranges;
+	right = source_ranges->ranges_end;
+	while (left < right)
+	{
+		mid = left + (right - left) / 2;
+		if (mid->end_offset <= *offset)
+		{
+			left = mid + 1;
+		}
+		else
+		{
+			right = mid;
+		}
+	}
+
+	if (left >= source_ranges->ranges_end || left->start_offset > *offset)
+	{
+		return FALSE;
+	}
+
+	// include the frames of other tracks that precede the requested frame (see read_cache_get_from_cache)
+	start_offset = *offset;
+	if (request->min_offset < start_offset && request->min_offset >= left->start_offset)
+	{
+		start_offset = request->min_offset;
+	}
+	start_offset &= ~alignment;
+
+	end_offset = (left->end_offset + alignment) & ~alignment;
+	if (end_offset - start_offset > state->max_coalesced_size)
+	{
+		// the range is too large, read as much of it as possible starting from the requested offset
+		start_offset = *offset & ~alignment;
+		end_offset = (start_offset + state->max_coalesced_size) & ~alignment;
+		if (end_offset <= *offset)
+		{
+			return FALSE;
+		}
+	}
+
+	*offset = start_offset;
+	*read_size = end_offset - start_offset;
+
+	return TRUE;
 }
 
 vod_status_t
@@ -76,20 +298,24 @@ read_cache_get_from_cache(
 	alignment = state->alignment - 1;
 	target_buffer = &state->buffers[request->cache_slot_id % state->buffer_count];
 
-	// start reading from the min offset, if that would contain the whole frame
-	// Note: this condition is intended to optimize the case in which the frame order 
-	//		in the output segment is <video1><audio1> while on disk it's <audio1><video1>. 
-	//		in this case it would be better to start reading from the beginning, even 
-	//		though the first frame that is requested is the second one
-	if (request->min_offset < offset && 
-		request->end_offset < (request->min_offset & ~alignment) + state->buffer_size)
+	if (state->max_coalesced_size <= 0 ||
+		!read_cache_get_coalesced_read(state, request, &offset, &read_size))
 	{
-		offset = request->min_offset;
-	}
-	offset &= ~alignment;
+		// start reading from the min offset, if that would contain the whole frame
+		// Note: this condition is intended to optimize the case in which the frame order 
+		//		in the output segment is <video1><audio1> while on disk it's <audio1><video1>. 
+		//		in this case it would be better to start reading from the beginning, even 
+		//		though the first frame that is requested is the second one
+		if (request->min_offset < offset && 
+			request->end_offset < (request->min_offset & ~alignment) + state->buffer_size)
+		{
+			offset = request->min_offset;
+		}
+		offset &= ~alignment;
 
-	// calculate the read size
-	read_size = state->buffer_size;
+		// calculate the read size
+		read_size = state->buffer_size;
+	}
 
 	// don't read anything that is already in the cache
 	for (cur_buffer = state->buffers; cur_buffer < state->buffers_end; cur_buffer++)
@@ -150,3 +376,105 @@ read_cache_read_completed(read_cache_state_t* state, vod_buf_t* buf)
 	// no longer have an active request
 	state->target_buffer = NULL;
 }
+
+vod_status_t
+read_cache_get_parallel_reads(
+	read_cache_state_t* state,
+	media_clip_source_t* sources_head,
+	size_t max_count,
+	read_cache_get_read_buffer_t* result,
+	size_t* result_count)
+{
+	read_cache_source_ranges_t* source_ranges;
+	read_cache_range_t* cur_range;
+	media_clip_source_t* source;
+	cache_buffer_t* cur_buffer;
+	uint64_t start_offset;
+	uint64_t end_offset;
+	uint64_t cur_end;
+	size_t alignment = state->alignment - 1;
+	size_t max_read_size;
+	size_t count;
+	vod_status_t rc;
+
+	*result_count = 0;
+
+	if (state->max_coalesced_size <= 0 || max_count <= 0)
+	{
+		return VOD_OK;
+	}
+
+	rc = read_cache_allocate_buffer_slots(state, max_count);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	max_read_size = state->max_coalesced_size & ~alignment;
+	if (max_read_size <= 0)
+	{
+		max_read_size = state->alignment;
+	}
+
+	count = 0;
+	for (source = sources_head; source != NULL; source = source->next)
+	{
+		source_ranges = read_cache_get_source_ranges(state, source);
+		if (source_ranges == NULL)
+		{
+			return VOD_ALLOC_FAILED;
+		}
+
+		for (cur_range = source_ranges->ranges; cur_range < source_ranges->ranges_end; cur_range++)
+		{
+			start_offset = cur_range->start_offset & ~alignment;
+			end_offset = (cur_range->end_offset + alignment) & ~alignment;
+
+			// split ranges that are larger than the max coalesced size
+			while (start_offset < end_offset)
+			{
+				if (count >= max_count)
+				{
+					goto done;
+				}
+
+				cur_end = vod_min(end_offset, start_offset + max_read_size);
+
+				// Note: the buffer holds no data until the read completes (end_offset = start_offset)
+				cur_buffer = &state->buffers[count];
+				cur_buffer->source = source;
+				cur_buffer->start_offset = start_offset;
+				cur_buffer->end_offset = start_offset;
+				cur_buffer->buffer_size = cur_end - start_offset;
+
+				result[count].source = source;
+				result[count].offset = start_offset;
+				result[count].buffer = NULL;
+				result[count].size = cur_end - start_offset;
+				count++;
+
+				start_offset = cur_end;
+			}
+		}
+	}
+
+done:
+
+	vod_log_debug1(VOD_LOG_DEBUG_LEVEL, state->request_context->log, 0,
+		"read_cache_get_parallel_reads: returning %uz reads", count);
+
+	*result_count = count;
+
+	return VOD_OK;
+}
+
+void
+read_cache_parallel_read_completed(read_cache_state_t* state, size_t index, vod_buf_t* buf)
+{
+	cache_buffer_t* cur_buffer = &state->buffers[index];
+
+	cur_buffer->buffer_start = buf->start;
+	cur_buffer->buffer_pos = buf->pos;
+	cur_buffer->buffer_size = buf->last - buf->pos;
+	cur_buffer->end_offset = cur_buffer->start_offset + cur_buffer->buffer_size;
+}
@@ -16,6 +16,17 @@ typedef struct {
 	uint64_t end_offset;
 } cache_buffer_t;
 
+typedef struct {
+	uint64_t start_offset;
+	uint64_t end_offset;
+} read_cache_range_t;
+
+typedef struct {
+	void* source;
+	read_cache_range_t* ranges;		// sorted by offset, non overlapping
+	read_cache_range_t* ranges_end;
+} read_cache_source_ranges_t;
+
 typedef struct {
 	request_context_t* request_context;
 	cache_buffer_t* buffers;
@@ -25,6 +36,11 @@ typedef struct {
 	size_t buffer_size;
 	size_t alignment;
 	bool_t reuse_buffers;
+
+	// coalescing
+	size_t max_coalesced_size;		// 0 = disabled
+	size_t max_gap;
+	vod_array_t source_ranges;		// read_cache_source_ranges_t
 } read_cache_state_t;
 
 typedef struct {
@@ -49,6 +65,11 @@ void read_cache_init(
 	size_t buffer_size, 
 	size_t alignment);
 	
+vod_status_t read_cache_enable_coalescing(
+	read_cache_state_t* state,
+	size_t max_coalesced_size,
+	size_t max_gap);
+
 vod_status_t read_cache_allocate_buffer_slots(
 	read_cache_state_t* state,
 	size_t buffer_count);
@@ -68,4 +89,13 @@ void read_cache_get_read_buffer(
 	
 void read_cache_read_completed(read_cache_state_t* state, vod_buf_t* buf);
 
+vod_status_t read_cache_get_parallel_reads(
+	read_cache_state_t* state,
+	struct media_clip_source_s* sources_head,
+	size_t max_count,
+	read_cache_get_read_buffer_t* result,
+	size_t* result_count);
+
+void read_cache_parallel_read_completed(read_cache_state_t* state, size_t index, vod_buf_t* buf);
+
 #endif // __READ_CACHE_H__
@@ -28,6 +28,7 @@
 #define PARSE_FLAG_EXTRA_DATA_PARSE		(0x00000008)
 #define PARSE_FLAG_SAVE_RAW_ATOMS		(0x00000010)		// mp4 only
 #define PARSE_FLAG_EDIT_LIST			(0x00000020)
+#define PARSE_FLAG_SAMPLE_INDEX			(0x00000040)		// mp4 only
 
 // frames
 #define PARSE_FLAG_FRAMES_DURATION		(0x00010000)
@@ -37,6 +38,7 @@
 #define PARSE_FLAG_FRAMES_IS_KEY		(0x00100000)
 #define PARSE_FLAG_DURATION_LIMITS		(0x00200000)
 #define PARSE_FLAG_TOTAL_SIZE_ESTIMATE	(0x00400000)
+#define PARSE_FLAG_FRAME_INDEX			(0x00800000)		// mp4 only
 
 // media set
 #define PARSE_FLAG_ALL_CLIPS			(0x01000000)
@@ -230,10 +232,18 @@ typedef struct {
 	uint64_t last_offset;
 } media_clipper_parse_result_t;
 
+typedef struct {
+	uint32_t media_type;
+	uint32_t track_index;		// index of the track in the file, within its media type
+	vod_str_t data;				// serialized frame index, empty when not available
+	bool_t save;				// set by read_frames when the frame index was built
+} media_frame_index_t;
+
 typedef struct {
 	vod_array_t tracks;
 	uint64_t duration;
 	uint32_t timescale;
+	media_frame_index_t* frame_indexes;		// [tracks.nelts], set only when PARSE_FLAG_FRAME_INDEX is supported
 } media_base_metadata_t;
 
 typedef struct {
@@ -912,6 +912,7 @@ mkv_metadata_parse(
 
 	metadata->base.timescale = timescale;
 	metadata->base.duration = info.duration;
+	metadata->base.frame_indexes = NULL;
 	metadata->cues = metadata_parts[SECTION_CUES];
 	metadata->base_layout = *(mkv_base_layout_t*)metadata_parts[SECTION_LAYOUT].data;
 	*result = &metadata->base;
@@ -4,6 +4,9 @@
 // includes
 #include "../media_format.h"
 
+// constants
+#define MKV_METADATA_VERSION (1)		// Note: must be incremented when the metadata sections or mkv_base_layout_t change
+
 // globals
 extern media_format_t mkv_format;
 
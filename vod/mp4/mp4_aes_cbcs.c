@@ -0,0 +1,152 @@
+#include "mp4_aes_cbcs.h"
+
+/*
+	implements the 'cbcs' pattern encryption of common encryption (ISO/IEC 23001-7) -
+	each range (subsample or sample) starts with clear bytes, followed by the protected bytes.
+	in the protected bytes, one block out of every 1 + skip_blocks blocks is encrypted, 
+	when skip_blocks is zero, all the blocks are encrypted. a trailing partial block is left clear.
+	the cbc chain is reset to the constant iv at the beginning of each range, and continues
+	across the skipped blocks.
+*/
+
+#if (VOD_HAVE_OPENSSL_EVP)
+
+static void
+mp4_aes_cbcs_cleanup(mp4_aes_cbcs_state_t* state)
+{
+	EVP_CIPHER_CTX_cleanup(&state->cipher);
+}
+
+vod_status_t
+mp4_aes_cbcs_init(
+	mp4_aes_cbcs_state_t* state,
+	request_context_t* request_context,
+	write_buffer_state_t* write_buffer,
+	u_char* key,
+	const u_char* iv)
+{
+	vod_pool_cleanup_t *cln;
+
+	state->request_context = request_context;
+	state->write_buffer = write_buffer;
+	vod_memcpy(state->key, key, sizeof(state->key));
+	vod_memcpy(state->iv, iv, sizeof(state->iv));
+
+	cln = vod_pool_cleanup_add(request_context->pool, 0);
+	if (cln == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mp4_aes_cbcs_init: vod_pool_cleanup_add failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	cln->handler = (vod_pool_cleanup_pt)mp4_aes_cbcs_cleanup;
+	cln->data = state;
+
+	EVP_CIPHER_CTX_init(&state->cipher);
+
+	return VOD_OK;
+}
+
+vod_status_t
+mp4_aes_cbcs_start(
+	mp4_aes_cbcs_state_t* state,
+	uint32_t clear_size,
+	uint32_t size,
+	uint32_t skip_blocks)
+{
+	state->skip_size = skip_blocks * AES_BLOCK_SIZE;
+	state->cur_offset = 0;
+
+	if (size < clear_size + AES_BLOCK_SIZE)
+	{
+		state->next_encrypt_offset = UINT_MAX;
+		return VOD_OK;
+	}
+
+	state->next_encrypt_offset = clear_size;
+	state->end_encrypt_offset = clear_size + aes_round_down_to_block(size - clear_size);
+
+	// reset the iv (it is ok to call EVP_EncryptInit_ex several times without cleanup)
+	if (1 != EVP_EncryptInit_ex(&state->cipher, EVP_aes_128_cbc(), NULL, state->key, state->iv))
+	{
+		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+			"mp4_aes_cbcs_start: EVP_EncryptInit_ex failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	return VOD_OK;
+}
+
+vod_status_t
+mp4_aes_cbcs_write(
+	mp4_aes_cbcs_state_t* state,
+	const u_char* buffer,
+	uint32_t size)
+{
+	uint32_t encrypt_end;
+	uint32_t end_offset;
+	uint32_t cur_size;
+	size_t alloc_size;
+	u_char* output;
+	vod_status_t rc;
+	int out_size;
+
+	for (end_offset = state->cur_offset + size;
+		state->cur_offset < end_offset;
+		state->cur_offset += cur_size, buffer += cur_size)
+	{
+		if (state->cur_offset < state->next_encrypt_offset)
+		{
+			// clear part
+			cur_size = vod_min(state->next_encrypt_offset, end_offset) - state->cur_offset;
+			rc = write_buffer_write(state->write_buffer, buffer, cur_size);
+			if (rc != VOD_OK)
+			{
+				return rc;
+			}
+			continue;
+		}
+
+		// encrypted part, a single block, or all the remaining blocks when there is no skip
+		encrypt_end = state->skip_size > 0 ? state->next_encrypt_offset + AES_BLOCK_SIZE : state->end_encrypt_offset;
+
+		rc = write_buffer_get_bytes(state->write_buffer, 2 * AES_BLOCK_SIZE, &alloc_size, &output);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+
+		// Note: the cipher may output a block that was buffered in a previous call
+		cur_size = vod_min(encrypt_end, end_offset) - state->cur_offset;
+		if (cur_size > alloc_size - AES_BLOCK_SIZE)
+		{
+			cur_size = alloc_size - AES_BLOCK_SIZE;
+		}
+
+		if (1 != EVP_EncryptUpdate(&state->cipher, output, &out_size, buffer, cur_size))
+		{
+			vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+				"mp4_aes_cbcs_write: EVP_EncryptUpdate failed");
+			return VOD_UNEXPECTED;
+		}
+
+		state->write_buffer->cur_pos += out_size;
+
+		if (state->cur_offset + cur_size < encrypt_end)
+		{
+			continue;
+		}
+
+		// find the next encrypt offset
+		state->next_encrypt_offset = encrypt_end + state->skip_size;
+		if (state->next_encrypt_offset >= state->end_encrypt_offset)
+		{
+			state->next_encrypt_offset = UINT_MAX;
+		}
+	}
+
+	return VOD_OK;
+}
+
+#endif //(VOD_HAVE_OPENSSL_EVP)
@@ -0,0 +1,47 @@
+#ifndef __MP4_AES_CBCS_H__
+#define __MP4_AES_CBCS_H__
+
+// includes
+#include "../write_buffer.h"
+#include "../aes_defs.h"
+
+#define MP4_AES_CBCS_KEY_SIZE (16)
+#define MP4_AES_CBCS_IV_SIZE (16)
+
+// typedefs
+typedef struct {
+	request_context_t* request_context;
+	write_buffer_state_t* write_buffer;
+#if (VOD_HAVE_OPENSSL_EVP)
+	EVP_CIPHER_CTX cipher;
+#endif //(VOD_HAVE_OPENSSL_EVP)
+	u_char key[MP4_AES_CBCS_KEY_SIZE];
+	u_char iv[MP4_AES_CBCS_IV_SIZE];
+
+	// range state
+	uint32_t skip_size;
+	uint32_t cur_offset;
+	uint32_t next_encrypt_offset;
+	uint32_t end_encrypt_offset;
+} mp4_aes_cbcs_state_t;
+
+// functions
+vod_status_t mp4_aes_cbcs_init(
+	mp4_aes_cbcs_state_t* state,
+	request_context_t* request_context,
+	write_buffer_state_t* write_buffer,
+	u_char* key,
+	const u_char* iv);
+
+vod_status_t mp4_aes_cbcs_start(
+	mp4_aes_cbcs_state_t* state,
+	uint32_t clear_size,
+	uint32_t size,
+	uint32_t skip_blocks);
+
+vod_status_t mp4_aes_cbcs_write(
+	mp4_aes_cbcs_state_t* state,
+	const u_char* buffer,
+	uint32_t size);
+
+#endif //__MP4_AES_CBCS_H__
@@ -1,4 +1,6 @@
 #include "mp4_aes_ctr.h"
+#include "../read_stream.h"
+#include "../write_stream.h"
 
 #if (VOD_HAVE_OPENSSL_EVP)
 
@@ -47,7 +49,7 @@ mp4_aes_ctr_set_iv(
 	u_char* iv)
 {
 	vod_memcpy(state->counter, iv, MP4_AES_CTR_IV_SIZE);
-	vod_memzero(state->counter + MP4_AES_CTR_IV_SIZE, sizeof(state->counter) - MP4_AES_CTR_IV_SIZE);
+	vod_memzero(state->counter + MP4_AES_CTR_IV_SIZE, AES_BLOCK_SIZE - MP4_AES_CTR_IV_SIZE);
 	state->encrypted_pos = NULL;
 	state->encrypted_end = NULL;
 }
@@ -67,17 +69,56 @@ mp4_aes_ctr_increment_be64(u_char* counter)
 	}
 }
 
+static vod_status_t
+mp4_aes_ctr_encrypt_counters(mp4_aes_ctr_state_t* state, size_t size)
+{
+	u_char* end = state->encrypted_counter + size;
+	u_char* p;
+	uint64_t counter;
+	int out_size;
+
+	// write the clear counters, the iv is followed by a 64 bit big endian block counter
+	counter = parse_be64(state->counter + MP4_AES_CTR_IV_SIZE);
+	for (p = state->encrypted_counter; p < end; counter++)
+	{
+		p = vod_copy(p, state->counter, MP4_AES_CTR_IV_SIZE);
+		write_be64(p, counter);
+	}
+
+	// encrypt them in place
+	if (1 != EVP_EncryptUpdate(
+		&state->cipher,
+		state->encrypted_counter,
+		&out_size,
+		state->encrypted_counter,
+		size) ||
+		out_size != (int)size)
+	{
+		vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
+			"mp4_aes_ctr_encrypt_counters: EVP_EncryptUpdate failed");
+		return VOD_UNEXPECTED;
+	}
+
+	// update the first counter
+	p = state->counter + MP4_AES_CTR_IV_SIZE;
+	write_be64(p, counter);
+
+	state->encrypted_pos = state->encrypted_counter;
+	state->encrypted_end = end;
+
+	return VOD_OK;
+}
+
 vod_status_t
 mp4_aes_ctr_process(mp4_aes_ctr_state_t* state, u_char* dest, const u_char* src, uint32_t size)
 {
 	const u_char* src_end = src + size;
 	const u_char* cur_end_pos;
 	u_char* encrypted_counter_pos;
-	u_char* cur_block;
-	u_char* next_block;
-	u_char* end_block;
+	uint64_t data;
+	uint64_t key;
 	size_t encrypted_size;
-	int out_size;
+	vod_status_t rc;
 
 	while (src < src_end)
 	{
@@ -85,57 +126,38 @@ mp4_aes_ctr_process(mp4_aes_ctr_state_t* state, u_char* dest, const u_char* src,
 		{
 			// find the size of the data to encrypt
 			encrypted_size = aes_round_up_to_block_exact(src_end - src);
-			if (encrypted_size > sizeof(state->counter))
-			{
-				encrypted_size = sizeof(state->counter);
-			}
-
-			// initialize the clear counters (the first counter is already initialized)
-			end_block = state->counter + encrypted_size - AES_BLOCK_SIZE;
-			for (cur_block = state->counter; cur_block < end_block; cur_block = next_block)
-			{
-				next_block = cur_block + AES_BLOCK_SIZE;
-				vod_memcpy(next_block, cur_block, AES_BLOCK_SIZE);
-				mp4_aes_ctr_increment_be64(next_block + 8);
-			}
-
-			// encrypt the clear counters
-			if (1 != EVP_EncryptUpdate(
-				&state->cipher,
-				state->encrypted_counter,
-				&out_size,
-				state->counter,
-				encrypted_size) ||
-				out_size != (int)encrypted_size)
+			if (encrypted_size > sizeof(state->encrypted_counter))
 			{
-				vod_log_error(VOD_LOG_ERR, state->request_context->log, 0,
-					"mp4_aes_ctr_process: EVP_EncryptUpdate failed");
-				return VOD_UNEXPECTED;
+				encrypted_size = sizeof(state->encrypted_counter);
 			}
 
-			// update the first counter
-			if (encrypted_size > AES_BLOCK_SIZE)
+			rc = mp4_aes_ctr_encrypt_counters(state, encrypted_size);
+			if (rc != VOD_OK)
 			{
-				vod_memcpy(state->counter, end_block, AES_BLOCK_SIZE);
+				return rc;
 			}
-			mp4_aes_ctr_increment_be64(state->counter + 8);
-
-			state->encrypted_end = state->encrypted_counter + encrypted_size;
-
-			encrypted_counter_pos = state->encrypted_counter;
-			cur_end_pos = src + encrypted_size;
-		}
-		else
-		{
-			encrypted_counter_pos = state->encrypted_pos;
-			cur_end_pos = src + (state->encrypted_end - encrypted_counter_pos);
 		}
 
+		encrypted_counter_pos = state->encrypted_pos;
+		cur_end_pos = src + (state->encrypted_end - encrypted_counter_pos);
 		if (src_end < cur_end_pos)
 		{
 			cur_end_pos = src_end;
 		}
 
+		// xor a word at a time (memcpy is used since the buffers are not aligned)
+		while ((size_t)(cur_end_pos - src) >= sizeof(data))
+		{
+			vod_memcpy(&data, src, sizeof(data));
+			vod_memcpy(&key, encrypted_counter_pos, sizeof(key));
+			data ^= key;
+			vod_memcpy(dest, &data, sizeof(data));
+
+			src += sizeof(data);
+			dest += sizeof(data);
+			encrypted_counter_pos += sizeof(data);
+		}
+
 		while (src < cur_end_pos)
 		{
 			*dest++ = *src++ ^ *encrypted_counter_pos++;
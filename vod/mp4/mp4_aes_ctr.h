@@ -6,7 +6,7 @@
 
 #define MP4_AES_CTR_KEY_SIZE (16)
 #define MP4_AES_CTR_IV_SIZE (8)
-#define MP4_AES_CTR_COUNTER_BUFFER_SIZE (AES_BLOCK_SIZE * 64)
+#define MP4_AES_CTR_COUNTER_BUFFER_SIZE (AES_BLOCK_SIZE * 256)
 
 // typedefs
 typedef struct {
@@ -14,7 +14,7 @@ typedef struct {
 #if (VOD_HAVE_OPENSSL_EVP)
 	EVP_CIPHER_CTX cipher;
 #endif //(VOD_HAVE_OPENSSL_EVP)
-	u_char counter[MP4_AES_CTR_COUNTER_BUFFER_SIZE];
+	u_char counter[AES_BLOCK_SIZE];
 	u_char encrypted_counter[MP4_AES_CTR_COUNTER_BUFFER_SIZE];
 	u_char* encrypted_pos;
 	u_char* encrypted_end;
@@ -30,6 +30,7 @@ void mp4_aes_ctr_set_iv(
 	mp4_aes_ctr_state_t* state,
 	u_char* iv);
 
+// Note: dest may be equal to src, for encrypting in place
 vod_status_t mp4_aes_ctr_process(
 	mp4_aes_ctr_state_t* state,
 	u_char* dest,
@@ -1,5 +1,9 @@
 #include "mp4_builder.h"
 #include "mp4_defs.h"
+#include "../input/frames_source_cache.h"
+
+// constants
+#define MAX_FILE_RANGE_SIZE (0x40000000)
 
 u_char*
 mp4_builder_write_mfhd_atom(u_char* p, uint32_t segment_index)
@@ -154,6 +158,7 @@ mp4_builder_frame_writer_init(
 	request_context_t* request_context,
 	media_sequence_t* sequence,
 	write_callback_t write_callback,
+	write_file_callback_t write_file_callback,
 	void* write_context, 
 	bool_t reuse_buffers,
 	fragment_writer_state_t** result)
@@ -170,6 +175,7 @@ mp4_builder_frame_writer_init(
 
 	state->request_context = request_context;
 	state->write_callback = write_callback;
+	state->write_file_callback = write_file_callback;
 	state->write_context = write_context;
 	state->reuse_buffers = reuse_buffers;
 	state->frame_started = FALSE;
@@ -207,6 +213,86 @@ mp4_builder_move_to_next_frame(fragment_writer_state_t* state)
 	return TRUE;
 }
 
+static vod_status_t
+mp4_builder_write_file_part(fragment_writer_state_t* state)
+{
+	input_frame_t* cur_frame;
+	input_frame_t* last_frame = state->cur_frame_part.last_frame;
+	uint64_t start_offset;
+	uint64_t end_offset;
+	vod_status_t rc;
+	void* source;
+
+	source = get_frame_part_source_clip(state->cur_frame_part);
+
+	start_offset = 0;
+	end_offset = 0;
+
+	for (cur_frame = state->cur_frame; cur_frame < last_frame; cur_frame++)
+	{
+		// output a single range for frames that are contiguous in the file
+		if (cur_frame->offset != end_offset ||
+			end_offset - start_offset + cur_frame->size > MAX_FILE_RANGE_SIZE)
+		{
+			if (end_offset > start_offset)
+			{
+				rc = state->write_file_callback(state->write_context, source, start_offset, end_offset - start_offset);
+				if (rc != VOD_OK)
+				{
+					return rc;
+				}
+			}
+
+			start_offset = cur_frame->offset;
+			end_offset = start_offset;
+		}
+
+		end_offset += cur_frame->size;
+	}
+
+	if (end_offset > start_offset)
+	{
+		rc = state->write_file_callback(state->write_context, source, start_offset, end_offset - start_offset);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+	}
+
+	state->cur_frame = last_frame;
+
+	return VOD_OK;
+}
+
+static vod_status_t
+mp4_builder_move_to_next_read_frame(fragment_writer_state_t* state, bool_t* done)
+{
+	vod_status_t rc;
+
+	for (;;)
+	{
+		if (!mp4_builder_move_to_next_frame(state))
+		{
+			*done = TRUE;
+			return VOD_OK;
+		}
+
+		// frames that are read as is from the source file are passed to the writer as file ranges
+		if (state->write_file_callback == NULL ||
+			state->cur_frame_part.frames_source != &frames_source_cache)
+		{
+			*done = FALSE;
+			return VOD_OK;
+		}
+
+		rc = mp4_builder_write_file_part(state);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+	}
+}
+
 vod_status_t
 mp4_builder_frame_writer_process(fragment_writer_state_t* state)
 {
@@ -216,12 +302,14 @@ mp4_builder_frame_writer_process(fragment_writer_state_t* state)
 	uint32_t write_buffer_size = 0;
 	vod_status_t rc;
 	bool_t frame_done;
+	bool_t done;
 
 	if (!state->frame_started)
 	{
-		if (!mp4_builder_move_to_next_frame(state))
+		rc = mp4_builder_move_to_next_read_frame(state, &done);
+		if (rc != VOD_OK || done)
 		{
-			return VOD_OK;
+			return rc;
 		}
 
 		rc = state->cur_frame_part.frames_source->start_frame(state->cur_frame_part.frames_source_context, state->cur_frame, ULLONG_MAX);
@@ -314,9 +402,10 @@ mp4_builder_frame_writer_process(fragment_writer_state_t* state)
 				write_buffer = NULL;
 			}
 
-			if (!mp4_builder_move_to_next_frame(state))
+			rc = mp4_builder_move_to_next_read_frame(state, &done);
+			if (rc != VOD_OK || done)
 			{
-				return VOD_OK;
+				return rc;
 			}
 		}
 
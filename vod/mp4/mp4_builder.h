@@ -39,6 +39,7 @@ typedef struct {
 typedef struct {
 	request_context_t* request_context;
 	write_callback_t write_callback;
+	write_file_callback_t write_file_callback;
 	void* write_context;
 	bool_t reuse_buffers;
 
@@ -65,6 +66,7 @@ vod_status_t mp4_builder_frame_writer_init(
 	request_context_t* request_context,
 	media_sequence_t* sequence,
 	write_callback_t write_callback,
+	write_file_callback_t write_file_callback,
 	void* write_context,
 	bool_t reuse_buffers,
 	fragment_writer_state_t** result);
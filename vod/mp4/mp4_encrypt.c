@@ -5,11 +5,16 @@
 #include "mp4_decrypt.h"
 #include "mp4_builder.h"
 #include "../read_stream.h"
+#include "../avc_defs.h"
 #include "../udrm.h"
 
 #define MAX_FRAME_RATE (60)
 #define MIN_ALLOC_SIZE (16)
 
+// cbcs video - nal units up to this size are left clear, larger vcl nal units start with this number of clear bytes
+#define CBCS_MAX_CLEAR_NAL_SIZE (48)
+#define CBCS_NAL_CLEAR_LEAD_SIZE (32)
+
 // Note: SNPF = Single Nalu Per Frame
 
 // fragment writer state
@@ -57,6 +62,7 @@ mp4_encrypt_init_state(
 	request_context_t* request_context,
 	media_set_t* media_set,
 	uint32_t segment_index,
+	uint32_t scheme,
 	segment_writer_t* segment_writer,
 	const u_char* iv)
 {
@@ -72,9 +78,21 @@ mp4_encrypt_init_state(
 	state->sequence = sequence;
 	state->segment_index = segment_index;
 	state->segment_writer = *segment_writer;
+	state->scheme = scheme;
+
+	// init the cipher
+	if (scheme == MP4_ENCRYPT_SCHEME_CBCS)
+	{
+		// Note: iv is the constant iv, reset on every subsample
+		rc = mp4_aes_cbcs_init(&state->cbcs_cipher, request_context, &state->write_buffer, drm_info->key, iv);
+		state->sample_iv_size = 0;
+	}
+	else
+	{
+		rc = mp4_aes_ctr_init(&state->cipher, request_context, drm_info->key);
+		state->sample_iv_size = MP4_AES_CTR_IV_SIZE;
+	}
 
-	// init the aes ctr
-	rc = mp4_aes_ctr_init(&state->cipher, request_context, drm_info->key);
 	if (rc != VOD_OK)
 	{
 		return rc;
@@ -150,6 +168,11 @@ mp4_encrypt_start_frame(mp4_encrypt_state_t* state)
 	state->frame_size_left = state->cur_frame->size;
 	state->cur_frame++;
 
+	if (state->scheme == MP4_ENCRYPT_SCHEME_CBCS)
+	{
+		return VOD_OK;
+	}
+
 	// set and increment the iv
 	mp4_aes_ctr_set_iv(&state->cipher, state->iv);
 	mp4_aes_ctr_increment_be64(state->iv);
@@ -169,6 +192,11 @@ mp4_encrypt_write_encrypted(
 	u_char* output;
 	vod_status_t rc;
 
+	if (state->scheme == MP4_ENCRYPT_SCHEME_CBCS)
+	{
+		return mp4_aes_cbcs_write(&state->cbcs_cipher, cur_pos, write_size);
+	}
+
 	write_end = cur_pos + write_size;
 	while (cur_pos < write_end)
 	{
@@ -198,6 +226,7 @@ mp4_encrypt_write_encrypted(
 static vod_status_t
 mp4_encrypt_video_init_track(mp4_encrypt_video_state_t* state, media_track_t* track)
 {
+	state->codec_id = track->media_info.codec_id;
 	state->nal_packet_size_length = track->media_info.u.video.nal_packet_size_length;
 
 	if (state->nal_packet_size_length < 1 || state->nal_packet_size_length > 4)
@@ -436,7 +465,7 @@ mp4_encrypt_video_start_frame(mp4_encrypt_video_state_t* state)
 		return rc;
 	}
 
-	state->auxiliary_data.pos = vod_copy(state->auxiliary_data.pos, state->base.iv, sizeof(state->base.iv));
+	state->auxiliary_data.pos = vod_copy(state->auxiliary_data.pos, state->base.iv, state->base.sample_iv_size);
 	state->auxiliary_data.pos += sizeof(uint16_t);		// write the subsample count on frame end
 	state->subsample_count = 0;
 
@@ -453,24 +482,102 @@ mp4_encrypt_video_start_frame(mp4_encrypt_video_state_t* state)
 }
 
 static vod_status_t
-mp4_encrypt_video_add_subsample(mp4_encrypt_video_state_t* state, uint16_t bytes_of_clear_data, uint32_t bytes_of_encrypted_data)
+mp4_encrypt_video_add_subsample(mp4_encrypt_video_state_t* state, uint32_t bytes_of_clear_data, uint32_t bytes_of_encrypted_data)
 {
+	uint32_t last_clear_data;
 	vod_status_t rc;
+	u_char* p;
 
-	rc = vod_dynamic_buf_reserve(&state->auxiliary_data, sizeof(cenc_sample_auxiliary_data_subsample_t));
-	if (rc != VOD_OK)
+	// merge with the previous subsample if it has no encrypted data
+	if (state->subsample_count > 0)
 	{
-		vod_log_debug1(VOD_LOG_DEBUG_LEVEL, state->base.request_context->log, 0,
-			"mp4_encrypt_video_add_subsample: vod_dynamic_buf_reserve failed %i", rc);
-		return rc;
+		p = state->auxiliary_data.pos - sizeof(cenc_sample_auxiliary_data_subsample_t);
+		last_clear_data = parse_be16(p);
+		if (parse_be32(p + sizeof(uint16_t)) == 0 && last_clear_data + bytes_of_clear_data <= 0xffff)
+		{
+			bytes_of_clear_data += last_clear_data;
+			write_be16(p, bytes_of_clear_data);
+			write_be32(p, bytes_of_encrypted_data);
+			return VOD_OK;
+		}
+	}
+
+	for (;;)
+	{
+		rc = vod_dynamic_buf_reserve(&state->auxiliary_data, sizeof(cenc_sample_auxiliary_data_subsample_t));
+		if (rc != VOD_OK)
+		{
+			vod_log_debug1(VOD_LOG_DEBUG_LEVEL, state->base.request_context->log, 0,
+				"mp4_encrypt_video_add_subsample: vod_dynamic_buf_reserve failed %i", rc);
+			return rc;
+		}
+		state->subsample_count++;
+
+		// the clear bytes field is 16 bit, split large clear units
+		if (bytes_of_clear_data <= 0xffff)
+		{
+			break;
+		}
+
+		write_be16(state->auxiliary_data.pos, 0xffff);
+		write_be32(state->auxiliary_data.pos, 0);
+		bytes_of_clear_data -= 0xffff;
 	}
+
 	write_be16(state->auxiliary_data.pos, bytes_of_clear_data);
 	write_be32(state->auxiliary_data.pos, bytes_of_encrypted_data);
-	state->subsample_count++;
 
 	return VOD_OK;
 }
 
+static bool_t
+mp4_encrypt_video_is_vcl_nal_unit(mp4_encrypt_video_state_t* state, u_char nal_header)
+{
+	int unit_type;
+
+	if (state->codec_id == VOD_CODEC_ID_HEVC)
+	{
+		unit_type = (nal_header >> 1) & 0x3f;
+		return unit_type < HEVC_NAL_VPS;
+	}
+
+	unit_type = nal_header & 0x1f;
+	return unit_type >= AVC_NAL_SLICE && unit_type <= AVC_NAL_IDR_SLICE;
+}
+
+static vod_status_t
+mp4_encrypt_video_cbcs_start_nal_unit(mp4_encrypt_video_state_t* state, u_char nal_header)
+{
+	uint32_t clear_size;
+	vod_status_t rc;
+
+	// Note: packet_size_left excludes the nal header byte
+	if (mp4_encrypt_video_is_vcl_nal_unit(state, nal_header) &&
+		state->packet_size_left + 1 > CBCS_MAX_CLEAR_NAL_SIZE)
+	{
+		clear_size = CBCS_NAL_CLEAR_LEAD_SIZE - 1;
+	}
+	else
+	{
+		clear_size = state->packet_size_left;
+	}
+
+	rc = mp4_aes_cbcs_start(
+		&state->base.cbcs_cipher,
+		clear_size,
+		state->packet_size_left,
+		MP4_ENCRYPT_CBCS_VIDEO_SKIP_BLOCKS);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	return mp4_encrypt_video_add_subsample(
+		state,
+		state->nal_packet_size_length + 1 + clear_size,
+		state->packet_size_left - clear_size);
+}
+
 static vod_status_t
 mp4_encrypt_video_end_frame(mp4_encrypt_video_state_t* state)
 {
@@ -478,12 +585,12 @@ mp4_encrypt_video_end_frame(mp4_encrypt_video_state_t* state)
 	u_char* p;
 
 	// add the sample size to saiz
-	sample_size = sizeof(cenc_sample_auxiliary_data_t)+
+	sample_size = state->base.sample_iv_size + sizeof(uint16_t) +
 		state->subsample_count * sizeof(cenc_sample_auxiliary_data_subsample_t);
 	*(state->auxiliary_sample_sizes_pos)++ = sample_size;
 
 	// update subsample count in auxiliary_data
-	p = state->auxiliary_data.pos - sample_size + offsetof(cenc_sample_auxiliary_data_t, subsample_count);
+	p = state->auxiliary_data.pos - sample_size + state->base.sample_iv_size;
 	write_be16(p, state->subsample_count);
 
 	return VOD_OK;
@@ -553,6 +660,7 @@ mp4_encrypt_video_write_buffer(void* context, u_char* buffer, uint32_t size)
 	u_char* buffer_end = buffer + size;
 	u_char* cur_pos = buffer;
 	u_char* output;
+	u_char nal_header;
 	uint32_t write_size;
 	int32_t cur_shift;
 	size_t ignore;
@@ -616,7 +724,8 @@ mp4_encrypt_video_write_buffer(void* context, u_char* buffer, uint32_t size)
 				*output++ = (state->packet_size_left >> cur_shift) & 0xff;
 			}
 
-			*output++ = *cur_pos++;		// nal type
+			nal_header = *cur_pos++;
+			*output++ = nal_header;		// nal type
 
 			// update the packet size
 			if (state->packet_size_left <= 0)
@@ -628,7 +737,15 @@ mp4_encrypt_video_write_buffer(void* context, u_char* buffer, uint32_t size)
 			state->packet_size_left--;
 
 			// add the subsample
-			rc = mp4_encrypt_video_add_subsample(state, state->nal_packet_size_length + 1, state->packet_size_left);
+			if (state->base.scheme == MP4_ENCRYPT_SCHEME_CBCS)
+			{
+				rc = mp4_encrypt_video_cbcs_start_nal_unit(state, nal_header);
+			}
+			else
+			{
+				rc = mp4_encrypt_video_add_subsample(state, state->nal_packet_size_length + 1, state->packet_size_left);
+			}
+
 			if (rc != VOD_OK)
 			{
 				return rc;
@@ -725,6 +842,7 @@ mp4_encrypt_video_get_fragment_writer(
 	request_context_t* request_context,
 	media_set_t* media_set,
 	uint32_t segment_index,
+	uint32_t scheme,
 	bool_t single_nalu_per_frame,
 	mp4_encrypt_video_build_fragment_header_t build_fragment_header,
 	segment_writer_t* segment_writer,
@@ -747,7 +865,7 @@ mp4_encrypt_video_get_fragment_writer(
 		return VOD_ALLOC_FAILED;
 	}
 
-	rc = mp4_encrypt_init_state(&state->base, request_context, media_set, segment_index, segment_writer, iv);
+	rc = mp4_encrypt_init_state(&state->base, request_context, media_set, segment_index, scheme, segment_writer, iv);
 	if (rc != VOD_OK)
 	{
 		vod_log_debug1(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
@@ -776,7 +894,8 @@ mp4_encrypt_video_get_fragment_writer(
 		return VOD_OK;
 	}
 	
-	if (single_nalu_per_frame)
+	// Note: in cbcs, the clear size of each nal unit depends on its type, so the auxiliary data can't be built in advance
+	if (single_nalu_per_frame && scheme == MP4_ENCRYPT_SCHEME_CENC)
 	{
 		// each frame is a single nal unit, can generate the auxiliary data and write the header now
 		state->build_fragment_header = NULL;
@@ -834,6 +953,7 @@ mp4_encrypt_video_get_fragment_writer(
 	}
 
 	result->write_head = NULL;
+	result->write_file = NULL;
 	result->context = state;
 
 	return VOD_OK;
@@ -904,6 +1024,16 @@ mp4_encrypt_audio_write_buffer(void* context, u_char* buffer, uint32_t size)
 			{
 				return rc;
 			}
+
+			if (state->scheme == MP4_ENCRYPT_SCHEME_CBCS)
+			{
+				// full sample encryption
+				rc = mp4_aes_cbcs_start(&state->cbcs_cipher, 0, state->frame_size_left, 0);
+				if (rc != VOD_OK)
+				{
+					return rc;
+				}
+			}
 		}
 
 		write_size = (uint32_t)(buffer_end - cur_pos);
@@ -944,6 +1074,7 @@ mp4_encrypt_audio_get_fragment_writer(
 	request_context_t* request_context,
 	media_set_t* media_set,
 	uint32_t segment_index,
+	uint32_t scheme,
 	segment_writer_t* segment_writer,
 	const u_char* iv)
 {
@@ -959,7 +1090,7 @@ mp4_encrypt_audio_get_fragment_writer(
 		return VOD_ALLOC_FAILED;
 	}
 
-	rc = mp4_encrypt_init_state(state, request_context, media_set, segment_index, segment_writer, iv);
+	rc = mp4_encrypt_init_state(state, request_context, media_set, segment_index, scheme, segment_writer, iv);
 	if (rc != VOD_OK)
 	{
 		vod_log_debug1(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
@@ -969,6 +1100,7 @@ mp4_encrypt_audio_get_fragment_writer(
 
 	result->write_tail = mp4_encrypt_audio_write_buffer;
 	result->write_head = NULL;
+	result->write_file = NULL;
 	result->context = state;
 
 	return VOD_OK;
@@ -989,6 +1121,8 @@ mp4_encrypt_video_get_fragment_writer(
 	request_context_t* request_context,
 	media_set_t* media_set,
 	uint32_t segment_index,
+	uint32_t scheme,
+	bool_t single_nalu_per_frame,
 	mp4_encrypt_video_build_fragment_header_t build_fragment_header,
 	segment_writer_t* segment_writer,
 	const u_char* iv, 
@@ -1004,6 +1138,7 @@ mp4_encrypt_audio_get_fragment_writer(
 	request_context_t* request_context,
 	media_set_t* media_set,
 	uint32_t segment_index,
+	uint32_t scheme,
 	segment_writer_t* segment_writer,
 	const u_char* iv)
 {
@@ -6,10 +6,20 @@
 #include "../write_buffer.h"
 #include "../media_set.h"
 #include "mp4_aes_ctr.h"
+#include "mp4_aes_cbcs.h"
 
 // constants
 #define VOD_GUID_LENGTH (sizeof("00000000-0000-0000-0000-000000000000") - 1)
 
+#define MP4_ENCRYPT_CBCS_VIDEO_CRYPT_BLOCKS (1)
+#define MP4_ENCRYPT_CBCS_VIDEO_SKIP_BLOCKS (9)
+
+// enums
+enum {
+	MP4_ENCRYPT_SCHEME_CENC,		// aes-ctr, per sample iv
+	MP4_ENCRYPT_SCHEME_CBCS,		// aes-cbc 1:9 pattern (video) / full sample (audio), constant iv
+};
+
 // typedef
 struct mp4_encrypt_video_state_s;
 typedef struct mp4_encrypt_video_state_s mp4_encrypt_video_state_t;
@@ -27,6 +37,8 @@ typedef struct {
 	media_set_t* media_set;
 	media_sequence_t* sequence;
 	uint32_t segment_index;
+	uint32_t scheme;
+	uint32_t sample_iv_size;
 
 	// write buffer
 	write_buffer_state_t write_buffer;
@@ -34,6 +46,7 @@ typedef struct {
 	// encryption state
 #if (VOD_HAVE_OPENSSL_EVP)
 	mp4_aes_ctr_state_t cipher;
+	mp4_aes_cbcs_state_t cbcs_cipher;
 #endif
 	u_char iv[MP4_AES_CTR_IV_SIZE];
 
@@ -55,6 +68,7 @@ struct mp4_encrypt_video_state_s {
 
 	// fixed
 	mp4_encrypt_video_build_fragment_header_t build_fragment_header;
+	uint32_t codec_id;
 	uint32_t nal_packet_size_length;
 
 	// auxiliary data state
@@ -82,6 +96,7 @@ vod_status_t mp4_encrypt_video_get_fragment_writer(
 	request_context_t* request_context,
 	media_set_t* media_set,
 	uint32_t segment_index,
+	uint32_t scheme,
 	bool_t single_nalu_per_frame,
 	mp4_encrypt_video_build_fragment_header_t build_fragment_header,
 	segment_writer_t* segment_writer,
@@ -94,6 +109,7 @@ vod_status_t mp4_encrypt_audio_get_fragment_writer(
 	request_context_t* request_context,
 	media_set_t* media_set,
 	uint32_t segment_index,
+	uint32_t scheme,
 	segment_writer_t* segment_writer,
 	const u_char* iv);
 
@@ -72,6 +72,8 @@ mp4_metadata_reader_init(
 	state->max_moov_size = max_metadata_size;
 	state->state = STATE_READ_MOOV_HEADER;
 	state->parts[MP4_METADATA_PART_FTYP].len = 0;
+	state->parts[MP4_METADATA_PART_SAMPLE_INDEX].data = NULL;
+	state->parts[MP4_METADATA_PART_SAMPLE_INDEX].len = 0;
 	*ctx = state;
 	return VOD_OK;
 }
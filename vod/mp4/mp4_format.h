@@ -4,10 +4,14 @@
 // includes
 #include "../media_format.h"
 
+// constants
+#define MP4_METADATA_VERSION (1)		// Note: must be incremented when the metadata parts or their layout change
+
 // enums
 enum {
 	MP4_METADATA_PART_FTYP,
 	MP4_METADATA_PART_MOOV,
+	MP4_METADATA_PART_SAMPLE_INDEX,		// built by the parser
 	MP4_METADATA_PART_COUNT
 };
 
@@ -0,0 +1,428 @@
+#include "mp4_frame_index.h"
+
+// Note: the index is position independent so that it can be stored as is in a shared memory cache.
+//		it is composed of a header, an array of groups and the frames data. each frame is encoded as -
+//		varint((size << FRAME_FLAGS_BITS) | flags) followed by optional varints according to the flags.
+//		the first frame of each group always has an explicit duration, so that decoding can start
+//		at any group
+
+// constants
+#define MP4_FRAME_INDEX_VERSION (2)
+#define MAX_VARINT_SIZE (10)
+#define MAX_ENCODED_FRAME_SIZE (4 * MAX_VARINT_SIZE)
+
+#define FRAME_FLAG_KEY_FRAME	(0x01)
+#define FRAME_FLAG_DURATION		(0x02)		// duration is different than the duration of the previous frame
+#define FRAME_FLAG_PTS_DELAY	(0x04)		// pts delay is non-zero
+#define FRAME_FLAG_OFFSET		(0x08)		// frame is not contiguous to the previous frame
+#define FRAME_FLAGS_BITS		(4)
+
+// macros
+#define zigzag_encode(x) (((uint64_t)(x) << 1) ^ (uint64_t)((int64_t)(x) >> 63))
+#define zigzag_decode(x) ((int64_t)((x) >> 1) ^ -(int64_t)((x) & 1))
+
+static u_char*
+mp4_frame_index_write_varint(u_char* p, uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		*p++ = (u_char)(value | 0x80);
+		value >>= 7;
+	}
+	*p++ = (u_char)value;
+	return p;
+}
+
+static u_char*
+mp4_frame_index_write_frame(
+	u_char* p,
+	input_frame_t* frame,
+	uint32_t prev_duration,
+	uint64_t expected_offset,
+	bool_t group_start)
+{
+	int32_t pts_delay = (int32_t)frame->pts_delay;
+	uint32_t flags = 0;
+
+	if (frame->key_frame)
+	{
+		flags |= FRAME_FLAG_KEY_FRAME;
+	}
+
+	if (group_start || frame->duration != prev_duration)
+	{
+		flags |= FRAME_FLAG_DURATION;
+	}
+
+	if (pts_delay != 0)
+	{
+		flags |= FRAME_FLAG_PTS_DELAY;
+	}
+
+	if (frame->offset != expected_offset)
+	{
+		flags |= FRAME_FLAG_OFFSET;
+	}
+
+	p = mp4_frame_index_write_varint(p, ((uint64_t)frame->size << FRAME_FLAGS_BITS) | flags);
+
+	if (flags & FRAME_FLAG_DURATION)
+	{
+		p = mp4_frame_index_write_varint(p, frame->duration);
+	}
+
+	if (flags & FRAME_FLAG_PTS_DELAY)
+	{
+		p = mp4_frame_index_write_varint(p, zigzag_encode((int64_t)pts_delay));
+	}
+
+	if (flags & FRAME_FLAG_OFFSET)
+	{
+		p = mp4_frame_index_write_varint(p, zigzag_encode((int64_t)(frame->offset - expected_offset)));
+	}
+
+	return p;
+}
+
+vod_status_t
+mp4_frame_index_build(
+	request_context_t* request_context,
+	input_frame_t* frames,
+	uint32_t frame_count,
+	uint32_t timescale,
+	uint32_t sample_count,
+	vod_str_t* result)
+{
+	mp4_frame_index_header_t* header;
+	mp4_frame_index_group_t* cur_group;
+	input_frame_t* cur_frame;
+	input_frame_t* last_frame = frames + frame_count;
+	uint64_t expected_offset;
+	uint64_t data_size;
+	uint64_t dts;
+	uint32_t prev_duration;
+	uint32_t group_count;
+	uint32_t key_frame_end;
+	uint32_t dts_shift;
+	uint32_t frame_index;
+	u_char temp[MAX_ENCODED_FRAME_SIZE];
+	u_char* data_start;
+	u_char* p;
+	size_t alloc_size;
+
+	// calculate the size of the frames data
+	data_size = 0;
+	prev_duration = 0;
+	expected_offset = 0;
+	for (cur_frame = frames, frame_index = 0; cur_frame < last_frame; cur_frame++, frame_index++)
+	{
+		data_size += mp4_frame_index_write_frame(
+			temp,
+			cur_frame,
+			prev_duration,
+			expected_offset,
+			frame_index % MP4_FRAME_INDEX_GROUP_SIZE == 0) - temp;
+
+		prev_duration = cur_frame->duration;
+		expected_offset = cur_frame->offset + cur_frame->size;
+	}
+
+	if (data_size > UINT_MAX)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mp4_frame_index_build: data size %uL too big", data_size);
+		return VOD_BAD_DATA;
+	}
+
+	// allocate the buffer
+	group_count = vod_div_ceil(frame_count, MP4_FRAME_INDEX_GROUP_SIZE);
+	alloc_size = sizeof(*header) + sizeof(*cur_group) * group_count + data_size;
+
+	header = vod_alloc(request_context->pool, alloc_size);
+	if (header == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mp4_frame_index_build: vod_alloc failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	cur_group = (mp4_frame_index_group_t*)(header + 1);
+	data_start = (u_char*)(cur_group + group_count);
+
+	// write the groups and frames data
+	p = data_start;
+	dts = 0;
+	dts_shift = 0;
+	key_frame_end = 0;
+	prev_duration = 0;
+	expected_offset = 0;
+	for (cur_frame = frames, frame_index = 0; cur_frame < last_frame; cur_frame++, frame_index++)
+	{
+		if (frame_index % MP4_FRAME_INDEX_GROUP_SIZE == 0)
+		{
+			cur_group->dts = dts;
+			cur_group->offset = expected_offset;
+			cur_group->data_offset = p - data_start;
+			cur_group->dts_shift = dts_shift;
+			cur_group++;
+		}
+
+		p = mp4_frame_index_write_frame(
+			p,
+			cur_frame,
+			prev_duration,
+			expected_offset,
+			frame_index % MP4_FRAME_INDEX_GROUP_SIZE == 0);
+
+		if (cur_frame->key_frame)
+		{
+			key_frame_end = frame_index + 1;
+		}
+
+		if ((int32_t)cur_frame->pts_delay < 0 && (uint32_t)-(int32_t)cur_frame->pts_delay > dts_shift)
+		{
+			dts_shift = (uint32_t)-(int32_t)cur_frame->pts_delay;
+		}
+
+		dts += cur_frame->duration;
+		prev_duration = cur_frame->duration;
+		expected_offset = cur_frame->offset + cur_frame->size;
+	}
+
+	header->version = MP4_FRAME_INDEX_VERSION;
+	header->timescale = timescale;
+	header->sample_count = sample_count;
+	header->frame_count = frame_count;
+	header->key_frame_end = key_frame_end;
+	header->group_count = group_count;
+	header->data_size = data_size;
+
+	vod_log_debug3(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+		"mp4_frame_index_build: built index of %uD frames, %uL data bytes, %uz total bytes",
+		frame_count, data_size, alloc_size);
+
+	result->data = (u_char*)header;
+	result->len = alloc_size;
+
+	return VOD_OK;
+}
+
+vod_status_t
+mp4_frame_index_init(
+	request_context_t* request_context,
+	vod_str_t* buffer,
+	uint32_t timescale,
+	uint32_t sample_count,
+	mp4_frame_index_t* result)
+{
+	const mp4_frame_index_header_t* header;
+	size_t groups_size;
+
+	if (buffer->len < sizeof(*header))
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mp4_frame_index_init: buffer size %uz too small", buffer->len);
+		return VOD_BAD_DATA;
+	}
+
+	header = (const mp4_frame_index_header_t*)buffer->data;
+	if (header->version != MP4_FRAME_INDEX_VERSION ||
+		header->timescale != timescale ||
+		header->sample_count != sample_count)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mp4_frame_index_init: index does not match the track, version=%uD timescale=%uD sample_count=%uD",
+			header->version, header->timescale, header->sample_count);
+		return VOD_BAD_DATA;
+	}
+
+	if (header->group_count != vod_div_ceil(header->frame_count, MP4_FRAME_INDEX_GROUP_SIZE) ||
+		header->key_frame_end > header->frame_count)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mp4_frame_index_init: invalid header, frame_count=%uD group_count=%uD key_frame_end=%uD",
+			header->frame_count, header->group_count, header->key_frame_end);
+		return VOD_BAD_DATA;
+	}
+
+	groups_size = sizeof(mp4_frame_index_group_t) * header->group_count;
+	if (header->data_size > buffer->len - sizeof(*header) ||
+		groups_size > buffer->len - sizeof(*header) - header->data_size)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mp4_frame_index_init: buffer size %uz too small for %uD groups and %uL data bytes",
+			buffer->len, header->group_count, header->data_size);
+		return VOD_BAD_DATA;
+	}
+
+	result->header = header;
+	result->groups = (const mp4_frame_index_group_t*)(header + 1);
+	result->data = (const u_char*)(result->groups + header->group_count);
+	result->data_end = result->data + header->data_size;
+
+	return VOD_OK;
+}
+
+vod_status_t
+mp4_frame_index_reader_init(
+	request_context_t* request_context,
+	mp4_frame_index_t* index,
+	uint64_t initial_dts,
+	uint64_t dts,
+	mp4_frame_index_reader_t* reader)
+{
+	const mp4_frame_index_group_t* group;
+	uint32_t left;
+	uint32_t right;
+	uint32_t mid;
+
+	if (index->header->group_count == 0)
+	{
+		vod_memzero(reader, sizeof(*reader));
+		reader->request_context = request_context;
+		return VOD_OK;
+	}
+
+	// find the last group that starts before the dts
+	dts = dts > initial_dts ? dts - initial_dts : 0;
+	left = 0;
+	right = index->header->group_count - 1;
+	while (left < right)
+	{
+		mid = (left + right + 1) / 2;
+		if (index->groups[mid].dts < dts)
+		{
+			left = mid;
+		}
+		else
+		{
+			right = mid - 1;
+		}
+	}
+
+	group = index->groups + left;
+	if (group->data_offset > index->header->data_size)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mp4_frame_index_reader_init: invalid data offset %uD", group->data_offset);
+		return VOD_BAD_DATA;
+	}
+
+	reader->request_context = request_context;
+	reader->cur_pos = index->data + group->data_offset;
+	reader->end_pos = index->data_end;
+	reader->frame_index = left * MP4_FRAME_INDEX_GROUP_SIZE;
+	reader->frame_count = index->header->frame_count;
+	reader->dts = initial_dts + group->dts;
+	reader->offset = group->offset;
+	reader->duration = 0;
+	reader->dts_shift = group->dts_shift;
+
+	return VOD_OK;
+}
+
+static bool_t
+mp4_frame_index_read_varint(mp4_frame_index_reader_t* reader, uint64_t* result)
+{
+	const u_char* p = reader->cur_pos;
+	uint64_t value = 0;
+	unsigned shift;
+
+	for (shift = 0; shift < 64; shift += 7)
+	{
+		if (p >= reader->end_pos)
+		{
+			return FALSE;
+		}
+
+		value |= (uint64_t)(*p & 0x7f) << shift;
+		if ((*p++ & 0x80) == 0)
+		{
+			reader->cur_pos = p;
+			*result = value;
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+vod_status_t
+mp4_frame_index_reader_next(
+	mp4_frame_index_reader_t* reader,
+	input_frame_t* frame,
+	uint64_t* dts)
+{
+	int32_t pts_delay;
+	uint64_t value;
+	uint32_t flags;
+
+	if (reader->frame_index >= reader->frame_count)
+	{
+		return VOD_NOT_FOUND;
+	}
+
+	if (!mp4_frame_index_read_varint(reader, &value))
+	{
+		goto corrupt;
+	}
+
+	flags = value & ((1 << FRAME_FLAGS_BITS) - 1);
+	value >>= FRAME_FLAGS_BITS;
+	if (value > MAX_FRAME_SIZE)
+	{
+		goto corrupt;
+	}
+	frame->size = value;
+	frame->key_frame = (flags & FRAME_FLAG_KEY_FRAME) != 0;
+
+	if (flags & FRAME_FLAG_DURATION)
+	{
+		if (!mp4_frame_index_read_varint(reader, &value) || value > UINT_MAX)
+		{
+			goto corrupt;
+		}
+		reader->duration = value;
+	}
+	frame->duration = reader->duration;
+
+	pts_delay = 0;
+	if (flags & FRAME_FLAG_PTS_DELAY)
+	{
+		if (!mp4_frame_index_read_varint(reader, &value))
+		{
+			goto corrupt;
+		}
+		pts_delay = (int32_t)zigzag_decode(value);
+	}
+	frame->pts_delay = (uint32_t)pts_delay;
+
+	if (pts_delay < 0 && (uint32_t)-pts_delay > reader->dts_shift)
+	{
+		reader->dts_shift = (uint32_t)-pts_delay;
+	}
+
+	if (flags & FRAME_FLAG_OFFSET)
+	{
+		if (!mp4_frame_index_read_varint(reader, &value))
+		{
+			goto corrupt;
+		}
+		reader->offset += zigzag_decode(value);
+	}
+	frame->offset = reader->offset;
+
+	*dts = reader->dts;
+
+	reader->dts += frame->duration;
+	reader->offset += frame->size;
+	reader->frame_index++;
+
+	return VOD_OK;
+
+corrupt:
+
+	vod_log_error(VOD_LOG_ERR, reader->request_context->log, 0,
+		"mp4_frame_index_reader_next: failed to decode frame %uD", reader->frame_index);
+	return VOD_BAD_DATA;
+}
@@ -0,0 +1,75 @@
+#ifndef __MP4_FRAME_INDEX_H__
+#define __MP4_FRAME_INDEX_H__
+
+// includes
+#include "../media_format.h"
+
+// constants
+#define MP4_FRAME_INDEX_GROUP_SIZE (256)		// frames per group, the group is the unit of random access
+
+// typedefs
+typedef struct {
+	uint32_t version;
+	uint32_t timescale;
+	uint32_t sample_count;		// the number of entries in stsz, used to validate the index
+	uint32_t frame_count;
+	uint32_t key_frame_end;		// index of the last key frame + 1, zero when there are no key frames
+	uint32_t group_count;
+	uint64_t data_size;
+} mp4_frame_index_header_t;
+
+typedef struct {
+	uint64_t dts;				// relative to the first frame of the track
+	uint64_t offset;			// end offset of the previous frame, the first frame of the group is encoded relative to it
+	uint32_t data_offset;		// offset of the first frame in the encoded frames data
+	uint32_t dts_shift;			// max negative pts delay of the frames preceding the group
+} mp4_frame_index_group_t;
+
+typedef struct {
+	const mp4_frame_index_header_t* header;
+	const mp4_frame_index_group_t* groups;
+	const u_char* data;
+	const u_char* data_end;
+} mp4_frame_index_t;
+
+typedef struct {
+	request_context_t* request_context;
+	const u_char* cur_pos;
+	const u_char* end_pos;
+	uint32_t frame_index;
+	uint32_t frame_count;
+	uint64_t dts;				// dts of the next frame
+	uint64_t offset;			// offset of the next frame, in case it is contiguous to the previous one
+	uint32_t duration;			// duration of the previous frame
+	uint32_t dts_shift;			// max negative pts delay of the frames that were read
+} mp4_frame_index_reader_t;
+
+// functions
+vod_status_t mp4_frame_index_build(
+	request_context_t* request_context,
+	input_frame_t* frames,					// pts_delay should not include the dts shift
+	uint32_t frame_count,
+	uint32_t timescale,
+	uint32_t sample_count,
+	vod_str_t* result);
+
+vod_status_t mp4_frame_index_init(
+	request_context_t* request_context,
+	vod_str_t* buffer,
+	uint32_t timescale,
+	uint32_t sample_count,
+	mp4_frame_index_t* result);
+
+vod_status_t mp4_frame_index_reader_init(
+	request_context_t* request_context,
+	mp4_frame_index_t* index,
+	uint64_t initial_dts,					// dts of the first frame of the track
+	uint64_t dts,							// the reader is positioned on the last group that starts before dts
+	mp4_frame_index_reader_t* reader);
+
+vod_status_t mp4_frame_index_reader_next(
+	mp4_frame_index_reader_t* reader,
+	input_frame_t* frame,
+	uint64_t* dts);							// VOD_NOT_FOUND = no more frames
+
+#endif // __MP4_FRAME_INDEX_H__
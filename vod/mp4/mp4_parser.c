@@ -4,6 +4,8 @@
 #include "mp4_decrypt.h"
 #include "mp4_format.h"
 #include "mp4_parser.h"
+#include "mp4_frame_index.h"
+#include "mp4_sample_index.h"
 #include "mp4_defs.h"
 #include "../media_format.h"
 #include "../input/frames_source_cache.h"
@@ -27,6 +29,7 @@
 // constants
 #define MAX_FRAMERATE_TEST_SAMPLES (20)
 #define MAX_TOTAL_SIZE_TEST_SAMPLES (100000)
+#define MAX_FRAME_INDEX_FRAME_COUNT (256 * 1024)		// ~6MB of temporary frames while building the index
 
 // typedefs
 typedef struct {
@@ -58,6 +61,8 @@ typedef struct {
 	uint32_t track_indexes[MEDIA_TYPE_COUNT];
 	file_info_t* file_info;
 	vod_str_t ftyp_atom;
+	uint32_t trak_count;
+	mp4_sample_index_builder_t* sample_index_builder;		// set only when the sample index should be built
 	mp4_base_metadata_t* result;
 } process_moov_context_t;
 
@@ -79,6 +84,7 @@ typedef struct {
 	// input - reset between tracks
 	const uint32_t* stss_start_pos;			// initialized only when aligning keyframes
 	uint32_t stss_entries;					// initialized only when aligning keyframes
+	mp4_sample_index_t sample_index;		// checkpoint_count is zero when the index is not available
 
 	// output
 	uint32_t stss_start_index;
@@ -107,6 +113,9 @@ typedef struct {
 	atom_info_t sinf_atom;
 	file_info_t file_info;
 	uint32_t track_index;
+	uint32_t trak_index;				// index of the trak atom in the moov atom
+	mp4_sample_index_t sample_index;
+	media_frame_index_t* frame_index;
 } mp4_track_base_metadata_t;
 
 typedef struct {
@@ -531,6 +540,55 @@ mp4_parser_parse_stts_atom_frame_duration_only(atom_info_t* atom_info, frames_pa
 	return VOD_OK;
 }
 
+static uint64_t
+mp4_parser_get_initial_dts(frames_parse_context_t* context)
+{
+	int64_t empty_duration;
+
+	empty_duration = rescale_time_neg(context->media_info->empty_duration, context->mvhd_timescale, context->media_info->timescale);
+	if (empty_duration > context->media_info->start_time)
+	{
+		return empty_duration - context->media_info->start_time;
+	}
+
+	// TODO: support negative offsets
+	return 0;
+}
+
+static bool_t
+mp4_parser_stts_seek(
+	frames_parse_context_t* context,
+	uint64_t initial_dts,
+	uint64_t time,
+	const stts_entry_t* first_entry,
+	uint32_t entries,
+	const stts_entry_t** cur_entry,
+	uint32_t* frame_index,
+	uint64_t* accum_duration)
+{
+	const mp4_sample_index_checkpoint_t* checkpoint;
+
+	if (context->sample_index.checkpoint_count == 0 || time < initial_dts)
+	{
+		return FALSE;
+	}
+
+	checkpoint = mp4_sample_index_find_by_dts(&context->sample_index, time - initial_dts);
+	if (checkpoint == NULL || 
+		checkpoint->stts_entry >= entries || 
+		first_entry + checkpoint->stts_entry <= *cur_entry)
+	{
+		return FALSE;
+	}
+
+	// Note: all the entries preceding the checkpoint entry end before the requested time,
+	//		so skipping them does not change the result of the scan
+	*cur_entry = first_entry + checkpoint->stts_entry;
+	*frame_index = checkpoint->stts_frame_index;
+	*accum_duration = initial_dts + checkpoint->stts_dts;
+	return TRUE;
+}
+
 static vod_status_t 
 mp4_parser_parse_stts_atom(atom_info_t* atom_info, frames_parse_context_t* context)
 {
@@ -538,9 +596,11 @@ mp4_parser_parse_stts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 	const stts_entry_t* last_entry;
 	const stts_entry_t* cur_entry;
 	media_range_t* range = context->parse_params.range;
+	const stts_entry_t* first_entry;
 	uint32_t sample_count;
 	uint32_t sample_duration;
 	uint32_t entries;
+	uint64_t initial_dts;
 	uint64_t clip_from;
 	uint64_t start_time;
 	uint64_t end_time;
@@ -548,7 +608,6 @@ mp4_parser_parse_stts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 	uint64_t clip_from_accum_duration = 0;
 	uint64_t accum_duration;
 	uint64_t next_accum_duration;
-	int64_t empty_duration;
 	uint32_t cur_count;
 	uint32_t skip_count;
 	uint32_t initial_alloc_size;
@@ -570,19 +629,12 @@ mp4_parser_parse_stts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 	}
 	
 	// calculate the initial duration for this stream
-	empty_duration = rescale_time_neg(context->media_info->empty_duration, context->mvhd_timescale, timescale);
-	if (empty_duration > context->media_info->start_time)
-	{
-		accum_duration = empty_duration - context->media_info->start_time;
-	}
-	else
-	{
-		// TODO: support negative offsets
-		accum_duration = 0;
-	}
+	initial_dts = mp4_parser_get_initial_dts(context);
+	accum_duration = initial_dts;
 
 	// parse the first sample
-	cur_entry = (const stts_entry_t*)(atom_info->ptr + sizeof(stts_atom_t));
+	first_entry = (const stts_entry_t*)(atom_info->ptr + sizeof(stts_atom_t));
+	cur_entry = first_entry;
 	last_entry = cur_entry + entries;
 	if (cur_entry >= last_entry)
 	{
@@ -602,6 +654,13 @@ mp4_parser_parse_stts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 	{
 		clip_from = (((uint64_t)context->parse_params.clip_from * timescale) / 1000);
 
+		if (mp4_parser_stts_seek(context, initial_dts, clip_from, first_entry, entries, &cur_entry, &frame_index, &accum_duration))
+		{
+			sample_duration = parse_be32(cur_entry->duration);
+			sample_count = parse_be32(cur_entry->count);
+			next_accum_duration = accum_duration + (uint64_t)sample_duration * sample_count;
+		}
+
 		for (;;)
 		{
 			if (sample_duration > 0 &&
@@ -631,8 +690,12 @@ mp4_parser_parse_stts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 		}
 
 		// calculate the clip from duration
-		skip_count = vod_div_ceil(clip_from - accum_duration, sample_duration);
-		clip_from_accum_duration = accum_duration + (uint64_t)skip_count * sample_duration;
+		clip_from_accum_duration = accum_duration;
+		if (clip_from > accum_duration)
+		{
+			skip_count = vod_div_ceil(clip_from - accum_duration, sample_duration);
+			clip_from_accum_duration += (uint64_t)skip_count * sample_duration;
+		}
 
 		context->clip_from_frame_offset = clip_from_accum_duration - clip_from;
 	}
@@ -640,6 +703,13 @@ mp4_parser_parse_stts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 	// skip to the sample containing the start time
 	start_time = ((range->start + context->clip_from) * timescale) / range->timescale;
 
+	if (mp4_parser_stts_seek(context, initial_dts, start_time, first_entry, entries, &cur_entry, &frame_index, &accum_duration))
+	{
+		sample_duration = parse_be32(cur_entry->duration);
+		sample_count = parse_be32(cur_entry->count);
+		next_accum_duration = accum_duration + (uint64_t)sample_duration * sample_count;
+	}
+
 	for (;;)
 	{
 		if (sample_duration > 0 && 
@@ -881,7 +951,7 @@ mp4_parser_parse_stts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 				clip_to != ULLONG_MAX &&
 				clip_to < accum_duration + ((uint64_t)UINT_MAX) * sample_duration)
 			{
-				cur_count = vod_div_ceil(clip_to - accum_duration, sample_duration);
+				cur_count = clip_to > accum_duration ? vod_div_ceil(clip_to - accum_duration, sample_duration) : 0;
 				sample_count = vod_min(cur_count, sample_count);
 			}
 
@@ -968,6 +1038,7 @@ mp4_parser_parse_ctts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 {
 	const ctts_entry_t* last_entry;
 	const ctts_entry_t* cur_entry;
+	const mp4_sample_index_checkpoint_t* checkpoint;
 	input_frame_t* cur_frame = context->frames;
 	input_frame_t* last_frame = cur_frame + context->frame_count;
 	input_frame_t* cur_limit;
@@ -992,6 +1063,15 @@ mp4_parser_parse_ctts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 	cur_entry = (const ctts_entry_t*)(atom_info->ptr + sizeof(ctts_atom_t));
 	last_entry = cur_entry + entries;
 
+	// skip to the entry of the nearest checkpoint
+	checkpoint = mp4_sample_index_find_by_frame(&context->sample_index, context->first_frame);
+	if (checkpoint != NULL && checkpoint->ctts_entry < entries)
+	{
+		cur_entry += checkpoint->ctts_entry;
+		frame_index = checkpoint->ctts_frame_index;
+		dts_shift = checkpoint->ctts_dts_shift;
+	}
+
 	// parse the first entry
 	if (cur_entry >= last_entry)
 	{
@@ -999,9 +1079,9 @@ mp4_parser_parse_ctts_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 	}
 
 	sample_duration = parse_be32(cur_entry->duration);
-	if (sample_duration < 0)
+	if (sample_duration < 0 && (uint32_t)-sample_duration > dts_shift)
 	{
-		dts_shift = vod_max(dts_shift, (uint32_t)-sample_duration);
+		dts_shift = (uint32_t)-sample_duration;
 	}
 
 	sample_count = parse_be32(cur_entry->count);
@@ -1172,6 +1252,7 @@ static const u_char chunk_equals_sample_entry[] = {
 static vod_status_t 
 mp4_parser_parse_stsc_atom(atom_info_t* atom_info, frames_parse_context_t* context)
 {
+	const mp4_sample_index_checkpoint_t* checkpoint;
 	input_frame_t* cur_frame = context->frames;
 	input_frame_t* last_frame = cur_frame + context->frame_count;
 	const stsc_entry_t* last_entry;
@@ -1213,6 +1294,15 @@ mp4_parser_parse_stsc_atom(atom_info_t* atom_info, frames_parse_context_t* conte
 		return VOD_BAD_DATA;
 	}
 
+	// skip to the entry of the nearest checkpoint
+	checkpoint = mp4_sample_index_find_by_frame(&context->sample_index, context->first_frame);
+	if (checkpoint != NULL && checkpoint->stsc_entry < entries)
+	{
+		cur_entry += checkpoint->stsc_entry;
+		frame_index = checkpoint->stsc_frame_index;
+		next_chunk = parse_be32(cur_entry->first_chunk);
+	}
+
 	if (frame_index < context->first_frame)
 	{
 		// skip to the relevant entry
@@ -2162,6 +2252,7 @@ mp4_parser_process_moov_atom_callback(void* ctx, atom_info_t* atom_info)
 	media_sequence_t* sequence;
 	uint32_t duration_millis;
 	uint32_t track_index;
+	uint32_t trak_index;
 	bool_t extra_data_required;
 	bool_t format_supported;
 	vod_status_t rc;
@@ -2190,6 +2281,21 @@ mp4_parser_process_moov_atom_callback(void* ctx, atom_info_t* atom_info)
 		return rc;
 	}
 
+	// add the trak to the sample index, the index covers all traks since it is shared by all requests
+	trak_index = context->trak_count++;
+	if (context->sample_index_builder != NULL)
+	{
+		rc = mp4_sample_index_builder_add_track(
+			context->sample_index_builder, 
+			&trak_atom_infos.stts, 
+			&trak_atom_infos.ctts, 
+			&trak_atom_infos.stsc);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+	}
+
 	// get the media info
 	vod_memzero(&metadata_parse_context, sizeof(metadata_parse_context));
 	metadata_parse_context.request_context = context->request_context;
@@ -2391,6 +2497,10 @@ mp4_parser_process_moov_atom_callback(void* ctx, atom_info_t* atom_info)
 	result_track->sinf_atom = metadata_parse_context.sinf_atom;
 	result_track->file_info = *context->file_info;
 	result_track->track_index = track_index;
+	result_track->trak_index = trak_index;
+	result_track->sample_index.checkpoints = NULL;
+	result_track->sample_index.checkpoint_count = 0;
+	result_track->frame_index = NULL;
 
 	// update max duration / track index
 	if (result->base.duration == 0 ||
@@ -2467,15 +2577,20 @@ mp4_parser_parse_basic_metadata(
 	file_info_t* file_info,
 	media_base_metadata_t** result)
 {
+	mp4_sample_index_builder_t sample_index_builder;
 	process_moov_context_t context;
+	mp4_track_base_metadata_t* first_track;
+	mp4_track_base_metadata_t* cur_track;
 	mp4_base_metadata_t* metadata;
+	media_frame_index_t* frame_index;
+	vod_str_t* sample_index;
 	vod_status_t rc;
 
 	metadata = vod_alloc(request_context->pool, sizeof(*metadata));
 	if (metadata == NULL)
 	{
 		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
-			"mp4_parser_parse_basic_metadata: vod_alloc failed");
+			"mp4_parser_parse_basic_metadata: vod_alloc failed (1)");
 		return VOD_ALLOC_FAILED;
 	}
 
@@ -2492,8 +2607,27 @@ mp4_parser_parse_basic_metadata(
 	vod_memzero(context.track_indexes, sizeof(context.track_indexes));
 	context.file_info = file_info;
 	context.ftyp_atom = metadata_parts[MP4_METADATA_PART_FTYP];
+	context.trak_count = 0;
+	context.sample_index_builder = NULL;
 	context.result = metadata;
 
+	// Note: the sample index is saved as a metadata part, so that it will be stored in the cache with the moov atom
+	sample_index = NULL;
+	if (metadata_part_count > MP4_METADATA_PART_SAMPLE_INDEX)
+	{
+		sample_index = &metadata_parts[MP4_METADATA_PART_SAMPLE_INDEX];
+		if (sample_index->len == 0 && (parse_params->parse_type & PARSE_FLAG_SAMPLE_INDEX) != 0)
+		{
+			rc = mp4_sample_index_builder_init(request_context, &sample_index_builder);
+			if (rc != VOD_OK)
+			{
+				return rc;
+			}
+
+			context.sample_index_builder = &sample_index_builder;
+		}
+	}
+
 	rc = mp4_parser_parse_atoms(
 		request_context, 
 		metadata_parts[MP4_METADATA_PART_MOOV].data,
@@ -2513,6 +2647,63 @@ mp4_parser_parse_basic_metadata(
 		return VOD_BAD_DATA;
 	}
 
+	// get the sample index of the tracks
+	if (context.sample_index_builder != NULL)
+	{
+		rc = mp4_sample_index_builder_finalize(&sample_index_builder, sample_index);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+	}
+
+	if (sample_index != NULL && sample_index->len != 0)
+	{
+		first_track = (mp4_track_base_metadata_t*)metadata->base.tracks.elts;
+		for (cur_track = first_track; cur_track < first_track + metadata->base.tracks.nelts; cur_track++)
+		{
+			rc = mp4_sample_index_get_track(
+				request_context,
+				sample_index,
+				cur_track->trak_index,
+				&cur_track->trak_atom_infos.stts,
+				&cur_track->trak_atom_infos.ctts,
+				&cur_track->trak_atom_infos.stsc,
+				&cur_track->sample_index);
+			if (rc != VOD_OK)
+			{
+				// Note: the index is only an optimization, the track is parsed without it
+				cur_track->sample_index.checkpoint_count = 0;
+			}
+		}
+	}
+
+	// allocate the frame indexes, the caller can fill them before calling read_frames
+	if ((parse_params->parse_type & PARSE_FLAG_FRAME_INDEX) != 0 && metadata->base.tracks.nelts > 0)
+	{
+		frame_index = vod_alloc(request_context->pool, sizeof(*frame_index) * metadata->base.tracks.nelts);
+		if (frame_index == NULL)
+		{
+			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+				"mp4_parser_parse_basic_metadata: vod_alloc failed (2)");
+			return VOD_ALLOC_FAILED;
+		}
+
+		metadata->base.frame_indexes = frame_index;
+
+		first_track = (mp4_track_base_metadata_t*)metadata->base.tracks.elts;
+		for (cur_track = first_track; cur_track < first_track + metadata->base.tracks.nelts; cur_track++, frame_index++)
+		{
+			frame_index->media_type = cur_track->media_info.media_type;
+			frame_index->track_index = cur_track->track_index;
+			frame_index->data.data = NULL;
+			frame_index->data.len = 0;
+			frame_index->save = FALSE;
+
+			cur_track->frame_index = frame_index;
+		}
+	}
+
 	*result = &metadata->base;
 
 	return VOD_OK;
@@ -2603,6 +2794,493 @@ mp4_parser_compare_tracks(const void *s1, const void *s2)
 	return track1->track_index - track2->track_index;
 }
 
+static vod_status_t
+mp4_parser_build_frame_index(
+	frames_parse_context_t* context,
+	mp4_track_base_metadata_t* cur_track,
+	uint32_t sample_count,
+	vod_str_t* result)
+{
+	const trak_atom_parser_t* cur_parser;
+	frames_parse_context_t build_context;
+	media_range_t range;
+	vod_status_t rc;
+
+	if (sample_count > MAX_FRAME_INDEX_FRAME_COUNT)
+	{
+		vod_log_debug1(VOD_LOG_DEBUG_LEVEL, context->request_context->log, 0,
+			"mp4_parser_build_frame_index: sample count %uD too big for indexing", sample_count);
+		return VOD_NOT_FOUND;
+	}
+
+	// parse all the frames of the track
+	range.start = 0;
+	range.end = ULLONG_MAX;
+	range.timescale = 1000;
+
+	vod_memzero(&build_context, sizeof(build_context));
+	build_context.request_context = context->request_context;
+	build_context.media_info = context->media_info;
+	build_context.parse_params = context->parse_params;
+	build_context.parse_params.parse_type = PARSE_FLAG_FRAMES_ALL;
+	build_context.parse_params.clip_from = 0;
+	build_context.parse_params.clip_to = UINT_MAX;
+	build_context.parse_params.range = &range;
+	build_context.parse_params.max_frame_count = MAX_FRAME_INDEX_FRAME_COUNT;
+	build_context.mvhd_timescale = context->mvhd_timescale;
+
+	for (cur_parser = trak_atom_parsers; cur_parser->parse; cur_parser++)
+	{
+		if ((cur_parser->flag & PARSE_FLAG_FRAMES_ALL) == 0)
+		{
+			continue;
+		}
+
+		rc = cur_parser->parse((atom_info_t*)((u_char*)&cur_track->trak_atom_infos + cur_parser->offset), &build_context);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+	}
+
+	if (build_context.frame_count == 0 || build_context.first_frame != 0)
+	{
+		// Note: tracks that start with zero duration frames are not indexed
+		vod_free(context->request_context->pool, build_context.frames);
+		return VOD_NOT_FOUND;
+	}
+
+	rc = mp4_frame_index_build(
+		context->request_context,
+		build_context.frames,
+		build_context.frame_count,
+		context->media_info->timescale,
+		sample_count,
+		result);
+
+	// Note: the frames array of the whole track is only needed for building the index, 
+	//		release it instead of holding it until the request completes
+	vod_free(context->request_context->pool, build_context.frames);
+
+	return rc;
+}
+
+static vod_status_t
+mp4_parser_get_frame_index(
+	frames_parse_context_t* context,
+	mp4_track_base_metadata_t* cur_track,
+	mp4_frame_index_t* result)
+{
+	media_frame_index_t* frame_index = cur_track->frame_index;
+	uint32_t uniform_size;
+	uint32_t sample_count;
+	unsigned field_size;
+	vod_status_t rc;
+
+	if (cur_track->trak_atom_infos.saiz.size != 0 || cur_track->trak_atom_infos.senc.size != 0)
+	{
+		// encrypted tracks are not indexed, the auxiliary info has to be parsed per request
+		return VOD_NOT_FOUND;
+	}
+
+	if (cur_track->trak_atom_infos.stsz.size == 0)
+	{
+		return VOD_NOT_FOUND;
+	}
+
+	rc = mp4_parser_validate_stsz_atom(context->request_context, &cur_track->trak_atom_infos.stsz, 0, &uniform_size, &field_size, &sample_count);
+	if (rc != VOD_OK)
+	{
+		return VOD_NOT_FOUND;
+	}
+
+	if (frame_index->data.len == 0)
+	{
+		rc = mp4_parser_build_frame_index(context, cur_track, sample_count, &frame_index->data);
+		if (rc != VOD_OK)
+		{
+			// fall back to parsing the sample tables, unless we're out of memory
+			return rc == VOD_ALLOC_FAILED ? rc : VOD_NOT_FOUND;
+		}
+
+		frame_index->save = TRUE;
+	}
+
+	rc = mp4_frame_index_init(
+		context->request_context,
+		&frame_index->data,
+		context->media_info->timescale,
+		sample_count,
+		result);
+	if (rc != VOD_OK)
+	{
+		frame_index->data.len = 0;
+		frame_index->save = FALSE;
+		return VOD_NOT_FOUND;
+	}
+
+	return VOD_OK;
+}
+
+static vod_status_t
+mp4_parser_frame_index_seek(
+	mp4_frame_index_t* index,
+	frames_parse_context_t* context,
+	uint64_t initial_dts,
+	uint64_t dts,
+	mp4_frame_index_reader_t* reader,
+	input_frame_t* frame,
+	uint64_t* frame_dts)
+{
+	vod_status_t rc;
+
+	rc = mp4_frame_index_reader_init(context->request_context, index, initial_dts, dts, reader);
+	if (rc != VOD_OK)
+	{
+		return rc;
+	}
+
+	// find the first frame with non-zero duration that starts at or after dts
+	for (;;)
+	{
+		rc = mp4_frame_index_reader_next(reader, frame, frame_dts);
+		if (rc != VOD_OK)
+		{
+			return rc;
+		}
+
+		if (frame->duration > 0 && *frame_dts >= dts)
+		{
+			return VOD_OK;
+		}
+	}
+}
+
+static vod_status_t
+mp4_parser_frame_index_push_frame(
+	frames_parse_context_t* context,
+	vod_array_t* frames_array,
+	input_frame_t* frame)
+{
+	int parse_type = context->parse_params.parse_type;
+	input_frame_t* cur_frame;
+
+	if (frames_array->nelts >= context->parse_params.max_frame_count)
+	{
+		vod_log_error(VOD_LOG_ERR, context->request_context->log, 0,
+			"mp4_parser_frame_index_push_frame: frame count exceeds the limit %uD", context->parse_params.max_frame_count);
+		return VOD_BAD_DATA;
+	}
+
+	cur_frame = vod_array_push(frames_array);
+	if (cur_frame == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, context->request_context->log, 0,
+			"mp4_parser_frame_index_push_frame: vod_array_push failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	cur_frame->duration = frame->duration;
+	cur_frame->pts_delay = (parse_type & PARSE_FLAG_FRAMES_PTS_DELAY) != 0 ? frame->pts_delay : 0;
+	cur_frame->offset = (parse_type & PARSE_FLAG_FRAMES_OFFSET) != 0 ? frame->offset : 0;
+
+	if ((parse_type & PARSE_FLAG_FRAMES_SIZE) != 0)
+	{
+		cur_frame->size = frame->size;
+		context->total_frames_size += frame->size;
+	}
+	else
+	{
+		cur_frame->size = 0;
+	}
+
+	if ((parse_type & PARSE_FLAG_FRAMES_IS_KEY) != 0 && frame->key_frame)
+	{
+		cur_frame->key_frame = TRUE;
+		context->key_frame_count++;
+	}
+	else
+	{
+		cur_frame->key_frame = FALSE;
+	}
+
+	return VOD_OK;
+}
+
+// Note: this function selects the same frames as the stts/stss parsers, using the frame index instead of the sample tables
+static vod_status_t
+mp4_parser_parse_frame_index(mp4_frame_index_t* index, frames_parse_context_t* context)
+{
+	uint32_t timescale = context->media_info->timescale;
+	media_range_t* range = context->parse_params.range;
+	mp4_frame_index_reader_t reader;
+	input_frame_t frame;
+	vod_array_t frames_array;
+	uint64_t clip_from_accum_duration = 0;
+	uint64_t accum_duration;
+	uint64_t alloc_estimate;
+	uint64_t initial_dts;
+	uint64_t frame_dts;
+	uint64_t start_time;
+	uint64_t end_time;
+	uint64_t clip_from;
+	uint64_t clip_to;
+	uint32_t initial_alloc_size;
+	uint32_t dts_shift = 0;
+	bool_t has_next_key_frame;
+	bool_t exhausted = FALSE;
+	vod_status_t rc;
+
+	initial_dts = mp4_parser_get_initial_dts(context);
+
+	if (context->parse_params.clip_from > 0)
+	{
+		clip_from = (((uint64_t)context->parse_params.clip_from * timescale) / 1000);
+
+		rc = mp4_parser_frame_index_seek(index, context, initial_dts, clip_from, &reader, &frame, &frame_dts);
+		if (rc != VOD_OK)
+		{
+			if (rc != VOD_NOT_FOUND)
+			{
+				return rc;
+			}
+
+			if (context->stss_entries != 0)
+			{
+				range->start = 0;
+				range->end = 0;
+			}
+			return VOD_OK;
+		}
+
+		// calculate the clip from duration
+		clip_from_accum_duration = frame_dts;
+
+		context->clip_from_frame_offset = clip_from_accum_duration - clip_from;
+	}
+
+	// skip to the frame containing the start time
+	start_time = ((range->start + context->clip_from) * timescale) / range->timescale;
+
+	rc = mp4_parser_frame_index_seek(index, context, initial_dts, start_time, &reader, &frame, &frame_dts);
+	if (rc != VOD_OK)
+	{
+		if (rc != VOD_NOT_FOUND)
+		{
+			return rc;
+		}
+
+		if (context->stss_entries != 0)
+		{
+			if (context->media_info->duration > clip_from_accum_duration)
+			{
+				context->first_frame_time_offset = context->media_info->duration - clip_from_accum_duration;
+			}
+			range->start = 0;
+			range->end = 0;
+		}
+		return VOD_OK;
+	}
+
+	if (context->stss_entries != 0)
+	{
+		// jump to the first key frame after the start position
+		while (!frame.key_frame)
+		{
+			rc = mp4_frame_index_reader_next(&reader, &frame, &frame_dts);
+			if (rc != VOD_OK)
+			{
+				if (rc != VOD_NOT_FOUND)
+				{
+					return rc;
+				}
+
+				// can't find any key frame after the start pos
+				if (context->media_info->duration > clip_from_accum_duration)
+				{
+					context->first_frame_time_offset = context->media_info->duration - clip_from_accum_duration;
+				}
+				range->start = 0;
+				range->end = 0;
+				return VOD_OK;
+			}
+		}
+	}
+
+	// store the first frame info
+	context->first_frame = reader.frame_index - 1;
+	context->first_frame_time_offset = frame_dts;
+	accum_duration = frame_dts;
+
+	// calculate the end time and initial alloc size
+	if (range->end == ULLONG_MAX)
+	{
+		end_time = ULLONG_MAX;
+		alloc_estimate = ULLONG_MAX;
+	}
+	else
+	{
+		end_time = ((range->end + context->clip_from) * timescale) / range->timescale;
+
+		// Note: the estimate assumes all frames have the duration of the first frame
+		if (end_time <= frame_dts)
+		{
+			alloc_estimate = 1;
+		}
+		else if (frame.duration > 0)
+		{
+			alloc_estimate = (end_time - frame_dts) / frame.duration + 1;
+		}
+		else
+		{
+			alloc_estimate = 128;
+		}
+	}
+
+	initial_alloc_size = index->header->frame_count - context->first_frame;
+	if (initial_alloc_size > alloc_estimate)
+	{
+		initial_alloc_size = alloc_estimate;
+	}
+
+	if (initial_alloc_size > context->parse_params.max_frame_count)
+	{
+		initial_alloc_size = context->parse_params.max_frame_count;
+	}
+
+	if (vod_array_init(&frames_array, context->request_context->pool, initial_alloc_size, sizeof(input_frame_t)) != VOD_OK)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, context->request_context->log, 0,
+			"mp4_parser_parse_frame_index: vod_array_init failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	// read the frames until end time
+	if (accum_duration < end_time)
+	{
+		for (;;)
+		{
+			rc = mp4_parser_frame_index_push_frame(context, &frames_array, &frame);
+			if (rc != VOD_OK)
+			{
+				return rc;
+			}
+
+			dts_shift = reader.dts_shift;
+			accum_duration = frame_dts + frame.duration;
+			if (accum_duration >= end_time)
+			{
+				break;
+			}
+
+			rc = mp4_frame_index_reader_next(&reader, &frame, &frame_dts);
+			if (rc != VOD_OK)
+			{
+				if (rc != VOD_NOT_FOUND)
+				{
+					return rc;
+				}
+
+				exhausted = TRUE;
+				break;
+			}
+		}
+	}
+
+	if (context->parse_params.clip_to == UINT_MAX)
+	{
+		clip_to = ULLONG_MAX;
+	}
+	else
+	{
+		clip_to = ((uint64_t)context->parse_params.clip_to * timescale) / range->timescale;
+	}
+
+	// read the frames until the next key frame
+	if (context->stss_entries != 0)
+	{
+		if (frames_array.nelts == 0)
+		{
+			context->first_frame = 0;
+			context->first_frame_time_offset -= clip_from_accum_duration;
+			range->start = 0;
+			range->end = 0;
+			return VOD_OK;
+		}
+
+		has_next_key_frame = context->first_frame + frames_array.nelts < index->header->key_frame_end;
+
+		while (!exhausted)
+		{
+			rc = mp4_frame_index_reader_next(&reader, &frame, &frame_dts);
+			if (rc != VOD_OK)
+			{
+				if (rc != VOD_NOT_FOUND)
+				{
+					return rc;
+				}
+
+				exhausted = TRUE;
+				break;
+			}
+
+			if (frame.key_frame || frame_dts >= clip_to)
+			{
+				break;
+			}
+
+			rc = mp4_parser_frame_index_push_frame(context, &frames_array, &frame);
+			if (rc != VOD_OK)
+			{
+				return rc;
+			}
+
+			dts_shift = reader.dts_shift;
+			accum_duration = frame_dts + frame.duration;
+		}
+
+		// adjust the start / end parameters so that next tracks will align according to this one
+		range->timescale = timescale;
+		range->start = context->first_frame_time_offset - clip_from_accum_duration;
+		if (has_next_key_frame)
+		{
+			range->end = accum_duration - clip_from_accum_duration;
+			if (clip_to < range->end)
+			{
+				range->end = clip_to;
+			}
+		}
+		else
+		{
+			range->end = ULLONG_MAX;
+		}
+		context->clip_from = clip_from_accum_duration;
+	}
+
+	if ((context->parse_params.parse_type & PARSE_FLAG_FRAMES_PTS_DELAY) != 0)
+	{
+		context->dts_shift = dts_shift;
+	}
+
+	context->total_frames_duration = accum_duration - context->first_frame_time_offset;
+	context->first_frame_time_offset -= clip_from_accum_duration;
+	context->frames = frames_array.elts;
+	context->frame_count = frames_array.nelts;
+	context->last_frame = context->first_frame + frames_array.nelts;
+
+	if (clip_to != ULLONG_MAX &&
+		(exhausted || (accum_duration - clip_from_accum_duration) > clip_to))
+	{
+		context->clip_to = context->parse_params.clip_to - context->parse_params.clip_from;
+	}
+	else
+	{
+		context->clip_to = UINT_MAX;
+	}
+
+	return VOD_OK;
+}
+
 vod_status_t
 mp4_parser_parse_frames(
 	request_context_t* request_context,
@@ -2620,6 +3298,7 @@ mp4_parser_parse_frames(
 	mp4_track_base_metadata_t* cur_track;
 	frames_parse_context_t context;
 	frames_source_t* frames_source;
+	mp4_frame_index_t frame_index;
 	media_track_t* result_track;
 	input_frame_t* cur_frame;
 	input_frame_t* last_frame;
@@ -2629,6 +3308,7 @@ mp4_parser_parse_frames(
 	vod_array_t tracks;
 	uint64_t last_offset;
 	uint32_t media_type;
+	bool_t use_frame_index;
 
 	if (vod_array_init(&tracks, request_context->pool, 2, sizeof(media_track_t)) != VOD_OK)
 	{
@@ -2673,6 +3353,8 @@ mp4_parser_parse_frames(
 		// reset the output part of the context
 		vod_memzero(&context.stss_start_pos, sizeof(context) - offsetof(frames_parse_context_t, stss_start_pos));
 
+		context.sample_index = cur_track->sample_index;
+
 		if (cur_track == first_track &&
 			media_type == MEDIA_TYPE_VIDEO &&
 			cur_track->trak_atom_infos.stss.size != 0 &&
@@ -2687,6 +3369,31 @@ mp4_parser_parse_frames(
 			context.stss_start_pos = (const uint32_t*)(cur_track->trak_atom_infos.stss.ptr + sizeof(stss_atom_t));
 		}
 
+		// read the frames from the frame index, if available
+		use_frame_index = FALSE;
+		if (cur_track->frame_index != NULL && 
+			(parse_params->parse_type & PARSE_FLAG_FRAMES_DURATION) != 0)
+		{
+			rc = mp4_parser_get_frame_index(&context, cur_track, &frame_index);
+			switch (rc)
+			{
+			case VOD_OK:
+				rc = mp4_parser_parse_frame_index(&frame_index, &context);
+				if (rc != VOD_OK)
+				{
+					return rc;
+				}
+				use_frame_index = TRUE;
+				break;
+
+			case VOD_NOT_FOUND:
+				break;
+
+			default:
+				return rc;
+			}
+		}
+
 		for (cur_parser = trak_atom_parsers; cur_parser->parse; cur_parser++)
 		{
 			if ((parse_params->parse_type & cur_parser->flag) == 0)
@@ -2694,6 +3401,11 @@ mp4_parser_parse_frames(
 				continue;
 			}
 
+			if (use_frame_index && (cur_parser->flag & PARSE_FLAG_FRAMES_ALL) != 0)
+			{
+				continue;		// already read from the frame index
+			}
+
 			vod_log_debug1(VOD_LOG_DEBUG_LEVEL, request_context->log, 0, "mp4_parser_parse_frames: running parser 0x%xD", cur_parser->flag);
 			rc = cur_parser->parse((atom_info_t*)((u_char*)&cur_track->trak_atom_infos + cur_parser->offset), &context);
 			if (rc != VOD_OK)
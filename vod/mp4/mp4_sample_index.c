@@ -0,0 +1,366 @@
+#include "mp4_sample_index.h"
+#include "../read_stream.h"
+
+// Note: the sample index is position independent so that it can be stored in the metadata cache
+//		alongside the moov atom. it is composed of a header, an array of tracks (one per trak atom,
+//		in the order they appear in the moov) and an array of checkpoints. each checkpoint holds
+//		the position in the stts / ctts / stsc atoms of a sample, so that the parser can start
+//		scanning these atoms near the requested range instead of at their beginning
+
+static uint32_t
+mp4_sample_index_get_entries(atom_info_t* atom_info, size_t entry_size)
+{
+	const stts_atom_t* atom = (const stts_atom_t*)atom_info->ptr;		// Note: stts / ctts / stsc share the same header
+	uint32_t entries;
+
+	if (atom_info->size < sizeof(*atom))
+	{
+		return 0;
+	}
+
+	entries = parse_be32(atom->entries);
+	if (entries >= (INT_MAX - sizeof(*atom)) / entry_size ||			// integer overflow protection
+		atom_info->size < sizeof(*atom) + entries * entry_size)
+	{
+		return 0;
+	}
+
+	return entries;
+}
+
+vod_status_t
+mp4_sample_index_builder_init(
+	request_context_t* request_context,
+	mp4_sample_index_builder_t* builder)
+{
+	builder->request_context = request_context;
+
+	if (vod_array_init(&builder->tracks, request_context->pool, 4, sizeof(mp4_sample_index_track_t)) != VOD_OK)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mp4_sample_index_builder_init: vod_array_init failed (1)");
+		return VOD_ALLOC_FAILED;
+	}
+
+	if (vod_array_init(&builder->checkpoints, request_context->pool, 64, sizeof(mp4_sample_index_checkpoint_t)) != VOD_OK)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, request_context->log, 0,
+			"mp4_sample_index_builder_init: vod_array_init failed (2)");
+		return VOD_ALLOC_FAILED;
+	}
+
+	return VOD_OK;
+}
+
+vod_status_t
+mp4_sample_index_builder_add_track(
+	mp4_sample_index_builder_t* builder,
+	atom_info_t* stts,
+	atom_info_t* ctts,
+	atom_info_t* stsc)
+{
+	mp4_sample_index_checkpoint_t* checkpoint;
+	mp4_sample_index_track_t* track;
+	const stts_entry_t* stts_first;
+	const stts_entry_t* stts_last;
+	const stts_entry_t* stts_cur;
+	const ctts_entry_t* ctts_first;
+	const ctts_entry_t* ctts_last;
+	const ctts_entry_t* ctts_cur;
+	const stsc_entry_t* stsc_first;
+	const stsc_entry_t* stsc_last;
+	const stsc_entry_t* stsc_cur;
+	uint64_t stts_frame_index = 0;
+	uint64_t stts_dts = 0;
+	uint64_t ctts_frame_index = 0;
+	uint64_t stsc_frame_index = 0;
+	uint64_t frame_index;
+	uint32_t ctts_dts_shift = 0;
+	uint32_t samples_per_chunk;
+	uint32_t cur_chunk;
+	uint32_t next_chunk;
+	uint32_t count;
+	int32_t pts_delay;
+
+	track = vod_array_push(&builder->tracks);
+	if (track == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, builder->request_context->log, 0,
+			"mp4_sample_index_builder_add_track: vod_array_push failed (1)");
+		return VOD_ALLOC_FAILED;
+	}
+
+	vod_memzero(track, sizeof(*track));
+	track->first_checkpoint = builder->checkpoints.nelts;
+
+	// Note: not logging errors on invalid atoms, the track is left without checkpoints and
+	//		the errors are reported if the track is actually parsed
+	track->stts_entries = mp4_sample_index_get_entries(stts, sizeof(stts_entry_t));
+	track->stsc_entries = mp4_sample_index_get_entries(stsc, sizeof(stsc_entry_t));
+	if (ctts->size != 0)
+	{
+		track->ctts_entries = mp4_sample_index_get_entries(ctts, sizeof(ctts_entry_t));
+	}
+
+	if (track->stts_entries == 0 || track->stsc_entries == 0)
+	{
+		return VOD_OK;
+	}
+
+	stts_first = (const stts_entry_t*)(stts->ptr + sizeof(stts_atom_t));
+	stts_last = stts_first + track->stts_entries;
+	stts_cur = stts_first;
+
+	ctts_first = (const ctts_entry_t*)(ctts->ptr + sizeof(ctts_atom_t));
+	ctts_last = ctts_first + track->ctts_entries;
+	ctts_cur = ctts_first;
+
+	stsc_first = (const stsc_entry_t*)(stsc->ptr + sizeof(stsc_atom_t));
+	stsc_last = stsc_first + track->stsc_entries;
+	stsc_cur = stsc_first;
+
+	for (frame_index = MP4_SAMPLE_INDEX_INTERVAL; frame_index < UINT_MAX; frame_index += MP4_SAMPLE_INDEX_INTERVAL)
+	{
+		// find the stts entry containing the frame
+		for (; stts_cur < stts_last; stts_cur++)
+		{
+			count = parse_be32(stts_cur->count);
+			if (frame_index < stts_frame_index + count)
+			{
+				break;
+			}
+
+			stts_frame_index += count;
+			stts_dts += (uint64_t)count * parse_be32(stts_cur->duration);
+		}
+
+		if (stts_cur >= stts_last)
+		{
+			break;		// frame index is beyond the end of the track
+		}
+
+		// find the ctts entry containing the frame
+		for (; ctts_cur < ctts_last; ctts_cur++)
+		{
+			count = parse_be32(ctts_cur->count);
+			if (frame_index < ctts_frame_index + count)
+			{
+				break;
+			}
+
+			pts_delay = parse_be32(ctts_cur->duration);
+			if (pts_delay < 0 && (uint32_t)-pts_delay > ctts_dts_shift)
+			{
+				ctts_dts_shift = (uint32_t)-pts_delay;
+			}
+
+			ctts_frame_index += count;
+		}
+
+		// find the stsc entry containing the frame
+		for (; stsc_cur + 1 < stsc_last; stsc_cur++)
+		{
+			cur_chunk = parse_be32(stsc_cur->first_chunk);
+			next_chunk = parse_be32(stsc_cur[1].first_chunk);
+			samples_per_chunk = parse_be32(stsc_cur->samples_per_chunk);
+			if (next_chunk <= cur_chunk || samples_per_chunk == 0)
+			{
+				return VOD_OK;		// invalid atom, keep the checkpoints collected so far
+			}
+
+			if (frame_index < stsc_frame_index + (uint64_t)(next_chunk - cur_chunk) * samples_per_chunk)
+			{
+				break;
+			}
+
+			stsc_frame_index += (uint64_t)(next_chunk - cur_chunk) * samples_per_chunk;
+			if (stsc_frame_index > UINT_MAX)
+			{
+				return VOD_OK;
+			}
+		}
+
+		checkpoint = vod_array_push(&builder->checkpoints);
+		if (checkpoint == NULL)
+		{
+			vod_log_debug0(VOD_LOG_DEBUG_LEVEL, builder->request_context->log, 0,
+				"mp4_sample_index_builder_add_track: vod_array_push failed (2)");
+			return VOD_ALLOC_FAILED;
+		}
+
+		checkpoint->stts_dts = stts_dts;
+		checkpoint->stts_entry = stts_cur - stts_first;
+		checkpoint->stts_frame_index = stts_frame_index;
+		checkpoint->ctts_entry = ctts_cur - ctts_first;
+		checkpoint->ctts_frame_index = ctts_frame_index;
+		checkpoint->ctts_dts_shift = ctts_dts_shift;
+		checkpoint->stsc_entry = stsc_cur - stsc_first;
+		checkpoint->stsc_frame_index = stsc_frame_index;
+		checkpoint->reserved = 0;
+
+		track->checkpoint_count++;
+	}
+
+	return VOD_OK;
+}
+
+vod_status_t
+mp4_sample_index_builder_finalize(
+	mp4_sample_index_builder_t* builder,
+	vod_str_t* result)
+{
+	mp4_sample_index_header_t* header;
+	size_t tracks_size;
+	size_t checkpoints_size;
+	u_char* p;
+
+	tracks_size = sizeof(mp4_sample_index_track_t) * builder->tracks.nelts;
+	checkpoints_size = sizeof(mp4_sample_index_checkpoint_t) * builder->checkpoints.nelts;
+
+	p = vod_alloc(builder->request_context->pool, sizeof(*header) + tracks_size + checkpoints_size);
+	if (p == NULL)
+	{
+		vod_log_debug0(VOD_LOG_DEBUG_LEVEL, builder->request_context->log, 0,
+			"mp4_sample_index_builder_finalize: vod_alloc failed");
+		return VOD_ALLOC_FAILED;
+	}
+
+	result->data = p;
+
+	header = (mp4_sample_index_header_t*)p;
+	header->version = MP4_SAMPLE_INDEX_VERSION;
+	header->track_count = builder->tracks.nelts;
+	p += sizeof(*header);
+
+	p = vod_copy(p, builder->tracks.elts, tracks_size);
+	p = vod_copy(p, builder->checkpoints.elts, checkpoints_size);
+
+	result->len = p - result->data;
+
+	vod_log_debug2(VOD_LOG_DEBUG_LEVEL, builder->request_context->log, 0,
+		"mp4_sample_index_builder_finalize: built index with %uz checkpoints, size %uz",
+		(size_t)builder->checkpoints.nelts, result->len);
+
+	return VOD_OK;
+}
+
+vod_status_t
+mp4_sample_index_get_track(
+	request_context_t* request_context,
+	vod_str_t* buffer,
+	uint32_t trak_index,
+	atom_info_t* stts,
+	atom_info_t* ctts,
+	atom_info_t* stsc,
+	mp4_sample_index_t* result)
+{
+	const mp4_sample_index_header_t* header;
+	const mp4_sample_index_track_t* track;
+	size_t checkpoints_size;
+	size_t tracks_size;
+
+	if (buffer->len < sizeof(*header))
+	{
+		return VOD_NOT_FOUND;
+	}
+
+	header = (const mp4_sample_index_header_t*)buffer->data;
+	if (header->version != MP4_SAMPLE_INDEX_VERSION ||
+		trak_index >= header->track_count)
+	{
+		return VOD_NOT_FOUND;
+	}
+
+	tracks_size = sizeof(*track) * header->track_count;
+	if (tracks_size > buffer->len - sizeof(*header))
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mp4_sample_index_get_track: buffer size %uz too small for %uD tracks", buffer->len, header->track_count);
+		return VOD_BAD_DATA;
+	}
+
+	track = (const mp4_sample_index_track_t*)(header + 1) + trak_index;
+	if (track->checkpoint_count == 0)
+	{
+		return VOD_NOT_FOUND;
+	}
+
+	checkpoints_size = sizeof(mp4_sample_index_checkpoint_t) * ((uint64_t)track->first_checkpoint + track->checkpoint_count);
+	if (checkpoints_size > buffer->len - sizeof(*header) - tracks_size)
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mp4_sample_index_get_track: buffer size %uz too small for checkpoint %uD",
+			buffer->len, track->first_checkpoint + track->checkpoint_count);
+		return VOD_BAD_DATA;
+	}
+
+	if (track->stts_entries != mp4_sample_index_get_entries(stts, sizeof(stts_entry_t)) ||
+		track->ctts_entries != (ctts->size != 0 ? mp4_sample_index_get_entries(ctts, sizeof(ctts_entry_t)) : 0) ||
+		track->stsc_entries != mp4_sample_index_get_entries(stsc, sizeof(stsc_entry_t)))
+	{
+		vod_log_error(VOD_LOG_ERR, request_context->log, 0,
+			"mp4_sample_index_get_track: index does not match the track, stts=%uD ctts=%uD stsc=%uD",
+			track->stts_entries, track->ctts_entries, track->stsc_entries);
+		return VOD_BAD_DATA;
+	}
+
+	result->checkpoints = (const mp4_sample_index_checkpoint_t*)((u_char*)(header + 1) + tracks_size) + track->first_checkpoint;
+	result->checkpoint_count = track->checkpoint_count;
+
+	return VOD_OK;
+}
+
+const mp4_sample_index_checkpoint_t*
+mp4_sample_index_find_by_dts(
+	mp4_sample_index_t* index,
+	uint64_t dts)
+{
+	uint32_t left;
+	uint32_t right;
+	uint32_t mid;
+
+	if (index->checkpoint_count == 0 || index->checkpoints[0].stts_dts > dts)
+	{
+		return NULL;
+	}
+
+	// find the last checkpoint whose stts entry starts before the dts
+	left = 0;
+	right = index->checkpoint_count - 1;
+	while (left < right)
+	{
+		mid = (left + right + 1) / 2;
+		if (index->checkpoints[mid].stts_dts <= dts)
+		{
+			left = mid;
+		}
+		else
+		{
+			right = mid - 1;
+		}
+	}
+
+	return &index->checkpoints[left];
+}
+
+const mp4_sample_index_checkpoint_t*
+mp4_sample_index_find_by_frame(
+	mp4_sample_index_t* index,
+	uint32_t frame_index)
+{
+	uint32_t checkpoint_index;
+
+	checkpoint_index = frame_index / MP4_SAMPLE_INDEX_INTERVAL;
+	if (checkpoint_index == 0 || index->checkpoint_count == 0)
+	{
+		return NULL;
+	}
+
+	checkpoint_index--;
+	if (checkpoint_index >= index->checkpoint_count)
+	{
+		checkpoint_index = index->checkpoint_count - 1;
+	}
+
+	return &index->checkpoints[checkpoint_index];
+}
@@ -0,0 +1,81 @@
+#ifndef __MP4_SAMPLE_INDEX_H__
+#define __MP4_SAMPLE_INDEX_H__
+
+// includes
+#include "mp4_parser_base.h"
+
+// constants
+#define MP4_SAMPLE_INDEX_VERSION (1)
+#define MP4_SAMPLE_INDEX_INTERVAL (1024)		// samples between checkpoints
+
+// typedefs
+typedef struct {
+	uint32_t version;
+	uint32_t track_count;		// the number of trak atoms in the moov atom
+} mp4_sample_index_header_t;
+
+typedef struct {
+	uint32_t stts_entries;		// the number of entries in the atoms, used to validate the index
+	uint32_t ctts_entries;
+	uint32_t stsc_entries;
+	uint32_t first_checkpoint;
+	uint32_t checkpoint_count;
+	uint32_t reserved;
+} mp4_sample_index_track_t;
+
+typedef struct {
+	uint64_t stts_dts;			// dts of the first sample of the stts entry, relative to the first sample of the track
+	uint32_t stts_entry;		// the entry containing the checkpoint sample
+	uint32_t stts_frame_index;	// index of the first sample of the stts entry
+	uint32_t ctts_entry;
+	uint32_t ctts_frame_index;
+	uint32_t ctts_dts_shift;	// max negative pts delay of the ctts entries preceding ctts_entry
+	uint32_t stsc_entry;
+	uint32_t stsc_frame_index;
+	uint32_t reserved;
+} mp4_sample_index_checkpoint_t;
+
+typedef struct {
+	const mp4_sample_index_checkpoint_t* checkpoints;		// checkpoint i points to sample (i + 1) * MP4_SAMPLE_INDEX_INTERVAL
+	uint32_t checkpoint_count;
+} mp4_sample_index_t;
+
+typedef struct {
+	request_context_t* request_context;
+	vod_array_t tracks;
+	vod_array_t checkpoints;
+} mp4_sample_index_builder_t;
+
+// functions
+vod_status_t mp4_sample_index_builder_init(
+	request_context_t* request_context,
+	mp4_sample_index_builder_t* builder);
+
+vod_status_t mp4_sample_index_builder_add_track(
+	mp4_sample_index_builder_t* builder,
+	atom_info_t* stts,
+	atom_info_t* ctts,
+	atom_info_t* stsc);
+
+vod_status_t mp4_sample_index_builder_finalize(
+	mp4_sample_index_builder_t* builder,
+	vod_str_t* result);
+
+vod_status_t mp4_sample_index_get_track(
+	request_context_t* request_context,
+	vod_str_t* buffer,
+	uint32_t trak_index,
+	atom_info_t* stts,
+	atom_info_t* ctts,
+	atom_info_t* stsc,
+	mp4_sample_index_t* result);			// VOD_NOT_FOUND = the track has no checkpoints
+
+const mp4_sample_index_checkpoint_t* mp4_sample_index_find_by_dts(
+	mp4_sample_index_t* index,
+	uint64_t dts);							// relative to the first sample of the track
+
+const mp4_sample_index_checkpoint_t* mp4_sample_index_find_by_frame(
+	mp4_sample_index_t* index,
+	uint32_t frame_index);
+
+#endif // __MP4_SAMPLE_INDEX_H__
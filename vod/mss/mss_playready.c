@@ -305,6 +305,7 @@ mss_playready_get_fragment_writer(
 			request_context,
 			media_set,
 			segment_index,
+			MP4_ENCRYPT_SCHEME_CENC,
 			single_nalu_per_frame,
 			mss_playready_video_build_fragment_header,
 			segment_writer,
@@ -318,6 +319,7 @@ mss_playready_get_fragment_writer(
 			request_context,
 			media_set,
 			segment_index,
+			MP4_ENCRYPT_SCHEME_CENC,
 			segment_writer,
 			iv);
 		if (rc != VOD_OK)
@@ -1,7 +1,8 @@
 #include "write_buffer_queue.h"
 #include "buffer_pool.h"
 
-#define BUFFER_SIZE (188 * 16 * 32)		// chosen to be a multiple of mpegTS packet size and AES block size
+#define BUFFER_ALIGNMENT (188 * 16)		// multiple of mpegTS packet size and AES block size
+#define BUFFER_SIZE (BUFFER_ALIGNMENT * 32)
 
 void 
 write_buffer_queue_init(
@@ -9,13 +10,15 @@ write_buffer_queue_init(
 	request_context_t* request_context, 
 	write_callback_t write_callback,
 	void* write_context,
-	bool_t reuse_buffers)
+	bool_t reuse_buffers,
+	uint32_t reserved_size)
 {
 	queue->request_context = request_context;
 	queue->output_buffer_pool = request_context->output_buffer_pool;
 	queue->write_callback = write_callback;
 	queue->write_context = write_context;
 	queue->reuse_buffers = reuse_buffers;
+	queue->reserved_size = reserved_size;
 
 	initialize_list_head(&queue->buffers);
 	queue->cur_write_buffer = NULL;
@@ -29,6 +32,7 @@ write_buffer_queue_get_buffer(write_buffer_queue_t* queue, uint32_t size, void*
 	buffer_header_t* write_buffer = queue->cur_write_buffer;
 	size_t buffer_size;
 	u_char* result;
+	u_char* start;
 
 	// optimization for the common case
 	if (write_buffer != NULL && write_buffer->cur_pos + size <= write_buffer->end_pos)
@@ -71,12 +75,16 @@ write_buffer_queue_get_buffer(write_buffer_queue_t* queue, uint32_t size, void*
 	{
 		// allocate a buffer
 		buffer_size = BUFFER_SIZE;
-		write_buffer->start_pos = buffer_pool_alloc(queue->request_context, queue->output_buffer_pool, &buffer_size);
-		if (write_buffer->start_pos == NULL)
+		start = buffer_pool_alloc(queue->request_context, queue->output_buffer_pool, &buffer_size);
+		if (start == NULL)
 		{
 			return NULL;
 		}
 
+		// leave the reserved space before the buffer, and keep the size aligned, in case the pool returned a larger buffer
+		write_buffer->start_pos = start + queue->reserved_size;
+		buffer_size = (buffer_size - queue->reserved_size) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT;
+
 		write_buffer->cur_pos = write_buffer->start_pos;
 		write_buffer->end_pos = write_buffer->start_pos + buffer_size;
 	}
@@ -99,6 +107,40 @@ write_buffer_queue_get_buffer(write_buffer_queue_t* queue, uint32_t size, void*
 	return result;
 }
 
+// gets a contiguous buffer for up to 'count' units, count is updated to the number of units returned
+u_char*
+write_buffer_queue_get_buffers(write_buffer_queue_t* queue, uint32_t unit_size, uint32_t* count, void* writer_context)
+{
+	buffer_header_t* write_buffer = queue->cur_write_buffer;
+	uint32_t available;
+	uint32_t size;
+	u_char* result;
+
+	if (write_buffer != NULL)
+	{
+		available = (write_buffer->end_pos - write_buffer->cur_pos) / unit_size;
+		if (available > 0)
+		{
+			if (*count > available)
+			{
+				*count = available;
+			}
+
+			size = *count * unit_size;
+
+			result = write_buffer->cur_pos;
+			write_buffer->cur_pos += size;
+			queue->cur_offset += size;
+			queue->last_writer_context = writer_context;
+			return result;
+		}
+	}
+
+	// the current buffer is full, return a single unit from the next buffer
+	*count = 1;
+	return write_buffer_queue_get_buffer(queue, unit_size, writer_context);
+}
+
 vod_status_t
 write_buffer_queue_send(write_buffer_queue_t* queue, off_t max_offset)
 {
@@ -21,6 +21,7 @@ typedef struct {
 	write_callback_t write_callback;
 	void* write_context;
 	bool_t reuse_buffers;
+	uint32_t reserved_size;
 
 	list_entry_t buffers;
 	buffer_header_t* cur_write_buffer;
@@ -35,8 +36,10 @@ void write_buffer_queue_init(
 	request_context_t* request_context, 
 	write_callback_t write_callback,
 	void* write_context,
-	bool_t reuse_buffers);
+	bool_t reuse_buffers,
+	uint32_t reserved_size);
 u_char* write_buffer_queue_get_buffer(write_buffer_queue_t* queue, uint32_t size, void* writer_context);
+u_char* write_buffer_queue_get_buffers(write_buffer_queue_t* queue, uint32_t unit_size, uint32_t* count, void* writer_context);
 vod_status_t write_buffer_queue_send(write_buffer_queue_t* queue, off_t max_offset);
 vod_status_t write_buffer_queue_flush(write_buffer_queue_t* queue);
 